@@ -1,14 +1,59 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <cstring>
 #include <map>
+#include <list>
+#include <queue>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
 #include <cmath>
+#include <cstdint>
+#include <limits>
 #include <algorithm>
+#include <array>
+#include <chrono>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <thread>
+#include <random>
+#include <iomanip>
+#include <cstdlib>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define DISPATCH_HAVE_MMAP 1
+#endif
+// On x86 the AVX kernels are compiled with a target attribute and picked at
+// run time, so a default build still uses them on CPUs that have AVX.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define DISPATCH_X86_AVX 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// The vector kernels are checked bit for bit against the scalar code, so
+// the scalar code must not be contracted into fused multiply-adds either.
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
 
 using namespace std;
 
 // Enums
 enum VehicleType { BIKE, SEDAN, SUV, AUTO };
+const int VEHICLE_TYPE_COUNT = 4;
 enum RideStatus {
     REQUESTED,
     DRIVER_ASSIGNED,
@@ -17,10 +62,67 @@ enum RideStatus {
     COMPLETED,
     CANCELLED
 };
+const int RIDE_STATUS_COUNT = 6;
 enum DriverStatus { AVAILABLE, ON_TRIP, OFFLINE };
+enum CancelReason : uint8_t {
+    CANCEL_BY_RIDER,
+    CANCEL_BY_DRIVER,
+    CANCEL_RIDER_NO_SHOW,   // driver waited at the pickup
+    CANCEL_DRIVER_NO_SHOW   // driver never reached the pickup
+};
+const int CANCEL_REASON_COUNT = 4;
+
+const char* vehicleTypeName(VehicleType type) {
+    switch (type) {
+        case BIKE:  return "BIKE";
+        case SEDAN: return "SEDAN";
+        case SUV:   return "SUV";
+        case AUTO:  return "AUTO";
+    }
+    return "UNKNOWN";
+}
+
+const char* rideStatusName(RideStatus status) {
+    switch (status) {
+        case REQUESTED:           return "REQUESTED";
+        case DRIVER_ASSIGNED:     return "DRIVER_ASSIGNED";
+        case EN_ROUTE_TO_PICKUP:  return "EN_ROUTE_TO_PICKUP";
+        case IN_PROGRESS:         return "IN_PROGRESS";
+        case COMPLETED:           return "COMPLETED";
+        case CANCELLED:           return "CANCELLED";
+    }
+    return "UNKNOWN";
+}
+
+const char* cancelReasonName(CancelReason reason) {
+    switch (reason) {
+        case CANCEL_BY_RIDER:       return "cancelled by rider";
+        case CANCEL_BY_DRIVER:      return "cancelled by driver";
+        case CANCEL_RIDER_NO_SHOW:  return "rider no-show";
+        case CANCEL_DRIVER_NO_SHOW: return "driver no-show";
+    }
+    return "unknown";
+}
+
+// Status changes a ride accepts, [from][to]. Rides only move forward, may
+// skip the steps before pickup, and can be cancelled until they complete.
+const bool RIDE_TRANSITIONS[RIDE_STATUS_COUNT][RIDE_STATUS_COUNT] = {
+    //             REQ    ASSIGN EN_RT  IN_PR  DONE   CANCEL
+    /* REQ    */ {false, true,  false, false, false, true},
+    /* ASSIGN */ {false, false, true,  true,  true,  true},
+    /* EN_RT  */ {false, false, false, true,  true,  true},
+    /* IN_PR  */ {false, false, false, false, true,  true},
+    /* DONE   */ {false, false, false, false, false, false},
+    /* CANCEL */ {false, false, false, false, false, false},
+};
+
+// Rides are identified by a dense 64-bit counter; 0 is never issued.
+typedef uint64_t RideId;
 
 // Declaring the classes
 class Ride;
+class PinnedRide;
+class RidePool;
 class Rider;
 class Driver;
 
@@ -38,28 +140,128 @@ public:
         double dy = longitude - other.longitude;
         return std::sqrt(dx * dx + dy * dy);
     }
+
+    // Great-circle distance in km.
+    double haversineKm(const Location& other) const;
+};
+
+const double EARTH_RADIUS_KM = 6371.0088;
+const double DEG_TO_RAD = 3.14159265358979323846 / 180.0;
+
+enum DistanceMetric { EUCLIDEAN_DEGREES, HAVERSINE };
+
+class User;
+
+// UserRegistry
+// Process-wide home for user strings and the id -> user table. Strings are
+// copied into append-only arena chunks that never move, so the views
+// handed out stay valid until exit. Names are interned because a large
+// rider base repeats few of them; phones and plates are unique and only
+// copied. Users are indexed by their dense id in a chunked table whose
+// lookups take no lock.
+class UserRegistry {
+    static const size_t ARENA_CHUNK = 64 * 1024;
+    static const int USER_CHUNK_BITS = 16;
+    static const size_t USER_CHUNK = size_t(1) << USER_CHUNK_BITS;
+    static const size_t MAX_USER_CHUNKS = size_t(1) << (31 - USER_CHUNK_BITS);
+
+    mutable mutex lock;
+    vector<unique_ptr<char[]>> chunks;
+    char* current = nullptr;
+    size_t currentUsed = 0;
+    size_t bytesStored = 0;
+    unordered_set<string_view> names;
+    atomic<atomic<User*>*> users[MAX_USER_CHUNKS] = {};
+
+    UserRegistry() {}
+    // Caller holds lock.
+    string_view copy(const string& s);
+    atomic<User*>* slotFor(int id, bool create);
+
+public:
+    UserRegistry(const UserRegistry&) = delete;
+    UserRegistry& operator=(const UserRegistry&) = delete;
+
+    // Never destroyed, so users owned by other singletons can still
+    // unregister during exit.
+    static UserRegistry& getInstance() {
+        static UserRegistry* instance = new UserRegistry();
+        return *instance;
+    }
+
+    string_view intern(const string& s);
+    string_view store(const string& s) {
+        lock_guard<mutex> guard(lock);
+        return copy(s);
+    }
+
+    void add(int id, User* user) {
+        atomic<User*>* slot = slotFor(id, true);
+        if (slot) slot->store(user, memory_order_release);
+    }
+    // Leaves the slot alone if another user has taken the id since. Takes
+    // the lock so nameOf never reads a user that is being destroyed.
+    void remove(int id, User* user) {
+        lock_guard<mutex> guard(lock);
+        atomic<User*>* slot = slotFor(id, false);
+        if (slot) slot->compare_exchange_strong(user, nullptr);
+    }
+    // The caller keeps the user alive, as with DispatchService::findDriver.
+    User* find(int id) const;
+    // Copies the name of a registered user; false if the id has none. Safe
+    // against the user going away concurrently.
+    bool nameOf(int id, string& out) const;
+
+    size_t internedNames() const {
+        lock_guard<mutex> guard(lock);
+        return names.size();
+    }
+    size_t arenaBytes() const {
+        lock_guard<mutex> guard(lock);
+        return bytesStored;
+    }
 };
 
 // Abstract User
 class User {
 protected:
-    static int idCounter;
+    static atomic<int> idCounter;
     int id;
-    string name;
-    string phone;
+    string_view name;
+    string_view phone;
 
 public:
     User(const string& name_, const string& phone_)
-        : name(name_), phone(phone_) {
+        : name(UserRegistry::getInstance().intern(name_)),
+          phone(UserRegistry::getInstance().store(phone_)) {
         id = ++idCounter;
+        UserRegistry::getInstance().add(id, this);
+    }
+
+    // Re-creates a user with a known id, e.g. on warm restart. Ids issued
+    // afterwards are above it.
+    User(int existingId, const string& name_, const string& phone_)
+        : id(existingId), name(UserRegistry::getInstance().intern(name_)),
+          phone(UserRegistry::getInstance().store(phone_)) {
+        reserveIdsThrough(existingId);
+        UserRegistry::getInstance().add(id, this);
+    }
+    ~User() { UserRegistry::getInstance().remove(id, this); }
+    User(const User&) = delete;
+    User& operator=(const User&) = delete;
+
+    static int lastIssuedId() { return idCounter.load(); }
+    static void reserveIdsThrough(int existingId) {
+        int seen = idCounter.load();
+        while (seen < existingId && !idCounter.compare_exchange_weak(seen, existingId)) {}
     }
 
     int getId() const { return id; }
-    string getName() const { return name; }
-    string getPhone() const { return phone; }
+    string_view getName() const { return name; }
+    string_view getPhone() const { return phone; }
 };
 
-int User::idCounter = 0;
+atomic<int> User::idCounter(0);
 
 // Abstract RideObserver
 class RideObserver {
@@ -71,68 +273,110 @@ class DispatchService;
 
 // Rider
 class Rider : public User {
+public:
+    static const size_t RECENT_RIDES = 8;
+
+private:
     Location currentLocation;
-    vector<Ride*> rideHistory;
+    // Ring of the last RECENT_RIDES ride ids; older rides are only in the
+    // archive.
+    RideId recentRides[RECENT_RIDES];
+    uint32_t rideCount = 0;
     double discountAmount = 0.0;
 
 public:
     Rider(const string& name_, const string& phone_, const Location& loc)
         : User(name_, phone_), currentLocation(loc) {}
+    Rider(int existingId, const string& name_, const string& phone_, const Location& loc)
+        : User(existingId, name_, phone_), currentLocation(loc) {}
 
     Location getCurrentLocation() const { return currentLocation; }
     void updateLocation(const Location& loc) { currentLocation = loc; }
 
-    void addRideToHistory(Ride* ride) {
-        rideHistory.push_back(ride);
+    void addRideToHistory(RideId rideId) {
+        recentRides[rideCount % RECENT_RIDES] = rideId;
+        ++rideCount;
+    }
+    uint32_t getRideCount() const { return rideCount; }
+    // Copies up to RECENT_RIDES ids into out, newest first.
+    size_t recentRideIds(RideId* out) const {
+        size_t n = rideCount < RECENT_RIDES ? rideCount : RECENT_RIDES;
+        for (size_t i = 0; i < n; ++i) out[i] = recentRides[(rideCount - 1 - i) % RECENT_RIDES];
+        return n;
     }
 
     bool hasDiscount() const { return discountAmount > 0.0; }
     double getDiscountAmount() const { return discountAmount; }
     void setDiscountAmount(double amt) { discountAmount = amt; }
 
-    Ride* requestRide(const Location& pickup, const Location& drop, VehicleType type);
+    PinnedRide requestRide(const Location& pickup, const Location& drop, VehicleType type);
 };
 
 // Vehicle
 class Vehicle {
-    string plateNumber;
+    string_view plateNumber;
     VehicleType type;
     int capacity;
     double farePerKm;
 
 public:
     Vehicle(const string& plate, VehicleType type_, int cap, double rate)
-        : plateNumber(plate), type(type_), capacity(cap), farePerKm(rate) {}
+        : plateNumber(UserRegistry::getInstance().store(plate)), type(type_), capacity(cap),
+          farePerKm(rate) {}
 
     VehicleType getType() const { return type; }
     double getFarePerKm() const { return farePerKm; }
     int getCapacity() const { return capacity; }
 
-    string getPlateNumber() const { return plateNumber; }
+    string_view getPlateNumber() const { return plateNumber; }
 };
 
 // Driver
 class Driver : public User {
     Vehicle* vehicle;
     Location currentLocation;
-    DriverStatus status;
+    atomic<DriverStatus> status;
     double rating;
+    atomic<int> homeShard;  // DispatchShard guarding this driver, -1 until registered
+    int64_t locationTimestamp;  // of the newest ingested ping, 0 if none
 
 public:
     Driver(const string& name_, const string& phone_,
            Vehicle* vehicle_, const Location& loc, double rating_)
         : User(name_, phone_), vehicle(vehicle_), currentLocation(loc),
-          status(AVAILABLE), rating(rating_) {}
+          status(AVAILABLE), rating(rating_), homeShard(-1),
+          locationTimestamp(0) {}
+    Driver(int existingId, const string& name_, const string& phone_,
+           Vehicle* vehicle_, const Location& loc, double rating_)
+        : User(existingId, name_, phone_), vehicle(vehicle_), currentLocation(loc),
+          status(AVAILABLE), rating(rating_), homeShard(-1),
+          locationTimestamp(0) {}
 
     Location getCurrentLocation() const { return currentLocation; }
-    void updateLocation(const Location& loc) { currentLocation = loc; }
+    void updateLocation(const Location& loc);
+    // Raw setter, called by DispatchService under the home shard's lock.
+    void setCurrentLocation(const Location& loc) { currentLocation = loc; }
 
-    DriverStatus getStatus() const { return status; }
-    void setStatus(DriverStatus s) { status = s; }
+    DriverStatus getStatus() const { return status.load(memory_order_acquire); }
+    void setStatus(DriverStatus s) { status.store(s, memory_order_release); }
+    // AVAILABLE -> ON_TRIP. Exactly one of several racing callers wins.
+    bool tryClaim() {
+        DriverStatus expected = AVAILABLE;
+        return status.compare_exchange_strong(expected, ON_TRIP, memory_order_acq_rel);
+    }
 
     Vehicle* getVehicle() const { return vehicle; }
     double getRating() const { return rating; }
-    void setRating(double r) { rating = r; }
+    void setRating(double r);
+    // Raw setter, called by DispatchService under the home shard's lock.
+    void setCurrentRating(double r) { rating = r; }
+
+    int getHomeShard() const { return homeShard.load(); }
+    void setHomeShard(int shard) { homeShard.store(shard); }
+
+    // Only touched by DispatchService's location apply, which is serialized.
+    int64_t getLocationTimestamp() const { return locationTimestamp; }
+    void setLocationTimestamp(int64_t ts) { locationTimestamp = ts; }
 
     friend ostream& operator<<(ostream& os, const Driver& d) {
         os << "Driver{name='" << d.name
@@ -156,42 +400,59 @@ class RideRequest {
     Location pickup;
     Location drop;
     VehicleType type;
+    double quotedFare;  // upfront fare shown to the rider, 0 until quoted
 
 public:
     RideRequest(Rider* r, const Location& p,
                 const Location& d, VehicleType t)
-        : rider(r), pickup(p), drop(d), type(t) {}
+        : rider(r), pickup(p), drop(d), type(t), quotedFare(0.0) {}
 
     Rider* getRider() const { return rider; }
     Location getPickup() const { return pickup; }
     Location getDrop() const { return drop; }
     VehicleType getType() const { return type; }
+    double getQuotedFare() const { return quotedFare; }
+    void setQuotedFare(double fare) { quotedFare = fare; }
 };
 
 // Implementing Ride Observer
+// Both services are stateless, so every ride shares one instance of each.
 class RiderNotificationService : public RideObserver {
 public:
+    static RiderNotificationService& getInstance() {
+        static RiderNotificationService instance;
+        return instance;
+    }
+
     void onRideStatusChanged(Ride* ride, RideStatus newStatus) override;
 };
 
 class DriverNotificationService : public RideObserver {
 public:
+    static DriverNotificationService& getInstance() {
+        static DriverNotificationService instance;
+        return instance;
+    }
+
     void onRideStatusChanged(Ride* ride, RideStatus newStatus) override;
 };
 
 // FareCalculator
 class FareCalculator {
 public:
+    virtual ~FareCalculator() {}
     virtual double calculate(Ride* ride) const = 0;
 };
 
 class BaseFareCalculator : public FareCalculator {
-    static const double BASE_FARE = 50.0;
-
 public:
+    static constexpr double BASE_FARE = 50.0;
+
     double calculate(Ride* ride) const override;
 };
 
+// A decorator owns the calculator it wraps, so deleting the outermost
+// decorator releases the whole chain.
 class FareDecorator : public FareCalculator {
 protected:
     FareCalculator* wrappedCalculator;
@@ -199,6 +460,10 @@ protected:
 public:
     FareDecorator(FareCalculator* calc)
         : wrappedCalculator(calc) {}
+    ~FareDecorator() override { delete wrappedCalculator; }
+
+    FareDecorator(const FareDecorator&) = delete;
+    FareDecorator& operator=(const FareDecorator&) = delete;
 };
 
 class SurgePricingDecorator : public FareDecorator {
@@ -221,386 +486,8791 @@ public:
     double calculate(Ride* ride) const override;
 };
 
-// Abstract PaymentProcessor
-class PaymentProcessor {
-public:
-    virtual bool processPayment(Ride* ride, double amount) = 0;
+// Fare rules
+// Value-type counterparts of the decorators above. Each rule maps the fare
+// so far to the next one, in the same order and with the same arithmetic
+// as the decorator chain, so both produce identical fares.
+struct FareInputs {
+    double distanceKm;
+    double farePerKm;
+    double surgeMultiplier;
+    double discount;
 };
 
-class DummyPaymentProcessor : public PaymentProcessor {
-public:
-    bool processPayment(Ride* ride, double amount) override;
+struct BaseFareRule {
+    static double apply(double, const FareInputs& in) {
+        return BaseFareCalculator::BASE_FARE + (in.distanceKm * in.farePerKm);
+    }
 };
 
-// MatchingStrategy
-class MatchingStrategy {
-public:
-    virtual Driver* chooseDriver(const RideRequest& request, const vector<Driver*>& availableDrivers) = 0;
+struct SurgeRule {
+    static double apply(double fare, const FareInputs& in) {
+        return fare * in.surgeMultiplier;
+    }
 };
 
-class NearestDriverStrategy : public MatchingStrategy {
-public:
-    Driver* chooseDriver(const RideRequest& request, const vector<Driver*>& availableDrivers) override;
+struct DiscountRule {
+    static double apply(double fare, const FareInputs& in) {
+        double discounted = fare - in.discount;
+        return (discounted < 0.0 ? 0.0 : discounted);
+    }
 };
 
-class BestRatedDriverStrategy : public MatchingStrategy {
-public:
-    Driver* chooseDriver(const RideRequest& request, const vector<Driver*>& availableDrivers) override;
+// FarePipeline
+// Compile-time composition of fare rules, applied left to right. Each
+// instantiation inlines to a handful of arithmetic ops; new promotions are
+// added as another rule type rather than another heap-allocated decorator.
+template <typename... Rules>
+struct FarePipeline {
+    static double calculate(const FareInputs& in) {
+        double fare = 0.0;
+        ((fare = Rules::apply(fare, in)), ...);
+        return fare;
+    }
 };
 
-// RideFactory
-class RideFactory {
-    static int rideCounter;
+typedef FarePipeline<BaseFareRule> BaseFarePipeline;
+typedef FarePipeline<BaseFareRule, SurgeRule> SurgeFarePipeline;
+typedef FarePipeline<BaseFareRule, DiscountRule> DiscountFarePipeline;
+typedef FarePipeline<BaseFareRule, SurgeRule, DiscountRule> SurgeDiscountFarePipeline;
 
-public:
-    static Ride* createRide(const RideRequest& request);
-};
+// FareQuoteBatch
+// Structure-of-arrays input for bulk quoting, one entry per fare.
+struct FareQuoteBatch {
+    vector<double> distanceKm;
+    vector<double> farePerKm;
+    vector<double> surgeMultiplier;
+    vector<double> discount;
 
-int RideFactory::rideCounter = 0;
+    size_t size() const { return distanceKm.size(); }
 
-// Ride
-class Ride {
-    string id;
-    Rider* rider;
-    Driver* driver;
-    Location pickupLocation;
-    Location dropLocation;
-    VehicleType requestedType;
-    RideStatus status;
-    double distanceKm;
-    double fare;
-    bool paid;
+    void add(double distance, double rate, double multiplier, double disc) {
+        distanceKm.push_back(distance);
+        farePerKm.push_back(rate);
+        surgeMultiplier.push_back(multiplier);
+        discount.push_back(disc);
+    }
+};
 
-    vector<RideObserver*> observers;
+// FareEngine
+// The active pricing configuration compiled down to a choice of pipeline.
+// DispatchService rebuilds it when surge changes and copies it by value, so
+// pricing a ride costs one indirect call and no allocation.
+class FareEngine {
+    typedef double (*Kernel)(const FareInputs&);
+
+    bool surgeActive;
+    double surgeMultiplier;
+    Kernel plainKernel;     // rider has no discount
+    Kernel discountKernel;  // rider has a discount
 
 public:
-    Ride(const string& rideId, Rider* r,
-         const Location& pickup, const Location& drop, VehicleType type)
-        : id(rideId),
-          rider(r),
-          driver(nullptr),
-          pickupLocation(pickup),
-          dropLocation(drop),
-          requestedType(type),
-          status(REQUESTED),
-          distanceKm(pickup.distanceTo(drop)),
-          fare(0.0),
-          paid(false) {}
+    FareEngine() : FareEngine(false, 1.0) {}
+    FareEngine(bool surge, double multiplier)
+        : surgeActive(surge),
+          surgeMultiplier(surge ? multiplier : 1.0),
+          plainKernel(surge ? &SurgeFarePipeline::calculate : &BaseFarePipeline::calculate),
+          discountKernel(surge ? &SurgeDiscountFarePipeline::calculate
+                               : &DiscountFarePipeline::calculate) {}
 
-    string getId() const { return id; }
-    Rider* getRider() const { return rider; }
-    Driver* getDriver() const { return driver; }
-    Location getPickupLocation() const { return pickupLocation; }
-    Location getDropLocation() const { return dropLocation; }
-    RideStatus getStatus() const { return status; }
-    double getDistanceKm() const { return distanceKm; }
-    double getFare() const { return fare; }
-    bool isPaid() const { return paid; }
+    bool isSurge() const { return surgeActive; }
+    double getSurgeMultiplier() const { return surgeMultiplier; }
 
-    void assignDriver(Driver* d);
-    void attachObserver(RideObserver* obs);
-    void removeObserver(RideObserver* obs);
-    void notifyObservers(RideStatus newStatus);
-    void updateStatus(RideStatus newStatus);
-    void setFare(double f) { fare = f; }
-    void setPaid(bool p) { paid = p; }
-};
+    double calculate(double distanceKm, double farePerKm, double discount) const {
+        FareInputs in{distanceKm, farePerKm, surgeMultiplier, discount};
+        return discount > 0.0 ? discountKernel(in) : plainKernel(in);
+    }
 
-// DispatchService
-class DispatchService {
-    vector<Driver*> availableDrivers;
-    map<string, Ride*> ongoingRides;
-    vector<Ride*> completedRides;
+    // Distance from the ride, rate from the assigned vehicle, discount from
+    // the rider.
+    double calculate(const Ride* ride) const;
 
-    MatchingStrategy* matchingStrategy;
-    PaymentProcessor* paymentProcessor;
+    // Writes batch.size() fares to out. Uses AVX when the CPU has it, or
+    // NEON on aarch64, and matches calculate() bit for bit: multiplying by
+    // 1.0 and clamping a non-negative fare are exact, and both paths keep
+    // the same rounding order (contraction is off for this file).
+    static void calculateBatch(const FareQuoteBatch& batch, double* out);
+};
 
-    bool surgeActive;
-    double surgeMultiplier;
+// FareQuoteCache
+// Distance and base fare (BASE_FARE + distance * rate, per VehicleType)
+// between pairs of map cells, so a repeated quote costs one slot lookup.
+// Surge and discounts are multiplicative/subtractive on top of the base
+// fare and are applied per quote, so entries do not depend on them.
+// Entries are tagged with the pricing version they were computed under and
+// a lookup under any other version is a miss. Direct-mapped: a colliding
+// pair simply overwrites the slot.
+class FareQuoteCache {
+public:
+    struct Quote {
+        double distanceKm;
+        double baseFare[VEHICLE_TYPE_COUNT];
+    };
 
-    DispatchService()
-        : matchingStrategy(new NearestDriverStrategy()), paymentProcessor(new DummyPaymentProcessor()), surgeActive(false), surgeMultiplier(1.0) {}
+private:
+    static const int STRIPES = 64;
 
-public:
-    // Delete copy/move constructors
-    DispatchService(const DispatchService&) = delete;
-    DispatchService& operator=(const DispatchService&) = delete;
+    struct Slot {
+        long long from, to;
+        uint64_t version;
+        bool used;
+        Quote quote;
+    };
 
-    static DispatchService& getInstance() {
-        static DispatchService instance;
-        return instance;
-    }
+    vector<Slot> slots;
+    size_t mask;
+    mutable mutex stripes[STRIPES];  // slot i is guarded by stripes[i % STRIPES]
+    double cellSize;
+    atomic<uint64_t> hits, misses;
 
-    void setMatchingStrategy(MatchingStrategy* strategy) {
-        if (matchingStrategy) delete matchingStrategy;
-        matchingStrategy = strategy;
+    size_t slotFor(long long from, long long to) const {
+        uint64_t h = (uint64_t)from * 0x9E3779B97F4A7C15ULL ^ (uint64_t)to * 0xC2B2AE3D27D4EB4FULL;
+        return (size_t)(h ^ (h >> 29)) & mask;
     }
 
-    void activateSurge(double multiplier) {
-        surgeActive = true;
-        surgeMultiplier = multiplier;
-    }
+public:
+    // entries is rounded up to a power of two, and to at least STRIPES.
+    FareQuoteCache(size_t entries, double cellSizeDeg);
 
-    void deactivateSurge() {
-        surgeActive = false;
-        surgeMultiplier = 1.0;
+    long long cellOf(const Location& loc) const {
+        long long x = (long long)std::floor(loc.latitude / cellSize);
+        long long y = (long long)std::floor(loc.longitude / cellSize);
+        return (x << 32) ^ (long long)(uint32_t)y;
+    }
+    Location centreOf(long long cell) const {
+        int32_t x = (int32_t)(cell >> 32);
+        int32_t y = (int32_t)(uint32_t)cell;
+        return Location((x + 0.5) * cellSize, (y + 0.5) * cellSize);
     }
 
-    bool isSurge() const { return surgeActive; }
-    double getCurrentMultiplier() const { return surgeMultiplier; }
+    bool find(long long from, long long to, uint64_t version, Quote& out);
+    void put(long long from, long long to, uint64_t version, const Quote& quote);
 
-    void registerDriver(Driver* driver) {
-        driver->setStatus(AVAILABLE);
-        availableDrivers.push_back(driver);
-        cout << "Driver registered: " << *driver << endl;
-    }
+    uint64_t hitCount() const { return hits.load(memory_order_relaxed); }
+    uint64_t missCount() const { return misses.load(memory_order_relaxed); }
+};
 
-    void deregisterDriver(Driver* driver) {
-        driver->setStatus(OFFLINE);
-        availableDrivers.erase(
-            remove(availableDrivers.begin(), availableDrivers.end(), driver),
-            availableDrivers.end());
-        cout << "Driver deregistered: " << *driver << endl;
+// Abstract PaymentProcessor
+// The ride id is the idempotency key: a gateway must treat a repeated
+// charge for the same ride as the one it has already seen, so failed
+// attempts can be retried safely.
+struct PaymentCharge {
+    Ride* ride;
+    double amount;
+    bool settled;  // out
+};
+
+class PaymentProcessor {
+public:
+    virtual ~PaymentProcessor() {}
+    virtual bool processPayment(Ride* ride, double amount) = 0;
+    // Settles several charges in one round trip. Gateways with a batch API
+    // override this; the default charges them one by one.
+    virtual void processPayments(PaymentCharge* charges, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            charges[i].settled = processPayment(charges[i].ride, charges[i].amount);
+        }
     }
+};
 
-    Ride* requestRide(Rider* rider, const Location& pickup, const Location& drop, VehicleType type) {
-        cout << "\n=== Rider " << rider->getName() << " requests a "
-             << (type == BIKE   ? "BIKE" :
-                 type == SEDAN  ? "SEDAN" :
-                 type == SUV    ? "SUV"   : "AUTO")
-             << " ride ===" << endl;
+class DummyPaymentProcessor : public PaymentProcessor {
+public:
+    bool processPayment(Ride* ride, double amount) override;
+};
 
-        RideRequest request(rider, pickup, drop, type);
-        Ride* ride = RideFactory::createRide(request);
-        rider->addRideToHistory(ride);
+// CandidateKernel
+// Ranking keys for a block of candidates held as separate lat/lon arrays.
+// Keys are monotonic in distance, so ranking never takes a square root or
+// an arcsine. The Euclidean key uses AVX when the CPU has it, or NEON on
+// aarch64, and has a scalar fallback.
+struct CandidateKernel {
+    // out[i] = squared Euclidean distance in degrees to q.
+    static void squaredDistances(const double* lat, const double* lon, size_t n,
+                                 const Location& q, double* out);
+    // out[i] = haversine term sin^2(dlat/2) + cos(lat)cos(qlat)sin^2(dlon/2).
+    static void haversineKeys(const double* lat, const double* lon, size_t n,
+                              const Location& q, double* out);
 
-        // Choose a driver
-        Driver* chosenDriver =
-            matchingStrategy->chooseDriver(request, availableDrivers);
-        if (!chosenDriver) {
-            cout << "No available drivers for Ride " << ride->getId()
-                 << ". Cancelling ride." << endl;
-            ride->updateStatus(CANCELLED);
-            return ride;
-        }
+    static int argmin(const double* keys, size_t n);
+    // Indices of the k smallest keys, smallest first.
+    static vector<int> topK(const double* keys, size_t n, size_t k);
+};
 
-        // Assign driver
-        ride->attachObserver(new RiderNotificationService());
-        ride->attachObserver(new DriverNotificationService());
-        ride->assignDriver(chosenDriver);
+// ScoreWeights
+// Distance-independent part of a composite driver score:
+//   rating * ratingWeight + idle minutes * idleWeight.
+// Idle minutes are now - availableSince, and now is the same for every
+// candidate of a request, so the pool stores
+//   rating * ratingWeight - availableSince * idleWeight
+// per slot and only refreshes it when the rating or the weights change.
+struct ScoreWeights {
+    double ratingWeight;
+    double idleWeight;  // per minute idle
 
-        // Update driver status & remove from available pool
-        chosenDriver->setStatus(ON_TRIP);
-        availableDrivers.erase(
-            remove(availableDrivers.begin(), availableDrivers.end(), chosenDriver),
-            availableDrivers.end());
+    ScoreWeights(double rating = 0.0, double idle = 0.0)
+        : ratingWeight(rating), idleWeight(idle) {}
 
-        // Save in ongoing rides
-        ongoingRides[ride->getId()] = ride;
-        return ride;
+    double staticScore(double rating, double availableSince) const {
+        return rating * ratingWeight - availableSince * idleWeight;
     }
-
-    void updateRideStatus(const string& rideId, RideStatus newStatus) {
-        auto it = ongoingRides.find(rideId);
-        if (it == ongoingRides.end()) {
-            cout << "Ride " << rideId
-                 << " not found or already completed." << endl;
-            return;
-        }
-        it->second->updateStatus(newStatus);
+    bool operator==(const ScoreWeights& o) const {
+        return ratingWeight == o.ratingWeight && idleWeight == o.idleWeight;
     }
+};
 
-    void completeRide(const string& rideId) {
-        auto it = ongoingRides.find(rideId);
-        if (it == ongoingRides.end()) {
-            cout << "Ride " << rideId
-                 << " not found or already completed." << endl;
-            return;
-        }
-        Ride* ride = it->second;
+// DriverStateStore
+// Hot matching state of the available drivers of one VehicleType, as
+// parallel arrays indexed by a dense slot (see DriverPool::slotOf). Matching
+// scans stream through these arrays; the Driver objects are cold metadata
+// that are only touched once a driver has been picked.
+struct DriverStateStore {
+    typedef long long CellKey;
 
-        // 1. Mark completed
-        ride->updateStatus(COMPLETED);
+    vector<double> latitude;
+    vector<double> longitude;
+    vector<DriverStatus> status;
+    vector<double> rating;
+    vector<double> farePerKm;
+    vector<double> availableSince;  // DriverPool::minutesNow, when pooled
+    vector<double> staticScore;     // see ScoreWeights
+    vector<CellKey> cell;      // SpatialDriverIndex cell holding the slot
+    vector<Driver*> drivers;
 
-        // 2. Fare Calculation
-        FareCalculator* calculator = new BaseFareCalculator();
-        if (surgeActive) {
-            calculator = new SurgePricingDecorator(calculator, surgeMultiplier);
-        }
-        if (ride->getRider()->hasDiscount()) {
-            calculator = new DiscountDecorator(
-                calculator, ride->getRider()->getDiscountAmount());
-        }
-        double finalFare = calculator->calculate(ride);
-        delete calculator;
-        ride->setFare(finalFare);
+    size_t size() const { return drivers.size(); }
 
-        // 3. Process payment
-        bool paid = paymentProcessor->processPayment(ride, finalFare);
-        if (paid) {
-            ride->setPaid(true);
-            cout << "[Notification to Rider " << ride->getRider()->getName()
-                 << "]: Payment of ₹" << finalFare
-                 << " successful." << endl;
-        } else {
-            cout << "Payment failed for Ride " << ride->getId() << endl;
-        }
+    Location locationOf(int slot) const {
+        return Location(latitude[slot], longitude[slot]);
+    }
+    double distanceTo(int slot, const Location& loc) const {
+        double dx = latitude[slot] - loc.latitude;
+        double dy = longitude[slot] - loc.longitude;
+        return std::sqrt(dx * dx + dy * dy);
+    }
 
-        // 4. Free up driver
-        Driver* driver = ride->getDriver();
-        driver->setStatus(AVAILABLE);
-        availableDrivers.push_back(driver);
-        cout << "Driver " << driver->getName() << " is now AVAILABLE." << endl;
+    int append(Driver* driver, CellKey key, double since, double score);
+    // Appends a copy of row slot of other.
+    int appendRow(const DriverStateStore& other, int slot);
+    void moveSlot(int from, int to);
+    void popBack();
+};
+
+// SpatialDriverIndex
+// Uniform lat/lon grid, one per VehicleType, over DriverStateStore slots.
+// Cells are keyed on the floored coordinates, so a nearest-driver query
+// only visits the rings of cells around the pickup instead of every
+// available driver.
+class SpatialDriverIndex {
+public:
+    typedef DriverStateStore::CellKey CellKey;
+
+private:
+    struct CellBounds {
+        int minX, maxX, minY, maxY;
+        bool empty;
+        CellBounds() : minX(0), maxX(0), minY(0), maxY(0), empty(true) {}
+    };
+
+    double cellSize;
+    unordered_map<CellKey, vector<int>> cells[VEHICLE_TYPE_COUNT];
+    CellBounds bounds[VEHICLE_TYPE_COUNT];
 
-        // 5. Move ride from ongoing to completed
-        ongoingRides.erase(it);
-        completedRides.push_back(ride);
-        cout << "Ride " << rideId << " completed and archived.\n" << endl;
+    int cellCoord(double deg) const { return (int)std::floor(deg / cellSize); }
+    static CellKey makeKey(int x, int y) {
+        return ((CellKey)x << 32) ^ (CellKey)(unsigned int)y;
     }
+    static int keyX(CellKey key) { return (int)(key >> 32); }
+    static int keyY(CellKey key) { return (int)(unsigned int)key; }
+    void growBounds(VehicleType type, int x, int y);
 
-    void printAvailableDrivers() const {
-        cout << "\n--- Available Drivers ---" << endl;
-        for (const auto& d : availableDrivers) {
-            cout << *d << endl;
+    // Calls fn with the slots of every occupied cell exactly ring cells
+    // from (qx, qy), in row-major order. Only the 8 * ring cells on the
+    // ring's edges are looked up, and none outside the bounds.
+    template <class Fn>
+    void forEachRingCell(VehicleType type, int qx, int qy, int ring, Fn fn) const {
+        const CellBounds& b = bounds[type];
+        auto visit = [&](int x, int y) {
+            if (x < b.minX || x > b.maxX || y < b.minY || y > b.maxY) return;
+            auto it = cells[type].find(makeKey(x, y));
+            if (it != cells[type].end()) fn(it->second);
+        };
+        for (int dx = -ring; dx <= ring; ++dx) {
+            if (dx == -ring || dx == ring) {
+                for (int dy = -ring; dy <= ring; ++dy) visit(qx + dx, qy + dy);
+            } else {
+                visit(qx + dx, qy - ring);
+                visit(qx + dx, qy + ring);
+            }
         }
-        cout << "-------------------------" << endl;
     }
-};
 
-// Implementation Details
-Ride* Rider::requestRide(const Location& pickup, const Location& drop, VehicleType type) {
-    return DispatchService::getInstance().requestRide(this, pickup, drop, type);
-}
-void RiderNotificationService::onRideStatusChanged(Ride* ride, RideStatus newStatus) {
-    cout << "[Notification to Rider " << ride->getRider()->getName()
-         << "]: Ride " << ride->getId() << " is now ";
-    switch (newStatus) {
-        case REQUESTED:           cout << "REQUESTED";           break;
-        case DRIVER_ASSIGNED:     cout << "DRIVER_ASSIGNED";     break;
-        case EN_ROUTE_TO_PICKUP:  cout << "EN_ROUTE_TO_PICKUP";  break;
-        case IN_PROGRESS:         cout << "IN_PROGRESS";         break;
-        case COMPLETED:           cout << "COMPLETED";           break;
-        case CANCELLED:           cout << "CANCELLED";           break;
-    }
-    cout << endl;
-}
+public:
+    // 0.01 degrees is roughly 1.1 km at the equator.
+    explicit SpatialDriverIndex(double cellSizeDeg = 0.01)
+        : cellSize(cellSizeDeg) {}
 
-void DriverNotificationService::onRideStatusChanged(Ride* ride, RideStatus newStatus) {
-    if (ride->getDriver()) {
-        cout << "[Notification to Driver " << ride->getDriver()->getName()
-             << "]: Ride " << ride->getId() << " is now ";
-        switch (newStatus) {
-            case REQUESTED:           cout << "REQUESTED";           break;
-            case DRIVER_ASSIGNED:     cout << "DRIVER_ASSIGNED";     break;
-            case EN_ROUTE_TO_PICKUP:  cout << "EN_ROUTE_TO_PICKUP";  break;
-            case IN_PROGRESS:         cout << "IN_PROGRESS";         break;
-            case COMPLETED:           cout << "COMPLETED";           break;
-            case CANCELLED:           cout << "CANCELLED";           break;
-        }
-        cout << endl;
+    CellKey cellKeyFor(const Location& loc) const {
+        return makeKey(cellCoord(loc.latitude), cellCoord(loc.longitude));
     }
-}
 
-double BaseFareCalculator::calculate(Ride* ride) const {
-    double distance = ride->getDistanceKm();
-    double perKmRate = ride->getDriver()->getVehicle()->getFarePerKm();
-    return BASE_FARE + (distance * perKmRate);
-}
+    void insert(VehicleType type, CellKey key, int slot);
+    void erase(VehicleType type, CellKey key, int slot);
+    // The store moved a driver from oldSlot to newSlot.
+    void renumber(VehicleType type, CellKey key, int oldSlot, int newSlot);
 
-double SurgePricingDecorator::calculate(Ride* ride) const {
-    double baseFare = wrappedCalculator->calculate(ride);
-    return baseFare * surgeMultiplier;
-}
+    // Up to k slots of the given type within radius of loc, nearest first.
+    vector<int> kNearest(VehicleType type, const DriverStateStore& store,
+                         const Location& loc, double radius, size_t k) const;
 
-double DiscountDecorator::calculate(Ride* ride) const {
-    double fareBeforeDiscount = wrappedCalculator->calculate(ride);
-    double finalFare = fareBeforeDiscount - discountAmount;
-    return (finalFare < 0.0 ? 0.0 : finalFare);
-}
+    // Up to k slots within radius with the highest
+    //   staticScore - distanceWeight * distance (degrees),
+    // best first. scoreBound is at least every slot's staticScore; rings
+    // that cannot beat the k-th best even at that score are not visited.
+    vector<int> kBestScored(VehicleType type, const DriverStateStore& store,
+                            const Location& loc, double radius, double distanceWeight,
+                            double scoreBound, size_t k) const;
+};
 
-bool DummyPaymentProcessor::processPayment(Ride* ride, double amount) {
-    cout << "Processing payment of ₹" << amount
-         << " for Ride " << ride->getId() << endl;
-    return true;
-}
+// Keeps the k best (score, slot) pairs as a min-heap on score.
+struct ScoredTopK {
+    size_t k;
+    vector<pair<double, int>> heap;
 
-// Matching Strategies
-Driver* NearestDriverStrategy::chooseDriver(
-    const RideRequest& request,
-    const vector<Driver*>& availableDrivers) {
+    explicit ScoredTopK(size_t k_) : k(k_) {}
 
-    Driver* nearest = nullptr;
-    double minDistance = numeric_limits<double>::infinity();
-    for (auto d : availableDrivers) {
-        if (d->getStatus() == AVAILABLE &&
-            d->getVehicle()->getType() == request.getType()) {
-            double dist = d->getCurrentLocation().distanceTo(request.getPickup());
-            if (dist < minDistance) {
-                minDistance = dist;
-                nearest = d;
-            }
+    static bool worse(const pair<double, int>& a, const pair<double, int>& b) {
+        return a.first > b.first;
+    }
+    bool full() const { return heap.size() == k; }
+    double worst() const { return heap.front().first; }
+    void offer(double score, int slot) {
+        if (heap.size() < k) {
+            heap.emplace_back(score, slot);
+            push_heap(heap.begin(), heap.end(), worse);
+        } else if (score > heap.front().first) {
+            pop_heap(heap.begin(), heap.end(), worse);
+            heap.back() = make_pair(score, slot);
+            push_heap(heap.begin(), heap.end(), worse);
         }
     }
-    return nearest;
-}
+    vector<int> slots() {
+        sort_heap(heap.begin(), heap.end(), worse);
+        vector<int> result;
+        for (const auto& entry : heap) result.push_back(entry.second);
+        return result;
+    }
+};
 
-Driver* BestRatedDriverStrategy::chooseDriver(
-    const RideRequest& request,
-    const vector<Driver*>& availableDrivers) {
+// SurgeZoneTracker
+// Demand and supply per map zone and VehicleType, kept up to date as
+// requests arrive and drivers enter or leave the available pool. Demand is
+// the number of requests in a sliding window, counted in a ring of time
+// buckets; supply is the number of available drivers right now. Every
+// event and every multiplier lookup is O(1).
+class SurgeZoneTracker {
+public:
+    static const int WINDOW_BUCKETS = 12;
+    typedef uint64_t ZoneKey;
 
-    Driver* best = nullptr;
-    double bestRating = -1.0;
-    for (auto d : availableDrivers) {
-        if (d->getStatus() == AVAILABLE &&
-            d->getVehicle()->getType() == request.getType()) {
-            if (d->getRating() > bestRating) {
-                bestRating = d->getRating();
-                best = d;
-            }
-        }
-    }
-    return best;
-}
+private:
+    static const int STRIPES = 16;
 
-// RideFactory
-Ride* RideFactory::createRide(const RideRequest& request) {
-    string rideId = to_string(++rideCounter);
-    return new Ride(rideId,
-                    request.getRider(),
-                    request.getPickup(),
-                    request.getDrop(),
-                    request.getType());
-}
+    struct ZoneCounters {
+        int supply[VEHICLE_TYPE_COUNT] = {};
+        int demand[VEHICLE_TYPE_COUNT] = {};  // sum of the buckets below
+        int buckets[VEHICLE_TYPE_COUNT][WINDOW_BUCKETS] = {};
+        int64_t newestBucket = 0;
+    };
 
-// Ride methods
-void Ride::assignDriver(Driver* d) {
-    driver = d;
-    updateStatus(DRIVER_ASSIGNED);
-}
+    struct Stripe {
+        mutex lock;
+        unordered_map<ZoneKey, ZoneCounters> zones;
+    };
 
-void Ride::attachObserver(RideObserver* obs) {
+    // Lookups also expire old buckets, hence mutable.
+    mutable Stripe stripes[STRIPES];
+    double zoneSize;  // degrees
+    chrono::milliseconds bucketLength;
+    double sensitivity;
+    double maxMultiplier;
+    chrono::steady_clock::time_point epoch;
+
+    int64_t bucketAt(chrono::steady_clock::time_point t) const {
+        return (int64_t)((t - epoch) / bucketLength);
+    }
+    Stripe& stripeFor(ZoneKey key) const {
+        return stripes[(key * 0x9E3779B97F4A7C15ULL) >> 60];
+    }
+    // Zeroes the buckets that slid out of the window since the last event.
+    void advance(ZoneCounters& zone, int64_t bucket) const;
+    void addSupply(VehicleType type, const Location& loc, int delta);
+
+public:
+    SurgeZoneTracker(double zoneSizeDeg = 0.02,
+                     chrono::milliseconds bucket = chrono::milliseconds(5000),
+                     double surgeSensitivity = 0.5, double surgeCap = 3.0)
+        : zoneSize(zoneSizeDeg), bucketLength(bucket), sensitivity(surgeSensitivity),
+          maxMultiplier(surgeCap), epoch(chrono::steady_clock::now()) {}
+
+    ZoneKey zoneFor(const Location& loc) const {
+        uint32_t x = (uint32_t)(int32_t)std::floor(loc.latitude / zoneSize);
+        uint32_t y = (uint32_t)(int32_t)std::floor(loc.longitude / zoneSize);
+        return ((ZoneKey)x << 32) | y;
+    }
+
+    void driverAvailable(VehicleType type, const Location& loc) { addSupply(type, loc, 1); }
+    void driverUnavailable(VehicleType type, const Location& loc) { addSupply(type, loc, -1); }
+    void driverMoved(VehicleType type, const Location& from, const Location& to) {
+        if (zoneFor(from) == zoneFor(to)) return;
+        addSupply(type, from, -1);
+        addSupply(type, to, 1);
+    }
+    void rideRequested(VehicleType type, const Location& pickup);
+
+    // 1.0 while windowed demand does not exceed supply, then rising by
+    // sensitivity per unit of excess demand/supply ratio, floored to 0.1
+    // steps and capped at maxMultiplier.
+    double multiplierFor(VehicleType type, const Location& pickup) const;
+    // multiplierFor every VehicleType, taking the zone's lock once.
+    void multipliersFor(const Location& pickup, double* out) const;
+
+private:
+    double multiplierFrom(int demand, int supply) const {
+        if (demand <= supply) return 1.0;
+        double ratio = (double)demand / max(supply, 1);
+        double multiplier = 1.0 + sensitivity * (ratio - 1.0);
+        return min(maxMultiplier, std::floor(multiplier * 10.0) / 10.0);
+    }
+};
+
+// DriverPool
+// The set of AVAILABLE drivers: one DriverStateStore per VehicleType plus
+// the spatial index over them. Slots stay dense, so removal is O(1)
+// swap-and-pop and strategies only scan the requested type. Each pool
+// keeps its own driver -> slot map, so a copy answers for its own members.
+// DispatchService owns the pool; matching strategies only read it.
+class DriverPool {
+public:
+    // Longer change logs are cut off; see setChangeLog.
+    static const size_t CHANGE_LOG_LIMIT = 4096;
+
+private:
+    // Where a pooled driver's row is. The type is kept so that logged
+    // drivers can be dropped without reading the Driver.
+    struct Member {
+        VehicleType type;
+        int slot;
+    };
+
+    DriverStateStore stores[VEHICLE_TYPE_COUNT];
+    SpatialDriverIndex index;
+    unordered_map<const Driver*, Member> slots;
+    SurgeZoneTracker* zones;     // told about every supply change, if set
+    atomic<uint64_t>* changes;   // bumped on every mutation, if set
+    vector<Driver*>* changeLog;  // gets every driver whose row changed, if set
+    const atomic<double>* clock; // minutes add stamps availableSince with, if set
+    ScoreWeights weights;
+    // Upper bound on the staticScore column per type. Only raised between
+    // reweighs, so removals leave it loose but still valid.
+    double scoreBound[VEHICLE_TYPE_COUNT];
+
+    void changed(Driver* driver) {
+        if (changes) changes->fetch_add(1, memory_order_release);
+        if (changeLog && changeLog->size() <= CHANGE_LOG_LIMIT) changeLog->push_back(driver);
+    }
+    void changedAll() {
+        if (changes) changes->fetch_add(1, memory_order_release);
+        if (changeLog) changeLog->assign(CHANGE_LOG_LIMIT + 1, nullptr);
+    }
+    void rescore(VehicleType type, int slot) {
+        DriverStateStore& store = stores[type];
+        store.staticScore[slot] = weights.staticScore(store.rating[slot],
+                                                      store.availableSince[slot]);
+        scoreBound[type] = max(scoreBound[type], store.staticScore[slot]);
+    }
+
+public:
+    DriverPool() : zones(nullptr), changes(nullptr), changeLog(nullptr), clock(nullptr) {
+        fill(begin(scoreBound), end(scoreBound), -numeric_limits<double>::infinity());
+    }
+
+    // steady_clock minutes, or the pinned clock's.
+    double minutesNow() const {
+        if (clock) return clock->load(memory_order_relaxed);
+        return chrono::duration<double, ratio<60>>(
+                   chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void setZoneTracker(SurgeZoneTracker* tracker) { zones = tracker; }
+    void setChangeCounter(atomic<uint64_t>* counter) { changes = counter; }
+    // The log holds more than CHANGE_LOG_LIMIT entries once it overflowed,
+    // and then no longer lists every change.
+    void setChangeLog(vector<Driver*>* log) { changeLog = log; }
+    void setClock(const atomic<double>* minutes) { clock = minutes; }
+    const DriverStateStore& ofType(VehicleType type) const { return stores[type]; }
+    // Slot of driver in ofType(its vehicle type), -1 if not pooled here.
+    int slotOf(const Driver* driver) const {
+        auto it = slots.find(driver);
+        return it == slots.end() ? -1 : it->second.slot;
+    }
+    bool contains(const Driver* driver) const { return slots.count(driver) != 0; }
+    size_t size() const { return slots.size(); }
+
+    void add(Driver* driver);
+    void remove(Driver* driver);
+    // Re-reads location from a pooled driver and moves it between cells.
+    void relocate(Driver* driver);
+    // Re-reads the non-location hot fields (rating) of a pooled driver.
+    void refresh(Driver* driver);
+    // Recomputes every staticScore for new weights.
+    void setScoreWeights(const ScoreWeights& w);
+    // Makes driver's row match live: dropped if live does not pool it,
+    // copied over otherwise. Brings a copy of live up to date one logged
+    // change at a time, so driver is never read: it may be gone by now.
+    // Weights must already match.
+    void syncFrom(const DriverPool& live, Driver* driver);
+    const ScoreWeights& scoreWeights() const { return weights; }
+
+    // Pools this small are cheaper to scan end to end with the SIMD kernel
+    // than to walk through the grid.
+    static const size_t LINEAR_SCAN_LIMIT = 64;
+
+    vector<int> nearestSlots(VehicleType type, const Location& loc,
+                             double radius, size_t k) const;
+    vector<Driver*> nearest(VehicleType type, const Location& loc,
+                            double radius, size_t k) const {
+        vector<Driver*> result;
+        for (int slot : nearestSlots(type, loc, radius, k)) {
+            result.push_back(stores[type].drivers[slot]);
+        }
+        return result;
+    }
+
+    // See SpatialDriverIndex::kBestScored.
+    vector<int> bestScoredSlots(VehicleType type, const Location& loc, double radius,
+                                double distanceWeight, size_t k) const;
+};
+
+// RoadNetwork
+// Directed road graph with travel times, preprocessed into a contraction
+// hierarchy: nodes are contracted from least to most important, and
+// shortcuts between the remaining nodes keep every shortest path intact.
+// A point-to-point query then only runs two small upward searches instead
+// of a Dijkstra over the whole city. The original arcs are kept for the
+// one-to-many search, which is bounded by the pickup radius anyway.
+// Read-only once prepared, so any number of threads may query it.
+class RoadNetwork {
+public:
+    struct Arc {
+        int to;  // for inArcs and upBackward: the tail of the arc
+        double seconds;
+        double km;
+    };
+
+private:
+    static const int WITNESS_SETTLE_LIMIT = 64;
+
+    vector<Location> nodes;
+    vector<vector<Arc>> outArcs, inArcs;
+    vector<vector<Arc>> upForward, upBackward;
+    vector<int> rank;
+    bool prepared;
+
+    double snapCell;
+    unordered_map<long long, vector<int>> snapGrid;
+
+    long long snapKey(int x, int y) const { return ((long long)x << 32) ^ (long long)(uint32_t)y; }
+    // Scratch for the query searches, one set per thread.
+    struct SearchSpace {
+        vector<double> seconds, km;
+        vector<int> touched;
+        void reset(size_t n) {
+            if (seconds.size() != n) {
+                seconds.assign(n, numeric_limits<double>::infinity());
+                km.assign(n, 0.0);
+                touched.clear();
+            }
+            for (int v : touched) seconds[v] = numeric_limits<double>::infinity();
+            touched.clear();
+        }
+        void set(int v, double s, double k) {
+            if (seconds[v] == numeric_limits<double>::infinity()) touched.push_back(v);
+            seconds[v] = s;
+            km[v] = k;
+        }
+    };
+    // Dijkstra from source over graph, exhaustive; for the upward graphs.
+    static void upwardSearch(const vector<vector<Arc>>& graph, int source, SearchSpace& space);
+    void addShortcut(vector<vector<Arc>>& out, vector<vector<Arc>>& in, int from, int to,
+                     double seconds, double km);
+
+public:
+    explicit RoadNetwork(double snapCellDeg = 0.01) : prepared(false), snapCell(snapCellDeg) {}
+
+    int addNode(const Location& loc);
+    void addRoad(int from, int to, double seconds, double km, bool twoWay = true);
+    // Builds the hierarchy. No roads may be added afterwards.
+    void prepare();
+
+    bool isPrepared() const { return prepared; }
+    size_t nodeCount() const { return nodes.size(); }
+    const Location& nodeLocation(int node) const { return nodes[node]; }
+    // -1 when the network is empty.
+    int nearestNode(const Location& loc) const;
+
+    // Fastest route. seconds is infinity when to cannot be reached.
+    void route(int from, int to, double& seconds, double& km) const;
+    // Fastest routes from every source to target, from one reverse search
+    // over the original graph that stops once all sources are settled or
+    // maxSeconds is passed. Unreached sources get infinity.
+    void routesTo(const int* sources, size_t n, int target, double maxSeconds,
+                  double* seconds, double* km) const;
+};
+
+// DistanceProvider
+// Distance and travel time between two points, for fares and matching.
+// Providers are shared by all dispatch threads.
+class DistanceProvider {
+public:
+    virtual ~DistanceProvider() {}
+    virtual double distanceKm(const Location& from, const Location& to) = 0;
+    virtual double etaSeconds(const Location& from, const Location& to) = 0;
+    // ETA from each of n origins to one destination. Providers answer it
+    // with a single search where they can.
+    virtual void etasTo(const Location* from, size_t n, const Location& to, double* out) {
+        for (size_t i = 0; i < n; ++i) out[i] = etaSeconds(from[i], to);
+    }
+};
+
+// Great-circle distance at a constant speed.
+class StraightLineProvider : public DistanceProvider {
+    double kmh;
+
+public:
+    explicit StraightLineProvider(double speedKmh = 25.0) : kmh(speedKmh) {}
+
+    double distanceKm(const Location& from, const Location& to) override {
+        return from.haversineKm(to);
+    }
+    double etaSeconds(const Location& from, const Location& to) override {
+        return from.haversineKm(to) / kmh * 3600.0;
+    }
+};
+
+// EtaCache
+// Bounded LRU of routes between map cells. Points in the same pair of
+// cells share an entry, so answers are accurate to about the cell size.
+class EtaCache {
+public:
+    struct Key {
+        long long from, to;
+        bool operator==(const Key& o) const { return from == o.from && to == o.to; }
+    };
+
+private:
+    struct KeyHash {
+        size_t operator()(const Key& k) const {
+            return (size_t)((uint64_t)k.from * 0x9E3779B97F4A7C15ULL ^ (uint64_t)k.to);
+        }
+    };
+    struct Entry {
+        Key key;
+        double seconds;
+        double km;
+    };
+
+    mutex lock;
+    list<Entry> lru;  // most recently used first
+    unordered_map<Key, list<Entry>::iterator, KeyHash> index;
+    size_t capacity;
+    double cellSize;
+    atomic<uint64_t> hits, misses;
+
+    long long cellOf(const Location& loc) const {
+        long long x = (long long)std::floor(loc.latitude / cellSize);
+        long long y = (long long)std::floor(loc.longitude / cellSize);
+        return (x << 32) ^ (long long)(uint32_t)y;
+    }
+
+public:
+    EtaCache(size_t maxEntries, double cellSizeDeg)
+        : capacity(max<size_t>(1, maxEntries)), cellSize(cellSizeDeg), hits(0), misses(0) {}
+
+    Key keyFor(const Location& from, const Location& to) const {
+        return Key{cellOf(from), cellOf(to)};
+    }
+    bool find(const Key& key, double& seconds, double& km);
+    void put(const Key& key, double seconds, double km);
+
+    uint64_t hitCount() const { return hits.load(memory_order_relaxed); }
+    uint64_t missCount() const { return misses.load(memory_order_relaxed); }
+};
+
+// Routes over a RoadNetwork. Points are snapped to their nearest node and
+// the legs to and from it are counted as straight lines at accessKmh.
+// When the network cannot connect two points (or etasTo's search bound
+// is passed) the ETA is infinity and only the distance falls back to the
+// straight line, for fares. Such answers are not cached.
+class RoadDistanceProvider : public DistanceProvider {
+    const RoadNetwork& network;
+    EtaCache cache;
+    double accessKmh;
+    double maxSearchSeconds;  // bound on the one-to-many search
+
+    double accessSeconds(const Location& loc, int node) const {
+        return loc.haversineKm(network.nodeLocation(node)) / accessKmh * 3600.0;
+    }
+    void route(const Location& from, const Location& to, double& seconds, double& km);
+
+public:
+    explicit RoadDistanceProvider(const RoadNetwork& roads, size_t cacheEntries = 1 << 16,
+                                  double cacheCellDeg = 0.002, double accessSpeedKmh = 15.0,
+                                  double maxSearch = 1800.0)
+        : network(roads), cache(cacheEntries, cacheCellDeg), accessKmh(accessSpeedKmh),
+          maxSearchSeconds(maxSearch) {}
+
+    double distanceKm(const Location& from, const Location& to) override {
+        double seconds, km;
+        route(from, to, seconds, km);
+        return km;
+    }
+    double etaSeconds(const Location& from, const Location& to) override {
+        double seconds, km;
+        route(from, to, seconds, km);
+        return seconds;
+    }
+    void etasTo(const Location* from, size_t n, const Location& to, double* out) override;
+
+    const EtaCache& getCache() const { return cache; }
+};
+
+// MatchingStrategy
+class MatchingStrategy {
+public:
+    virtual ~MatchingStrategy() {}
+
+    // Strategies are shared by all dispatch threads, so chooseSlot and
+    // chooseDrivers must not mutate strategy state. chooseSlot may be given
+    // a published snapshot of the pool, so it reads driver state from the
+    // pool's stores and never from the Driver objects.
+    // Returns the chosen slot in pool.ofType(request.getType()), or -1.
+    virtual int chooseSlot(const RideRequest& request, const DriverPool& pool) = 0;
+
+    // Up to k slots, best first, from one index query. Used to offer a ride
+    // down a ranked list when drivers decline. The default has only the
+    // chooseSlot pick.
+    virtual vector<int> chooseSlots(const RideRequest& request, const DriverPool& pool,
+                                    size_t k) {
+        int slot = chooseSlot(request, pool);
+        return slot < 0 || k == 0 ? vector<int>() : vector<int>(1, slot);
+    }
+
+    Driver* chooseDriver(const RideRequest& request, const DriverPool& pool) {
+        int slot = chooseSlot(request, pool);
+        return slot < 0 ? nullptr : pool.ofType(request.getType()).drivers[slot];
+    }
+
+    // Lower is better. Used to pick between the choices made in the shards
+    // a request searches.
+    virtual double rank(const RideRequest& request, const DriverStateStore& store, int slot) const;
+
+    // Weights the strategy needs precomputed in every DriverPool, or
+    // nullptr. DispatchService applies them when the strategy is set.
+    virtual const ScoreWeights* scoreWeights() const { return nullptr; }
+
+    // Farthest pickup distance (degrees) chooseSlot may pick from. A
+    // sharded DispatchService searches every shard owning a cell within
+    // it. The default is unbounded, so every shard is searched.
+    virtual double searchRadius() const { return numeric_limits<double>::infinity(); }
+
+    // Batch hook: one driver (or nullptr) per request, no driver used twice.
+    // The default returns an empty vector, which tells DispatchService to
+    // fall back to calling chooseDriver once per request.
+    virtual vector<Driver*> chooseDrivers(const vector<RideRequest>& /*requests*/,
+                                          const DriverPool& /*pool*/) {
+        return {};
+    }
+};
+
+class NearestDriverStrategy : public MatchingStrategy {
+    // HAVERSINE starts by re-ranking this many grid (Euclidean) candidates
+    // and widens the set when a skipped driver could still be closer.
+    static const size_t HAVERSINE_CANDIDATES = 8;
+
+    double maxPickupRadius;
+    DistanceMetric metric;
+
+    // Lower bound on great-circle km per Euclidean degree for any driver
+    // within the radius of pickup.
+    double minKmPerDegree(const Location& pickup) const;
+
+public:
+    // Radius is in the same units as Location::distanceTo (degrees).
+    explicit NearestDriverStrategy(double radius = 0.1, DistanceMetric metric_ = EUCLIDEAN_DEGREES)
+        : maxPickupRadius(radius), metric(metric_) {}
+
+    int chooseSlot(const RideRequest& request, const DriverPool& pool) override;
+    vector<int> chooseSlots(const RideRequest& request, const DriverPool& pool,
+                            size_t k) override;
+    double rank(const RideRequest& request, const DriverStateStore& store, int slot) const override;
+    double searchRadius() const override { return maxPickupRadius; }
+};
+
+class BestRatedDriverStrategy : public MatchingStrategy {
+public:
+    int chooseSlot(const RideRequest& request, const DriverPool& pool) override;
+    vector<int> chooseSlots(const RideRequest& request, const DriverPool& pool,
+                            size_t k) override;
+    double rank(const RideRequest& request, const DriverStateStore& store, int slot) const override;
+};
+
+// Weighted blend of pickup distance, rating and idle time. Higher scores
+// win:
+//   rating * ratingWeight + idle minutes * idleWeight - km * distanceWeight
+// The first two terms are kept per driver in the pool (see ScoreWeights),
+// so a request only computes distances, and the grid walk stops once no
+// farther ring can beat the current pick.
+class ScoredDriverStrategy : public MatchingStrategy {
+    static constexpr double KM_PER_DEGREE = 111.2;
+
+    ScoreWeights weights;
+    double distanceWeight;  // per degree
+    double maxPickupRadius;
+
+public:
+    // Radius is in degrees, like NearestDriverStrategy's.
+    ScoredDriverStrategy(double distanceWeightPerKm, double ratingWeight, double idleWeightPerMinute,
+                         double radius = 0.1)
+        : weights(ratingWeight, idleWeightPerMinute),
+          distanceWeight(distanceWeightPerKm * KM_PER_DEGREE), maxPickupRadius(radius) {}
+
+    int chooseSlot(const RideRequest& request, const DriverPool& pool) override {
+        vector<int> best = chooseSlots(request, pool, 1);
+        return best.empty() ? -1 : best.front();
+    }
+    vector<int> chooseSlots(const RideRequest& request, const DriverPool& pool,
+                            size_t k) override {
+        return pool.bestScoredSlots(request.getType(), request.getPickup(), maxPickupRadius,
+                                    distanceWeight, k);
+    }
+    double rank(const RideRequest& request, const DriverStateStore& store, int slot) const override {
+        return distanceWeight * store.distanceTo(slot, request.getPickup()) - store.staticScore[slot];
+    }
+    const ScoreWeights* scoreWeights() const override { return &weights; }
+    double searchRadius() const override { return maxPickupRadius; }
+};
+
+// Ranks the nearest grid candidates by ETA to the pickup, all of them with
+// one DistanceProvider::etasTo call per request. The provider is owned by
+// the caller.
+class EtaDriverStrategy : public MatchingStrategy {
+    DistanceProvider* provider;
+    size_t candidates;
+    double maxPickupRadius;
+
+public:
+    explicit EtaDriverStrategy(DistanceProvider* distances, size_t candidateCount = 50,
+                               double radius = 0.1)
+        : provider(distances), candidates(candidateCount), maxPickupRadius(radius) {}
+
+    int chooseSlot(const RideRequest& request, const DriverPool& pool) override {
+        vector<int> best = chooseSlots(request, pool, 1);
+        return best.empty() ? -1 : best.front();
+    }
+    vector<int> chooseSlots(const RideRequest& request, const DriverPool& pool,
+                            size_t k) override;
+    double rank(const RideRequest& request, const DriverStateStore& store, int slot) const override {
+        return provider->etaSeconds(store.locationOf(slot), request.getPickup());
+    }
+    double searchRadius() const override { return maxPickupRadius; }
+};
+
+// Solves a whole window of requests as a min-cost bipartite assignment
+// (Hungarian method) over the k nearest drivers of each request, instead
+// of greedily handing the closest driver to whoever asked first.
+// Single requests go through the NearestDriverStrategy fallback.
+class BatchAssignmentStrategy : public MatchingStrategy {
+    NearestDriverStrategy fallback;
+    size_t candidatesPerRequest;
+    double maxPickupRadius;
+
+    static vector<int> solveAssignment(const vector<vector<double>>& cost);
+
+public:
+    explicit BatchAssignmentStrategy(size_t k = 8, double radius = 0.1)
+        : fallback(radius), candidatesPerRequest(k), maxPickupRadius(radius) {}
+
+    int chooseSlot(const RideRequest& request, const DriverPool& pool) override {
+        return fallback.chooseSlot(request, pool);
+    }
+    vector<int> chooseSlots(const RideRequest& request, const DriverPool& pool,
+                            size_t k) override {
+        return fallback.chooseSlots(request, pool, k);
+    }
+    double searchRadius() const override { return maxPickupRadius; }
+
+    vector<Driver*> chooseDrivers(const vector<RideRequest>& requests,
+                                  const DriverPool& pool) override;
+};
+
+// DriverOfferChannel
+// Offers a ride to a driver and waits for the answer. DispatchService holds
+// the driver out of the pool while the offer is open, so one driver never
+// sees two offers at once.
+enum OfferResult { OFFER_ACCEPTED, OFFER_DECLINED, OFFER_TIMED_OUT };
+
+class DriverOfferChannel {
+public:
+    virtual ~DriverOfferChannel() {}
+    virtual OfferResult offer(Driver* driver, RideId rideId, const RideRequest& request,
+                              chrono::milliseconds timeout) = 0;
+};
+
+// Offers wait for the driver app to call respond(). The app finds its open
+// offer with pendingOfferFor(). The offering thread sleeps on the offer's
+// condition variable until the answer or the timeout, whichever is first.
+class DriverAppOfferChannel : public DriverOfferChannel {
+    enum Answer { PENDING, ACCEPT, DECLINE };
+    struct PendingOffer {
+        RideId rideId;
+        Answer answer;  // guarded by the channel lock
+        condition_variable answered;
+        explicit PendingOffer(RideId id) : rideId(id), answer(PENDING) {}
+    };
+
+    mutex lock;
+    unordered_map<int, shared_ptr<PendingOffer>> pending;  // by driver id
+
+public:
+    OfferResult offer(Driver* driver, RideId rideId, const RideRequest& request,
+                      chrono::milliseconds timeout) override;
+
+    // The ride offered to the driver, or 0.
+    RideId pendingOfferFor(int driverId);
+    // False when the offer is no longer open, e.g. it timed out.
+    bool respond(int driverId, RideId rideId, bool accept);
+};
+
+// RideFactory
+class RideFactory {
+    static atomic<RideId> rideCounter;
+
+public:
+    static Ride* createRide(const RideRequest& request, RidePool& pool);
+    // Makes later rides get ids above rideId, e.g. after a warm restart.
+    static void reserveIdsThrough(RideId rideId) {
+        RideId seen = rideCounter.load();
+        while (seen < rideId && !rideCounter.compare_exchange_weak(seen, rideId)) {}
+    }
+    static RideId lastIssuedId() { return rideCounter.load(); }
+};
+
+atomic<RideId> RideFactory::rideCounter(0);
+
+// Ride
+class Ride {
+    RideId id;
+    Rider* rider;
+    Driver* driver;
+    Location pickupLocation;
+    Location dropLocation;
+    VehicleType requestedType;
+    RideStatus status;
+    double distanceKm;
+    double fare;
+    atomic<bool> paid;  // set by the payment worker when async
+    int64_t requestedAt;  // wall clock, ms since the epoch
+    int64_t finishedAt;   // 0 until completed or cancelled
+
+    vector<RideObserver*> observers;
+    atomic<int> pins;  // queued async work that still reads this ride
+
+public:
+    Ride(RideId rideId, Rider* r,
+         const Location& pickup, const Location& drop, VehicleType type)
+        : id(rideId),
+          rider(r),
+          driver(nullptr),
+          pickupLocation(pickup),
+          dropLocation(drop),
+          requestedType(type),
+          status(REQUESTED),
+          distanceKm(pickup.distanceTo(drop)),
+          fare(0.0),
+          paid(false),
+          requestedAt(wallClockMs()),
+          finishedAt(0),
+          pins(0) {}
+
+    static int64_t wallClockMs() {
+        return chrono::duration_cast<chrono::milliseconds>(
+            chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // Re-initialises a recycled ride. observers keeps its capacity.
+    void reset(RideId rideId, Rider* r,
+               const Location& pickup, const Location& drop, VehicleType type);
+
+    RideId getId() const { return id; }
+    Rider* getRider() const { return rider; }
+    Driver* getDriver() const { return driver; }
+    Location getPickupLocation() const { return pickupLocation; }
+    Location getDropLocation() const { return dropLocation; }
+    VehicleType getRequestedType() const { return requestedType; }
+    RideStatus getStatus() const { return status; }
+    double getDistanceKm() const { return distanceKm; }
+    double getFare() const { return fare; }
+    bool isPaid() const { return paid.load(memory_order_acquire); }
+    int64_t getRequestedAt() const { return requestedAt; }
+    int64_t getFinishedAt() const { return finishedAt; }
+    void markFinished() { finishedAt = wallClockMs(); }
+
+    void assignDriver(Driver* d);
+    void attachObserver(RideObserver* obs);
+    void removeObserver(RideObserver* obs);
+    // Hands the change to the async NotificationDispatcher when one is
+    // installed, otherwise delivers it inline.
+    void notifyObservers(RideStatus newStatus);
+    // Calls every observer now, on the calling thread.
+    void deliverNotifications(RideStatus newStatus);
+    void updateStatus(RideStatus newStatus);
+    static bool canTransition(RideStatus from, RideStatus to) { return RIDE_TRANSITIONS[from][to]; }
+    void setFare(double f) { fare = f; }
+    void setDistanceKm(double km) { distanceKm = km; }
+    void setPaid(bool p) { paid.store(p, memory_order_release); }
+    // Raw restore for warm restart; observers are not notified.
+    void restore(Driver* d, RideStatus s, int64_t requestTime) {
+        driver = d;
+        status = s;
+        requestedAt = requestTime;
+    }
+
+    // A pinned ride is not recycled by RidePool when it ages out.
+    void pin() { pins.fetch_add(1, memory_order_relaxed); }
+    void unpin() { pins.fetch_sub(1, memory_order_release); }
+    bool isPinned() const { return pins.load(memory_order_acquire) > 0; }
+};
+
+// PinnedRide
+// Keeps a Ride from being recycled while any copy is held. requestRide and
+// the batch paths return one; a bare Ride* is only valid until the ride has
+// aged out of DispatchService's retention ring. Must not outlive the
+// DispatchService the ride came from.
+class PinnedRide {
+    Ride* ride;
+
+public:
+    PinnedRide() : ride(nullptr) {}
+    explicit PinnedRide(Ride* r) : ride(r) {
+        if (ride) ride->pin();
+    }
+    PinnedRide(const PinnedRide& other) : PinnedRide(other.ride) {}
+    PinnedRide(PinnedRide&& other) noexcept : ride(other.ride) { other.ride = nullptr; }
+    PinnedRide& operator=(PinnedRide other) {
+        swap(ride, other.ride);
+        return *this;
+    }
+    ~PinnedRide() {
+        if (ride) ride->unpin();
+    }
+
+    Ride* get() const { return ride; }
+    Ride* operator->() const { return ride; }
+    explicit operator bool() const { return ride != nullptr; }
+};
+
+// MpscRing
+// Bounded lock-free queue for many producers and one consumer (Vyukov's
+// sequence-numbered ring). tryPush fails instead of blocking when full.
+template <typename T>
+class MpscRing {
+    struct Cell {
+        atomic<size_t> sequence;
+        T value;
+    };
+
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> enqueuePos;
+    alignas(64) size_t dequeuePos;  // owned by the consumer
+
+public:
+    // capacity is rounded up to a power of two.
+    explicit MpscRing(size_t capacity) : enqueuePos(0), dequeuePos(0) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        cells.reset(new Cell[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; ++i) cells[i].sequence.store(i, memory_order_relaxed);
+    }
+
+    bool tryPush(const T& value) {
+        size_t pos = enqueuePos.load(memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueuePos.load(memory_order_relaxed);
+            }
+        }
+        cell->value = value;
+        cell->sequence.store(pos + 1, memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& out) {
+        Cell* cell = &cells[dequeuePos & mask];
+        size_t seq = cell->sequence.load(memory_order_acquire);
+        if ((intptr_t)seq - (intptr_t)(dequeuePos + 1) < 0) return false;
+        out = cell->value;
+        cell->sequence.store(dequeuePos + mask + 1, memory_order_release);
+        ++dequeuePos;
+        return true;
+    }
+};
+
+// NotificationDispatcher
+// Moves observer fan-out off the dispatch thread. Status changes are
+// queued on one of several worker rings, picked by ride id so each ride's
+// events stay in order, and delivered in batches. The built-in observers
+// only record to the EventLog, whose sink serialises all output. A full
+// ring makes the publisher wait, which bounds memory and pushes back on
+// dispatch only when delivery falls far behind.
+class NotificationDispatcher {
+public:
+    static const size_t BATCH_SIZE = 64;
+
+private:
+    struct StatusEvent {
+        Ride* ride;
+        RideStatus status;
+    };
+
+    struct Worker {
+        MpscRing<StatusEvent> queue;
+        thread runner;
+        explicit Worker(size_t capacity) : queue(capacity) {}
+    };
+
+    static atomic<NotificationDispatcher*> activeInstance;
+    // Callers between reading activeInstance and finishing their publish.
+    static atomic<int> publishers;
+
+    vector<unique_ptr<Worker>> workers;
+    atomic<bool> running;
+    atomic<size_t> published;
+    atomic<size_t> delivered;
+
+    void run(Worker& worker);
+
+public:
+    NotificationDispatcher(size_t workerCount, size_t queueCapacity);
+    ~NotificationDispatcher();
+
+    NotificationDispatcher(const NotificationDispatcher&) = delete;
+    NotificationDispatcher& operator=(const NotificationDispatcher&) = delete;
+
+    void install() { activeInstance.store(this); }
+    // Once this returns no publisher can still reach this dispatcher, so
+    // it may be drained and destroyed.
+    void uninstall();
+
+    // Queues the change on the installed dispatcher. False, and nothing
+    // queued, when none is installed.
+    static bool tryPublish(Ride* ride, RideStatus status);
+    void publish(Ride* ride, RideStatus status);
+    // Blocks until everything published so far has been delivered.
+    void drain();
+    // Published but not delivered yet.
+    size_t pending() const {
+        size_t done = delivered.load(memory_order_acquire);
+        return published.load(memory_order_acquire) - done;
+    }
+};
+
+atomic<NotificationDispatcher*> NotificationDispatcher::activeInstance(nullptr);
+atomic<int> NotificationDispatcher::publishers(0);
+
+// LatencyHistogram
+// Log-linear histogram of nanosecond durations, in the style of HDR
+// histograms: every power of two is split into 32 buckets, so a reported
+// percentile is within about 3% of the true value from 64ns up to the
+// 2^40ns cap, and recording is a shift and an increment. Not thread-safe;
+// keep one per thread and merge, or use a SharedLatencyHistogram.
+class LatencyHistogram {
+    friend class SharedLatencyHistogram;
+
+    static const int SUB_BITS = 6;
+    static const int SUB = 1 << SUB_BITS;
+    static const int HALF = SUB / 2;
+    static const int MAX_BITS = 40;
+    static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) * HALF + SUB;
+
+    array<uint64_t, BUCKETS> counts;
+    uint64_t total;
+    uint64_t sum;
+    uint64_t maxValue;
+
+    static int bucketOf(uint64_t ns) {
+        if (ns < (uint64_t)SUB) return (int)ns;
+        int msb = 63 - __builtin_clzll(ns);
+        int shift = msb - (SUB_BITS - 1);
+        return shift * HALF + (int)(ns >> shift);
+    }
+    // The largest value that lands in bucket.
+    static uint64_t highestIn(int bucket) {
+        if (bucket < SUB) return (uint64_t)bucket;
+        int shift = bucket / HALF - 1;
+        uint64_t top = (uint64_t)(bucket - shift * HALF);
+        return ((top + 1) << shift) - 1;
+    }
+
+public:
+    LatencyHistogram() { reset(); }
+
+    void record(uint64_t ns) {
+        ns = min<uint64_t>(ns, (1ULL << MAX_BITS) - 1);
+        ++counts[bucketOf(ns)];
+        ++total;
+        sum += ns;
+        maxValue = max(maxValue, ns);
+    }
+    void record(chrono::steady_clock::duration d) {
+        record((uint64_t)max<int64_t>(0, chrono::duration_cast<chrono::nanoseconds>(d).count()));
+    }
+    void merge(const LatencyHistogram& other);
+    void reset() {
+        counts.fill(0);
+        total = sum = maxValue = 0;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t maxRecorded() const { return maxValue; }
+    double mean() const { return total ? (double)sum / total : 0.0; }
+    // Smallest recorded bucket bound covering fraction q (0..1) of samples.
+    uint64_t percentile(double q) const;
+};
+
+// The same buckets in relaxed atomics, for one writer thread and any number
+// of readers: a reader may see a sample counted in total before its bucket,
+// never a torn count. maxValue is only raised by the writer.
+class SharedLatencyHistogram {
+    array<atomic<uint64_t>, LatencyHistogram::BUCKETS> counts;
+    atomic<uint64_t> total, sum, maxValue;
+
+public:
+    SharedLatencyHistogram() { reset(); }
+
+    void record(uint64_t ns) {
+        ns = min<uint64_t>(ns, (1ULL << LatencyHistogram::MAX_BITS) - 1);
+        counts[LatencyHistogram::bucketOf(ns)].fetch_add(1, memory_order_relaxed);
+        total.fetch_add(1, memory_order_relaxed);
+        sum.fetch_add(ns, memory_order_relaxed);
+        if (ns > maxValue.load(memory_order_relaxed)) maxValue.store(ns, memory_order_relaxed);
+    }
+    void record(chrono::steady_clock::duration d) {
+        record((uint64_t)max<int64_t>(0, chrono::duration_cast<chrono::nanoseconds>(d).count()));
+    }
+    void addTo(LatencyHistogram& out) const;
+    void reset();
+};
+
+// DispatchMetrics
+// Stage latencies, counters and candidates scanned per match, recorded on
+// the dispatch hot paths. Every thread writes to its own block of relaxed
+// atomics, so recording takes no lock and never contends; snapshot() merges
+// the blocks. A thread that exits hands its block, counts and all, to the
+// next thread that starts recording. Gauges such as pool sizes and
+// queue depths are read when metrics are pulled, not on the hot path.
+// Building with DISPATCH_METRICS=0 compiles the timers out; setEnabled
+// turns them off at runtime.
+#ifndef DISPATCH_METRICS
+#define DISPATCH_METRICS 1
+#endif
+
+enum MetricStage {
+    STAGE_REQUEST,      // requestRide end to end
+    STAGE_CREATE_RIDE,  // RideFactory, ride pool and distance
+    STAGE_MATCH,        // strategy, claim and pool removal for one request
+    STAGE_BATCH_MATCH,  // one batch solve across shards
+    STAGE_POOL_REMOVE,
+    STAGE_ASSIGN,       // assignment, ride table and journal
+    STAGE_NOTIFY,       // observer fan-out (or the async hand-off)
+    STAGE_STATUS_UPDATE,
+    STAGE_COMPLETE,     // completeRide end to end
+    STAGE_CANCEL,       // cancelRide end to end
+    STAGE_POOL_ADD,
+    STAGE_FARE,
+    STAGE_PAYMENT,      // the charge, or queueing it when payments are async
+    STAGE_ARCHIVE,
+    STAGE_COUNT
+};
+
+enum MetricCounter {
+    COUNTER_RIDES_CREATED,
+    COUNTER_MATCHED,
+    COUNTER_UNMATCHED,
+    COUNTER_CLAIMS_LOST,     // snapshot picks taken by another request first
+    COUNTER_LOCKED_MATCHES,  // requests settled under the shard locks
+    COUNTER_SNAPSHOT_COPIES, // pool snapshots copied whole, not patched
+    COUNTER_COMPLETED,
+    COUNTER_CANCELLED,       // after assignment, by either side or a no-show
+    COUNTER_PAYMENTS_FAILED,
+    COUNTER_COUNT
+};
+
+class DispatchMetrics {
+public:
+    struct Snapshot {
+        LatencyHistogram stages[STAGE_COUNT];
+        LatencyHistogram candidates;  // values are driver counts, not ns
+        uint64_t counters[COUNTER_COUNT] = {};
+    };
+
+private:
+    struct ThreadBlock {
+        SharedLatencyHistogram stages[STAGE_COUNT];
+        SharedLatencyHistogram candidates;
+        atomic<uint64_t> counters[COUNTER_COUNT];
+
+        ThreadBlock() { reset(); }
+        void reset();
+    };
+
+    // Returns its thread's block to freeBlocks when the thread exits.
+    struct ThreadSlot {
+        ThreadBlock* block = nullptr;
+        ~ThreadSlot();
+    };
+
+    mutable mutex registryLock;       // guards blocks and freeBlocks
+    vector<unique_ptr<ThreadBlock>> blocks;
+    vector<ThreadBlock*> freeBlocks;  // blocks of exited threads
+    atomic<bool> enabled;
+
+    DispatchMetrics() : enabled(true) {}
+
+    static size_t& scanned() {
+        static thread_local size_t count = 0;
+        return count;
+    }
+    ThreadBlock& local();
+
+public:
+    DispatchMetrics(const DispatchMetrics&) = delete;
+    DispatchMetrics& operator=(const DispatchMetrics&) = delete;
+
+    static DispatchMetrics& getInstance() {
+        static DispatchMetrics instance;
+        return instance;
+    }
+
+    bool isEnabled() const { return DISPATCH_METRICS && enabled.load(memory_order_relaxed); }
+    void setEnabled(bool on) { enabled.store(on, memory_order_relaxed); }
+
+    void recordStage(MetricStage stage, chrono::steady_clock::duration elapsed) {
+        if (!isEnabled()) return;
+        local().stages[stage].record(elapsed);
+    }
+    void increment(MetricCounter counter, uint64_t n = 1) {
+        if (!isEnabled()) return;
+        local().counters[counter].fetch_add(n, memory_order_relaxed);
+    }
+
+    // Index walks and pool scans add the drivers they look at; the caller
+    // brackets one match with startCandidateCount/recordCandidateCount.
+    static void countCandidates(size_t n) { scanned() += n; }
+    void startCandidateCount() { scanned() = 0; }
+    void recordCandidateCount();
+
+    Snapshot snapshot() const;
+    void reset();
+    // Blocks allocated so far, in use or free.
+    size_t blockCount() const {
+        lock_guard<mutex> guard(registryLock);
+        return blocks.size();
+    }
+
+    static const char* stageName(MetricStage stage);
+    static const char* counterName(MetricCounter counter);
+};
+
+// Times its scope into one MetricStage.
+class ScopedStageTimer {
+    MetricStage stage;
+    bool active;
+    chrono::steady_clock::time_point start;
+
+public:
+    explicit ScopedStageTimer(MetricStage s)
+        : stage(s), active(DispatchMetrics::getInstance().isEnabled()) {
+        if (active) start = chrono::steady_clock::now();
+    }
+    ~ScopedStageTimer() {
+        if (active) DispatchMetrics::getInstance().recordStage(stage, chrono::steady_clock::now() - start);
+    }
+
+    ScopedStageTimer(const ScopedStageTimer&) = delete;
+    ScopedStageTimer& operator=(const ScopedStageTimer&) = delete;
+};
+
+// Event log
+// Fixed-size binary records pushed onto a lock-free ring and formatted
+// off the hot path. Levels below DISPATCH_MIN_LOG_LEVEL are compiled out;
+// EventLog::setLevel filters the rest at runtime.
+enum LogLevel { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_OFF };
+
+#ifndef DISPATCH_MIN_LOG_LEVEL
+#define DISPATCH_MIN_LOG_LEVEL LOG_DEBUG
+#endif
+
+enum EventType : uint16_t {
+    EV_DRIVER_REGISTERED,
+    EV_DRIVER_DEREGISTERED,
+    EV_RIDE_REQUESTED,
+    EV_BATCH_MATCHED,
+    EV_NO_DRIVER,
+    EV_RIDE_NOT_FOUND,
+    EV_PAYMENT_PROCESSING,
+    EV_PAYMENT_SUCCEEDED,
+    EV_PAYMENT_FAILED,
+    EV_PAYMENT_RETRIED,
+    EV_DRIVER_AVAILABLE,
+    EV_LOCATIONS_APPLIED,  // value: locations applied, driverId: pings dropped
+    EV_RIDE_ARCHIVED,
+    EV_RIDER_NOTIFIED,
+    EV_DRIVER_NOTIFIED,
+    EV_OFFER_DECLINED,
+    EV_OFFER_TIMED_OUT,
+    EV_RIDE_POOLED,  // value: added route distance
+    EV_RIDE_CANCELLED,  // arg: CancelReason
+    EV_INVALID_TRANSITION,  // value: current RideStatus, arg: rejected RideStatus
+    EV_MESSAGE  // free text kept by EventLog, rideId: its index
+};
+
+struct EventRecord {
+    uint64_t timestampNs;  // steady_clock
+    RideId rideId;
+    int32_t driverId;
+    int32_t riderId;
+    double value;          // fare, amount, count or rating, depending on type
+    float latitude;        // driver position, for EV_DRIVER_REGISTERED
+    float longitude;
+    uint16_t type;         // EventType
+    uint8_t level;         // LogLevel
+    uint8_t arg;           // RideStatus or VehicleType, depending on type
+};
+
+class EventSink {
+public:
+    virtual ~EventSink() {}
+    virtual void write(const EventRecord* records, size_t count) = 0;
+    virtual void flush() {}
+};
+
+// Human-readable lines, one per record. Rider and driver ids are shown by
+// name while the user is still registered.
+class TextEventSink : public EventSink {
+    ostream& out;
+    bool timestamps;
+
+public:
+    explicit TextEventSink(ostream& os, bool withTimestamps = false)
+        : out(os), timestamps(withTimestamps) {}
+
+    void write(const EventRecord* records, size_t count) override;
+    void flush() override { out.flush(); }
+};
+
+// Raw records, for offline tooling.
+class BinaryEventSink : public EventSink {
+    ostream& out;
+
+public:
+    explicit BinaryEventSink(ostream& os) : out(os) {}
+
+    void write(const EventRecord* records, size_t count) override {
+        out.write(reinterpret_cast<const char*>(records), count * sizeof(EventRecord));
+    }
+    void flush() override { out.flush(); }
+};
+
+class EventLog {
+    static const size_t RING_CAPACITY = 1 << 16;
+    static const size_t DRAIN_BATCH = 256;
+
+    MpscRing<EventRecord> ring;
+    atomic<int> level;
+    atomic<size_t> dropped;
+
+    // The ring has a single consumer: the drain thread when it runs,
+    // otherwise whichever caller holds drainLock.
+    mutex drainLock;
+    unique_ptr<EventSink> sink;
+    thread drainer;
+    atomic<bool> draining;
+
+    // Text of EV_MESSAGE records until they are written out.
+    mutable mutex messageLock;
+    unordered_map<uint64_t, string> messages;
+    uint64_t nextMessage;
+
+    EventLog()
+        : ring(RING_CAPACITY), level(LOG_INFO), dropped(0),
+          sink(new TextEventSink(cout)), draining(false), nextMessage(0) {}
+
+    bool enabled(LogLevel lvl) const {
+        return lvl >= DISPATCH_MIN_LOG_LEVEL && lvl >= level.load(memory_order_relaxed);
+    }
+    static EventRecord makeRecord(LogLevel lvl, EventType type, RideId rideId) {
+        EventRecord rec;
+        rec.timestampNs = (uint64_t)chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+        rec.rideId = rideId;
+        rec.driverId = 0;
+        rec.riderId = 0;
+        rec.value = 0.0;
+        rec.latitude = 0.0f;
+        rec.longitude = 0.0f;
+        rec.type = type;
+        rec.level = (uint8_t)lvl;
+        rec.arg = 0;
+        return rec;
+    }
+    bool push(const EventRecord& rec);
+    size_t drainOnce();
+
+public:
+    EventLog(const EventLog&) = delete;
+    EventLog& operator=(const EventLog&) = delete;
+    ~EventLog();
+
+    static EventLog& getInstance() {
+        static EventLog instance;
+        return instance;
+    }
+
+    void setLevel(LogLevel l) { level.store(l, memory_order_relaxed); }
+    void setSink(EventSink* newSink);
+    size_t droppedRecords() const { return dropped.load(memory_order_relaxed); }
+
+    // Recording only pushes onto the ring. Without a drain thread each
+    // recording thread writes out a batch every DRAIN_BATCH records, if no
+    // one else is writing; flush() writes the rest, so a caller that mixes
+    // its own output with the log flushes first. startDrainThread moves all
+    // formatting and I/O to a background thread.
+    void startDrainThread();
+    void stopDrainThread();
+    void flush();
+
+    void record(LogLevel lvl, EventType type, RideId rideId, int driverId = 0,
+                int riderId = 0, double value = 0.0, int arg = 0) {
+        if (!enabled(lvl)) return;
+        EventRecord rec = makeRecord(lvl, type, rideId);
+        rec.driverId = driverId;
+        rec.riderId = riderId;
+        rec.value = value;
+        rec.arg = (uint8_t)arg;
+        push(rec);
+    }
+
+    void recordDriver(LogLevel lvl, EventType type, int driverId, const Location& loc,
+                      double rating, VehicleType vehicle) {
+        if (!enabled(lvl)) return;
+        EventRecord rec = makeRecord(lvl, type, 0);
+        rec.driverId = driverId;
+        rec.value = rating;
+        rec.latitude = (float)loc.latitude;
+        rec.longitude = (float)loc.longitude;
+        rec.arg = (uint8_t)vehicle;
+        push(rec);
+    }
+
+    // Free text for rare events such as configuration and I/O errors.
+    // Written out at once, so it lands before whatever the caller prints.
+    void message(LogLevel lvl, const string& text);
+    // "" once the message has been written out.
+    string messageText(uint64_t index) const;
+};
+
+// PaymentWorkerPool
+// Takes payment off the completeRide path. Charges are queued on one of
+// several worker rings, picked by ride id so every attempt for a ride runs
+// on the same worker. Each worker drains a batch, groups it by gateway and
+// settles each group with one processPayments call. Failed charges are
+// retried with exponential backoff up to MAX_ATTEMPTS, then reported as
+// failed. A ride stays pinned until its payment has settled.
+class PaymentWorkerPool {
+public:
+    static const size_t BATCH_SIZE = 32;
+    static const int MAX_ATTEMPTS = 4;
+
+    // Runs on a worker thread once per ride, with the final outcome.
+    typedef function<void(Ride*, double, bool)> SettleCallback;
+
+private:
+    struct PaymentJob {
+        Ride* ride;
+        PaymentProcessor* gateway;
+        double amount;
+        int attempts;
+        chrono::steady_clock::time_point due;
+    };
+
+    struct Worker {
+        MpscRing<PaymentJob> queue;
+        vector<PaymentJob> retries;  // owned by the worker thread
+        thread runner;
+        explicit Worker(size_t capacity) : queue(capacity) {}
+    };
+
+    vector<unique_ptr<Worker>> workers;
+    SettleCallback onSettled;
+    chrono::milliseconds retryBackoff;
+    atomic<bool> running;
+    atomic<size_t> submitted;
+    atomic<size_t> settled;
+
+    // Rides with a charge queued or being retried.
+    mutex inFlightLock;
+    unordered_set<RideId> inFlight;
+
+    void run(Worker& worker);
+    void finish(const PaymentJob& job, bool paid);
+
+public:
+    PaymentWorkerPool(size_t workerCount, size_t queueCapacity, SettleCallback callback,
+                      chrono::milliseconds backoff = chrono::milliseconds(50));
+    ~PaymentWorkerPool();
+
+    PaymentWorkerPool(const PaymentWorkerPool&) = delete;
+    PaymentWorkerPool& operator=(const PaymentWorkerPool&) = delete;
+
+    // Returns false, and queues nothing, if the ride is already paid or
+    // has a charge in flight.
+    bool submit(Ride* ride, PaymentProcessor* gateway, double amount);
+    // Blocks until everything submitted so far has settled.
+    void drain();
+    // Charges submitted but not settled yet.
+    size_t pending() const {
+        size_t done = settled.load(memory_order_acquire);
+        return submitted.load(memory_order_acquire) - done;
+    }
+};
+
+// LocationIngestor
+// Intake for GPS pings. Producers append to the active buffer under a
+// short lock; a flush swaps in the spare buffer and coalesces the retired
+// one outside that lock, so producers never wait for an apply in progress.
+// Coalescing keeps the newest ping per driver, whatever the arrival order.
+struct LocationPing {
+    int driverId;
+    double latitude;
+    double longitude;
+    int64_t timestamp;  // sender clock, monotonic per driver
+};
+
+class LocationIngestor {
+    mutex bufferLock;
+    vector<LocationPing> active;
+    chrono::steady_clock::time_point windowOpenedAt;
+    chrono::milliseconds window;
+    size_t maxBuffered;
+
+    // Held for a whole flush, so flushes are serial.
+    mutex flushLock;
+    vector<LocationPing> retired;
+    unordered_map<int, size_t> newestIndex;  // driverId -> slot in coalesced
+
+public:
+    LocationIngestor() : window(500), maxBuffered(65536) {}
+
+    void configure(chrono::milliseconds w, size_t maxPings) {
+        lock_guard<mutex> guard(bufferLock);
+        window = w;
+        maxBuffered = max<size_t>(1, maxPings);
+    }
+
+    // Buffers the pings. Returns true when the window is due for a flush.
+    bool add(const LocationPing* pings, size_t count);
+
+    // Swaps buffers and fills coalesced with the newest ping of every
+    // driver seen since the last flush. The returned lock keeps flushes
+    // serial until the caller has applied them.
+    unique_lock<mutex> flush(vector<LocationPing>& coalesced);
+
+    size_t buffered() {
+        lock_guard<mutex> guard(bufferLock);
+        return active.size();
+    }
+};
+
+// DispatchShard
+// One geographic partition of the available-driver supply. The shard lock
+// guards its pool as well as the location of every driver whose home shard
+// it is; driver status is claimed with Driver::tryClaim.
+//
+// Matching reads an immutable copy of the pool instead of taking the lock.
+// Copies are published read-copy-update style: the pool bumps version on
+// every change, and a reader that finds the published copy behind makes a
+// new one, but only if it gets the lock without waiting. A copy its last
+// reader dropped is handed back rather than freed, and the next publish
+// patches it with the drivers logged as changed since, so a publish costs
+// O(changes) instead of O(pool). Only when no copy came back, or the log
+// overflowed, is the pool copied whole.
+//
+// A copy can still list drivers that were claimed or deregistered since.
+// Claims settle that by CAS; deregisterDriver republishes every stale copy,
+// so only readers that loaded one earlier can reach a removed driver.
+struct DispatchShard {
+    mutex lock;
+    DriverPool availableDrivers;
+
+    atomic<uint64_t> version;
+    atomic<uint64_t> snapshotVersion;
+    atomic<int64_t> snapshotPublishedAt;  // steady_clock ticks
+
+    // Guarded by lock: the published copy's generation, and the drivers
+    // changed since it and in the generation before it.
+    uint64_t generation;
+    vector<Driver*> changedSince, changedBefore;
+
+    // Newest copy whose readers are all gone, waiting to be patched.
+    mutex recycleLock;
+    DriverPool* recycled;
+    uint64_t recycledGeneration;
+
+    // Declared last: its deleter hands copies back to recycled. Only via
+    // atomic_load/atomic_store. Readers must drop their copies before the
+    // shard is destroyed.
+    shared_ptr<const DriverPool> snapshot;
+
+    DispatchShard();
+    ~DispatchShard();
+    DispatchShard(const DispatchShard&) = delete;
+    DispatchShard& operator=(const DispatchShard&) = delete;
+
+    // Publishes availableDrivers as of version. Caller holds lock.
+    shared_ptr<const DriverPool> publish(uint64_t atVersion, int64_t now);
+
+private:
+    shared_ptr<const DriverPool> adopt(DriverPool* pool, uint64_t gen);
+    void recycle(DriverPool* pool, uint64_t gen);
+};
+
+// RidePool
+// Arena for Ride objects. Rides are constructed in fixed-size chunks and,
+// once released, reset in place and handed out again, so steady-state
+// dispatch allocates no rides at all. The pool owns every ride it issues.
+class RidePool {
+    static const size_t RIDES_PER_CHUNK = 256;
+
+    struct Chunk {
+        alignas(Ride) unsigned char storage[RIDES_PER_CHUNK * sizeof(Ride)];
+        size_t constructed = 0;
+    };
+
+    mutex lock;
+    vector<unique_ptr<Chunk>> chunks;
+    vector<Ride*> freeList;
+
+public:
+    RidePool() {}
+    RidePool(const RidePool&) = delete;
+    RidePool& operator=(const RidePool&) = delete;
+    ~RidePool();
+
+    Ride* acquire(RideId rideId, Rider* r,
+                  const Location& pickup, const Location& drop, VehicleType type);
+    void release(Ride* ride);
+};
+
+// RideTable
+// Open-addressing RideId -> Ride* table with linear probing and
+// backward-shift deletion, so lookups touch one or two cache lines and
+// nothing is allocated per entry. Id 0 marks an empty slot.
+class RideTable {
+    struct Slot {
+        RideId id;
+        Ride* ride;
+    };
+
+    vector<Slot> slots;
+    size_t count;
+    int shift;  // 64 - log2(capacity), for Fibonacci hashing
+
+    size_t home(RideId id) const {
+        return (size_t)((id * 0x9E3779B97F4A7C15ULL) >> shift);
+    }
+    size_t mask() const { return slots.size() - 1; }
+    void grow();
+
+public:
+    RideTable() : slots(16, Slot{0, nullptr}), count(0), shift(60) {}
+
+    size_t size() const { return count; }
+    Ride* find(RideId id) const;
+    template <class Fn> void forEach(Fn fn) const {
+        for (const auto& slot : slots) {
+            if (slot.id != 0) fn(slot.ride);
+        }
+    }
+    void insert(RideId id, Ride* ride);
+    // Removes and returns the ride, or nullptr if it is not present.
+    Ride* erase(RideId id);
+};
+
+// RideStripe
+// Ongoing rides are striped by ride id so that status updates on unrelated
+// rides do not serialize on one lock.
+struct RideStripe {
+    mutex lock;
+    RideTable rides;
+};
+
+// RideArchive
+// Finished rides as compact column blocks instead of Ride objects. Rows
+// are appended to an open block; a full block is sealed and, when a spill
+// directory is set, handed to a background thread that writes it out and
+// swaps in a read-only memory map, so it costs page cache rather than
+// heap. Sealed blocks are immutable and shared with the queries streaming
+// over them, which hold no lock; a heap block is freed once the last such
+// query lets go of it.
+class RideArchive {
+public:
+    static const size_t BLOCK_ROWS = 4096;
+
+    struct Block {
+        size_t rows;
+        RideId rideId[BLOCK_ROWS];
+        int32_t riderId[BLOCK_ROWS];
+        int32_t driverId[BLOCK_ROWS];  // 0 if none was assigned
+        double distanceKm[BLOCK_ROWS];
+        double fare[BLOCK_ROWS];
+        int64_t requestedAt[BLOCK_ROWS];
+        int64_t finishedAt[BLOCK_ROWS];
+        uint8_t type[BLOCK_ROWS];
+        uint8_t status[BLOCK_ROWS];
+        uint8_t paid[BLOCK_ROWS];
+    };
+
+    struct Row {
+        RideId rideId;
+        int riderId;
+        int driverId;
+        VehicleType type;
+        RideStatus status;
+        bool paid;
+        double distanceKm;
+        double fare;
+        int64_t requestedAt;
+        int64_t finishedAt;
+    };
+
+private:
+    struct Segment {
+        shared_ptr<const Block> block;
+        bool mapped;
+        RideId lowestId;
+        RideId highestId;
+    };
+
+    mutable mutex lock;
+    vector<Segment> sealed;
+    unique_ptr<Block> open;
+    size_t rowCount;
+    string spillDirectory;
+
+    // Sealed blocks waiting for the spill thread, by index into sealed.
+    // Guarded by lock.
+    deque<size_t> spillQueue;
+    bool spilling;  // the spill thread is writing a block
+    bool stopping;
+    condition_variable spillChanged;
+    thread spiller;
+
+    static Row rowAt(const Block& b, size_t i) {
+        return Row{b.rideId[i], b.riderId[i], b.driverId[i], (VehicleType)b.type[i],
+                   (RideStatus)b.status[i], b.paid[i] != 0, b.distanceKm[i], b.fare[i],
+                   b.requestedAt[i], b.finishedAt[i]};
+    }
+    void seal();
+    void spillLoop();
+    // Writes a full block to path and maps it back, or returns nullptr to
+    // keep it on the heap.
+    static const Block* spill(const Block& block, const string& path);
+
+    // Calls scan on every sealed block unlocked, then on the open block
+    // under the lock.
+    template <class Scan> void forEachBlock(Scan scan) const {
+        vector<Segment> blocks;
+        {
+            lock_guard<mutex> guard(lock);
+            blocks = sealed;
+        }
+        for (const auto& segment : blocks) scan(*segment.block);
+        lock_guard<mutex> guard(lock);
+        scan(*open);
+    }
+
+public:
+    RideArchive()
+        : open(new Block), rowCount(0), spilling(false), stopping(false) { open->rows = 0; }
+    ~RideArchive();
+    RideArchive(const RideArchive&) = delete;
+    RideArchive& operator=(const RideArchive&) = delete;
+
+    // Blocks sealed from now on go to files in dir. Empty keeps them in
+    // memory. POSIX builds only; elsewhere blocks always stay in memory.
+    void setSpillDirectory(const string& dir);
+    // Waits until every block sealed so far has been spilled or kept.
+    void flushSpills();
+    // Sealed blocks served from their file.
+    size_t spilledBlocks() const;
+
+    void append(const Ride* ride);
+    size_t size() const {
+        lock_guard<mutex> guard(lock);
+        return rowCount;
+    }
+
+    template <class Fn> void forEach(Fn fn) const {
+        forEachBlock([&](const Block& b) {
+            for (size_t i = 0; i < b.rows; ++i) fn(rowAt(b, i));
+        });
+    }
+
+    // Scans only the rider column and calls fn on every row of the rider.
+    template <class Fn> void forEachOfRider(int riderId, Fn fn) const {
+        forEachBlock([&](const Block& b) {
+            for (size_t i = 0; i < b.rows; ++i) {
+                if (b.riderId[i] == riderId) fn(rowAt(b, i));
+            }
+        });
+    }
+
+    // Looks a ride up by id. Rides finish close to the order they were
+    // requested in, so the id range of a sealed block rules most blocks
+    // out and only the ride id column of the rest is scanned.
+    bool findRide(RideId rideId, Row& out) const;
+};
+
+// SharedTrip
+// Stop sequence of one driver serving several riders at once. A new rider
+// is inserted into the existing sequence at the cheapest pickup and drop
+// positions that keep every rider within the detour limit and the vehicle
+// within its capacity; the rest of the route is left as it is. Evaluating
+// an insertion is O(stops^2 * riders), with stops at most twice the
+// vehicle capacity, so it stays in the microseconds.
+struct TripStop {
+    Location location;
+    RideId rideId;
+    int seats;
+    bool pickup;
+};
+
+class SharedTrip {
+public:
+    struct Insertion {
+        size_t pickupAt;  // the pickup goes before stops[pickupAt]
+        size_t dropAt;    // the drop goes before stops[dropAt], dropAt >= pickupAt
+        double addedDistance;
+        bool feasible;
+    };
+
+private:
+    struct Passenger {
+        RideId rideId;
+        int seats;
+        double rodeSoFar;  // distance travelled on board
+        double allowed;    // direct distance * (1 + max detour)
+        bool aboard;
+    };
+
+    Driver* driver;
+    int capacity;
+    double maxDetourRatio;
+    Location origin;  // last stop reached, or where the trip started
+    int onboard;      // seats taken at origin
+    vector<TripStop> stops;
+    vector<Passenger> passengers;
+    vector<long long> indexCells;  // where DispatchService indexed the trip
+
+    Location stopAt(long k) const { return k < 0 ? origin : stops[k].location; }
+
+public:
+    SharedTrip(Driver* d, const Location& start, double detourRatio)
+        : driver(d), capacity(d->getVehicle()->getCapacity()), maxDetourRatio(detourRatio),
+          origin(start), onboard(0) {}
+
+    Driver* getDriver() const { return driver; }
+    const vector<TripStop>& getStops() const { return stops; }
+    bool empty() const { return stops.empty(); }
+    vector<long long>& cells() { return indexCells; }
+    Location getOrigin() const { return origin; }
+
+    Insertion bestInsertion(const Location& pickup, const Location& drop, int seats) const;
+    void insert(RideId rideId, const Location& pickup, const Location& drop, int seats,
+                const Insertion& at);
+    // The driver reached the next stop; returns it.
+    TripStop advance();
+    // Drops the ride's remaining stops, e.g. when it is completed directly.
+    void removeRide(RideId rideId);
+};
+
+// TimerWheel
+// Hierarchical timing wheel: four levels of 256 slots, each slot an
+// intrusive list of entries. Booking and cancelling are O(1); an entry
+// moves down a level at most three times before it fires. Entries live in
+// one vector and are reused through a free list, so a large backlog costs
+// no per-entry allocation. ScheduleWheel holds pre-booked RideRequests;
+// DispatchService also keeps its no-show deadlines on one.
+template <class Payload> class TimerWheel {
+public:
+    typedef uint64_t ScheduleId;  // slot index and generation; 0 is never issued
+
+private:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 8;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static constexpr uint32_t NIL = 0xffffffffu;
+
+    struct Entry {
+        Payload payload;
+        int64_t fireTick;
+        uint32_t prev, next;
+        uint32_t generation;
+        int level, slot;  // -1 while on the free list
+
+        explicit Entry(const Payload& p)
+            : payload(p), fireTick(0), prev(NIL), next(NIL), generation(1), level(-1),
+              slot(0) {}
+    };
+
+    vector<Entry> entries;
+    uint32_t freeHead;
+    uint32_t heads[LEVELS][SLOTS];
+    int64_t currentTick;  // last tick processed
+    size_t live;
+
+    void link(uint32_t index);
+    void unlink(uint32_t index);
+    // Re-files every entry of one slot relative to currentTick.
+    void cascade(int level, int slot);
+
+public:
+    explicit TimerWheel(int64_t startTick);
+
+    size_t size() const { return live; }
+    int64_t getCurrentTick() const { return currentTick; }
+
+    // Entries due at or before currentTick fire on the next tick.
+    ScheduleId schedule(const Payload& payload, int64_t fireTick);
+    bool cancel(ScheduleId id);
+    // Processes every tick up to nowTick and appends what fired to due.
+    void advance(int64_t nowTick, vector<Payload>& due);
+};
+
+typedef TimerWheel<RideRequest> ScheduleWheel;
+
+// A no-show deadline: the ride is cancelled for reason when it fires.
+struct RideTimeout {
+    RideId rideId;
+    CancelReason reason;
+};
+
+// StateImage / StateJournal
+// Warm-restart persistence. A snapshot writes every registered driver and
+// ongoing ride as fixed-size records into one binary image; a restart maps
+// the image, rebuilds the pools and the spatial index from it and replays
+// the append-only journal of transitions recorded since. All records are
+// full upserts, so replaying one the snapshot already saw is harmless.
+struct DriverImage {
+    int32_t id;
+    int32_t capacity;
+    double latitude;
+    double longitude;
+    double rating;
+    double farePerKm;
+    uint8_t type;
+    uint8_t status;
+    // NUL-terminated; longer strings are cut, with a warning at register.
+    char name[64];
+    char phone[24];
+    char plate[24];
+};
+
+struct RideImage {
+    RideId rideId;
+    int32_t riderId;
+    int32_t driverId;
+    double pickupLatitude;
+    double pickupLongitude;
+    double dropLatitude;
+    double dropLongitude;
+    double riderDiscount;
+    int64_t requestedAt;
+    uint8_t type;
+    uint8_t status;
+};
+
+struct StateImageHeader {
+    static const uint32_t MAGIC = 0x44535031;  // "DSP1"
+    static const uint32_t VERSION = 2;         // 2: wider DriverImage strings
+    uint32_t magic;
+    uint32_t version;
+    uint64_t driverCount;
+    uint64_t rideCount;
+    RideId lastRideId;
+    int32_t lastUserId;
+};
+
+enum JournalOp : uint8_t {
+    JOURNAL_DRIVER_UPSERT,
+    JOURNAL_DRIVER_REMOVED,
+    JOURNAL_RIDE_UPSERT,    // also carries the assigned driver
+    JOURNAL_RIDE_FINISHED   // also carries the released driver
+};
+
+struct JournalRecord {
+    uint8_t op;
+    DriverImage driver;
+    RideImage ride;
+};
+
+#ifdef DISPATCH_HAVE_MMAP
+bool writeFully(int fd, const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = ::write(fd, bytes, size);
+        if (n <= 0) return false;
+        bytes += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+#endif
+
+// Read-only mapping of a whole file; empty when the file is missing.
+class MappedFile {
+    const char* bytes;
+    size_t length;
+
+public:
+    explicit MappedFile(const string& path);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+};
+
+// Append-only file of fixed-size records, written with group commit.
+// Appends only buffer; how the buffer reaches the disk is set at open:
+//   syncEvery > 0   a background thread writes and fsyncs the buffer every
+//                   syncEvery, or as soon as BUFFER_RECORDS are pending,
+//                   so a crash loses at most that window;
+//   syncEvery == 0  write-through: append returns once its record is
+//                   synced, and appenders that queue up meanwhile share
+//                   one write and fsync;
+//   syncEvery < 0   full buffers are written but never synced (traces).
+// flush() writes and syncs whatever is pending in every mode.
+template <class Record>
+class RecordJournal {
+    static const size_t BUFFER_RECORDS = 256;
+
+    mutex writeLock;  // held across one write and its sync; taken before lock
+    mutex lock;       // guards fd, buffer and the sync thread's state
+    int fd;
+    vector<Record> buffer;
+    vector<Record> writing;  // guarded by writeLock
+    chrono::milliseconds syncInterval;
+    bool stopping;
+    condition_variable wake;
+    thread syncer;
+
+    // Writes the buffer out, and syncs it if durable.
+    void writeBuffered(bool durable);
+    void syncLoop();
+
+public:
+    RecordJournal() : fd(-1), syncInterval(-1), stopping(false) {}
+    ~RecordJournal() { close(); }
+    RecordJournal(const RecordJournal&) = delete;
+    RecordJournal& operator=(const RecordJournal&) = delete;
+
+    bool isOpen() {
+        lock_guard<mutex> guard(lock);
+        return fd >= 0;
+    }
+    bool open(const string& path, bool truncate,
+              chrono::milliseconds syncEvery = chrono::milliseconds(-1));
+    void close();
+    void append(const Record& record);
+    void flush() { writeBuffered(true); }
+    // Runs fn with appends blocked, then empties the journal.
+    template <class Fn> bool rotate(const string& path, Fn fn) {
+        lock_guard<mutex> io(writeLock);
+        lock_guard<mutex> guard(lock);
+        if (!fn()) return false;
+        buffer.clear();
+#ifdef DISPATCH_HAVE_MMAP
+        if (fd >= 0) ::close(fd);
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+#endif
+        return fd >= 0;
+    }
+};
+
+typedef RecordJournal<JournalRecord> StateJournal;
+
+// Trace
+// Every external input to DispatchService, in call order, for replaying
+// an incident or a load test against another build or MatchingStrategy.
+// Records are fixed-size; the first one is TRACE_BEGIN. Times are ns since
+// the trace started. A request is stamped when it arrives and written
+// once its ride exists, before matching, so it carries the id of the ride
+// that later status records refer to.
+enum TraceOp : uint8_t {
+    TRACE_BEGIN,            // driverId = TRACE_MAGIC, capacity = TRACE_VERSION,
+                            // stamp = wall clock ms
+    TRACE_REGISTER_DRIVER,
+    TRACE_DEREGISTER_DRIVER,
+    TRACE_RATE_DRIVER,
+    TRACE_MOVE_DRIVER,      // Driver::updateLocation
+    TRACE_LOCATION_PING,    // stamp = ping timestamp
+    TRACE_FLUSH_LOCATIONS,
+    TRACE_REQUEST_RIDE,     // stamp = ride id
+    TRACE_RIDE_STATUS,      // stamp = ride id
+    TRACE_COMPLETE_RIDE,    // stamp = ride id
+    TRACE_SURGE_ON,         // value = multiplier
+    TRACE_SURGE_OFF,
+    TRACE_CANCEL_RIDE       // stamp = ride id, status = CancelReason
+};
+
+const int32_t TRACE_MAGIC = 0x44545231;  // "DTR1"
+const int32_t TRACE_VERSION = 1;
+
+struct TraceRecord {
+    uint8_t op;
+    uint8_t type;    // VehicleType
+    uint8_t status;  // RideStatus
+    int32_t driverId;
+    int32_t riderId;
+    int32_t capacity;
+    int64_t atNs;
+    int64_t stamp;
+    double latitude;
+    double longitude;
+    double dropLatitude;
+    double dropLongitude;
+    double value;      // rating or surge multiplier
+    double farePerKm;
+};
+
+// DispatchService
+class DispatchService {
+    static const int RIDE_STRIPES = 16;
+
+    // Declared before the shards, whose pools report supply changes to it.
+    SurgeZoneTracker surgeZones;
+    atomic<bool> zoneSurge;  // price from surgeZones as well as the global surge
+
+    vector<unique_ptr<DispatchShard>> shards;
+    chrono::steady_clock::duration snapshotRefresh;  // minimum age before a stale snapshot is replaced
+    double shardCellSize;  // degrees per shard cell
+    atomic<bool> driversRegistered;
+
+    RideStripe rideStripes[RIDE_STRIPES];
+
+    RidePool ridePool;
+
+    // Every finished ride is written to rideArchive.
+    RideArchive rideArchive;
+
+    // Warm-restart state: journal of transitions since the last snapshot,
+    // and the objects a restore had to re-create.
+    StateJournal journal;
+    string persistenceDir;
+    chrono::milliseconds journalSync;
+    vector<unique_ptr<Vehicle>> restoredVehicles;
+    vector<unique_ptr<Driver>> restoredDrivers;
+    unordered_map<int, unique_ptr<Rider>> restoredRiders;
+
+    // Input trace, written while tracing is set. traceStart is only
+    // written by startTrace, before tracing is published.
+    RecordJournal<TraceRecord> trace;
+    atomic<bool> tracing;
+    chrono::steady_clock::time_point traceStart;
+
+    // Set by pinPoolClock: the minutes every shard pool stamps
+    // availableSince with instead of steady_clock.
+    atomic<double> poolMinutes;
+    bool poolClockPinned;
+
+    // Carpooling: shared trips by driver id, and each trip indexed under
+    // the cells (carpoolRadius wide) of its origin and stops. Taken before
+    // any stripe or shard lock.
+    mutex carpoolLock;
+    unordered_map<int, unique_ptr<SharedTrip>> sharedTrips;
+    unordered_map<long long, vector<SharedTrip*>> tripCells;
+    double carpoolRadius;
+    double carpoolDetour;
+
+    // Finished (completed or cancelled) rides stay readable here until they
+    // age out, then go back to ridePool unless a PinnedRide still holds
+    // them. A bare Ride* is valid until RIDE_RETENTION more rides have
+    // finished.
+    static const size_t RIDE_RETENTION = 4096;
+    mutex archiveLock;
+    vector<Ride*> completedRides;
+    size_t completedHead;
+    vector<Ride*> pinnedEvictions;  // aged out but still pinned
+
+    // Declared after ridePool so their workers stop before rides go away.
+    unique_ptr<NotificationDispatcher> notifier;
+    unique_ptr<PaymentWorkerPool> payments;
+
+    // Registered drivers by id, for the location ingestion path.
+    shared_mutex registryLock;
+    unordered_map<int, Driver*> driversById;
+    LocationIngestor locationIngestor;
+
+    // Held shared while matching, exclusively while the strategy is swapped.
+    shared_mutex strategyLock;
+    MatchingStrategy* matchingStrategy;
+    PaymentProcessor* paymentProcessor;
+
+    // Trip distances for new rides and quotes; straight line when unset.
+    // Owned by the caller.
+    atomic<DistanceProvider*> distanceProvider;
+
+    // Driver offers; without a channel every driver accepts. Guarded by
+    // strategyLock. The channel is owned by the caller.
+    DriverOfferChannel* offerChannel;
+    size_t offerCandidates;
+    chrono::milliseconds offerTimeout;
+    chrono::milliseconds offerMaxWait;  // for all offers of one request together
+
+    // Guards fareEngine, which is only ever copied out, and the per-type
+    // rate card used for upfront quotes. pricingVersion is bumped on every
+    // change to either, or to the distance provider, and retires the
+    // quoteCache entries computed before it.
+    mutable mutex fareLock;
+    FareEngine fareEngine;
+    array<double, VEHICLE_TYPE_COUNT> quoteRates;
+    uint64_t pricingVersion;
+    // Only via atomic_load/atomic_store, so a quote in flight keeps the
+    // cache it loaded alive across enableQuoteCache.
+    shared_ptr<FareQuoteCache> quoteCache;
+
+    // Requests collected by submitRideRequest until the window closes.
+    mutex batchLock;
+    vector<RideRequest> pendingRequests;
+    size_t batchMaxRequests;
+    chrono::milliseconds batchWindow;
+    chrono::steady_clock::time_point batchOpenedAt;
+
+    // Pre-booked rides, released leadTime before their pickup time.
+    mutex scheduleLock;
+    chrono::milliseconds scheduleTick;
+    chrono::milliseconds scheduleLead;
+    ScheduleWheel scheduledRides;
+
+    // No-show deadlines of assigned rides. armedTimeouts holds each ride's
+    // pending deadline so it can be cancelled or replaced in O(1).
+    mutex timeoutLock;
+    atomic<bool> noShowTimeouts;
+    chrono::milliseconds timeoutTick;
+    chrono::milliseconds driverNoShowTimeout;
+    chrono::milliseconds riderNoShowTimeout;
+    TimerWheel<RideTimeout> rideTimeouts;
+    unordered_map<RideId, TimerWheel<RideTimeout>::ScheduleId> armedTimeouts;
+
+    DispatchService()
+        : zoneSurge(false), snapshotRefresh(0), shardCellSize(0.05), driversRegistered(false),
+          journalSync(5), tracing(false), poolMinutes(0.0), poolClockPinned(false), carpoolRadius(0.02), carpoolDetour(0.5),
+          completedRides(RIDE_RETENTION, nullptr), completedHead(0),
+          matchingStrategy(new NearestDriverStrategy()), paymentProcessor(new DummyPaymentProcessor()),
+          distanceProvider(nullptr),
+          offerChannel(nullptr), offerCandidates(5), offerTimeout(15000),
+          offerMaxWait(30000),
+          quoteRates{{8.0, 15.0, 20.0, 10.0}}, pricingVersion(0),
+          batchMaxRequests(32), batchWindow(2000),
+          scheduleTick(1000), scheduleLead(600000),
+          scheduledRides(Ride::wallClockMs() / 1000),
+          noShowTimeouts(false), timeoutTick(1000), driverNoShowTimeout(0), riderNoShowTimeout(0),
+          rideTimeouts(Ride::wallClockMs() / 1000) {
+        // Construct the log and metrics first so they are destroyed after
+        // this singleton.
+        EventLog::getInstance();
+        DispatchMetrics::getInstance();
+        addShards(1);
+    }
+
+    void addShards(int count) {
+        for (int i = 0; i < count; ++i) {
+            shards.emplace_back(new DispatchShard());
+            shards.back()->availableDrivers.setZoneTracker(&surgeZones);
+            if (poolClockPinned) shards.back()->availableDrivers.setClock(&poolMinutes);
+        }
+        applyScoreWeights();
+    }
+
+    // Precomputes the current strategy's score terms in every shard pool.
+    // Caller holds strategyLock exclusively, or no other thread runs yet.
+    void applyScoreWeights() {
+        const ScoreWeights* w = matchingStrategy ? matchingStrategy->scoreWeights() : nullptr;
+        ScoreWeights weights = w ? *w : ScoreWeights();
+        for (auto& shard : shards) {
+            lock_guard<mutex> guard(shard->lock);
+            shard->availableDrivers.setScoreWeights(weights);
+        }
+    }
+
+    Ride* createRide(const RideRequest& request) {
+        ScopedStageTimer timer(STAGE_CREATE_RIDE);
+        DispatchMetrics::getInstance().increment(COUNTER_RIDES_CREATED);
+        Ride* ride = RideFactory::createRide(request, ridePool);
+        if (DistanceProvider* provider = distanceProvider.load(memory_order_acquire)) {
+            ride->setDistanceKm(provider->distanceKm(request.getPickup(), request.getDrop()));
+        }
+        return ride;
+    }
+
+    // Called once a ride's fare and payment outcome are final.
+    void retireRide(Ride* ride) {
+        ScopedStageTimer timer(STAGE_ARCHIVE);
+        ride->markFinished();
+        rideArchive.append(ride);
+        lock_guard<mutex> guard(archiveLock);
+        Ride* evicted = completedRides[completedHead];
+        completedRides[completedHead] = ride;
+        completedHead = (completedHead + 1) % RIDE_RETENTION;
+        if (evicted) pinnedEvictions.push_back(evicted);
+
+        for (size_t i = 0; i < pinnedEvictions.size();) {
+            if (pinnedEvictions[i]->isPinned()) {
+                ++i;
+                continue;
+            }
+            ridePool.release(pinnedEvictions[i]);
+            pinnedEvictions[i] = pinnedEvictions.back();
+            pinnedEvictions.pop_back();
+        }
+    }
+
+    int shardIndexFor(int cellX, int cellY) const {
+        size_t h = ((size_t)(unsigned int)cellX * 73856093u) ^
+                   ((size_t)(unsigned int)cellY * 19349663u);
+        return (int)(h % shards.size());
+    }
+
+    int shardFor(const Location& loc) const {
+        return shardIndexFor((int)std::floor(loc.latitude / shardCellSize),
+                             (int)std::floor(loc.longitude / shardCellSize));
+    }
+
+    // Home shard first, then the shard of every other cell that has a point
+    // within radius of loc, so a sharded search sees every driver an
+    // unsharded one would. Every shard when that is most of them anyway.
+    vector<int> shardsNear(const Location& loc, double radius) const {
+        static const long long MAX_CELLS = 64;
+        vector<int> result(1, shardFor(loc));
+        if (shards.size() == 1) return result;
+
+        double reach = radius / shardCellSize;
+        double gx = loc.latitude / shardCellSize;
+        double gy = loc.longitude / shardCellSize;
+        long long span = (long long)std::ceil(2 * reach) + 1;
+        if (!(reach < MAX_CELLS) || span * span > MAX_CELLS) {
+            for (int s = 0; s < (int)shards.size(); ++s) {
+                if (s != result[0]) result.push_back(s);
+            }
+            return result;
+        }
+        int minX = (int)std::floor(gx - reach), maxX = (int)std::floor(gx + reach);
+        int minY = (int)std::floor(gy - reach), maxY = (int)std::floor(gy + reach);
+        for (int x = minX; x <= maxX; ++x) {
+            for (int y = minY; y <= maxY; ++y) {
+                // Distance from loc to the nearest point of cell (x, y).
+                double ex = max(0.0, max(x - gx, gx - (x + 1)));
+                double ey = max(0.0, max(y - gy, gy - (y + 1)));
+                if (ex * ex + ey * ey > reach * reach) continue;
+                int s = shardIndexFor(x, y);
+                if (find(result.begin(), result.end(), s) == result.end()) {
+                    result.push_back(s);
+                }
+            }
+        }
+        return result;
+    }
+
+    // Locks the driver's home shard, retrying if the driver migrates to
+    // another shard while we wait.
+    unique_lock<mutex> lockHomeShard(Driver* driver) {
+        while (true) {
+            int s = driver->getHomeShard();
+            unique_lock<mutex> guard(shards[s]->lock);
+            if (driver->getHomeShard() == s) return guard;
+        }
+    }
+
+    RideStripe& stripeFor(RideId rideId) {
+        return rideStripes[rideId % RIDE_STRIPES];
+    }
+
+    long long carpoolCell(const Location& loc) const {
+        long long x = (long long)std::floor(loc.latitude / carpoolRadius);
+        long long y = (long long)std::floor(loc.longitude / carpoolRadius);
+        return (x << 32) ^ (long long)(uint32_t)y;
+    }
+
+    // Caller holds carpoolLock.
+    void indexTrip(SharedTrip* trip) {
+        vector<long long>& cells = trip->cells();
+        cells.clear();
+        cells.push_back(carpoolCell(trip->getOrigin()));
+        for (const auto& stop : trip->getStops()) cells.push_back(carpoolCell(stop.location));
+        sort(cells.begin(), cells.end());
+        cells.erase(unique(cells.begin(), cells.end()), cells.end());
+        for (long long cell : cells) tripCells[cell].push_back(trip);
+    }
+
+    void unindexTrip(SharedTrip* trip) {
+        for (long long cell : trip->cells()) {
+            vector<SharedTrip*>& bucket = tripCells[cell];
+            bucket.erase(find(bucket.begin(), bucket.end(), trip));
+            if (bucket.empty()) tripCells.erase(cell);
+        }
+        trip->cells().clear();
+    }
+
+    // Takes a completed ride off its driver's shared trip. True when the
+    // driver has no other riders left and can go back to the pool.
+    bool leaveSharedTrip(Driver* driver, RideId rideId) {
+        lock_guard<mutex> guard(carpoolLock);
+        auto it = sharedTrips.find(driver->getId());
+        if (it == sharedTrips.end()) return true;
+        SharedTrip* trip = it->second.get();
+        unindexTrip(trip);
+        trip->removeRide(rideId);
+        if (trip->empty()) {
+            sharedTrips.erase(it);
+            return true;
+        }
+        indexTrip(trip);
+        return false;
+    }
+
+    static void copyField(char* dst, size_t size, string_view src) {
+        size_t n = min(size - 1, src.size());
+        memcpy(dst, src.data(), n);
+        memset(dst + n, 0, size - n);
+    }
+
+    // DriverImage strings are fixed-size; says so when a driver's do not fit.
+    static void warnIfImageCuts(const Driver* driver) {
+        DriverImage img;
+        const char* field = nullptr;
+        if (driver->getName().size() >= sizeof(img.name)) field = "name";
+        else if (driver->getPhone().size() >= sizeof(img.phone)) field = "phone";
+        else if (driver->getVehicle()->getPlateNumber().size() >= sizeof(img.plate)) field = "plate";
+        if (!field) return;
+        EventLog::getInstance().message(
+            LOG_WARN, "Driver " + to_string(driver->getId()) + ": " + field +
+                          " is too long for the snapshot and will be cut on restore.");
+    }
+
+    // Caller holds the driver's home shard lock, or the driver is unshared.
+    static DriverImage imageOf(const Driver* driver) {
+        DriverImage img;
+        memset(&img, 0, sizeof(img));
+        Location loc = driver->getCurrentLocation();
+        const Vehicle* v = driver->getVehicle();
+        img.id = driver->getId();
+        img.capacity = v->getCapacity();
+        img.latitude = loc.latitude;
+        img.longitude = loc.longitude;
+        img.rating = driver->getRating();
+        img.farePerKm = v->getFarePerKm();
+        img.type = (uint8_t)v->getType();
+        img.status = (uint8_t)driver->getStatus();
+        copyField(img.name, sizeof(img.name), driver->getName());
+        copyField(img.phone, sizeof(img.phone), driver->getPhone());
+        copyField(img.plate, sizeof(img.plate), v->getPlateNumber());
+        return img;
+    }
+
+    // Caller holds the ride's stripe lock, or the ride is unshared.
+    static RideImage imageOf(const Ride* ride) {
+        RideImage img;
+        memset(&img, 0, sizeof(img));
+        img.rideId = ride->getId();
+        img.riderId = ride->getRider()->getId();
+        img.driverId = ride->getDriver() ? ride->getDriver()->getId() : 0;
+        img.pickupLatitude = ride->getPickupLocation().latitude;
+        img.pickupLongitude = ride->getPickupLocation().longitude;
+        img.dropLatitude = ride->getDropLocation().latitude;
+        img.dropLongitude = ride->getDropLocation().longitude;
+        img.riderDiscount = ride->getRider()->getDiscountAmount();
+        img.requestedAt = ride->getRequestedAt();
+        img.type = (uint8_t)ride->getRequestedType();
+        img.status = (uint8_t)ride->getStatus();
+        return img;
+    }
+
+    // Journal appends happen after the state locks are released, because
+    // a snapshot holds the journal while it takes them.
+    void journalDriver(JournalOp op, const DriverImage& driver) {
+        if (!journal.isOpen()) return;
+        JournalRecord record;
+        memset(&record, 0, sizeof(record));
+        record.op = op;
+        record.driver = driver;
+        journal.append(record);
+    }
+
+    void journalRide(JournalOp op, const RideImage& ride, const DriverImage& driver) {
+        if (!journal.isOpen()) return;
+        JournalRecord record;
+        memset(&record, 0, sizeof(record));
+        record.op = op;
+        record.ride = ride;
+        record.driver = driver;
+        journal.append(record);
+    }
+
+    bool isTracing() const { return tracing.load(memory_order_acquire); }
+
+    // A zeroed record of op, stamped with the time since the trace started.
+    TraceRecord traceRecord(TraceOp op) const {
+        TraceRecord record;
+        memset(&record, 0, sizeof(record));
+        record.op = op;
+        record.atNs = chrono::duration_cast<chrono::nanoseconds>(
+                          chrono::steady_clock::now() - traceStart).count();
+        return record;
+    }
+
+    void traceRide(TraceOp op, RideId rideId, RideStatus status = REQUESTED) {
+        if (!isTracing()) return;
+        TraceRecord record = traceRecord(op);
+        record.stamp = (int64_t)rideId;
+        record.status = (uint8_t)status;
+        trace.append(record);
+    }
+
+    // Creates or updates a driver from its image. Restore only, before the
+    // driver is pooled.
+    Driver* restoreDriver(const DriverImage& img, unordered_map<int, Driver*>& byId) {
+        Driver*& driver = byId[img.id];
+        if (!driver) {
+            restoredVehicles.emplace_back(new Vehicle(img.plate, (VehicleType)img.type,
+                                                      img.capacity, img.farePerKm));
+            restoredDrivers.emplace_back(new Driver(img.id, img.name, img.phone,
+                                                    restoredVehicles.back().get(),
+                                                    Location(img.latitude, img.longitude),
+                                                    img.rating));
+            driver = restoredDrivers.back().get();
+        }
+        driver->setCurrentLocation(Location(img.latitude, img.longitude));
+        driver->setCurrentRating(img.rating);
+        driver->setStatus((DriverStatus)img.status);
+        return driver;
+    }
+
+    // Creates or updates an ongoing ride from its image. Restore only.
+    void restoreRide(const RideImage& img, unordered_map<int, Driver*>& drivers,
+                     unordered_map<RideId, Ride*>& rides,
+                     const function<Rider*(int)>& riderFor) {
+        Ride*& ride = rides[img.rideId];
+        if (!ride) {
+            Location pickup(img.pickupLatitude, img.pickupLongitude);
+            Rider* rider = riderFor ? riderFor(img.riderId) : nullptr;
+            if (!rider) {
+                unique_ptr<Rider>& stub = restoredRiders[img.riderId];
+                if (!stub) {
+                    stub.reset(new Rider(img.riderId, "", "", pickup));
+                    stub->setDiscountAmount(img.riderDiscount);
+                }
+                rider = stub.get();
+            }
+            ride = ridePool.acquire(img.rideId, rider, pickup,
+                                    Location(img.dropLatitude, img.dropLongitude),
+                                    (VehicleType)img.type);
+            ride->attachObserver(&RiderNotificationService::getInstance());
+            ride->attachObserver(&DriverNotificationService::getInstance());
+        }
+        auto d = drivers.find(img.driverId);
+        ride->restore(d == drivers.end() ? nullptr : d->second, (RideStatus)img.status,
+                      img.requestedAt);
+    }
+
+    // Records the payment outcome and archives the ride. Runs on a payment
+    // worker when payments are async.
+    void settlePayment(Ride* ride, double amount, bool paid) {
+        if (paid) {
+            ride->setPaid(true);
+            EventLog::getInstance().record(LOG_INFO, EV_PAYMENT_SUCCEEDED, ride->getId(), 0,
+                                           ride->getRider()->getId(), amount);
+        } else {
+            EventLog::getInstance().record(LOG_WARN, EV_PAYMENT_FAILED, ride->getId(), 0,
+                                           ride->getRider()->getId(), amount);
+            DispatchMetrics::getInstance().increment(COUNTER_PAYMENTS_FAILED);
+        }
+        RideId rideId = ride->getId();
+        retireRide(ride);
+        EventLog::getInstance().record(LOG_INFO, EV_RIDE_ARCHIVED, rideId);
+    }
+
+    // The shard's published pool snapshot, replaced first if it is stale,
+    // old enough and the shard lock is free. Never blocks.
+    shared_ptr<const DriverPool> snapshotOf(DispatchShard& shard) {
+        uint64_t published = shard.snapshotVersion.load(memory_order_acquire);
+        shared_ptr<const DriverPool> snap = atomic_load(&shard.snapshot);
+        if (published == shard.version.load(memory_order_acquire)) return snap;
+
+        int64_t now = chrono::steady_clock::now().time_since_epoch().count();
+        if (now - shard.snapshotPublishedAt.load(memory_order_relaxed) < snapshotRefresh.count()) {
+            return snap;
+        }
+        unique_lock<mutex> guard(shard.lock, try_to_lock);
+        if (!guard.owns_lock()) return snap;
+
+        return shard.publish(shard.version.load(memory_order_acquire), now);
+    }
+
+    // Replaces every snapshot that is behind its pool, whatever its age, so
+    // no new reader can pick up a driver that has left the pools. A
+    // deregistered driver may still be listed by the shard it last moved
+    // out of, not only by its home shard.
+    void republishStaleSnapshots() {
+        int64_t now = chrono::steady_clock::now().time_since_epoch().count();
+        for (auto& shard : shards) {
+            lock_guard<mutex> guard(shard->lock);
+            uint64_t current = shard->version.load(memory_order_acquire);
+            if (shard->snapshotVersion.load(memory_order_acquire) != current) {
+                shard->publish(current, now);
+            }
+        }
+    }
+
+    // Drops a claimed driver from its home shard's pool. Removal is
+    // idempotent, so the claimer and a bystander may both do it. A driver
+    // that became AVAILABLE again in the meantime stays; only lock holders
+    // make drivers available, so the check under the lock is stable.
+    void unpool(Driver* driver) {
+        ScopedStageTimer timer(STAGE_POOL_REMOVE);
+        unique_lock<mutex> guard = lockHomeShard(driver);
+        if (driver->getStatus() == AVAILABLE) return;
+        shards[driver->getHomeShard()]->availableDrivers.remove(driver);
+    }
+
+    // Picks and claims a driver for one request, looking in every shard
+    // within the strategy's search radius. Matching runs lock-free on the
+    // shard snapshots and the pick is claimed by CAS; a pick lost to another
+    // request is retried on fresh snapshots, and the locked path settles
+    // anything the snapshots could not. Caller holds strategyLock.
+    Driver* claimDriver(const RideRequest& request) {
+        static const int SNAPSHOT_ATTEMPTS = 3;
+        vector<int> involved = shardsNear(request.getPickup(), matchingStrategy->searchRadius());
+        for (int attempt = 0; attempt < SNAPSHOT_ATTEMPTS; ++attempt) {
+            vector<shared_ptr<const DriverPool>> views;
+            Driver* best = nullptr;
+            double bestRank = 0.0;
+            for (int s : involved) {
+                views.push_back(snapshotOf(*shards[s]));
+                const DriverPool& pool = *views.back();
+                int slot = matchingStrategy->chooseSlot(request, pool);
+                if (slot < 0) continue;
+                const DriverStateStore& store = pool.ofType(request.getType());
+                double r = matchingStrategy->rank(request, store, slot);
+                if (!best || r < bestRank) {
+                    best = store.drivers[slot];
+                    bestRank = r;
+                }
+            }
+            // An empty snapshot may just be stale; let the locked path decide.
+            if (!best) break;
+            if (best->tryClaim()) {
+                unpool(best);
+                return best;
+            }
+            unpool(best);
+            DispatchMetrics::getInstance().increment(COUNTER_CLAIMS_LOST);
+        }
+        DispatchMetrics::getInstance().increment(COUNTER_LOCKED_MATCHES);
+        return claimDriverLocked(request, involved);
+    }
+
+    // Adds the top k of one pool to candidates, keeping candidates sorted by
+    // rank and no longer than k.
+    void mergeCandidates(const RideRequest& request, const DriverPool& pool, size_t k,
+                         vector<pair<double, Driver*>>& candidates) {
+        const DriverStateStore& store = pool.ofType(request.getType());
+        for (int slot : matchingStrategy->chooseSlots(request, pool, k)) {
+            candidates.emplace_back(matchingStrategy->rank(request, store, slot),
+                                    store.drivers[slot]);
+        }
+        stable_sort(candidates.begin(), candidates.end(),
+                    [](const pair<double, Driver*>& a, const pair<double, Driver*>& b) {
+                        return a.first < b.first;
+                    });
+        if (candidates.size() > k) candidates.resize(k);
+    }
+
+    // The k best drivers for a request across the shards near its pickup,
+    // best first, read from the snapshots (or under the shard locks when
+    // the snapshots have nobody). Nothing is claimed. Caller holds
+    // strategyLock.
+    vector<Driver*> rankCandidates(const RideRequest& request, size_t k) {
+        vector<Driver*> drivers;
+        for (const auto& entry : rankedCandidates(request, k)) drivers.push_back(entry.second);
+        return drivers;
+    }
+
+    vector<pair<double, Driver*>> rankedCandidates(const RideRequest& request, size_t k) {
+        vector<int> involved = shardsNear(request.getPickup(), matchingStrategy->searchRadius());
+        vector<pair<double, Driver*>> ranked;
+        for (int s : involved) {
+            shared_ptr<const DriverPool> view = snapshotOf(*shards[s]);
+            mergeCandidates(request, *view, k, ranked);
+        }
+        if (ranked.empty()) {
+            vector<int> lockOrder(involved);
+            sort(lockOrder.begin(), lockOrder.end());
+            vector<unique_lock<mutex>> guards;
+            for (int s : lockOrder) guards.emplace_back(shards[s]->lock);
+            for (int s : involved) mergeCandidates(request, shards[s]->availableDrivers, k, ranked);
+        }
+        return ranked;
+    }
+
+    // Offers the ride down the ranked list until a driver accepts or the
+    // deadline passes; the last offer only gets what is left of it. Each
+    // driver is claimed for the length of its offer and put back on
+    // decline, so moving to the next candidate needs no new query.
+    Driver* offerToCandidates(Ride* ride, const RideRequest& request,
+                              const vector<Driver*>& candidates, DriverOfferChannel* channel,
+                              chrono::milliseconds timeout,
+                              chrono::steady_clock::time_point deadline) {
+        for (Driver* driver : candidates) {
+            auto left = chrono::duration_cast<chrono::milliseconds>(
+                deadline - chrono::steady_clock::now());
+            if (left <= chrono::milliseconds(0)) break;
+            bool won = driver->tryClaim();
+            unpool(driver);
+            if (!won) continue;
+            OfferResult answer =
+                channel->offer(driver, ride->getId(), request, min(timeout, left));
+            if (answer == OFFER_ACCEPTED) return driver;
+            EventLog::getInstance().record(LOG_INFO,
+                                           answer == OFFER_DECLINED ? EV_OFFER_DECLINED
+                                                                    : EV_OFFER_TIMED_OUT,
+                                           ride->getId(), driver->getId());
+            // deregisterDriver may have run while the offer was open.
+            unique_lock<mutex> guard = lockHomeShard(driver);
+            if (driver->getStatus() == OFFLINE) continue;
+            driver->setStatus(AVAILABLE);
+            shards[driver->getHomeShard()]->availableDrivers.add(driver);
+        }
+        return nullptr;
+    }
+
+    Driver* claimDriverLocked(const RideRequest& request, const vector<int>& involved) {
+        vector<int> lockOrder(involved);
+        sort(lockOrder.begin(), lockOrder.end());
+        vector<unique_lock<mutex>> guards;
+        for (int s : lockOrder) guards.emplace_back(shards[s]->lock);
+
+        while (true) {
+            Driver* best = nullptr;
+            double bestRank = 0.0;
+            for (int s : involved) {
+                const DriverPool& pool = shards[s]->availableDrivers;
+                int slot = matchingStrategy->chooseSlot(request, pool);
+                if (slot < 0) continue;
+                const DriverStateStore& store = pool.ofType(request.getType());
+                double r = matchingStrategy->rank(request, store, slot);
+                if (!best || r < bestRank) {
+                    best = store.drivers[slot];
+                    bestRank = r;
+                }
+            }
+            if (!best) return nullptr;
+            // A driver claimed off a snapshot may not be unpooled yet; its
+            // home shard is one of ours, since we hold that lock now.
+            bool won = best->tryClaim();
+            shards[best->getHomeShard()]->availableDrivers.remove(best);
+            if (won) return best;
+        }
+    }
+
+    // Assign the already-claimed driver (or cancel when there is none) and
+    // move the ride into ongoingRides.
+    void commitAssignment(Ride* ride, Driver* chosenDriver) {
+        ScopedStageTimer timer(STAGE_ASSIGN);
+        DispatchMetrics::getInstance().increment(chosenDriver ? COUNTER_MATCHED : COUNTER_UNMATCHED);
+        if (!chosenDriver) {
+            EventLog::getInstance().record(LOG_WARN, EV_NO_DRIVER, ride->getId(), 0,
+                                           ride->getRider()->getId());
+            ride->updateStatus(CANCELLED);
+            retireRide(ride);
+            return;
+        }
+
+        // Assign driver
+        ride->attachObserver(&RiderNotificationService::getInstance());
+        ride->attachObserver(&DriverNotificationService::getInstance());
+        ride->assignDriver(chosenDriver);
+
+        // Save in ongoing rides, then journal: a snapshot that starts in
+        // between already holds the ride, so the record it drops is not
+        // missed.
+        RideImage rideImg;
+        {
+            RideStripe& stripe = stripeFor(ride->getId());
+            lock_guard<mutex> guard(stripe.lock);
+            stripe.rides.insert(ride->getId(), ride);
+            rideImg = imageOf(ride);
+        }
+        if (journal.isOpen()) {
+            DriverImage driverImg;
+            {
+                unique_lock<mutex> guard = lockHomeShard(chosenDriver);
+                driverImg = imageOf(chosenDriver);
+            }
+            journalRide(JOURNAL_RIDE_UPSERT, rideImg, driverImg);
+        }
+        if (noShowTimeouts.load(memory_order_relaxed)) {
+            armTimeout(ride->getId(), CANCEL_DRIVER_NO_SHOW, Ride::wallClockMs());
+        }
+    }
+
+    // Replaces the ride's pending deadline, if any, with one for reason
+    // from nowMs. A zero timeout leaves the ride without one.
+    void armTimeout(RideId rideId, CancelReason reason, int64_t nowMs) {
+        lock_guard<mutex> guard(timeoutLock);
+        auto it = armedTimeouts.find(rideId);
+        if (it != armedTimeouts.end()) {
+            rideTimeouts.cancel(it->second);
+            armedTimeouts.erase(it);
+        }
+        int64_t timeout = (reason == CANCEL_DRIVER_NO_SHOW ? driverNoShowTimeout
+                                                           : riderNoShowTimeout).count();
+        if (timeout <= 0) return;
+        int64_t tick = timeoutTick.count();
+        armedTimeouts[rideId] =
+            rideTimeouts.schedule(RideTimeout{rideId, reason}, (nowMs + timeout + tick - 1) / tick);
+    }
+
+    void disarmTimeout(RideId rideId) {
+        if (!noShowTimeouts.load(memory_order_relaxed)) return;
+        lock_guard<mutex> guard(timeoutLock);
+        auto it = armedTimeouts.find(rideId);
+        if (it == armedTimeouts.end()) return;
+        rideTimeouts.cancel(it->second);
+        armedTimeouts.erase(it);
+    }
+
+    // requestRides for requests whose demand has already been recorded.
+    // Caller must not hold strategyLock.
+    vector<PinnedRide> matchBatch(const vector<RideRequest>& requests) {
+        vector<PinnedRide> rides;
+        if (requests.empty()) return rides;
+        EventLog::getInstance().record(LOG_INFO, EV_BATCH_MATCHED, 0, 0, 0,
+                                       (double)requests.size());
+
+        for (const auto& request : requests) {
+            rides.emplace_back(createRide(request));
+            request.getRider()->addRideToHistory(rides.back()->getId());
+        }
+
+        vector<Driver*> chosen(requests.size(), nullptr);
+        {
+            ScopedStageTimer timer(STAGE_BATCH_MATCH);
+            shared_lock<shared_mutex> strategyGuard(strategyLock);
+            // Requests whose search stays inside their home shard are solved
+            // together per shard; the rest are matched one at a time below.
+            map<int, vector<size_t>> byShard;
+            double radius = matchingStrategy->searchRadius();
+            for (size_t i = 0; i < requests.size(); ++i) {
+                vector<int> involved = shardsNear(requests[i].getPickup(), radius);
+                if (involved.size() == 1) byShard[involved[0]].push_back(i);
+            }
+            for (const auto& group : byShard) {
+                vector<RideRequest> subset;
+                for (size_t i : group.second) subset.push_back(requests[i]);
+
+                DispatchShard& shard = *shards[group.first];
+                lock_guard<mutex> guard(shard.lock);
+                vector<Driver*> picks =
+                    matchingStrategy->chooseDrivers(subset, shard.availableDrivers);
+                if (picks.size() != subset.size()) continue;
+                for (size_t k = 0; k < picks.size(); ++k) {
+                    if (!picks[k]) continue;
+                    bool won = picks[k]->tryClaim();
+                    shard.availableDrivers.remove(picks[k]);
+                    if (won) chosen[group.second[k]] = picks[k];
+                }
+            }
+            for (size_t i = 0; i < requests.size(); ++i) {
+                if (!chosen[i]) chosen[i] = claimDriver(requests[i]);
+            }
+        }
+
+        for (size_t i = 0; i < requests.size(); ++i) {
+            commitAssignment(rides[i].get(), chosen[i]);
+        }
+        return rides;
+    }
+
+    // Cluster nodes each run a service of their own, and so do tests.
+    friend class ClusterNode;
+    friend class DispatchBenchmark;
+    friend struct DispatchTestAccess;
+
+public:
+    // Delete copy/move constructors
+    DispatchService(const DispatchService&) = delete;
+    DispatchService& operator=(const DispatchService&) = delete;
+
+    static DispatchService& getInstance() {
+        static DispatchService instance;
+        return instance;
+    }
+
+    // Splits driver supply into shardCount geographic shards, each with its
+    // own lock, so requests in different areas are matched in parallel.
+    // The map is tiled into cellSizeDeg cells hashed onto the shards. A
+    // request searches every shard owning a cell within the strategy's
+    // search radius, so cells much larger than that radius keep most
+    // requests on one shard. Only allowed before the first driver is
+    // registered.
+    bool enableSharding(int shardCount, double cellSizeDeg = 0.05) {
+        if (driversRegistered || shardCount < 1) {
+            EventLog::getInstance().message(
+                LOG_WARN, "Sharding must be configured before drivers register.");
+            return false;
+        }
+        shards.clear();
+        addShards(shardCount);
+        shardCellSize = cellSizeDeg;
+        return true;
+    }
+
+    // Delivers ride notifications on worker threads instead of inline.
+    // Observers must then be attached before the ride's first status change.
+    void enableAsyncNotifications(size_t workers = 2, size_t queueCapacity = 4096) {
+        disableAsyncNotifications();
+        notifier.reset(new NotificationDispatcher(workers, queueCapacity));
+        notifier->install();
+    }
+
+    // Drains outstanding notifications and goes back to inline delivery.
+    void disableAsyncNotifications() {
+        if (!notifier) return;
+        notifier->uninstall();
+        notifier.reset();
+    }
+
+    void flushNotifications() {
+        if (notifier) notifier->drain();
+    }
+
+    // Settles payments on worker threads, with retries, instead of inline
+    // in completeRide. isPaid() turns true once the charge goes through.
+    void enableAsyncPayments(size_t workers = 2, size_t queueCapacity = 1024) {
+        disableAsyncPayments();
+        payments.reset(new PaymentWorkerPool(
+            workers, queueCapacity,
+            [this](Ride* ride, double amount, bool paid) { settlePayment(ride, amount, paid); }));
+    }
+
+    // Waits for outstanding payments and goes back to paying inline.
+    void disableAsyncPayments() {
+        payments.reset();
+    }
+
+    void flushPayments() {
+        if (payments) payments->drain();
+    }
+
+    // How old a stale matching snapshot must be before it is replaced.
+    // Zero (the default) republishes on the first match after any change,
+    // which only patches the drivers changed since; larger values trade
+    // freshness for fewer publishes under heavy churn.
+    // Call before dispatch starts.
+    void setSnapshotRefreshInterval(chrono::microseconds interval) {
+        snapshotRefresh = interval;
+    }
+
+    void setMatchingStrategy(MatchingStrategy* strategy) {
+        unique_lock<shared_mutex> guard(strategyLock);
+        if (matchingStrategy) delete matchingStrategy;
+        matchingStrategy = strategy;
+        applyScoreWeights();
+    }
+
+    // Prices new rides and quotes on provider distances, e.g. a
+    // RoadDistanceProvider. Pair with EtaDriverStrategy to match on ETA.
+    void setDistanceProvider(DistanceProvider* provider) {
+        lock_guard<mutex> guard(fareLock);
+        distanceProvider.store(provider, memory_order_release);
+        ++pricingVersion;
+    }
+
+    // Offers each ride to up to candidates drivers in rank order, waiting up
+    // to timeout for each answer and up to maxWait for all of them, so a
+    // request never blocks for longer than maxWait. nullptr turns offers
+    // off again. Batched requests are not offered.
+    void setOfferChannel(DriverOfferChannel* channel, size_t candidates = 5,
+                         chrono::milliseconds timeout = chrono::milliseconds(15000),
+                         chrono::milliseconds maxWait = chrono::milliseconds(30000)) {
+        unique_lock<shared_mutex> guard(strategyLock);
+        offerChannel = channel;
+        offerCandidates = max<size_t>(1, candidates);
+        offerTimeout = timeout;
+        offerMaxWait = maxWait;
+    }
+
+    void activateSurge(double multiplier) {
+        if (isTracing()) {
+            TraceRecord record = traceRecord(TRACE_SURGE_ON);
+            record.value = multiplier;
+            trace.append(record);
+        }
+        {
+            lock_guard<mutex> guard(fareLock);
+            fareEngine = FareEngine(true, multiplier);
+            ++pricingVersion;
+        }
+        requotePendingRequests();
+    }
+
+    void deactivateSurge() {
+        if (isTracing()) trace.append(traceRecord(TRACE_SURGE_OFF));
+        {
+            lock_guard<mutex> guard(fareLock);
+            fareEngine = FareEngine(false, 1.0);
+            ++pricingVersion;
+        }
+        requotePendingRequests();
+    }
+
+    void setQuoteRate(VehicleType type, double farePerKm) {
+        lock_guard<mutex> guard(fareLock);
+        quoteRates[type] = farePerKm;
+        ++pricingVersion;
+    }
+
+    // Caches quote distances and base fares per pair of cellSizeDeg map
+    // cells (FareQuoteCache), so quotes are accurate to about the cell size.
+    // Safe while quotes are being served: they finish on the cache they
+    // started with.
+    void enableQuoteCache(size_t entries = 1 << 16, double cellSizeDeg = 0.002) {
+        atomic_store(&quoteCache, make_shared<FareQuoteCache>(entries, cellSizeDeg));
+    }
+
+    shared_ptr<const FareQuoteCache> fareQuoteCache() const { return atomic_load(&quoteCache); }
+
+    // The cached distance and base fares between the cells of pickup and
+    // drop, priced between the cell centres on a miss.
+    static FareQuoteCache::Quote cachedQuote(FareQuoteCache& cache, DistanceProvider* provider,
+                                             const array<double, VEHICLE_TYPE_COUNT>& rates,
+                                             uint64_t version, const Location& pickup,
+                                             const Location& drop) {
+        long long from = cache.cellOf(pickup), to = cache.cellOf(drop);
+        FareQuoteCache::Quote quote;
+        if (!cache.find(from, to, version, quote)) {
+            Location a = cache.centreOf(from), b = cache.centreOf(to);
+            quote.distanceKm = provider ? provider->distanceKm(a, b) : a.distanceTo(b);
+            for (int t = 0; t < VEHICLE_TYPE_COUNT; ++t) {
+                quote.baseFare[t] = BaseFareCalculator::BASE_FARE + quote.distanceKm * rates[t];
+            }
+            cache.put(from, to, version, quote);
+        }
+        return quote;
+    }
+
+    // Upfront fares for every VehicleType in one batch kernel call. With
+    // enableQuoteCache the distance and base fares come from the cache and
+    // only the multipliers and discount are applied here.
+    array<double, VEHICLE_TYPE_COUNT> quoteFares(const Rider* rider, const Location& pickup,
+                                                 const Location& drop) const {
+        FareEngine engine;
+        array<double, VEHICLE_TYPE_COUNT> rates;
+        uint64_t version;
+        {
+            lock_guard<mutex> guard(fareLock);
+            engine = fareEngine;
+            rates = quoteRates;
+            version = pricingVersion;
+        }
+        shared_ptr<FareQuoteCache> cache = atomic_load(&quoteCache);
+        DistanceProvider* provider = distanceProvider.load(memory_order_acquire);
+        double discount = rider->hasDiscount() ? rider->getDiscountAmount() : 0.0;
+        double multipliers[VEHICLE_TYPE_COUNT];
+        if (zoneSurge.load(memory_order_relaxed)) {
+            surgeZones.multipliersFor(pickup, multipliers);
+            for (double& m : multipliers) m = max(m, engine.getSurgeMultiplier());
+        } else {
+            fill(multipliers, multipliers + VEHICLE_TYPE_COUNT, engine.getSurgeMultiplier());
+        }
+
+        array<double, VEHICLE_TYPE_COUNT> fares;
+        if (cache) {
+            FareQuoteCache::Quote quote =
+                cachedQuote(*cache, provider, rates, version, pickup, drop);
+            // The rest of SurgeDiscountFarePipeline, so a cached quote
+            // matches the batch kernel for the cell centres bit for bit.
+            for (int t = 0; t < VEHICLE_TYPE_COUNT; ++t) {
+                FareInputs in{quote.distanceKm, rates[t], multipliers[t], discount};
+                fares[t] = DiscountRule::apply(SurgeRule::apply(quote.baseFare[t], in), in);
+            }
+            return fares;
+        }
+
+        double distance = provider ? provider->distanceKm(pickup, drop) : pickup.distanceTo(drop);
+        FareQuoteBatch batch;
+        for (int t = 0; t < VEHICLE_TYPE_COUNT; ++t) {
+            batch.add(distance, rates[t], multipliers[t], discount);
+        }
+        FareEngine::calculateBatch(batch, fares.data());
+        return fares;
+    }
+
+    // Re-prices every request still waiting for a batch, e.g. after a surge
+    // change. Distances come from the same source as quoteFares, so a
+    // re-quote only differs from a fresh quote by the new pricing.
+    void requotePendingRequests() {
+        FareEngine engine;
+        array<double, VEHICLE_TYPE_COUNT> rates;
+        uint64_t version;
+        {
+            lock_guard<mutex> guard(fareLock);
+            engine = fareEngine;
+            rates = quoteRates;
+            version = pricingVersion;
+        }
+
+        shared_ptr<FareQuoteCache> cache = atomic_load(&quoteCache);
+        DistanceProvider* provider = distanceProvider.load(memory_order_acquire);
+        bool zoned = zoneSurge.load(memory_order_relaxed);
+
+        lock_guard<mutex> guard(batchLock);
+        FareQuoteBatch batch;
+        for (const auto& request : pendingRequests) {
+            const Rider* rider = request.getRider();
+            double multiplier = engine.getSurgeMultiplier();
+            if (zoned) {
+                multiplier = max(multiplier,
+                                 surgeZones.multiplierFor(request.getType(), request.getPickup()));
+            }
+            const Location& pickup = request.getPickup();
+            const Location& drop = request.getDrop();
+            double distance;
+            if (cache) {
+                distance = cachedQuote(*cache, provider, rates, version, pickup, drop).distanceKm;
+            } else {
+                distance = provider ? provider->distanceKm(pickup, drop) : pickup.distanceTo(drop);
+            }
+            batch.add(distance, rates[request.getType()], multiplier,
+                      rider->hasDiscount() ? rider->getDiscountAmount() : 0.0);
+        }
+        vector<double> fares(batch.size());
+        FareEngine::calculateBatch(batch, fares.data());
+        for (size_t i = 0; i < pendingRequests.size(); ++i) {
+            pendingRequests[i].setQuotedFare(fares[i]);
+        }
+    }
+
+    FareEngine currentFareEngine() const {
+        lock_guard<mutex> guard(fareLock);
+        return fareEngine;
+    }
+
+    // Prices rides from the demand/supply of their pickup zone. The global
+    // surge set by activateSurge still applies as a floor.
+    void enableZoneSurge() { zoneSurge = true; }
+    void disableZoneSurge() { zoneSurge = false; }
+
+    double zoneMultiplier(VehicleType type, const Location& pickup) const {
+        return surgeZones.multiplierFor(type, pickup);
+    }
+
+    // The engine for a pickup: the global one, unless zone surge is on and
+    // the pickup zone's multiplier is higher.
+    FareEngine fareEngineFor(VehicleType type, const Location& pickup) const {
+        FareEngine engine = currentFareEngine();
+        if (!zoneSurge.load(memory_order_relaxed)) return engine;
+        double zone = surgeZones.multiplierFor(type, pickup);
+        return zone > engine.getSurgeMultiplier() ? FareEngine(true, zone) : engine;
+    }
+
+    bool isSurge() const { return currentFareEngine().isSurge(); }
+    double getCurrentMultiplier() const { return currentFareEngine().getSurgeMultiplier(); }
+
+    void registerDriver(Driver* driver) {
+        if (isTracing()) {
+            TraceRecord record = traceRecord(TRACE_REGISTER_DRIVER);
+            record.driverId = driver->getId();
+            record.type = (uint8_t)driver->getVehicle()->getType();
+            record.capacity = driver->getVehicle()->getCapacity();
+            record.farePerKm = driver->getVehicle()->getFarePerKm();
+            record.value = driver->getRating();
+            record.latitude = driver->getCurrentLocation().latitude;
+            record.longitude = driver->getCurrentLocation().longitude;
+            trace.append(record);
+        }
+        driversRegistered = true;
+        if (driver->getHomeShard() < 0) {
+            driver->setHomeShard(shardFor(driver->getCurrentLocation()));
+        }
+        {
+            // Only after the home shard is set, which ingestion relies on.
+            unique_lock<shared_mutex> guard(registryLock);
+            driversById[driver->getId()] = driver;
+        }
+        DriverImage img;
+        {
+            unique_lock<mutex> guard = lockHomeShard(driver);
+            driver->setStatus(AVAILABLE);
+            shards[driver->getHomeShard()]->availableDrivers.add(driver);
+            img = imageOf(driver);
+        }
+        journalDriver(JOURNAL_DRIVER_UPSERT, img);
+        if (journal.isOpen()) warnIfImageCuts(driver);
+        EventLog::getInstance().recordDriver(LOG_INFO, EV_DRIVER_REGISTERED, driver->getId(),
+                                             Location(img.latitude, img.longitude), img.rating,
+                                             driver->getVehicle()->getType());
+    }
+
+    // Backs Driver::updateLocation. Moves the driver to another shard when
+    // it crosses into a cell owned by one.
+    void moveDriver(Driver* driver, const Location& loc) {
+        if (isTracing()) {
+            TraceRecord record = traceRecord(TRACE_MOVE_DRIVER);
+            record.driverId = driver->getId();
+            record.latitude = loc.latitude;
+            record.longitude = loc.longitude;
+            trace.append(record);
+        }
+        if (driver->getHomeShard() < 0) {
+            driver->setCurrentLocation(loc);
+            return;
+        }
+        int target = shardFor(loc);
+        while (true) {
+            int from = driver->getHomeShard();
+            if (from == target) {
+                lock_guard<mutex> guard(shards[from]->lock);
+                if (driver->getHomeShard() != from) continue;
+                driver->setCurrentLocation(loc);
+                shards[from]->availableDrivers.relocate(driver);
+                return;
+            }
+
+            scoped_lock guard(shards[from]->lock, shards[target]->lock);
+            if (driver->getHomeShard() != from) continue;
+            bool pooled = shards[from]->availableDrivers.contains(driver);
+            if (pooled) shards[from]->availableDrivers.remove(driver);
+            driver->setCurrentLocation(loc);
+            driver->setHomeShard(target);
+            if (pooled) shards[target]->availableDrivers.add(driver);
+            return;
+        }
+    }
+
+    // Backs Driver::setRating so the driver store sees the new rating.
+    void rateDriver(Driver* driver, double rating) {
+        if (isTracing()) {
+            TraceRecord record = traceRecord(TRACE_RATE_DRIVER);
+            record.driverId = driver->getId();
+            record.value = rating;
+            trace.append(record);
+        }
+        if (driver->getHomeShard() < 0) {
+            driver->setCurrentRating(rating);
+            return;
+        }
+        DriverImage img;
+        {
+            unique_lock<mutex> guard = lockHomeShard(driver);
+            driver->setCurrentRating(rating);
+            shards[driver->getHomeShard()]->availableDrivers.refresh(driver);
+            img = imageOf(driver);
+        }
+        journalDriver(JOURNAL_DRIVER_UPSERT, img);
+    }
+
+    // Requests that start after this returns no longer see the driver.
+    // The Driver may be deleted once every call that was already running
+    // has returned; until then a matching call can still hold it from a
+    // snapshot, for as long as a whole offer round.
+    void deregisterDriver(Driver* driver) {
+        if (isTracing()) {
+            TraceRecord record = traceRecord(TRACE_DEREGISTER_DRIVER);
+            record.driverId = driver->getId();
+            trace.append(record);
+        }
+        if (driver->getHomeShard() < 0) return;
+        {
+            unique_lock<shared_mutex> guard(registryLock);
+            driversById.erase(driver->getId());
+        }
+        DriverImage img;
+        {
+            unique_lock<mutex> guard = lockHomeShard(driver);
+            driver->setStatus(OFFLINE);
+            shards[driver->getHomeShard()]->availableDrivers.remove(driver);
+            img = imageOf(driver);
+        }
+        republishStaleSnapshots();
+        journalDriver(JOURNAL_DRIVER_REMOVED, img);
+        EventLog::getInstance().record(LOG_INFO, EV_DRIVER_DEREGISTERED, 0, driver->getId());
+    }
+
+    // Bulk GPS ingestion. Pings are buffered and coalesced per driver, and
+    // applied once the ingestion window (or buffer limit) is reached.
+    void configureLocationIngestion(chrono::milliseconds window, size_t maxBufferedPings) {
+        locationIngestor.configure(window, maxBufferedPings);
+    }
+
+    void ingestLocations(const vector<LocationPing>& pings) {
+        if (pings.empty()) return;
+        if (isTracing()) {
+            for (const LocationPing& ping : pings) {
+                TraceRecord record = traceRecord(TRACE_LOCATION_PING);
+                record.driverId = ping.driverId;
+                record.latitude = ping.latitude;
+                record.longitude = ping.longitude;
+                record.stamp = ping.timestamp;
+                trace.append(record);
+            }
+        }
+        if (locationIngestor.add(pings.data(), pings.size())) flushLocationUpdates();
+    }
+
+    // Applies the newest buffered ping of every driver. Pings older than
+    // the driver's last applied one, or from drivers that are not
+    // registered, are dropped. Each shard is locked once for all of its
+    // drivers; only drivers that leave their shard take the moveDriver path.
+    // Returns the number of locations applied.
+    size_t flushLocationUpdates() {
+        if (isTracing()) trace.append(traceRecord(TRACE_FLUSH_LOCATIONS));
+        vector<LocationPing> coalesced;
+        unique_lock<mutex> flushGuard = locationIngestor.flush(coalesced);
+        if (coalesced.empty()) return 0;
+
+        vector<vector<pair<Driver*, const LocationPing*>>> byShard(shards.size());
+        size_t dropped = 0;
+        {
+            shared_lock<shared_mutex> guard(registryLock);
+            for (const auto& ping : coalesced) {
+                auto it = driversById.find(ping.driverId);
+                if (it == driversById.end() ||
+                    ping.timestamp <= it->second->getLocationTimestamp()) {
+                    ++dropped;
+                    continue;
+                }
+                byShard[it->second->getHomeShard()].emplace_back(it->second, &ping);
+            }
+        }
+
+        vector<pair<Driver*, Location>> crossing;
+        for (size_t s = 0; s < byShard.size(); ++s) {
+            if (byShard[s].empty()) continue;
+            lock_guard<mutex> guard(shards[s]->lock);
+            for (const auto& update : byShard[s]) {
+                Driver* driver = update.first;
+                Location loc(update.second->latitude, update.second->longitude);
+                driver->setLocationTimestamp(update.second->timestamp);
+                if (driver->getHomeShard() != (int)s || shardFor(loc) != (int)s) {
+                    crossing.emplace_back(driver, loc);
+                    continue;
+                }
+                driver->setCurrentLocation(loc);
+                shards[s]->availableDrivers.relocate(driver);
+            }
+        }
+        for (const auto& move : crossing) moveDriver(move.first, move.second);
+
+        size_t applied = coalesced.size() - dropped;
+        EventLog::getInstance().record(LOG_DEBUG, EV_LOCATIONS_APPLIED, 0, (int)dropped, 0,
+                                       (double)applied);
+        return applied;
+    }
+
+    PinnedRide requestRide(Rider* rider, const Location& pickup, const Location& drop,
+                           VehicleType type) {
+        ScopedStageTimer requestTimer(STAGE_REQUEST);
+        DispatchMetrics& metrics = DispatchMetrics::getInstance();
+        bool traced = isTracing();
+        TraceRecord record;
+        if (traced) record = traceRecord(TRACE_REQUEST_RIDE);
+        surgeZones.rideRequested(type, pickup);
+        RideRequest request(rider, pickup, drop, type);
+        // Pinned before anything can retire it.
+        PinnedRide pinned(createRide(request));
+        Ride* ride = pinned.get();
+        rider->addRideToHistory(ride->getId());
+        if (traced) {
+            record.stamp = (int64_t)ride->getId();
+            record.riderId = rider->getId();
+            record.type = (uint8_t)type;
+            record.latitude = pickup.latitude;
+            record.longitude = pickup.longitude;
+            record.dropLatitude = drop.latitude;
+            record.dropLongitude = drop.longitude;
+            trace.append(record);
+        }
+        EventLog::getInstance().record(LOG_INFO, EV_RIDE_REQUESTED, ride->getId(), 0,
+                                       rider->getId(), 0.0, type);
+
+        // Choose a driver. Offers can take seconds, so they are made
+        // without strategyLock.
+        Driver* chosenDriver = nullptr;
+        DriverOfferChannel* channel;
+        chrono::milliseconds timeout, maxWait;
+        vector<Driver*> candidates;
+        metrics.startCandidateCount();
+        {
+            ScopedStageTimer matchTimer(STAGE_MATCH);
+            shared_lock<shared_mutex> guard(strategyLock);
+            channel = offerChannel;
+            timeout = offerTimeout;
+            maxWait = offerMaxWait;
+            if (channel) {
+                candidates = rankCandidates(request, offerCandidates);
+            } else {
+                chosenDriver = claimDriver(request);
+            }
+        }
+        metrics.recordCandidateCount();
+        if (channel) {
+            chosenDriver = offerToCandidates(ride, request, candidates, channel, timeout,
+                                             chrono::steady_clock::now() + maxWait);
+        }
+        commitAssignment(ride, chosenDriver);
+        return pinned;
+    }
+
+    // Matches a whole batch at once, one solve per home shard. Requests the
+    // batch leaves unmatched, and every request when the strategy has no
+    // batch support, go through the per-request path across shards.
+    vector<PinnedRide> requestRides(const vector<RideRequest>& requests) {
+        for (const auto& request : requests) {
+            surgeZones.rideRequested(request.getType(), request.getPickup());
+        }
+        return matchBatch(requests);
+    }
+
+    // Batching window: a batch is matched once it holds maxRequests or has
+    // been open for longer than window, whichever comes first.
+    void configureBatching(size_t maxRequests, chrono::milliseconds window) {
+        lock_guard<mutex> guard(batchLock);
+        batchMaxRequests = max<size_t>(1, maxRequests);
+        batchWindow = window;
+    }
+
+    // Queues a request for the next batch. Returns the rides of any batch
+    // this call closed, which is usually none.
+    vector<PinnedRide> submitRideRequest(Rider* rider, const Location& pickup,
+                                         const Location& drop, VehicleType type) {
+        surgeZones.rideRequested(type, pickup);
+        RideRequest request(rider, pickup, drop, type);
+        request.setQuotedFare(quoteFares(rider, pickup, drop)[type]);
+
+        vector<RideRequest> batch;
+        {
+            lock_guard<mutex> guard(batchLock);
+            if (pendingRequests.empty()) batchOpenedAt = chrono::steady_clock::now();
+            pendingRequests.push_back(request);
+            if (pendingRequests.size() >= batchMaxRequests ||
+                chrono::steady_clock::now() - batchOpenedAt >= batchWindow) {
+                batch.swap(pendingRequests);
+            }
+        }
+        return matchBatch(batch);
+    }
+
+    // Called periodically by the owner of the dispatch loop.
+    vector<PinnedRide> flushIfWindowElapsed() {
+        vector<RideRequest> batch;
+        {
+            lock_guard<mutex> guard(batchLock);
+            if (!pendingRequests.empty() &&
+                chrono::steady_clock::now() - batchOpenedAt >= batchWindow) {
+                batch.swap(pendingRequests);
+            }
+        }
+        return matchBatch(batch);
+    }
+
+    vector<PinnedRide> flushPendingRequests() {
+        vector<RideRequest> batch;
+        {
+            lock_guard<mutex> guard(batchLock);
+            batch.swap(pendingRequests);
+        }
+        return matchBatch(batch);
+    }
+
+    // Scheduled rides fire lead before their pickup time, on ticks of the
+    // given length. Only while nothing is booked.
+    bool configureScheduling(chrono::milliseconds lead,
+                             chrono::milliseconds tick = chrono::milliseconds(1000)) {
+        lock_guard<mutex> guard(scheduleLock);
+        if (scheduledRides.size() > 0 || tick.count() < 1) {
+            EventLog::getInstance().message(
+                LOG_WARN, "Scheduling must be configured before rides are booked.");
+            return false;
+        }
+        scheduleTick = tick;
+        scheduleLead = lead;
+        scheduledRides = ScheduleWheel(Ride::wallClockMs() / tick.count());
+        return true;
+    }
+
+    // Books a ride for pickupAtMs (wall clock, ms since the epoch). The
+    // fare is quoted now. The returned id cancels the booking.
+    ScheduleWheel::ScheduleId scheduleRide(Rider* rider, const Location& pickup,
+                                           const Location& drop, VehicleType type,
+                                           int64_t pickupAtMs) {
+        RideRequest request(rider, pickup, drop, type);
+        request.setQuotedFare(quoteFares(rider, pickup, drop)[type]);
+        lock_guard<mutex> guard(scheduleLock);
+        return scheduledRides.schedule(request,
+                                       (pickupAtMs - scheduleLead.count()) / scheduleTick.count());
+    }
+
+    bool cancelScheduledRide(ScheduleWheel::ScheduleId id) {
+        lock_guard<mutex> guard(scheduleLock);
+        return scheduledRides.cancel(id);
+    }
+
+    size_t scheduledRideCount() {
+        lock_guard<mutex> guard(scheduleLock);
+        return scheduledRides.size();
+    }
+
+    // Called periodically by the owner of the dispatch loop. Everything
+    // that came due is matched as one batch, one solve per shard.
+    vector<PinnedRide> releaseScheduledRides(int64_t nowMs = Ride::wallClockMs()) {
+        vector<RideRequest> due;
+        {
+            lock_guard<mutex> guard(scheduleLock);
+            scheduledRides.advance(nowMs / scheduleTick.count(), due);
+        }
+        return requestRides(due);
+    }
+
+    // Only transitions in RIDE_TRANSITIONS are applied. COMPLETED and
+    // CANCELLED go through completeRide and cancelRide, which release the
+    // driver.
+    void updateRideStatus(RideId rideId, RideStatus newStatus) {
+        if (newStatus == COMPLETED) {
+            completeRide(rideId);
+            return;
+        }
+        if (newStatus == CANCELLED) {
+            cancelRide(rideId, CANCEL_BY_RIDER);
+            return;
+        }
+        ScopedStageTimer timer(STAGE_STATUS_UPDATE);
+        traceRide(TRACE_RIDE_STATUS, rideId, newStatus);
+        RideImage img;
+        {
+            RideStripe& stripe = stripeFor(rideId);
+            lock_guard<mutex> guard(stripe.lock);
+            Ride* ride = stripe.rides.find(rideId);
+            if (!ride) {
+                EventLog::getInstance().record(LOG_WARN, EV_RIDE_NOT_FOUND, rideId);
+                return;
+            }
+            if (!Ride::canTransition(ride->getStatus(), newStatus)) {
+                EventLog::getInstance().record(LOG_WARN, EV_INVALID_TRANSITION, rideId, 0, 0,
+                                               (double)ride->getStatus(), newStatus);
+                return;
+            }
+            ride->updateStatus(newStatus);
+            img = imageOf(ride);
+        }
+        if (newStatus == IN_PROGRESS) disarmTimeout(rideId);
+        if (journal.isOpen()) {
+            DriverImage driverImg;
+            memset(&driverImg, 0, sizeof(driverImg));
+            driverImg.id = img.driverId;
+            journalRide(JOURNAL_RIDE_UPSERT, img, driverImg);
+        }
+    }
+
+    void completeRide(RideId rideId) {
+        ScopedStageTimer completeTimer(STAGE_COMPLETE);
+        traceRide(TRACE_COMPLETE_RIDE, rideId);
+        // Taking the ride out of its stripe first makes completion one-shot
+        // even when two threads race on the same id. Once out, nothing else
+        // can reach the ride, so its status changes without the lock.
+        Ride* ride;
+        {
+            RideStripe& stripe = stripeFor(rideId);
+            lock_guard<mutex> guard(stripe.lock);
+            ride = stripe.rides.find(rideId);
+            if (!ride) {
+                EventLog::getInstance().record(LOG_WARN, EV_RIDE_NOT_FOUND, rideId);
+                return;
+            }
+            if (!Ride::canTransition(ride->getStatus(), COMPLETED)) {
+                EventLog::getInstance().record(LOG_WARN, EV_INVALID_TRANSITION, rideId, 0, 0,
+                                               (double)ride->getStatus(), COMPLETED);
+                return;
+            }
+            stripe.rides.erase(rideId);
+        }
+        disarmTimeout(rideId);
+
+        // 1. Mark completed
+        ride->updateStatus(COMPLETED);
+
+        // 2. Free up driver, unless other shared-ride riders are still on
+        // the trip; payment never holds a driver out of the pool
+        Driver* driver = ride->getDriver();
+        bool release = leaveSharedTrip(driver, rideId);
+        DriverImage driverImg;
+        {
+            ScopedStageTimer timer(STAGE_POOL_ADD);
+            unique_lock<mutex> guard = lockHomeShard(driver);
+            // A driver deregistered during the trip stays out of the pool.
+            release = release && driver->getStatus() != OFFLINE;
+            if (release) {
+                driver->setStatus(AVAILABLE);
+                shards[driver->getHomeShard()]->availableDrivers.add(driver);
+            }
+            driverImg = imageOf(driver);
+        }
+        journalRide(JOURNAL_RIDE_FINISHED, imageOf(ride), driverImg);
+        DispatchMetrics::getInstance().increment(COUNTER_COMPLETED);
+        if (release) {
+            EventLog::getInstance().record(LOG_INFO, EV_DRIVER_AVAILABLE, rideId, driver->getId());
+        }
+
+        // 3. Fare Calculation
+        double finalFare;
+        {
+            ScopedStageTimer timer(STAGE_FARE);
+            finalFare = fareEngineFor(ride->getRequestedType(), ride->getPickupLocation())
+                            .calculate(ride);
+        }
+        ride->setFare(finalFare);
+
+        // 4. Process payment, queued when a worker pool is running, then
+        // archive the ride once the outcome is known
+        bool paid;
+        {
+            ScopedStageTimer timer(STAGE_PAYMENT);
+            if (payments && payments->submit(ride, paymentProcessor, finalFare)) return;
+            paid = paymentProcessor->processPayment(ride, finalFare);
+        }
+        settlePayment(ride, finalFare, paid);
+    }
+
+    // Cancels an assigned ride and puts its driver straight back into the
+    // pool, unless other riders of a shared trip are still on board. The
+    // ride is archived as CANCELLED without a fare. No-show reasons are
+    // refused once the ride is IN_PROGRESS. False when the ride is unknown
+    // or already finished.
+    bool cancelRide(RideId rideId, CancelReason reason) {
+        ScopedStageTimer cancelTimer(STAGE_CANCEL);
+        if (isTracing()) {
+            TraceRecord record = traceRecord(TRACE_CANCEL_RIDE);
+            record.stamp = (int64_t)rideId;
+            record.status = (uint8_t)reason;
+            trace.append(record);
+        }
+        // Leaving the stripe makes cancellation and completion one-shot
+        // against each other.
+        Ride* ride;
+        {
+            RideStripe& stripe = stripeFor(rideId);
+            lock_guard<mutex> guard(stripe.lock);
+            ride = stripe.rides.find(rideId);
+            if (!ride) {
+                EventLog::getInstance().record(LOG_WARN, EV_RIDE_NOT_FOUND, rideId);
+                return false;
+            }
+            bool noShow = reason == CANCEL_RIDER_NO_SHOW || reason == CANCEL_DRIVER_NO_SHOW;
+            if (!Ride::canTransition(ride->getStatus(), CANCELLED) ||
+                (noShow && ride->getStatus() == IN_PROGRESS)) {
+                EventLog::getInstance().record(LOG_WARN, EV_INVALID_TRANSITION, rideId, 0, 0,
+                                               (double)ride->getStatus(), CANCELLED);
+                return false;
+            }
+            stripe.rides.erase(rideId);
+        }
+        disarmTimeout(rideId);
+        ride->updateStatus(CANCELLED);
+
+        Driver* driver = ride->getDriver();
+        bool release = leaveSharedTrip(driver, rideId);
+        DriverImage driverImg;
+        {
+            ScopedStageTimer timer(STAGE_POOL_ADD);
+            unique_lock<mutex> guard = lockHomeShard(driver);
+            // A driver deregistered during the trip stays out of the pool.
+            release = release && driver->getStatus() != OFFLINE;
+            if (release) {
+                driver->setStatus(AVAILABLE);
+                shards[driver->getHomeShard()]->availableDrivers.add(driver);
+            }
+            driverImg = imageOf(driver);
+        }
+        journalRide(JOURNAL_RIDE_FINISHED, imageOf(ride), driverImg);
+        DispatchMetrics::getInstance().increment(COUNTER_CANCELLED);
+        EventLog::getInstance().record(LOG_INFO, EV_RIDE_CANCELLED, rideId, driver->getId(),
+                                       ride->getRider()->getId(), 0.0, reason);
+        if (release) {
+            EventLog::getInstance().record(LOG_INFO, EV_DRIVER_AVAILABLE, rideId, driver->getId());
+        }
+        retireRide(ride);
+        return true;
+    }
+
+    // Assigned rides are cancelled when the driver has not called
+    // driverArrived within driverTimeout, or the rider has not boarded
+    // (IN_PROGRESS) within riderTimeout after that. Zero turns either one
+    // off. Deadlines fire in expireRideTimeouts on ticks of the given
+    // length. Only while no deadline is pending.
+    bool configureNoShowTimeouts(chrono::milliseconds driverTimeout, chrono::milliseconds riderTimeout,
+                                 chrono::milliseconds tick = chrono::milliseconds(1000)) {
+        lock_guard<mutex> guard(timeoutLock);
+        if (rideTimeouts.size() > 0 || tick.count() < 1) {
+            EventLog::getInstance().message(
+                LOG_WARN, "No-show timeouts must be configured while none are pending.");
+            return false;
+        }
+        timeoutTick = tick;
+        driverNoShowTimeout = driverTimeout;
+        riderNoShowTimeout = riderTimeout;
+        rideTimeouts = TimerWheel<RideTimeout>(Ride::wallClockMs() / tick.count());
+        noShowTimeouts.store(driverTimeout.count() > 0 || riderTimeout.count() > 0);
+        return true;
+    }
+
+    // The driver is at the pickup; the rider's deadline replaces the
+    // driver's.
+    void driverArrived(RideId rideId, int64_t nowMs = Ride::wallClockMs()) {
+        if (!noShowTimeouts.load(memory_order_relaxed)) return;
+        {
+            RideStripe& stripe = stripeFor(rideId);
+            lock_guard<mutex> guard(stripe.lock);
+            Ride* ride = stripe.rides.find(rideId);
+            if (!ride || ride->getStatus() == IN_PROGRESS) return;
+        }
+        armTimeout(rideId, CANCEL_RIDER_NO_SHOW, nowMs);
+    }
+
+    size_t pendingTimeoutCount() {
+        lock_guard<mutex> guard(timeoutLock);
+        return rideTimeouts.size();
+    }
+
+    // Called periodically by the owner of the dispatch loop, like
+    // releaseScheduledRides. Returns how many rides were cancelled.
+    size_t expireRideTimeouts(int64_t nowMs = Ride::wallClockMs()) {
+        vector<RideTimeout> due;
+        {
+            lock_guard<mutex> guard(timeoutLock);
+            rideTimeouts.advance(nowMs / timeoutTick.count(), due);
+            for (const RideTimeout& t : due) armedTimeouts.erase(t.rideId);
+        }
+        size_t cancelled = 0;
+        for (const RideTimeout& t : due) cancelled += cancelRide(t.rideId, t.reason);
+        return cancelled;
+    }
+
+    // Shared rides join trips whose route passes within searchRadius
+    // (degrees) of the pickup. No rider's time on board may exceed their
+    // direct distance by more than maxDetourRatio.
+    void configureCarpool(double searchRadius, double maxDetourRatio) {
+        lock_guard<mutex> guard(carpoolLock);
+        if (!sharedTrips.empty()) {
+            EventLog::getInstance().message(
+                LOG_WARN, "Carpooling must be configured while no shared trips run.");
+            return;
+        }
+        carpoolRadius = searchRadius;
+        carpoolDetour = maxDetourRatio;
+    }
+
+    // Like requestRide, but first tries to add the rider to a driver's
+    // shared trip nearby, at the insertion that adds the least distance.
+    // Without a feasible insertion a free driver starts a new shared trip.
+    PinnedRide requestSharedRide(Rider* rider, const Location& pickup, const Location& drop,
+                                 VehicleType type, int seats = 1) {
+        surgeZones.rideRequested(type, pickup);
+        RideRequest request(rider, pickup, drop, type);
+        // Pinned before anything can retire it.
+        PinnedRide pinned(createRide(request));
+        Ride* ride = pinned.get();
+        rider->addRideToHistory(ride->getId());
+        EventLog::getInstance().record(LOG_INFO, EV_RIDE_REQUESTED, ride->getId(), 0,
+                                       rider->getId(), 0.0, type);
+        {
+            lock_guard<mutex> guard(carpoolLock);
+            SharedTrip* best = nullptr;
+            SharedTrip::Insertion bestAt = {0, 0, 0.0, false};
+            long long home = carpoolCell(pickup);
+            int hx = (int)(home >> 32), hy = (int)(uint32_t)home;
+            vector<SharedTrip*> seen;
+            for (int dx = -1; dx <= 1; ++dx) {
+                for (int dy = -1; dy <= 1; ++dy) {
+                    long long cell = ((long long)(hx + dx) << 32) ^ (long long)(uint32_t)(hy + dy);
+                    auto it = tripCells.find(cell);
+                    if (it == tripCells.end()) continue;
+                    for (SharedTrip* trip : it->second) {
+                        if (trip->getDriver()->getVehicle()->getType() != type) continue;
+                        if (find(seen.begin(), seen.end(), trip) != seen.end()) continue;
+                        seen.push_back(trip);
+                        SharedTrip::Insertion at = trip->bestInsertion(pickup, drop, seats);
+                        if (at.feasible && (!best || at.addedDistance < bestAt.addedDistance)) {
+                            best = trip;
+                            bestAt = at;
+                        }
+                    }
+                }
+            }
+            if (best) {
+                unindexTrip(best);
+                best->insert(ride->getId(), pickup, drop, seats, bestAt);
+                indexTrip(best);
+                EventLog::getInstance().record(LOG_INFO, EV_RIDE_POOLED, ride->getId(),
+                                               best->getDriver()->getId(), rider->getId(),
+                                               bestAt.addedDistance);
+                commitAssignment(ride, best->getDriver());
+                return pinned;
+            }
+        }
+
+        // Vehicles too small for the party stay claimed until a driver is
+        // found, so each further claim goes to the next best driver. Then
+        // they go back to the pool.
+        Driver* chosenDriver;
+        vector<Driver*> tooSmall;
+        {
+            shared_lock<shared_mutex> guard(strategyLock);
+            while ((chosenDriver = claimDriver(request)) &&
+                   chosenDriver->getVehicle()->getCapacity() < seats) {
+                tooSmall.push_back(chosenDriver);
+            }
+        }
+        for (Driver* driver : tooSmall) {
+            unique_lock<mutex> guard = lockHomeShard(driver);
+            if (driver->getStatus() == OFFLINE) continue;
+            driver->setStatus(AVAILABLE);
+            shards[driver->getHomeShard()]->availableDrivers.add(driver);
+        }
+        if (!chosenDriver) {
+            commitAssignment(ride, nullptr);
+            return pinned;
+        }
+        Location start;
+        {
+            unique_lock<mutex> guard = lockHomeShard(chosenDriver);
+            start = chosenDriver->getCurrentLocation();
+        }
+        lock_guard<mutex> guard(carpoolLock);
+        unique_ptr<SharedTrip> trip(new SharedTrip(chosenDriver, start, carpoolDetour));
+        trip->insert(ride->getId(), pickup, drop, seats, SharedTrip::Insertion{0, 0, 0.0, true});
+        indexTrip(trip.get());
+        sharedTrips[chosenDriver->getId()] = move(trip);
+        commitAssignment(ride, chosenDriver);
+        return pinned;
+    }
+
+    // The driver reached the next stop of their shared trip: a pickup
+    // starts that ride, a drop completes it. False when there is no stop.
+    bool advanceSharedTrip(int driverId) {
+        TripStop stop;
+        {
+            lock_guard<mutex> guard(carpoolLock);
+            auto it = sharedTrips.find(driverId);
+            if (it == sharedTrips.end() || it->second->empty()) return false;
+            SharedTrip* trip = it->second.get();
+            unindexTrip(trip);
+            stop = trip->advance();
+            indexTrip(trip);
+        }
+        if (stop.pickup) {
+            updateRideStatus(stop.rideId, IN_PROGRESS);
+        } else {
+            completeRide(stop.rideId);
+        }
+        return true;
+    }
+
+    // Remaining stops of the driver's shared trip, next first.
+    vector<TripStop> sharedTripStops(int driverId) {
+        lock_guard<mutex> guard(carpoolLock);
+        auto it = sharedTrips.find(driverId);
+        return it == sharedTrips.end() ? vector<TripStop>() : it->second->getStops();
+    }
+
+    // Starts journaling state transitions to dir/journal.bin. Pair with
+    // periodic saveSnapshot calls, which also empty the journal. Driver
+    // locations are not journaled; the next ping after a restart fixes them.
+    // Records are fsynced in groups at least every syncEvery, so a crash
+    // loses at most that much; zero syncs every transition before the call
+    // that made it returns (see RecordJournal).
+    bool enablePersistence(const string& dir,
+                           chrono::milliseconds syncEvery = chrono::milliseconds(5)) {
+#ifdef DISPATCH_HAVE_MMAP
+        persistenceDir = dir;
+        journalSync = syncEvery;
+        if (journal.open(dir + "/journal.bin", false, syncEvery)) return true;
+        EventLog::getInstance().message(LOG_WARN, string("Cannot open journal in ") + dir + ".");
+#else
+        EventLog::getInstance().message(LOG_WARN, "Persistence needs a POSIX build.");
+#endif
+        return false;
+    }
+
+    void flushJournal() { journal.flush(); }
+    // Stops journaling; the files in the directory are left as they are.
+    void disablePersistence() {
+        journal.close();
+        persistenceDir.clear();
+    }
+
+    // Records every external input (drivers, locations, requestRide,
+    // status changes, completions, surge) to a TraceRecord file at path
+    // until stopTrace. TraceReplayer feeds such a file back in. Batched,
+    // shared and scheduled requests are not traced. Calls still running
+    // from an earlier trace must have returned before a new one starts.
+    bool startTrace(const string& path) {
+        stopTrace();
+#ifdef DISPATCH_HAVE_MMAP
+        if (!trace.open(path, true)) {
+            EventLog::getInstance().message(LOG_WARN, string("Cannot open trace ") + path + ".");
+            return false;
+        }
+        traceStart = chrono::steady_clock::now();
+        TraceRecord begin = traceRecord(TRACE_BEGIN);
+        begin.driverId = TRACE_MAGIC;
+        begin.capacity = TRACE_VERSION;
+        begin.stamp = Ride::wallClockMs();
+        trace.append(begin);
+        tracing.store(true, memory_order_release);
+        return true;
+#else
+        EventLog::getInstance().message(LOG_WARN, "Tracing needs a POSIX build.");
+        return false;
+#endif
+    }
+
+    void stopTrace() {
+        tracing.store(false, memory_order_release);
+        trace.close();
+    }
+
+    // From now on drivers entering a pool are stamped available at the
+    // given minutes rather than at steady_clock's, so idle times, and with
+    // them ScoredDriverStrategy's picks, only depend on the inputs.
+    // TraceReplayer sets it to each record's traced time. Call from one
+    // thread; the first call must come before matching starts.
+    void pinPoolClock(double minutes) {
+        poolMinutes.store(minutes, memory_order_relaxed);
+        if (poolClockPinned) return;
+        poolClockPinned = true;
+        for (auto& shard : shards) {
+            lock_guard<mutex> guard(shard->lock);
+            shard->availableDrivers.setClock(&poolMinutes);
+        }
+    }
+
+    // Writes every registered driver and ongoing ride to dir/state.img and
+    // starts a new journal. Each shard and ride stripe is locked in turn
+    // while it is copied; journal appends wait for the whole snapshot.
+    bool saveSnapshot() {
+#ifdef DISPATCH_HAVE_MMAP
+        if (persistenceDir.empty()) return false;
+        string imagePath = persistenceDir + "/state.img";
+        return journal.rotate(persistenceDir + "/journal.bin", [&] {
+            vector<Driver*> drivers;
+            {
+                shared_lock<shared_mutex> guard(registryLock);
+                for (const auto& entry : driversById) drivers.push_back(entry.second);
+            }
+            vector<DriverImage> driverImages;
+            driverImages.reserve(drivers.size());
+            for (Driver* d : drivers) {
+                unique_lock<mutex> guard = lockHomeShard(d);
+                driverImages.push_back(imageOf(d));
+            }
+            vector<RideImage> rideImages;
+            for (auto& stripe : rideStripes) {
+                lock_guard<mutex> guard(stripe.lock);
+                stripe.rides.forEach([&](Ride* ride) { rideImages.push_back(imageOf(ride)); });
+            }
+
+            StateImageHeader header;
+            memset(&header, 0, sizeof(header));
+            header.magic = StateImageHeader::MAGIC;
+            header.version = StateImageHeader::VERSION;
+            header.driverCount = driverImages.size();
+            header.rideCount = rideImages.size();
+            header.lastRideId = RideFactory::lastIssuedId();
+            header.lastUserId = User::lastIssuedId();
+
+            string tmp = imagePath + ".tmp";
+            int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) return false;
+            bool ok = writeFully(fd, &header, sizeof(header)) &&
+                      writeFully(fd, driverImages.data(), driverImages.size() * sizeof(DriverImage)) &&
+                      writeFully(fd, rideImages.data(), rideImages.size() * sizeof(RideImage));
+            ::close(fd);
+            if (!ok || ::rename(tmp.c_str(), imagePath.c_str()) != 0) {
+                EventLog::getInstance().message(
+                    LOG_WARN, string("Cannot write snapshot ") + imagePath + ".");
+                return false;
+            }
+            return true;
+        });
+#else
+        return false;
+#endif
+    }
+
+    // Warm restart from dir: maps the last snapshot, replays the journal on
+    // top, re-pools the available drivers and resumes journaling. Must run
+    // before any driver registers. riderFor maps saved rider ids to live
+    // riders; rides of unknown riders get a stub Rider. Restored drivers are
+    // owned by the service (see findDriver); removed ones are only kept while
+    // a restored ride has them. Returns the number of drivers back in the
+    // registry.
+    size_t restoreState(const string& dir, function<Rider*(int)> riderFor = nullptr) {
+        if (driversRegistered) {
+            EventLog::getInstance().message(
+                LOG_WARN, "State must be restored before drivers register.");
+            return 0;
+        }
+        unordered_map<int, Driver*> drivers;
+        unordered_map<RideId, Ride*> rides;
+        RideId lastRide = 0;
+        int lastUser = 0;
+
+        MappedFile image(dir + "/state.img");
+        if (image.size() >= sizeof(StateImageHeader)) {
+            StateImageHeader header;
+            memcpy(&header, image.data(), sizeof(header));
+            size_t expected = sizeof(header) + header.driverCount * sizeof(DriverImage) +
+                              header.rideCount * sizeof(RideImage);
+            if (header.magic != StateImageHeader::MAGIC || header.version != StateImageHeader::VERSION ||
+                image.size() < expected) {
+                EventLog::getInstance().message(
+                    LOG_WARN, string("Ignoring unreadable snapshot in ") + dir + ".");
+            } else {
+                const char* p = image.data() + sizeof(header);
+                for (uint64_t i = 0; i < header.driverCount; ++i, p += sizeof(DriverImage)) {
+                    DriverImage img;
+                    memcpy(&img, p, sizeof(img));
+                    restoreDriver(img, drivers);
+                }
+                for (uint64_t i = 0; i < header.rideCount; ++i, p += sizeof(RideImage)) {
+                    RideImage img;
+                    memcpy(&img, p, sizeof(img));
+                    restoreRide(img, drivers, rides, riderFor);
+                }
+                lastRide = header.lastRideId;
+                lastUser = header.lastUserId;
+            }
+        }
+
+        // A torn record at the end of the journal is ignored.
+        MappedFile log(dir + "/journal.bin");
+        for (size_t off = 0; off + sizeof(JournalRecord) <= log.size(); off += sizeof(JournalRecord)) {
+            JournalRecord record;
+            memcpy(&record, log.data() + off, sizeof(record));
+            // Status-only ride updates carry an id-only driver image.
+            if (record.driver.id != 0 && record.driver.capacity != 0) {
+                restoreDriver(record.driver, drivers);
+            }
+            switch ((JournalOp)record.op) {
+                case JOURNAL_DRIVER_UPSERT:
+                    break;
+                case JOURNAL_DRIVER_REMOVED: {
+                    auto it = drivers.find(record.driver.id);
+                    if (it != drivers.end()) it->second->setStatus(OFFLINE);
+                    break;
+                }
+                case JOURNAL_RIDE_UPSERT:
+                    restoreRide(record.ride, drivers, rides, riderFor);
+                    break;
+                case JOURNAL_RIDE_FINISHED: {
+                    auto it = rides.find(record.ride.rideId);
+                    if (it != rides.end()) {
+                        ridePool.release(it->second);
+                        rides.erase(it);
+                    }
+                    break;
+                }
+            }
+            lastRide = max(lastRide, record.ride.rideId);
+            lastUser = max(lastUser, max(record.driver.id, record.ride.riderId));
+        }
+
+        // Re-pool; inserting rebuilds the spatial index and zone counters.
+        size_t registered = 0;
+        for (const auto& entry : drivers) {
+            Driver* driver = entry.second;
+            // A removed driver may still be on a restored ride, which
+            // releases it through its home shard.
+            driver->setHomeShard(shardFor(driver->getCurrentLocation()));
+            if (driver->getStatus() == OFFLINE) continue;
+            driversRegistered = true;
+            ++registered;
+            {
+                unique_lock<shared_mutex> guard(registryLock);
+                driversById[driver->getId()] = driver;
+            }
+            if (driver->getStatus() == AVAILABLE) {
+                lock_guard<mutex> guard(shards[driver->getHomeShard()]->lock);
+                shards[driver->getHomeShard()]->availableDrivers.add(driver);
+            }
+        }
+        unordered_set<const Driver*> onRides;
+        for (const auto& entry : rides) {
+            RideStripe& stripe = stripeFor(entry.first);
+            lock_guard<mutex> guard(stripe.lock);
+            stripe.rides.insert(entry.first, entry.second);
+            entry.second->getRider()->addRideToHistory(entry.first);
+            onRides.insert(entry.second->getDriver());
+        }
+        // Removed drivers no ride still points at are not kept.
+        unordered_set<const Vehicle*> unused;
+        restoredDrivers.erase(
+            remove_if(restoredDrivers.begin(), restoredDrivers.end(),
+                      [&](const unique_ptr<Driver>& d) {
+                          if (d->getStatus() != OFFLINE || onRides.count(d.get())) return false;
+                          unused.insert(d->getVehicle());
+                          return true;
+                      }),
+            restoredDrivers.end());
+        restoredVehicles.erase(
+            remove_if(restoredVehicles.begin(), restoredVehicles.end(),
+                      [&](const unique_ptr<Vehicle>& v) { return unused.count(v.get()) > 0; }),
+            restoredVehicles.end());
+        RideFactory::reserveIdsThrough(lastRide);
+        User::reserveIdsThrough(lastUser);
+
+        enablePersistence(dir, journalSync);
+        return registered;
+    }
+
+    // The driver requestRide would most likely get and the strategy's rank
+    // for it (lower is better), without claiming anyone. The request may
+    // have no rider. Lets a cluster compare nodes near a zone edge.
+    Driver* bestCandidate(const RideRequest& request, double* rank) {
+        shared_lock<shared_mutex> guard(strategyLock);
+        vector<pair<double, Driver*>> ranked = rankedCandidates(request, 1);
+        if (ranked.empty()) return nullptr;
+        if (rank) *rank = ranked[0].first;
+        return ranked[0].second;
+    }
+
+    // Registered driver by id, or nullptr.
+    Driver* findDriver(int driverId) {
+        shared_lock<shared_mutex> guard(registryLock);
+        auto it = driversById.find(driverId);
+        return it == driversById.end() ? nullptr : it->second;
+    }
+
+    // Finished rides, oldest first, as archived rows.
+    const RideArchive& archive() const { return rideArchive; }
+
+    // Sealed archive blocks are written to dir and memory-mapped.
+    void setArchiveDirectory(const string& dir) { rideArchive.setSpillDirectory(dir); }
+
+    // Streams a rider's finished rides from the archive.
+    template <class Fn> void forEachArchivedRide(const Rider* rider, Fn fn) const {
+        rideArchive.forEachOfRider(rider->getId(), fn);
+    }
+
+    // The archived rows of a rider's last few rides, newest first. Rides
+    // still in flight are not archived yet and are skipped.
+    template <class Fn> void forEachRecentRide(const Rider* rider, Fn fn) const {
+        RideId ids[Rider::RECENT_RIDES];
+        size_t n = rider->recentRideIds(ids);
+        RideArchive::Row row;
+        for (size_t i = 0; i < n; ++i) {
+            if (rideArchive.findRide(ids[i], row)) fn(row);
+        }
+    }
+
+    // Gauges read at pull time: available drivers per VehicleType and the
+    // depth of every queue in front of dispatch.
+    struct MetricGauges {
+        size_t availableDrivers[VEHICLE_TYPE_COUNT] = {};
+        size_t ongoingRides = 0;
+        size_t pendingBatchRequests = 0;
+        size_t scheduledRides = 0;
+        size_t noShowDeadlines = 0;
+        size_t bufferedLocationPings = 0;
+        size_t pendingPayments = 0;
+        size_t pendingNotifications = 0;
+        size_t droppedLogRecords = 0;
+    };
+
+    MetricGauges metricGauges() {
+        MetricGauges g;
+        for (auto& shard : shards) {
+            lock_guard<mutex> guard(shard->lock);
+            for (int t = 0; t < VEHICLE_TYPE_COUNT; ++t) {
+                g.availableDrivers[t] += shard->availableDrivers.ofType((VehicleType)t).size();
+            }
+        }
+        for (RideStripe& stripe : rideStripes) {
+            lock_guard<mutex> guard(stripe.lock);
+            g.ongoingRides += stripe.rides.size();
+        }
+        {
+            lock_guard<mutex> guard(batchLock);
+            g.pendingBatchRequests = pendingRequests.size();
+        }
+        {
+            lock_guard<mutex> guard(scheduleLock);
+            g.scheduledRides = scheduledRides.size();
+        }
+        g.noShowDeadlines = pendingTimeoutCount();
+        g.bufferedLocationPings = locationIngestor.buffered();
+        if (payments) g.pendingPayments = payments->pending();
+        if (notifier) g.pendingNotifications = notifier->pending();
+        g.droppedLogRecords = EventLog::getInstance().droppedRecords();
+        return g;
+    }
+
+    // Pull endpoint: every metric in the Prometheus text format, for a
+    // scraper or an admin handler to serve as is. Latencies are in ns.
+    void writeMetrics(ostream& out);
+
+    void printAvailableDrivers() {
+        EventLog::getInstance().flush();
+        cout << "\n--- Available Drivers ---" << endl;
+        for (auto& shard : shards) {
+            lock_guard<mutex> guard(shard->lock);
+            for (int t = 0; t < VEHICLE_TYPE_COUNT; ++t) {
+                for (const auto& d : shard->availableDrivers.ofType((VehicleType)t).drivers) {
+                    cout << *d << endl;
+                }
+            }
+        }
+        cout << "-------------------------" << endl;
+    }
+};
+
+// SyntheticCity
+// Random trips over a made-up city: most points fall in Gaussian hot spots
+// of varying popularity (centres, stations, malls), the rest uniformly over
+// the city square. VehicleTypes follow a fixed mix. Deterministic per seed.
+class SyntheticCity {
+    struct HotSpot {
+        Location centre;
+        double spread;  // degrees, one standard deviation
+    };
+
+    static constexpr double HOT_SPOT_SHARE = 0.8;
+
+    Location centre;
+    double radius;  // degrees, half the side of the city square
+    vector<HotSpot> hotSpots;
+    mt19937_64 rng;
+    discrete_distribution<int> spotPicker;
+    discrete_distribution<int> typePicker;
+
+public:
+    SyntheticCity(const Location& cityCentre, double radiusDeg, int hotSpotCount, uint64_t seed);
+
+    Location samplePoint();
+    VehicleType sampleType() { return (VehicleType)typePicker(rng); }
+    // A vehicle of type with the rate and capacity usual for it.
+    static Vehicle* makeVehicle(VehicleType type, int serial);
+};
+
+// DispatchBenchmark
+// Load generator and micro-benchmarks behind `--bench`. The end-to-end run
+// registers a synthetic city's drivers with the DispatchService and drives
+// requestRide, updateRideStatus and completeRide from several threads,
+// either as fast as possible or paced to a fixed request rate. Paced
+// latencies count from the scheduled send time, so a stall also shows up
+// in the requests queued behind it. The micro-benchmarks time each
+// MatchingStrategy against a DriverPool of the same city and each
+// FareCalculator on one ride.
+// The built-in strategies by command-line name: nearest, haversine,
+// bestrated, scored or batch. nullptr for any other name.
+MatchingStrategy* strategyNamed(const string& name);
+
+struct BenchmarkOptions {
+    int drivers = 20000;
+    int requestsPerSecond = 0;  // 0: unpaced
+    double seconds = 3.0;
+    int threads = 4;
+    int shards = 4;
+    uint64_t seed = 42;
+    string strategy = "nearest";  // for the end-to-end run
+    string tracePath;             // records the end-to-end run when set
+
+    // Parses --drivers, --rps, --seconds, --threads, --shards, --seed,
+    // --strategy and --trace.
+    bool parse(int argc, char** argv);
+};
+
+class DispatchBenchmark {
+    struct Result {
+        string name;
+        LatencyHistogram latency;
+        double seconds;  // wall time the operations ran for, for ops/s
+        // Operations too quick to clock one by one are only timed in total:
+        // latency stays empty and the row reports calls and their mean.
+        uint64_t calls = 0;
+    };
+
+    static const int MICRO_CALLS = 20000 * 64;
+    static const int MICRO_SAMPLES = 20000;
+
+    BenchmarkOptions options;
+    vector<Result> results;
+    uint64_t unmatched;
+    LatencyHistogram candidates;  // drivers scanned per match, end-to-end run
+
+    void runEndToEnd();
+    void runStrategies();
+    void runFares();
+    void runPersistence();
+    template <class Fn> void timeMicro(const string& name, Fn fn);
+    void report(ostream& out) const;
+
+public:
+    explicit DispatchBenchmark(const BenchmarkOptions& opts) : options(opts), unmatched(0) {}
+
+    // Runs everything once against DispatchService::getInstance() and
+    // prints the report. Leaves the drivers registered.
+    void run(ostream& out);
+};
+
+// TraceReplayer
+// Feeds a trace written by DispatchService::startTrace back through a
+// DispatchService, one record at a time in file order, so two runs of the
+// same trace see identical inputs. Drivers, riders and rides are created
+// afresh and mapped from their traced ids. Status changes of rides that
+// were not matched in the replay are skipped. Location pings are applied
+// only at the traced flushes, never by the ingestion window, and drivers
+// become available at the traced times (DispatchService::pinPoolClock).
+// The replayer owns the drivers it registers and must outlive the
+// service's use of them.
+class TraceReplayer {
+public:
+    struct Report {
+        size_t records = 0;
+        size_t skipped = 0;  // referred to a driver or ride the replay does not have
+        uint64_t matched = 0;
+        uint64_t unmatched = 0;
+        uint64_t completed = 0;
+        uint64_t cancelled = 0;
+        double pickupKm = 0.0;  // driver to pickup, straight line, over matched rides
+        double fares = 0.0;     // over completed rides
+        double seconds = 0.0;
+        LatencyHistogram request, status, complete;
+
+        void print(ostream& out) const;
+    };
+
+private:
+    DispatchService& service;
+    vector<unique_ptr<Vehicle>> vehicles;
+    vector<unique_ptr<Driver>> ownedDrivers;
+    unordered_map<int, Driver*> drivers;  // by traced id
+    unordered_map<int, unique_ptr<Rider>> riders;
+    unordered_map<RideId, PinnedRide> rides;  // by traced ride id, until completed
+    vector<LocationPing> pings;
+
+    void apply(const TraceRecord& record, Report& report);
+    Driver* driverFor(int tracedId, Report& report);
+
+public:
+    explicit TraceReplayer(DispatchService& target) : service(target) {}
+
+    // speed 0 replays as fast as possible, 1 in real time, 2 twice as fast.
+    bool replay(const string& path, double speed, Report& report);
+};
+
+// `--replay path [--strategy name] [--speed x] [--shards n]`
+struct ReplayOptions {
+    string path;
+    string strategy = "nearest";
+    double speed = 0.0;
+    int shards = 4;
+
+    bool parse(int argc, char** argv);
+};
+
+// ZoneRing
+// Consistent hashing of map cells onto cluster nodes. Every node puts
+// VIRTUAL_POINTS points on a 64-bit ring and a cell belongs to the node of
+// the first point at or after the cell's hash, so a node joining or
+// leaving only moves the cells next to its own points.
+class ZoneRing {
+public:
+    static const int VIRTUAL_POINTS = 64;
+
+private:
+    vector<pair<uint64_t, int>> points;  // sorted by hash
+
+    static uint64_t mix(uint64_t x) {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+public:
+    void addNode(int node);
+    void removeNode(int node);
+    bool empty() const { return points.empty(); }
+
+    // -1 while the ring is empty.
+    int ownerOf(int cellX, int cellY) const { return ownerAfter(cellX, cellY, -1); }
+    // The first node other than skip walking the ring from the cell: the
+    // node that takes the cell over if skip is lost. -1 if there is none.
+    int ownerAfter(int cellX, int cellY, int skip) const;
+};
+
+// Cluster wire protocol
+// A frame is a message type byte, a varint payload length and the payload.
+// Integers are LEB128 varints, zigzag-encoded when signed. Coordinates,
+// ratings and ranks are doubles in host byte order, as in the snapshot
+// files. Strings are a varint length followed by the bytes. A driver's
+// state takes about 70 bytes, against 160 for a DriverImage.
+enum WireType : uint8_t {
+    WIRE_ACK = 1,
+    WIRE_ERROR,
+    WIRE_DRIVER_STATE,     // driver state; host the driver
+    WIRE_DRIVER_REPLICA,   // driver state; keep it as a passive copy
+    WIRE_DROP_REPLICA,     // driver id
+    WIRE_PROMOTE_REPLICA,  // driver id, location; host the copy
+    WIRE_DRIVER_EXPORT,    // driver id, location; hand the driver over
+    WIRE_DRIVER_SNAPSHOT,  // driver id; answered with its state
+    WIRE_DRIVER_MOVE,      // driver id, location
+    WIRE_DRIVER_RATE,      // driver id, rating
+    WIRE_DRIVER_REMOVE,    // driver id
+    WIRE_CANDIDATE_QUERY,  // type, pickup, drop
+    WIRE_CANDIDATE_REPLY,  // found, driver id, rank
+    WIRE_RIDE_REQUEST,     // rider id, name, phone, discount, type, pickup, drop
+    WIRE_RIDE_REPLY,       // ride id, status, driver id
+    WIRE_RIDE_STATUS,      // ride id, status
+    WIRE_RIDE_COMPLETE,    // ride id; acked with the driver id
+    WIRE_RIDE_CANCEL       // ride id, CancelReason; acked with the driver id
+};
+
+class WireWriter {
+    WireType type;
+    vector<uint8_t> payload;
+
+public:
+    explicit WireWriter(WireType t) : type(t) {}
+
+    WireWriter& varint(uint64_t v) {
+        while (v >= 0x80) {
+            payload.push_back((uint8_t)(v | 0x80));
+            v >>= 7;
+        }
+        payload.push_back((uint8_t)v);
+        return *this;
+    }
+    WireWriter& signedVarint(int64_t v) {
+        return varint(((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+    }
+    WireWriter& real(double v) {
+        uint8_t bytes[sizeof(double)];
+        memcpy(bytes, &v, sizeof(v));
+        payload.insert(payload.end(), bytes, bytes + sizeof(bytes));
+        return *this;
+    }
+    WireWriter& text(string_view s) {
+        varint(s.size());
+        payload.insert(payload.end(), s.begin(), s.end());
+        return *this;
+    }
+    WireWriter& location(const Location& loc) { return real(loc.latitude).real(loc.longitude); }
+
+    vector<uint8_t> frame() const;
+};
+
+// Reads a frame back. A truncated or malformed frame clears ok() and the
+// remaining reads return zeros.
+class WireReader {
+    const uint8_t* pos;
+    const uint8_t* end;
+    WireType type;
+    bool valid;
+
+public:
+    explicit WireReader(const vector<uint8_t>& frame);
+    // The reader points into the frame, which must outlive it.
+    explicit WireReader(const vector<uint8_t>&& frame) = delete;
+
+    // WIRE_ERROR for a malformed frame.
+    WireType messageType() const { return valid ? type : WIRE_ERROR; }
+    bool ok() const { return valid; }
+
+    uint64_t varint();
+    int64_t signedVarint() {
+        uint64_t v = varint();
+        return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+    }
+    double real();
+    string text();
+    Location location() {
+        double lat = real();
+        return Location(lat, real());
+    }
+};
+
+// A driver as it travels between nodes.
+struct WireDriverState {
+    int id;
+    VehicleType type;
+    int capacity;
+    double farePerKm;
+    double rating;
+    Location location;
+    string name;
+    string phone;
+    string plate;
+};
+
+WireType frameType(const vector<uint8_t>& frame) { return WireReader(frame).messageType(); }
+
+void writeDriverState(WireWriter& out, const Driver* driver, const Location& loc);
+bool readDriverState(WireReader& in, WireDriverState& state);
+
+// ClusterTransport
+// Delivers a frame to a node and returns the node's reply. An empty reply
+// means the node could not be reached.
+class ClusterTransport {
+public:
+    virtual ~ClusterTransport() {}
+    virtual vector<uint8_t> call(int node, const vector<uint8_t>& frame) = 0;
+};
+
+class ClusterNode;
+
+// Hands frames straight to node objects in this process. Detaching a node
+// makes it unreachable, as if its machine were lost; it waits for calls
+// already in flight to that node.
+class LocalTransport : public ClusterTransport {
+    shared_mutex lock;
+    unordered_map<int, ClusterNode*> nodes;
+    atomic<uint64_t> frames;
+    atomic<uint64_t> bytes;
+
+public:
+    LocalTransport() : frames(0), bytes(0) {}
+
+    void attach(int id, ClusterNode* node) {
+        unique_lock<shared_mutex> guard(lock);
+        nodes[id] = node;
+    }
+    void detach(int id) {
+        unique_lock<shared_mutex> guard(lock);
+        nodes.erase(id);
+    }
+
+    vector<uint8_t> call(int node, const vector<uint8_t>& frame) override;
+
+    // Frames and bytes sent, replies included.
+    uint64_t framesSent() const { return frames.load(memory_order_relaxed); }
+    uint64_t bytesSent() const { return bytes.load(memory_order_relaxed); }
+};
+
+// ClusterNode
+// One member of a DispatchCluster. It runs a DispatchService of its own
+// for the drivers it hosts and keeps passive copies of drivers hosted by
+// other nodes, to take them over if their host is lost. Everything
+// reaches it as frames through handle().
+class ClusterNode {
+    struct HostedDriver {
+        unique_ptr<Vehicle> vehicle;
+        unique_ptr<Driver> driver;
+        bool hosted;
+    };
+
+    int nodeId;
+    DispatchService service;
+
+    // Guards drivers, riders, replicas and rideDrivers. A driver handed
+    // to another node keeps its object here: pool snapshots may still
+    // point at it. The object is reused if the driver comes back.
+    mutex lock;
+    unordered_map<int, HostedDriver> drivers;
+    unordered_map<int, unique_ptr<Rider>> riders;
+    unordered_map<int, vector<uint8_t>> replicas;  // driver id -> replica frame
+    unordered_map<RideId, int> rideDrivers;        // ongoing ride -> driver id
+
+    // Caller holds lock.
+    Driver* hostedDriver(int driverId);
+    void host(const WireDriverState& state);
+
+    vector<uint8_t> exportDriver(WireReader& in);
+    vector<uint8_t> requestRide(WireReader& in);
+    vector<uint8_t> completeRide(WireReader& in);
+    vector<uint8_t> cancelRide(WireReader& in);
+
+    static vector<uint8_t> ack() { return WireWriter(WIRE_ACK).frame(); }
+    static vector<uint8_t> error() { return WireWriter(WIRE_ERROR).frame(); }
+
+public:
+    explicit ClusterNode(int id) : nodeId(id) {}
+    ClusterNode(const ClusterNode&) = delete;
+    ClusterNode& operator=(const ClusterNode&) = delete;
+
+    int getId() const { return nodeId; }
+    // The node's own service, e.g. to set its strategy or sharding before
+    // drivers arrive.
+    DispatchService& dispatch() { return service; }
+
+    vector<uint8_t> handle(const vector<uint8_t>& frame);
+
+    size_t hostedDriverCount();
+    size_t replicaCount() {
+        lock_guard<mutex> guard(lock);
+        return replicas.size();
+    }
+};
+
+// DispatchCluster
+// Front door of a multi-node deployment. The map is cut into cells of
+// zoneCellDeg and a ZoneRing spreads the cells over the nodes. A driver is
+// hosted by the owner of its current cell. The next node on the ring keeps
+// a copy of it. A request goes to the node that owns the pickup cell. If
+// the pickup is within borderMargin of a cell owned by another node, every
+// such node is asked for its best candidate and the request goes to the
+// node whose candidate ranks first. The cluster itself only keeps a
+// directory of where drivers and ongoing rides live.
+//
+// Calls about one driver are assumed to be serialized by that driver's
+// session, as a Rider's are; different drivers and riders may call from
+// any thread. Adding and losing nodes excludes all other calls.
+class DispatchCluster {
+public:
+    struct RideHandle {
+        // The node's own id with the node in the top bits, since every
+        // node numbers its rides on its own. 0 if no node was reachable.
+        RideId rideId;
+        RideStatus status;
+        int driverId;  // 0 if none was assigned
+        int node;
+    };
+
+    struct Stats {
+        size_t nodes;
+        size_t drivers;
+        size_t ongoingRides;
+        uint64_t migrations;
+        uint64_t crossNodeQueries;
+        uint64_t promotedDrivers;
+        uint64_t lostDrivers;
+        uint64_t lostRides;
+        uint64_t frames;
+        uint64_t bytes;
+    };
+
+private:
+    struct DriverEntry {
+        int node;
+        int replica;  // -1 while the driver has no copy
+        Location location;
+    };
+
+    static const size_t DRIVER_STRIPES = 64;
+    static const int RIDE_NODE_SHIFT = 48;
+    static const RideId LOCAL_RIDE_MASK = ((RideId)1 << RIDE_NODE_SHIFT) - 1;
+
+    static RideId clusterRideId(int node, RideId local) {
+        return ((RideId)node << RIDE_NODE_SHIFT) | local;
+    }
+    static RideId localRideId(RideId rideId) { return rideId & LOCAL_RIDE_MASK; }
+
+    double zoneCellSize;
+    double borderMargin;
+
+    // Shared by every call, exclusive while a node joins or is lost.
+    shared_mutex topologyLock;
+    ZoneRing ring;
+    // By id. Lost nodes stay allocated since late replies may still be
+    // unwinding through them.
+    vector<unique_ptr<ClusterNode>> nodes;
+    vector<bool> nodeUp;
+    LocalTransport transport;
+
+    mutex directoryLock;
+    unordered_map<int, DriverEntry> drivers;
+    unordered_map<RideId, int> rides;  // ongoing ride, by cluster id -> node
+    // Serializes migration of one driver between its own calls and the
+    // hand-back after its ride completes.
+    mutex driverStripes[DRIVER_STRIPES];
+
+    atomic<uint64_t> migrations;
+    atomic<uint64_t> crossNodeQueries;
+    atomic<uint64_t> promotedDrivers;
+    atomic<uint64_t> lostDrivers;
+    atomic<uint64_t> lostRides;
+
+    int cellX(const Location& loc) const { return (int)std::floor(loc.latitude / zoneCellSize); }
+    int cellY(const Location& loc) const { return (int)std::floor(loc.longitude / zoneCellSize); }
+    int ownerOf(const Location& loc) const { return ring.ownerOf(cellX(loc), cellY(loc)); }
+    vector<int> nodesNear(const Location& loc) const;
+
+    bool lookup(int driverId, DriverEntry& entry) {
+        lock_guard<mutex> guard(directoryLock);
+        auto it = drivers.find(driverId);
+        if (it == drivers.end()) return false;
+        entry = it->second;
+        return true;
+    }
+    void store(int driverId, const DriverEntry& entry) {
+        lock_guard<mutex> guard(directoryLock);
+        drivers[driverId] = entry;
+    }
+
+    // Callers hold topologyLock and the driver's stripe, or topologyLock
+    // exclusively.
+    void migrate(int driverId, DriverEntry& entry, int target);
+    void replicate(int driverId, DriverEntry& entry);
+    void rehome(int driverId);
+    // Caller holds topologyLock exclusively.
+    void rebalance();
+
+public:
+    explicit DispatchCluster(double zoneCellDeg = 0.05, double borderMarginDeg = 0.005)
+        : zoneCellSize(zoneCellDeg), borderMargin(borderMarginDeg), migrations(0),
+          crossNodeQueries(0), promotedDrivers(0), lostDrivers(0), lostRides(0) {}
+    DispatchCluster(const DispatchCluster&) = delete;
+    DispatchCluster& operator=(const DispatchCluster&) = delete;
+
+    // Starts a node and moves the cells it now owns onto it. Returns its id.
+    int addNode();
+    // Drops a node as if its machine were lost. Its cells go to the next
+    // nodes on the ring, its drivers come back there from their copies
+    // as AVAILABLE, and the rides it was running are lost.
+    bool failNode(int nodeId);
+    ClusterNode* node(int nodeId) {
+        return nodeId >= 0 && nodeId < (int)nodes.size() ? nodes[nodeId].get() : nullptr;
+    }
+
+    // The driver object is only read: the host builds its own copy with
+    // the same id.
+    bool registerDriver(const Driver* driver);
+    void deregisterDriver(int driverId);
+    void moveDriver(int driverId, const Location& loc);
+    void rateDriver(int driverId, double rating);
+
+    RideHandle requestRide(const Rider* rider, const Location& pickup, const Location& drop,
+                           VehicleType type);
+    void updateRideStatus(RideId rideId, RideStatus status);
+    void completeRide(RideId rideId);
+    bool cancelRide(RideId rideId, CancelReason reason);
+
+    // -1 if the driver is not in the cluster.
+    int nodeOfDriver(int driverId) {
+        DriverEntry entry;
+        return lookup(driverId, entry) ? entry.node : -1;
+    }
+    Stats stats();
+};
+
+// Implementation Details
+double Location::haversineKm(const Location& other) const {
+    double sinLat = std::sin((other.latitude - latitude) * DEG_TO_RAD * 0.5);
+    double sinLon = std::sin((other.longitude - longitude) * DEG_TO_RAD * 0.5);
+    double a = sinLat * sinLat +
+               std::cos(latitude * DEG_TO_RAD) * std::cos(other.latitude * DEG_TO_RAD) *
+               sinLon * sinLon;
+    return 2.0 * EARTH_RADIUS_KM * std::asin(std::sqrt(min(1.0, a)));
+}
+
+PinnedRide Rider::requestRide(const Location& pickup, const Location& drop, VehicleType type) {
+    return DispatchService::getInstance().requestRide(this, pickup, drop, type);
+}
+
+void Driver::updateLocation(const Location& loc) {
+    DispatchService::getInstance().moveDriver(this, loc);
+}
+
+void Driver::setRating(double r) {
+    DispatchService::getInstance().rateDriver(this, r);
+}
+void RiderNotificationService::onRideStatusChanged(Ride* ride, RideStatus newStatus) {
+    EventLog::getInstance().record(LOG_INFO, EV_RIDER_NOTIFIED, ride->getId(), 0,
+                                   ride->getRider()->getId(), 0.0, newStatus);
+}
+
+void DriverNotificationService::onRideStatusChanged(Ride* ride, RideStatus newStatus) {
+    if (ride->getDriver()) {
+        EventLog::getInstance().record(LOG_INFO, EV_DRIVER_NOTIFIED, ride->getId(),
+                                       ride->getDriver()->getId(), 0, 0.0, newStatus);
+    }
+}
+
+double BaseFareCalculator::calculate(Ride* ride) const {
+    double distance = ride->getDistanceKm();
+    double perKmRate = ride->getDriver()->getVehicle()->getFarePerKm();
+    return BASE_FARE + (distance * perKmRate);
+}
+
+double FareEngine::calculate(const Ride* ride) const {
+    const Rider* rider = ride->getRider();
+    return calculate(ride->getDistanceKm(),
+                     ride->getDriver()->getVehicle()->getFarePerKm(),
+                     rider->hasDiscount() ? rider->getDiscountAmount() : 0.0);
+}
+
+#if defined(DISPATCH_X86_AVX)
+static bool cpuHasAvx() {
+    static const bool has = [] {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx") != 0;
+    }();
+    return has;
+}
+
+// Fares for the leading multiple of four; returns how many were written.
+__attribute__((target("avx"))) static size_t fareBatchAvx(
+    const double* distance, const double* rate, const double* multiplier,
+    const double* discount, size_t n, double* out) {
+    const __m256d base = _mm256_set1_pd(BaseFareCalculator::BASE_FARE);
+    const __m256d zero = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d fare = _mm256_add_pd(base, _mm256_mul_pd(_mm256_loadu_pd(distance + i),
+                                                         _mm256_loadu_pd(rate + i)));
+        fare = _mm256_mul_pd(fare, _mm256_loadu_pd(multiplier + i));
+        fare = _mm256_sub_pd(fare, _mm256_loadu_pd(discount + i));
+        // (fare < 0.0 ? 0.0 : fare), including its NaN behaviour
+        fare = _mm256_blendv_pd(fare, zero, _mm256_cmp_pd(fare, zero, _CMP_LT_OQ));
+        _mm256_storeu_pd(out + i, fare);
+    }
+    return i;
+}
+#endif
+
+void FareEngine::calculateBatch(const FareQuoteBatch& batch, double* out) {
+    const size_t n = batch.size();
+    const double* distance = batch.distanceKm.data();
+    const double* rate = batch.farePerKm.data();
+    const double* multiplier = batch.surgeMultiplier.data();
+    const double* discount = batch.discount.data();
+    size_t i = 0;
+
+#if defined(DISPATCH_X86_AVX)
+    if (cpuHasAvx()) i = fareBatchAvx(distance, rate, multiplier, discount, n, out);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float64x2_t base = vdupq_n_f64(BaseFareCalculator::BASE_FARE);
+    const float64x2_t zero = vdupq_n_f64(0.0);
+    for (; i + 2 <= n; i += 2) {
+        float64x2_t fare = vaddq_f64(base, vmulq_f64(vld1q_f64(distance + i),
+                                                     vld1q_f64(rate + i)));
+        fare = vmulq_f64(fare, vld1q_f64(multiplier + i));
+        fare = vsubq_f64(fare, vld1q_f64(discount + i));
+        fare = vbslq_f64(vcltq_f64(fare, zero), zero, fare);
+        vst1q_f64(out + i, fare);
+    }
+#endif
+
+    for (; i < n; ++i) {
+        FareInputs in{distance[i], rate[i], multiplier[i], discount[i]};
+        out[i] = SurgeDiscountFarePipeline::calculate(in);
+    }
+}
+
+// FareQuoteCache
+FareQuoteCache::FareQuoteCache(size_t entries, double cellSizeDeg)
+    : cellSize(cellSizeDeg), hits(0), misses(0) {
+    size_t size = STRIPES;
+    while (size < entries) size <<= 1;
+    slots.assign(size, Slot{0, 0, 0, false, Quote{}});
+    mask = size - 1;
+}
+
+bool FareQuoteCache::find(long long from, long long to, uint64_t version, Quote& out) {
+    size_t i = slotFor(from, to);
+    {
+        lock_guard<mutex> guard(stripes[i % STRIPES]);
+        const Slot& slot = slots[i];
+        if (slot.used && slot.version == version && slot.from == from && slot.to == to) {
+            out = slot.quote;
+            hits.fetch_add(1, memory_order_relaxed);
+            return true;
+        }
+    }
+    misses.fetch_add(1, memory_order_relaxed);
+    return false;
+}
+
+void FareQuoteCache::put(long long from, long long to, uint64_t version, const Quote& quote) {
+    size_t i = slotFor(from, to);
+    lock_guard<mutex> guard(stripes[i % STRIPES]);
+    slots[i] = Slot{from, to, version, true, quote};
+}
+
+double SurgePricingDecorator::calculate(Ride* ride) const {
+    double baseFare = wrappedCalculator->calculate(ride);
+    return baseFare * surgeMultiplier;
+}
+
+double DiscountDecorator::calculate(Ride* ride) const {
+    double fareBeforeDiscount = wrappedCalculator->calculate(ride);
+    double finalFare = fareBeforeDiscount - discountAmount;
+    return (finalFare < 0.0 ? 0.0 : finalFare);
+}
+
+bool DummyPaymentProcessor::processPayment(Ride* ride, double amount) {
+    EventLog::getInstance().record(LOG_INFO, EV_PAYMENT_PROCESSING, ride->getId(), 0,
+                                   ride->getRider()->getId(), amount);
+    return true;
+}
+
+// DriverStateStore
+int DriverStateStore::append(Driver* driver, CellKey key, double since, double score) {
+    Location loc = driver->getCurrentLocation();
+    latitude.push_back(loc.latitude);
+    longitude.push_back(loc.longitude);
+    status.push_back(driver->getStatus());
+    rating.push_back(driver->getRating());
+    farePerKm.push_back(driver->getVehicle()->getFarePerKm());
+    availableSince.push_back(since);
+    staticScore.push_back(score);
+    cell.push_back(key);
+    drivers.push_back(driver);
+    return (int)drivers.size() - 1;
+}
+
+int DriverStateStore::appendRow(const DriverStateStore& other, int slot) {
+    latitude.push_back(other.latitude[slot]);
+    longitude.push_back(other.longitude[slot]);
+    status.push_back(other.status[slot]);
+    rating.push_back(other.rating[slot]);
+    farePerKm.push_back(other.farePerKm[slot]);
+    availableSince.push_back(other.availableSince[slot]);
+    staticScore.push_back(other.staticScore[slot]);
+    cell.push_back(other.cell[slot]);
+    drivers.push_back(other.drivers[slot]);
+    return (int)drivers.size() - 1;
+}
+
+void DriverStateStore::moveSlot(int from, int to) {
+    latitude[to] = latitude[from];
+    longitude[to] = longitude[from];
+    status[to] = status[from];
+    rating[to] = rating[from];
+    farePerKm[to] = farePerKm[from];
+    availableSince[to] = availableSince[from];
+    staticScore[to] = staticScore[from];
+    cell[to] = cell[from];
+    drivers[to] = drivers[from];
+}
+
+void DriverStateStore::popBack() {
+    latitude.pop_back();
+    longitude.pop_back();
+    status.pop_back();
+    rating.pop_back();
+    farePerKm.pop_back();
+    availableSince.pop_back();
+    staticScore.pop_back();
+    cell.pop_back();
+    drivers.pop_back();
+}
+
+// SpatialDriverIndex
+void SpatialDriverIndex::growBounds(VehicleType type, int x, int y) {
+    CellBounds& b = bounds[type];
+    if (b.empty) {
+        b.minX = b.maxX = x;
+        b.minY = b.maxY = y;
+        b.empty = false;
+        return;
+    }
+    b.minX = min(b.minX, x);
+    b.maxX = max(b.maxX, x);
+    b.minY = min(b.minY, y);
+    b.maxY = max(b.maxY, y);
+}
+
+void SpatialDriverIndex::insert(VehicleType type, CellKey key, int slot) {
+    cells[type][key].push_back(slot);
+    growBounds(type, keyX(key), keyY(key));
+}
+
+void SpatialDriverIndex::erase(VehicleType type, CellKey key, int slot) {
+    auto it = cells[type].find(key);
+    if (it == cells[type].end()) return;
+    vector<int>& bucket = it->second;
+    auto pos = find(bucket.begin(), bucket.end(), slot);
+    if (pos != bucket.end()) {
+        *pos = bucket.back();
+        bucket.pop_back();
+    }
+    if (bucket.empty()) cells[type].erase(it);
+}
+
+void SpatialDriverIndex::renumber(VehicleType type, CellKey key, int oldSlot, int newSlot) {
+    auto it = cells[type].find(key);
+    if (it == cells[type].end()) return;
+    replace(it->second.begin(), it->second.end(), oldSlot, newSlot);
+}
+
+vector<int> SpatialDriverIndex::kNearest(VehicleType type, const DriverStateStore& store,
+                                         const Location& loc, double radius, size_t k) const {
+    vector<int> result;
+    const CellBounds& b = bounds[type];
+    if (k == 0 || b.empty) return result;
+
+    int qx = cellCoord(loc.latitude);
+    int qy = cellCoord(loc.longitude);
+
+    // Never walk past the outermost cell that has ever held a driver.
+    int extent = max(max(qx - b.minX, b.maxX - qx), max(qy - b.minY, b.maxY - qy));
+    int maxRing = extent;
+    if (radius < numeric_limits<double>::infinity()) {
+        maxRing = min(maxRing, (int)std::ceil(radius / cellSize));
+    }
+    double radiusSq = radius * radius;
+
+    // Each ring's candidates are gathered into one block for the kernel.
+    static thread_local vector<int> blockSlots;
+    static thread_local vector<double> blockLat, blockLon, blockKeys;
+
+    // Max-heap on squared distance holding the best k seen so far.
+    vector<pair<double, int>> heap;
+    for (int ring = 0; ring <= maxRing; ++ring) {
+        // Every point in ring r is at least (r - 1) cells away from loc.
+        if (heap.size() == k && ring > 0) {
+            double gap = (ring - 1) * cellSize;
+            if (gap * gap > heap.front().first) break;
+        }
+
+        blockSlots.clear();
+        blockLat.clear();
+        blockLon.clear();
+        forEachRingCell(type, qx, qy, ring, [&](const vector<int>& bucket) {
+            for (int slot : bucket) {
+                blockSlots.push_back(slot);
+                blockLat.push_back(store.latitude[slot]);
+                blockLon.push_back(store.longitude[slot]);
+            }
+        });
+        if (blockSlots.empty()) continue;
+        DispatchMetrics::countCandidates(blockSlots.size());
+
+        blockKeys.resize(blockSlots.size());
+        CandidateKernel::squaredDistances(blockLat.data(), blockLon.data(),
+                                          blockSlots.size(), loc, blockKeys.data());
+        for (size_t i = 0; i < blockSlots.size(); ++i) {
+            double key = blockKeys[i];
+            if (key > radiusSq) continue;
+            if (heap.size() < k) {
+                heap.emplace_back(key, blockSlots[i]);
+                push_heap(heap.begin(), heap.end());
+            } else if (key < heap.front().first) {
+                pop_heap(heap.begin(), heap.end());
+                heap.back() = make_pair(key, blockSlots[i]);
+                push_heap(heap.begin(), heap.end());
+            }
+        }
+    }
+
+    sort_heap(heap.begin(), heap.end());
+    for (const auto& entry : heap) result.push_back(entry.second);
+    return result;
+}
+
+vector<int> SpatialDriverIndex::kBestScored(VehicleType type, const DriverStateStore& store,
+                                            const Location& loc, double radius,
+                                            double distanceWeight, double scoreBound,
+                                            size_t k) const {
+    ScoredTopK best(k);
+    const CellBounds& b = bounds[type];
+    if (k == 0 || b.empty) return best.slots();
+
+    int qx = cellCoord(loc.latitude);
+    int qy = cellCoord(loc.longitude);
+    int extent = max(max(qx - b.minX, b.maxX - qx), max(qy - b.minY, b.maxY - qy));
+    int maxRing = extent;
+    if (radius < numeric_limits<double>::infinity()) {
+        maxRing = min(maxRing, (int)std::ceil(radius / cellSize));
+    }
+    double radiusSq = radius * radius;
+
+    for (int ring = 0; ring <= maxRing; ++ring) {
+        // Nothing in ring r scores above scoreBound minus the distance
+        // term at (r - 1) cells.
+        if (best.full() && ring > 0 &&
+            best.worst() >= scoreBound - distanceWeight * (ring - 1) * cellSize) {
+            break;
+        }
+        forEachRingCell(type, qx, qy, ring, [&](const vector<int>& bucket) {
+            DispatchMetrics::countCandidates(bucket.size());
+            for (int slot : bucket) {
+                // The distance term only lowers the score.
+                if (best.full() && store.staticScore[slot] <= best.worst()) continue;
+                double ddx = store.latitude[slot] - loc.latitude;
+                double ddy = store.longitude[slot] - loc.longitude;
+                double distSq = ddx * ddx + ddy * ddy;
+                if (distSq > radiusSq) continue;
+                best.offer(store.staticScore[slot] - distanceWeight * std::sqrt(distSq), slot);
+            }
+        });
+    }
+    return best.slots();
+}
+
+// CandidateKernel
+#if defined(DISPATCH_X86_AVX)
+__attribute__((target("avx"))) static size_t squaredDistancesAvx(
+    const double* lat, const double* lon, size_t n, const Location& q, double* out) {
+    const __m256d qlat = _mm256_set1_pd(q.latitude);
+    const __m256d qlon = _mm256_set1_pd(q.longitude);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(lat + i), qlat);
+        __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(lon + i), qlon);
+        _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)));
+    }
+    return i;
+}
+#endif
+
+void CandidateKernel::squaredDistances(const double* lat, const double* lon, size_t n,
+                                       const Location& q, double* out) {
+    size_t i = 0;
+#if defined(DISPATCH_X86_AVX)
+    if (cpuHasAvx()) i = squaredDistancesAvx(lat, lon, n, q, out);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float64x2_t qlat = vdupq_n_f64(q.latitude);
+    const float64x2_t qlon = vdupq_n_f64(q.longitude);
+    for (; i + 2 <= n; i += 2) {
+        float64x2_t dx = vsubq_f64(vld1q_f64(lat + i), qlat);
+        float64x2_t dy = vsubq_f64(vld1q_f64(lon + i), qlon);
+        vst1q_f64(out + i, vaddq_f64(vmulq_f64(dx, dx), vmulq_f64(dy, dy)));
+    }
+#endif
+    for (; i < n; ++i) {
+        double dx = lat[i] - q.latitude;
+        double dy = lon[i] - q.longitude;
+        out[i] = dx * dx + dy * dy;
+    }
+}
+
+void CandidateKernel::haversineKeys(const double* lat, const double* lon, size_t n,
+                                    const Location& q, double* out) {
+    double cosQ = std::cos(q.latitude * DEG_TO_RAD);
+    for (size_t i = 0; i < n; ++i) {
+        double sinLat = std::sin((lat[i] - q.latitude) * DEG_TO_RAD * 0.5);
+        double sinLon = std::sin((lon[i] - q.longitude) * DEG_TO_RAD * 0.5);
+        out[i] = sinLat * sinLat + std::cos(lat[i] * DEG_TO_RAD) * cosQ * sinLon * sinLon;
+    }
+}
+
+int CandidateKernel::argmin(const double* keys, size_t n) {
+    int best = -1;
+    double bestKey = numeric_limits<double>::infinity();
+    for (size_t i = 0; i < n; ++i) {
+        if (keys[i] < bestKey) {
+            bestKey = keys[i];
+            best = (int)i;
+        }
+    }
+    return best;
+}
+
+vector<int> CandidateKernel::topK(const double* keys, size_t n, size_t k) {
+    vector<pair<double, int>> heap;
+    for (size_t i = 0; i < n && k > 0; ++i) {
+        if (heap.size() < k) {
+            heap.emplace_back(keys[i], (int)i);
+            push_heap(heap.begin(), heap.end());
+        } else if (keys[i] < heap.front().first) {
+            pop_heap(heap.begin(), heap.end());
+            heap.back() = make_pair(keys[i], (int)i);
+            push_heap(heap.begin(), heap.end());
+        }
+    }
+    sort_heap(heap.begin(), heap.end());
+    vector<int> result;
+    for (const auto& entry : heap) result.push_back(entry.second);
+    return result;
+}
+
+// SurgeZoneTracker
+void SurgeZoneTracker::advance(ZoneCounters& zone, int64_t bucket) const {
+    if (bucket <= zone.newestBucket) return;
+    int64_t stale = min<int64_t>(bucket - zone.newestBucket, WINDOW_BUCKETS);
+    for (int64_t b = bucket - stale + 1; b <= bucket; ++b) {
+        int i = (int)(b % WINDOW_BUCKETS);
+        for (int t = 0; t < VEHICLE_TYPE_COUNT; ++t) {
+            zone.demand[t] -= zone.buckets[t][i];
+            zone.buckets[t][i] = 0;
+        }
+    }
+    zone.newestBucket = bucket;
+}
+
+void SurgeZoneTracker::addSupply(VehicleType type, const Location& loc, int delta) {
+    ZoneKey key = zoneFor(loc);
+    Stripe& stripe = stripeFor(key);
+    lock_guard<mutex> guard(stripe.lock);
+    stripe.zones[key].supply[type] += delta;
+}
+
+void SurgeZoneTracker::rideRequested(VehicleType type, const Location& pickup) {
+    ZoneKey key = zoneFor(pickup);
+    int64_t bucket = bucketAt(chrono::steady_clock::now());
+    Stripe& stripe = stripeFor(key);
+    lock_guard<mutex> guard(stripe.lock);
+    ZoneCounters& zone = stripe.zones[key];
+    advance(zone, bucket);
+    ++zone.buckets[type][bucket % WINDOW_BUCKETS];
+    ++zone.demand[type];
+}
+
+double SurgeZoneTracker::multiplierFor(VehicleType type, const Location& pickup) const {
+    ZoneKey key = zoneFor(pickup);
+    int64_t bucket = bucketAt(chrono::steady_clock::now());
+    int demand, supply;
+    {
+        Stripe& stripe = stripeFor(key);
+        lock_guard<mutex> guard(stripe.lock);
+        auto it = stripe.zones.find(key);
+        if (it == stripe.zones.end()) return 1.0;
+        advance(it->second, bucket);
+        demand = it->second.demand[type];
+        supply = it->second.supply[type];
+    }
+    return multiplierFrom(demand, supply);
+}
+
+void SurgeZoneTracker::multipliersFor(const Location& pickup, double* out) const {
+    ZoneKey key = zoneFor(pickup);
+    int64_t bucket = bucketAt(chrono::steady_clock::now());
+    int demand[VEHICLE_TYPE_COUNT], supply[VEHICLE_TYPE_COUNT];
+    {
+        Stripe& stripe = stripeFor(key);
+        lock_guard<mutex> guard(stripe.lock);
+        auto it = stripe.zones.find(key);
+        if (it == stripe.zones.end()) {
+            fill(out, out + VEHICLE_TYPE_COUNT, 1.0);
+            return;
+        }
+        advance(it->second, bucket);
+        copy(it->second.demand, it->second.demand + VEHICLE_TYPE_COUNT, demand);
+        copy(it->second.supply, it->second.supply + VEHICLE_TYPE_COUNT, supply);
+    }
+    for (int t = 0; t < VEHICLE_TYPE_COUNT; ++t) out[t] = multiplierFrom(demand[t], supply[t]);
+}
+
+// DriverPool
+void DriverPool::add(Driver* driver) {
+    if (contains(driver)) return;
+    VehicleType type = driver->getVehicle()->getType();
+    SpatialDriverIndex::CellKey key = index.cellKeyFor(driver->getCurrentLocation());
+    int slot = stores[type].append(driver, key, minutesNow(), 0.0);
+    rescore(type, slot);
+    index.insert(type, key, slot);
+    slots[driver] = Member{type, slot};
+    if (zones) zones->driverAvailable(type, driver->getCurrentLocation());
+    changed(driver);
+}
+
+void DriverPool::remove(Driver* driver) {
+    auto it = slots.find(driver);
+    if (it == slots.end()) return;
+    VehicleType type = it->second.type;
+    DriverStateStore& store = stores[type];
+    int slot = it->second.slot;
+    int last = (int)store.size() - 1;
+    if (zones) zones->driverUnavailable(type, store.locationOf(slot));
+
+    index.erase(type, store.cell[slot], slot);
+    if (slot != last) {
+        index.renumber(type, store.cell[last], last, slot);
+        store.moveSlot(last, slot);
+        slots[store.drivers[slot]].slot = slot;
+    }
+    store.popBack();
+    slots.erase(it);
+    changed(driver);
+}
+
+void DriverPool::relocate(Driver* driver) {
+    int slot = slotOf(driver);
+    if (slot < 0) return;
+    VehicleType type = driver->getVehicle()->getType();
+    DriverStateStore& store = stores[type];
+    Location loc = driver->getCurrentLocation();
+    if (zones) zones->driverMoved(type, store.locationOf(slot), loc);
+    store.latitude[slot] = loc.latitude;
+    store.longitude[slot] = loc.longitude;
+
+    SpatialDriverIndex::CellKey key = index.cellKeyFor(loc);
+    if (key != store.cell[slot]) {
+        index.erase(type, store.cell[slot], slot);
+        index.insert(type, key, slot);
+        store.cell[slot] = key;
+    }
+    changed(driver);
+}
+
+vector<int> DriverPool::nearestSlots(VehicleType type, const Location& loc,
+                                     double radius, size_t k) const {
+    const DriverStateStore& store = stores[type];
+    if (store.size() > LINEAR_SCAN_LIMIT) {
+        return index.kNearest(type, store, loc, radius, k);
+    }
+
+    DispatchMetrics::countCandidates(store.size());
+    double keys[LINEAR_SCAN_LIMIT];
+    CandidateKernel::squaredDistances(store.latitude.data(), store.longitude.data(),
+                                      store.size(), loc, keys);
+    vector<int> result;
+    for (int slot : CandidateKernel::topK(keys, store.size(), k)) {
+        if (keys[slot] <= radius * radius) result.push_back(slot);
+    }
+    return result;
+}
+
+void DriverPool::refresh(Driver* driver) {
+    int slot = slotOf(driver);
+    if (slot < 0) return;
+    VehicleType type = driver->getVehicle()->getType();
+    stores[type].rating[slot] = driver->getRating();
+    rescore(type, slot);
+    changed(driver);
+}
+
+void DriverPool::syncFrom(const DriverPool& live, Driver* driver) {
+    remove(driver);
+    auto it = live.slots.find(driver);
+    if (it == live.slots.end()) return;
+    VehicleType type = it->second.type;
+    int slot = stores[type].appendRow(live.stores[type], it->second.slot);
+    scoreBound[type] = max(scoreBound[type], stores[type].staticScore[slot]);
+    index.insert(type, stores[type].cell[slot], slot);
+    slots[driver] = Member{type, slot};
+}
+
+void DriverPool::setScoreWeights(const ScoreWeights& w) {
+    if (weights == w) return;
+    weights = w;
+    for (int t = 0; t < VEHICLE_TYPE_COUNT; ++t) {
+        scoreBound[t] = -numeric_limits<double>::infinity();
+        for (size_t slot = 0; slot < stores[t].size(); ++slot) rescore((VehicleType)t, (int)slot);
+    }
+    changedAll();
+}
+
+vector<int> DriverPool::bestScoredSlots(VehicleType type, const Location& loc, double radius,
+                                        double distanceWeight, size_t k) const {
+    const DriverStateStore& store = stores[type];
+    if (store.size() > LINEAR_SCAN_LIMIT) {
+        return index.kBestScored(type, store, loc, radius, distanceWeight, scoreBound[type], k);
+    }
+
+    DispatchMetrics::countCandidates(store.size());
+    double keys[LINEAR_SCAN_LIMIT];
+    CandidateKernel::squaredDistances(store.latitude.data(), store.longitude.data(),
+                                      store.size(), loc, keys);
+    ScoredTopK best(k);
+    if (k == 0) return best.slots();
+    for (size_t slot = 0; slot < store.size(); ++slot) {
+        if (keys[slot] > radius * radius) continue;
+        if (best.full() && store.staticScore[slot] <= best.worst()) continue;
+        best.offer(store.staticScore[slot] - distanceWeight * std::sqrt(keys[slot]), (int)slot);
+    }
+    return best.slots();
+}
+
+// DispatchShard
+DispatchShard::DispatchShard()
+    : version(0), snapshotVersion(0), snapshotPublishedAt(0), generation(0),
+      recycled(nullptr), recycledGeneration(0) {
+    availableDrivers.setChangeCounter(&version);
+    availableDrivers.setChangeLog(&changedSince);
+    snapshot = adopt(new DriverPool(), 0);
+}
+
+DispatchShard::~DispatchShard() {
+    snapshot.reset();
+    delete recycled;
+}
+
+shared_ptr<const DriverPool> DispatchShard::adopt(DriverPool* pool, uint64_t gen) {
+    return shared_ptr<const DriverPool>(pool, [this, gen](const DriverPool* done) {
+        recycle(const_cast<DriverPool*>(done), gen);
+    });
+}
+
+void DispatchShard::recycle(DriverPool* pool, uint64_t gen) {
+    lock_guard<mutex> guard(recycleLock);
+    if (recycled && recycledGeneration > gen) {
+        delete pool;
+        return;
+    }
+    delete recycled;
+    recycled = pool;
+    recycledGeneration = gen;
+}
+
+shared_ptr<const DriverPool> DispatchShard::publish(uint64_t atVersion, int64_t now) {
+    uint64_t gen = generation + 1;
+    DriverPool* pool;
+    uint64_t poolGen;
+    {
+        lock_guard<mutex> guard(recycleLock);
+        pool = recycled;
+        poolGen = recycledGeneration;
+        recycled = nullptr;
+    }
+    // The published copy is gen - 1 and still held here, so the newest one
+    // that can have come back is gen - 2, behind by the two logs.
+    bool patch = pool && poolGen + 2 == gen &&
+                 changedSince.size() <= DriverPool::CHANGE_LOG_LIMIT &&
+                 changedBefore.size() <= DriverPool::CHANGE_LOG_LIMIT;
+    if (patch) {
+        vector<Driver*> touched(changedBefore);
+        touched.insert(touched.end(), changedSince.begin(), changedSince.end());
+        sort(touched.begin(), touched.end());
+        touched.erase(unique(touched.begin(), touched.end()), touched.end());
+        for (Driver* driver : touched) pool->syncFrom(availableDrivers, driver);
+    } else {
+        if (pool) {
+            *pool = availableDrivers;
+        } else {
+            pool = new DriverPool(availableDrivers);
+        }
+        pool->setZoneTracker(nullptr);
+        pool->setChangeCounter(nullptr);
+        pool->setChangeLog(nullptr);
+        DispatchMetrics::getInstance().increment(COUNTER_SNAPSHOT_COPIES);
+    }
+    changedBefore.swap(changedSince);
+    changedSince.clear();
+    generation = gen;
+
+    shared_ptr<const DriverPool> snap = adopt(pool, gen);
+    atomic_store(&snapshot, snap);
+    snapshotPublishedAt.store(now, memory_order_relaxed);
+    snapshotVersion.store(atVersion, memory_order_release);
+    return snap;
+}
+
+// RoadNetwork
+int RoadNetwork::addNode(const Location& loc) {
+    int node = (int)nodes.size();
+    nodes.push_back(loc);
+    outArcs.emplace_back();
+    inArcs.emplace_back();
+    snapGrid[snapKey((int)std::floor(loc.latitude / snapCell),
+                     (int)std::floor(loc.longitude / snapCell))].push_back(node);
+    return node;
+}
+
+void RoadNetwork::addRoad(int from, int to, double seconds, double km, bool twoWay) {
+    if (prepared) {
+        EventLog::getInstance().message(LOG_WARN, "Road network is already prepared.");
+        return;
+    }
+    outArcs[from].push_back(Arc{to, seconds, km});
+    inArcs[to].push_back(Arc{from, seconds, km});
+    if (twoWay) {
+        outArcs[to].push_back(Arc{from, seconds, km});
+        inArcs[from].push_back(Arc{to, seconds, km});
+    }
+}
+
+int RoadNetwork::nearestNode(const Location& loc) const {
+    if (nodes.empty()) return -1;
+    int qx = (int)std::floor(loc.latitude / snapCell);
+    int qy = (int)std::floor(loc.longitude / snapCell);
+    int best = -1;
+    double bestSq = numeric_limits<double>::infinity();
+    // A node in ring r is at least (r - 1) cells away. Past every occupied
+    // cell, fall back to a scan.
+    int maxRing = (int)std::sqrt((double)snapGrid.size()) + 2;
+    for (int ring = 0; ring <= maxRing; ++ring) {
+        double gap = (ring - 1) * snapCell;
+        if (best >= 0 && ring > 0 && gap * gap > bestSq) return best;
+        for (int dx = -ring; dx <= ring; ++dx) {
+            for (int dy = -ring; dy <= ring; ++dy) {
+                if (max(abs(dx), abs(dy)) != ring) continue;
+                auto it = snapGrid.find(snapKey(qx + dx, qy + dy));
+                if (it == snapGrid.end()) continue;
+                for (int node : it->second) {
+                    double ddx = nodes[node].latitude - loc.latitude;
+                    double ddy = nodes[node].longitude - loc.longitude;
+                    if (ddx * ddx + ddy * ddy < bestSq) {
+                        bestSq = ddx * ddx + ddy * ddy;
+                        best = node;
+                    }
+                }
+            }
+        }
+    }
+    if (best >= 0) return best;
+    for (size_t node = 0; node < nodes.size(); ++node) {
+        double ddx = nodes[node].latitude - loc.latitude;
+        double ddy = nodes[node].longitude - loc.longitude;
+        if (ddx * ddx + ddy * ddy < bestSq) {
+            bestSq = ddx * ddx + ddy * ddy;
+            best = (int)node;
+        }
+    }
+    return best;
+}
+
+void RoadNetwork::addShortcut(vector<vector<Arc>>& out, vector<vector<Arc>>& in, int from, int to,
+                              double seconds, double km) {
+    for (Arc& a : out[from]) {
+        if (a.to != to) continue;
+        if (seconds < a.seconds) {
+            a.seconds = seconds;
+            a.km = km;
+            for (Arc& b : in[to]) {
+                if (b.to == from) { b.seconds = seconds; b.km = km; }
+            }
+        }
+        return;
+    }
+    out[from].push_back(Arc{to, seconds, km});
+    in[to].push_back(Arc{from, seconds, km});
+}
+
+void RoadNetwork::prepare() {
+    typedef pair<double, int> QueueEntry;
+    size_t n = nodes.size();
+    vector<vector<Arc>> out(outArcs), in(inArcs);
+    vector<bool> contracted(n, false);
+    vector<int> contractedNeighbours(n, 0);
+    vector<int> level(n, 0);  // depth in the hierarchy so far
+    rank.assign(n, 0);
+
+    // Witness search scratch; heap is a min-heap through greater<>.
+    vector<double> dist(n, numeric_limits<double>::infinity());
+    vector<int> touched;
+    vector<QueueEntry> heap;
+
+    // Shortcuts needed to contract v; added to the graph when apply is set.
+    auto contractNode = [&](int v, bool apply) {
+        int shortcuts = 0;
+        for (size_t i = 0; i < in[v].size(); ++i) {
+            Arc into = in[v][i];
+            int u = into.to;
+            if (contracted[u] || u == v) continue;
+            double limit = 0.0;
+            for (const Arc& a : out[v]) {
+                if (!contracted[a.to] && a.to != u) limit = max(limit, into.seconds + a.seconds);
+            }
+            if (limit == 0.0) continue;
+
+            // Bounded Dijkstra from u that avoids v.
+            for (int t : touched) dist[t] = numeric_limits<double>::infinity();
+            touched.clear();
+            heap.clear();
+            dist[u] = 0.0;
+            touched.push_back(u);
+            heap.push_back(QueueEntry(0.0, u));
+            int settled = 0;
+            while (!heap.empty() && settled < WITNESS_SETTLE_LIMIT) {
+                pop_heap(heap.begin(), heap.end(), greater<QueueEntry>());
+                QueueEntry top = heap.back();
+                heap.pop_back();
+                if (top.first > dist[top.second]) continue;
+                if (top.first > limit) break;
+                ++settled;
+                for (const Arc& a : out[top.second]) {
+                    if (contracted[a.to] || a.to == v) continue;
+                    double d = top.first + a.seconds;
+                    if (d < dist[a.to]) {
+                        if (dist[a.to] == numeric_limits<double>::infinity()) touched.push_back(a.to);
+                        dist[a.to] = d;
+                        heap.push_back(QueueEntry(d, a.to));
+                        push_heap(heap.begin(), heap.end(), greater<QueueEntry>());
+                    }
+                }
+            }
+
+            for (size_t j = 0; j < out[v].size(); ++j) {
+                Arc onward = out[v][j];
+                int w = onward.to;
+                if (contracted[w] || w == u) continue;
+                double via = into.seconds + onward.seconds;
+                if (dist[w] <= via) continue;
+                ++shortcuts;
+                if (apply) addShortcut(out, in, u, w, via, into.km + onward.km);
+            }
+        }
+        return shortcuts;
+    };
+    auto priority = [&](int v) {
+        int removed = 0;
+        for (const Arc& a : in[v]) removed += !contracted[a.to];
+        for (const Arc& a : out[v]) removed += !contracted[a.to];
+        return 2 * (contractNode(v, false) - removed) + contractedNeighbours[v] + level[v];
+    };
+
+    upForward.assign(n, vector<Arc>());
+    upBackward.assign(n, vector<Arc>());
+
+    // Lazy updates: a popped node is re-scored and put back if it is no
+    // longer the cheapest.
+    typedef pair<int, int> Candidate;
+    priority_queue<Candidate, vector<Candidate>, greater<Candidate>> order;
+    for (size_t v = 0; v < n; ++v) order.push(Candidate(priority((int)v), (int)v));
+    int next = 0;
+    while (!order.empty()) {
+        Candidate top = order.top();
+        order.pop();
+        int v = top.second;
+        if (contracted[v]) continue;
+        int current = priority(v);
+        if (!order.empty() && current > order.top().first) {
+            order.push(Candidate(current, v));
+            continue;
+        }
+        contractNode(v, true);
+        contracted[v] = true;
+        rank[v] = next++;
+
+        // Every arc v still has leads up the hierarchy. Move them to the
+        // search graphs and out of the working graph, which keeps the
+        // remaining nodes' lists short.
+        auto unlinkFrom = [v](vector<Arc>& arcs) {
+            arcs.erase(remove_if(arcs.begin(), arcs.end(), [v](const Arc& a) { return a.to == v; }),
+                       arcs.end());
+        };
+        for (const Arc& a : out[v]) {
+            if (a.to == v) continue;
+            upForward[v].push_back(a);
+            unlinkFrom(in[a.to]);
+            contractedNeighbours[a.to]++;
+            level[a.to] = max(level[a.to], level[v] + 1);
+        }
+        for (const Arc& a : in[v]) {
+            if (a.to == v) continue;
+            upBackward[v].push_back(a);
+            unlinkFrom(out[a.to]);
+            contractedNeighbours[a.to]++;
+            level[a.to] = max(level[a.to], level[v] + 1);
+        }
+        vector<Arc>().swap(out[v]);
+        vector<Arc>().swap(in[v]);
+    }
+    prepared = true;
+}
+
+void RoadNetwork::upwardSearch(const vector<vector<Arc>>& graph, int source, SearchSpace& space) {
+    typedef pair<double, int> QueueEntry;
+    priority_queue<QueueEntry, vector<QueueEntry>, greater<QueueEntry>> queue;
+    space.set(source, 0.0, 0.0);
+    queue.push(QueueEntry(0.0, source));
+    while (!queue.empty()) {
+        QueueEntry top = queue.top();
+        queue.pop();
+        int v = top.second;
+        if (top.first > space.seconds[v]) continue;
+        for (const Arc& a : graph[v]) {
+            double d = top.first + a.seconds;
+            if (d < space.seconds[a.to]) {
+                space.set(a.to, d, space.km[v] + a.km);
+                queue.push(QueueEntry(d, a.to));
+            }
+        }
+    }
+}
+
+void RoadNetwork::route(int from, int to, double& seconds, double& km) const {
+    seconds = numeric_limits<double>::infinity();
+    km = 0.0;
+    if (!prepared || from < 0 || to < 0) return;
+
+    static thread_local SearchSpace forward, backward;
+    forward.reset(nodes.size());
+    backward.reset(nodes.size());
+    upwardSearch(upForward, from, forward);
+    upwardSearch(upBackward, to, backward);
+    for (int v : forward.touched) {
+        double total = forward.seconds[v] + backward.seconds[v];
+        if (total < seconds) {
+            seconds = total;
+            km = forward.km[v] + backward.km[v];
+        }
+    }
+}
+
+void RoadNetwork::routesTo(const int* sources, size_t n, int target, double maxSeconds,
+                           double* seconds, double* km) const {
+    typedef pair<double, int> QueueEntry;
+    static thread_local SearchSpace space;
+    static thread_local vector<int> wanted;
+    if (wanted.size() != nodes.size()) wanted.assign(nodes.size(), 0);
+    space.reset(nodes.size());
+
+    size_t remaining = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (sources[i] >= 0 && wanted[sources[i]]++ == 0) ++remaining;
+    }
+    if (target >= 0) {
+        priority_queue<QueueEntry, vector<QueueEntry>, greater<QueueEntry>> queue;
+        space.set(target, 0.0, 0.0);
+        queue.push(QueueEntry(0.0, target));
+        while (!queue.empty() && remaining > 0) {
+            QueueEntry top = queue.top();
+            queue.pop();
+            int v = top.second;
+            if (top.first > space.seconds[v]) continue;
+            if (top.first > maxSeconds) break;
+            if (wanted[v]) --remaining;
+            for (const Arc& a : inArcs[v]) {
+                double d = top.first + a.seconds;
+                if (d < space.seconds[a.to]) {
+                    space.set(a.to, d, space.km[v] + a.km);
+                    queue.push(QueueEntry(d, a.to));
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < n; ++i) {
+        bool reached = sources[i] >= 0 && space.seconds[sources[i]] <= maxSeconds;
+        seconds[i] = reached ? space.seconds[sources[i]] : numeric_limits<double>::infinity();
+        km[i] = reached ? space.km[sources[i]] : 0.0;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (sources[i] >= 0) wanted[sources[i]] = 0;
+    }
+}
+
+// EtaCache
+bool EtaCache::find(const Key& key, double& seconds, double& km) {
+    lock_guard<mutex> guard(lock);
+    auto it = index.find(key);
+    if (it == index.end()) {
+        misses.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+    lru.splice(lru.begin(), lru, it->second);
+    seconds = it->second->seconds;
+    km = it->second->km;
+    hits.fetch_add(1, memory_order_relaxed);
+    return true;
+}
+
+void EtaCache::put(const Key& key, double seconds, double km) {
+    lock_guard<mutex> guard(lock);
+    auto it = index.find(key);
+    if (it != index.end()) {
+        it->second->seconds = seconds;
+        it->second->km = km;
+        lru.splice(lru.begin(), lru, it->second);
+        return;
+    }
+    if (index.size() >= capacity) {
+        index.erase(lru.back().key);
+        lru.pop_back();
+    }
+    lru.push_front(Entry{key, seconds, km});
+    index[key] = lru.begin();
+}
+
+// RoadDistanceProvider
+void RoadDistanceProvider::route(const Location& from, const Location& to, double& seconds,
+                                 double& km) {
+    EtaCache::Key key = cache.keyFor(from, to);
+    if (cache.find(key, seconds, km)) return;
+
+    int a = network.nearestNode(from);
+    int b = network.nearestNode(to);
+    network.route(a, b, seconds, km);
+    if (seconds == numeric_limits<double>::infinity()) {
+        km = from.haversineKm(to);
+        return;
+    }
+    seconds += accessSeconds(from, a) + accessSeconds(to, b);
+    km += from.haversineKm(network.nodeLocation(a)) + to.haversineKm(network.nodeLocation(b));
+    cache.put(key, seconds, km);
+}
+
+void RoadDistanceProvider::etasTo(const Location* from, size_t n, const Location& to,
+                                  double* out) {
+    // Cache hits are answered directly; the rest share one search.
+    vector<size_t> misses;
+    vector<int> sources;
+    for (size_t i = 0; i < n; ++i) {
+        double km;
+        if (cache.find(cache.keyFor(from[i], to), out[i], km)) continue;
+        misses.push_back(i);
+        sources.push_back(network.nearestNode(from[i]));
+    }
+    if (misses.empty()) return;
+
+    int target = network.nearestNode(to);
+    vector<double> seconds(misses.size()), km(misses.size());
+    network.routesTo(sources.data(), sources.size(), target, maxSearchSeconds, seconds.data(),
+                     km.data());
+    for (size_t m = 0; m < misses.size(); ++m) {
+        const Location& loc = from[misses[m]];
+        double s = seconds[m], k = km[m];
+        // Unreachable, or beyond the search bound: the source cannot make
+        // it in time, and a later, wider search may still connect it.
+        if (s == numeric_limits<double>::infinity()) {
+            out[misses[m]] = s;
+            continue;
+        }
+        s += accessSeconds(loc, sources[m]) + accessSeconds(to, target);
+        k += loc.haversineKm(network.nodeLocation(sources[m])) +
+             to.haversineKm(network.nodeLocation(target));
+        out[misses[m]] = s;
+        cache.put(cache.keyFor(loc, to), s, k);
+    }
+}
+
+// Matching Strategies
+double MatchingStrategy::rank(const RideRequest& request, const DriverStateStore& store,
+                              int slot) const {
+    return store.distanceTo(slot, request.getPickup());
+}
+
+int NearestDriverStrategy::chooseSlot(
+    const RideRequest& request,
+    const DriverPool& pool) {
+
+    VehicleType type = request.getType();
+    if (metric == EUCLIDEAN_DEGREES) {
+        vector<int> nearest = pool.nearestSlots(type, request.getPickup(), maxPickupRadius, 1);
+        return nearest.empty() ? -1 : nearest.front();
+    }
+    vector<int> best = chooseSlots(request, pool, 1);
+    return best.empty() ? -1 : best.front();
+}
+
+// Within the radius both latitudes are at most |lat| + radius from the
+// equator, so the haversine term is at least cos^2 of that times the
+// squared half-deltas, and sin x >= x (1 - x^2 / 6) bounds the rest.
+double NearestDriverStrategy::minKmPerDegree(const Location& pickup) const {
+    double lat = min(90.0, std::fabs(pickup.latitude) + maxPickupRadius);
+    double half = maxPickupRadius * DEG_TO_RAD * 0.5;
+    return EARTH_RADIUS_KM * DEG_TO_RAD * std::cos(lat * DEG_TO_RAD) *
+           (1.0 - half * half / 6.0);
+}
+
+vector<int> NearestDriverStrategy::chooseSlots(const RideRequest& request,
+                                              const DriverPool& pool, size_t k) {
+    VehicleType type = request.getType();
+    const Location& pickup = request.getPickup();
+    if (metric == EUCLIDEAN_DEGREES || k == 0) {
+        return pool.nearestSlots(type, pickup, maxPickupRadius, k);
+    }
+
+    // Degrees of longitude shrink with latitude, so the Euclidean grid order
+    // is only a prefilter. A driver the grid skipped is at least as far in
+    // degrees as the last candidate; if that cannot be closer by great
+    // circle than the k-th best candidate, the re-rank is exact. Otherwise
+    // every driver within reach of the k-th best is re-ranked.
+    const DriverStateStore& store = pool.ofType(type);
+    size_t want = max(k, HAVERSINE_CANDIDATES);
+    vector<int> slots = pool.nearestSlots(type, pickup, maxPickupRadius, want);
+    if (slots.size() >= want) {
+        vector<double> km(slots.size());
+        for (size_t i = 0; i < slots.size(); ++i) {
+            km[i] = store.locationOf(slots[i]).haversineKm(pickup);
+        }
+        nth_element(km.begin(), km.begin() + (k - 1), km.end());
+        double reach = km[k - 1] / minKmPerDegree(pickup);
+        if (!(reach < store.distanceTo(slots.back(), pickup))) {
+            slots = pool.nearestSlots(type, pickup, min(reach, maxPickupRadius),
+                                      numeric_limits<size_t>::max());
+        }
+    }
+
+    vector<double> lat(slots.size()), lon(slots.size()), keys(slots.size());
+    for (size_t i = 0; i < slots.size(); ++i) {
+        lat[i] = store.latitude[slots[i]];
+        lon[i] = store.longitude[slots[i]];
+    }
+    CandidateKernel::haversineKeys(lat.data(), lon.data(), slots.size(), pickup, keys.data());
+    vector<size_t> order(slots.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    size_t keep = min(k, order.size());
+    partial_sort(order.begin(), order.begin() + keep, order.end(),
+                 [&](size_t a, size_t b) { return keys[a] < keys[b]; });
+    vector<int> result;
+    for (size_t i = 0; i < keep; ++i) result.push_back(slots[order[i]]);
+    return result;
+}
+
+double NearestDriverStrategy::rank(const RideRequest& request, const DriverStateStore& store,
+                                   int slot) const {
+    if (metric == HAVERSINE) {
+        return store.locationOf(slot).haversineKm(request.getPickup());
+    }
+    return MatchingStrategy::rank(request, store, slot);
+}
+
+int BestRatedDriverStrategy::chooseSlot(
+    const RideRequest& request,
+    const DriverPool& pool) {
+
+    const DriverStateStore& store = pool.ofType(request.getType());
+    DispatchMetrics::countCandidates(store.size());
+    int best = -1;
+    double bestRating = -1.0;
+    for (size_t slot = 0; slot < store.size(); ++slot) {
+        if (store.rating[slot] > bestRating) {
+            bestRating = store.rating[slot];
+            best = (int)slot;
+        }
+    }
+    return best;
+}
+
+vector<int> BestRatedDriverStrategy::chooseSlots(const RideRequest& request,
+                                                const DriverPool& pool, size_t k) {
+    const DriverStateStore& store = pool.ofType(request.getType());
+    vector<int> result;
+    if (k == 0) return result;
+    DispatchMetrics::countCandidates(store.size());
+
+    // Min-heap on rating holding the best k seen so far.
+    vector<pair<double, int>> heap;
+    auto worse = [](const pair<double, int>& a, const pair<double, int>& b) {
+        return a.first > b.first;
+    };
+    for (size_t slot = 0; slot < store.size(); ++slot) {
+        if (heap.size() < k) {
+            heap.emplace_back(store.rating[slot], (int)slot);
+            push_heap(heap.begin(), heap.end(), worse);
+        } else if (store.rating[slot] > heap.front().first) {
+            pop_heap(heap.begin(), heap.end(), worse);
+            heap.back() = make_pair(store.rating[slot], (int)slot);
+            push_heap(heap.begin(), heap.end(), worse);
+        }
+    }
+    sort_heap(heap.begin(), heap.end(), worse);
+    for (const auto& entry : heap) result.push_back(entry.second);
+    return result;
+}
+
+double BestRatedDriverStrategy::rank(const RideRequest& /*request*/, const DriverStateStore& store,
+                                     int slot) const {
+    return -store.rating[slot];
+}
+
+// Driver offers
+OfferResult DriverAppOfferChannel::offer(Driver* driver, RideId rideId,
+                                         const RideRequest& /*request*/,
+                                         chrono::milliseconds timeout) {
+    shared_ptr<PendingOffer> open = make_shared<PendingOffer>(rideId);
+    auto deadline = chrono::steady_clock::now() + timeout;
+    unique_lock<mutex> guard(lock);
+    pending[driver->getId()] = open;
+    open->answered.wait_until(guard, deadline, [&] { return open->answer != PENDING; });
+    // Closed under the lock: a later respond() finds no offer.
+    pending.erase(driver->getId());
+    if (open->answer == ACCEPT) return OFFER_ACCEPTED;
+    return open->answer == DECLINE ? OFFER_DECLINED : OFFER_TIMED_OUT;
+}
+
+RideId DriverAppOfferChannel::pendingOfferFor(int driverId) {
+    lock_guard<mutex> guard(lock);
+    auto it = pending.find(driverId);
+    return it == pending.end() ? 0 : it->second->rideId;
+}
+
+bool DriverAppOfferChannel::respond(int driverId, RideId rideId, bool accept) {
+    lock_guard<mutex> guard(lock);
+    auto it = pending.find(driverId);
+    if (it == pending.end() || it->second->rideId != rideId) return false;
+    PendingOffer& open = *it->second;
+    if (open.answer != PENDING) return false;
+    open.answer = accept ? ACCEPT : DECLINE;
+    open.answered.notify_one();
+    return true;
+}
+
+vector<int> EtaDriverStrategy::chooseSlots(const RideRequest& request, const DriverPool& pool,
+                                          size_t k) {
+    const DriverStateStore& store = pool.ofType(request.getType());
+    vector<int> slots = pool.nearestSlots(request.getType(), request.getPickup(), maxPickupRadius,
+                                          max(k, candidates));
+    vector<Location> from;
+    for (int slot : slots) from.push_back(store.locationOf(slot));
+    vector<double> etas(slots.size());
+    provider->etasTo(from.data(), from.size(), request.getPickup(), etas.data());
+
+    // Drivers the roads cannot bring to the pickup are never chosen.
+    vector<size_t> order;
+    for (size_t i = 0; i < slots.size(); ++i) {
+        if (etas[i] != numeric_limits<double>::infinity()) order.push_back(i);
+    }
+    size_t keep = min(k, order.size());
+    partial_sort(order.begin(), order.begin() + keep, order.end(),
+                 [&](size_t a, size_t b) { return etas[a] < etas[b]; });
+    vector<int> result;
+    for (size_t i = 0; i < keep; ++i) result.push_back(slots[order[i]]);
+    return result;
+}
+
+// Hungarian method for a rows x cols cost matrix with rows <= cols.
+// Returns the column assigned to each row.
+vector<int> BatchAssignmentStrategy::solveAssignment(const vector<vector<double>>& cost) {
+    const double INF = numeric_limits<double>::infinity();
+    int n = (int)cost.size();
+    int m = n ? (int)cost[0].size() : 0;
+    vector<double> u(n + 1, 0.0), v(m + 1, 0.0);
+    vector<int> p(m + 1, 0), way(m + 1, 0);
+
+    for (int i = 1; i <= n; ++i) {
+        p[0] = i;
+        int j0 = 0;
+        vector<double> minv(m + 1, INF);
+        vector<bool> used(m + 1, false);
+        do {
+            used[j0] = true;
+            int i0 = p[j0], j1 = 0;
+            double delta = INF;
+            for (int j = 1; j <= m; ++j) {
+                if (used[j]) continue;
+                double cur = cost[i0 - 1][j - 1] - u[i0] - v[j];
+                if (cur < minv[j]) { minv[j] = cur; way[j] = j0; }
+                if (minv[j] < delta) { delta = minv[j]; j1 = j; }
+            }
+            for (int j = 0; j <= m; ++j) {
+                if (used[j]) { u[p[j]] += delta; v[j] -= delta; }
+                else minv[j] -= delta;
+            }
+            j0 = j1;
+        } while (p[j0] != 0);
+        do {
+            int j1 = way[j0];
+            p[j0] = p[j1];
+            j0 = j1;
+        } while (j0);
+    }
+
+    vector<int> assignment(n, -1);
+    for (int j = 1; j <= m; ++j) {
+        if (p[j]) assignment[p[j] - 1] = j - 1;
+    }
+    return assignment;
+}
+
+vector<Driver*> BatchAssignmentStrategy::chooseDrivers(
+    const vector<RideRequest>& requests,
+    const DriverPool& pool) {
+
+    // Leaving a request unmatched must cost more than any real pickup, and
+    // an out-of-radius pair must cost more than leaving it unmatched.
+    const double UNMATCHED = 1e6;
+    const double INFEASIBLE = 1e9;
+
+    vector<Driver*> result(requests.size(), nullptr);
+    for (int t = 0; t < VEHICLE_TYPE_COUNT; ++t) {
+        vector<size_t> rows;
+        for (size_t i = 0; i < requests.size(); ++i) {
+            if (requests[i].getType() == (VehicleType)t) rows.push_back(i);
+        }
+        if (rows.empty()) continue;
+
+        // Candidate columns: union of each request's k nearest drivers.
+        const DriverStateStore& store = pool.ofType((VehicleType)t);
+        vector<int> candidates;
+        unordered_map<int, int> column;
+        for (size_t r : rows) {
+            for (int slot : pool.nearestSlots((VehicleType)t, requests[r].getPickup(),
+                                              maxPickupRadius, candidatesPerRequest)) {
+                if (column.emplace(slot, (int)candidates.size()).second) {
+                    candidates.push_back(slot);
+                }
+            }
+        }
+        if (candidates.empty()) continue;
+
+        // One dummy column per request so every row can stay unmatched.
+        size_t cols = candidates.size() + rows.size();
+        vector<vector<double>> cost(rows.size(), vector<double>(cols, UNMATCHED));
+        for (size_t i = 0; i < rows.size(); ++i) {
+            const Location pickup = requests[rows[i]].getPickup();
+            for (size_t j = 0; j < candidates.size(); ++j) {
+                double dist = store.distanceTo(candidates[j], pickup);
+                cost[i][j] = dist <= maxPickupRadius ? dist : INFEASIBLE;
+            }
+        }
+
+        vector<int> assignment = solveAssignment(cost);
+        for (size_t i = 0; i < rows.size(); ++i) {
+            int j = assignment[i];
+            if (j >= 0 && j < (int)candidates.size() && cost[i][j] < UNMATCHED) {
+                result[rows[i]] = store.drivers[candidates[j]];
+            }
+        }
+    }
+    return result;
+}
+
+// RideFactory
+Ride* RideFactory::createRide(const RideRequest& request, RidePool& pool) {
+    RideId rideId = ++rideCounter;
+    return pool.acquire(rideId,
+                        request.getRider(),
+                        request.getPickup(),
+                        request.getDrop(),
+                        request.getType());
+}
+
+// RidePool
+RidePool::~RidePool() {
+    for (auto& chunk : chunks) {
+        Ride* rides = reinterpret_cast<Ride*>(chunk->storage);
+        for (size_t i = 0; i < chunk->constructed; ++i) rides[i].~Ride();
+    }
+}
+
+Ride* RidePool::acquire(RideId rideId, Rider* r,
+                        const Location& pickup, const Location& drop, VehicleType type) {
+    lock_guard<mutex> guard(lock);
+    if (!freeList.empty()) {
+        Ride* ride = freeList.back();
+        freeList.pop_back();
+        ride->reset(rideId, r, pickup, drop, type);
+        return ride;
+    }
+    if (chunks.empty() || chunks.back()->constructed == RIDES_PER_CHUNK) {
+        chunks.emplace_back(new Chunk());
+    }
+    Chunk& chunk = *chunks.back();
+    void* slot = chunk.storage + chunk.constructed * sizeof(Ride);
+    ++chunk.constructed;
+    return new (slot) Ride(rideId, r, pickup, drop, type);
+}
+
+void RidePool::release(Ride* ride) {
+    lock_guard<mutex> guard(lock);
+    freeList.push_back(ride);
+}
+
+// RideTable
+Ride* RideTable::find(RideId id) const {
+    for (size_t i = home(id);; i = (i + 1) & mask()) {
+        if (slots[i].id == id) return slots[i].ride;
+        if (slots[i].id == 0) return nullptr;
+    }
+}
+
+void RideTable::insert(RideId id, Ride* ride) {
+    if ((count + 1) * 2 > slots.size()) grow();
+    size_t i = home(id);
+    while (slots[i].id != 0 && slots[i].id != id) i = (i + 1) & mask();
+    if (slots[i].id == 0) ++count;
+    slots[i] = Slot{id, ride};
+}
+
+Ride* RideTable::erase(RideId id) {
+    size_t i = home(id);
+    while (slots[i].id != id) {
+        if (slots[i].id == 0) return nullptr;
+        i = (i + 1) & mask();
+    }
+    Ride* removed = slots[i].ride;
+
+    // Shift later members of the probe run back into the hole so that
+    // lookups never need tombstones.
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask(); slots[j].id != 0; j = (j + 1) & mask()) {
+        size_t h = home(slots[j].id);
+        bool movable = (hole <= j) ? (h <= hole || h > j) : (h <= hole && h > j);
+        if (movable) {
+            slots[hole] = slots[j];
+            hole = j;
+        }
+    }
+    slots[hole] = Slot{0, nullptr};
+    --count;
+    return removed;
+}
+
+void RideTable::grow() {
+    vector<Slot> old;
+    old.swap(slots);
+    slots.assign(old.size() * 2, Slot{0, nullptr});
+    --shift;
+    count = 0;
+    for (const auto& slot : old) {
+        if (slot.id != 0) insert(slot.id, slot.ride);
+    }
+}
+
+// UserRegistry
+string_view UserRegistry::copy(const string& s) {
+    if (s.empty()) return string_view();
+    char* dst;
+    if (s.size() > ARENA_CHUNK / 8) {
+        chunks.emplace_back(new char[s.size()]);
+        dst = chunks.back().get();
+    } else {
+        if (!current || currentUsed + s.size() > ARENA_CHUNK) {
+            chunks.emplace_back(new char[ARENA_CHUNK]);
+            current = chunks.back().get();
+            currentUsed = 0;
+        }
+        dst = current + currentUsed;
+        currentUsed += s.size();
+    }
+    memcpy(dst, s.data(), s.size());
+    bytesStored += s.size();
+    return string_view(dst, s.size());
+}
+
+string_view UserRegistry::intern(const string& s) {
+    lock_guard<mutex> guard(lock);
+    auto it = names.find(string_view(s));
+    if (it != names.end()) return *it;
+    string_view view = copy(s);
+    names.insert(view);
+    return view;
+}
+
+atomic<User*>* UserRegistry::slotFor(int id, bool create) {
+    if (id < 0) return nullptr;
+    size_t chunk = (size_t)id >> USER_CHUNK_BITS;
+    if (chunk >= MAX_USER_CHUNKS) return nullptr;
+    atomic<User*>* slots = users[chunk].load(memory_order_acquire);
+    if (!slots && create) {
+        lock_guard<mutex> guard(lock);
+        slots = users[chunk].load(memory_order_relaxed);
+        if (!slots) {
+            slots = new atomic<User*>[USER_CHUNK]();
+            users[chunk].store(slots, memory_order_release);
+        }
+    }
+    return slots ? &slots[(size_t)id & (USER_CHUNK - 1)] : nullptr;
+}
+
+User* UserRegistry::find(int id) const {
+    if (id < 0 || ((size_t)id >> USER_CHUNK_BITS) >= MAX_USER_CHUNKS) return nullptr;
+    atomic<User*>* slots = users[(size_t)id >> USER_CHUNK_BITS].load(memory_order_acquire);
+    return slots ? slots[(size_t)id & (USER_CHUNK - 1)].load(memory_order_acquire) : nullptr;
+}
+
+bool UserRegistry::nameOf(int id, string& out) const {
+    lock_guard<mutex> guard(lock);
+    User* user = find(id);
+    if (!user) return false;
+    out.assign(user->getName().data(), user->getName().size());
+    return true;
+}
+
+// RideArchive
+RideArchive::~RideArchive() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    spillChanged.notify_all();
+    if (spiller.joinable()) spiller.join();
+}
+
+void RideArchive::setSpillDirectory(const string& dir) {
+    lock_guard<mutex> guard(lock);
+    spillDirectory = dir;
+#ifdef DISPATCH_HAVE_MMAP
+    if (!dir.empty() && !spiller.joinable()) spiller = thread([this] { spillLoop(); });
+#endif
+}
+
+void RideArchive::flushSpills() {
+    unique_lock<mutex> guard(lock);
+    spillChanged.wait(guard, [this] { return spillQueue.empty() && !spilling; });
+}
+
+size_t RideArchive::spilledBlocks() const {
+    lock_guard<mutex> guard(lock);
+    size_t n = 0;
+    for (const auto& segment : sealed) n += segment.mapped ? 1 : 0;
+    return n;
+}
+
+void RideArchive::append(const Ride* ride) {
+    lock_guard<mutex> guard(lock);
+    Block& b = *open;
+    size_t i = b.rows;
+    b.rideId[i] = ride->getId();
+    b.riderId[i] = ride->getRider()->getId();
+    b.driverId[i] = ride->getDriver() ? ride->getDriver()->getId() : 0;
+    b.distanceKm[i] = ride->getDistanceKm();
+    b.fare[i] = ride->getFare();
+    b.requestedAt[i] = ride->getRequestedAt();
+    b.finishedAt[i] = ride->getFinishedAt();
+    b.type[i] = (uint8_t)ride->getRequestedType();
+    b.status[i] = (uint8_t)ride->getStatus();
+    b.paid[i] = ride->isPaid() ? 1 : 0;
+    b.rows = i + 1;
+    ++rowCount;
+    if (b.rows == BLOCK_ROWS) seal();
+}
+
+bool RideArchive::findRide(RideId rideId, Row& out) const {
+    auto scan = [&](const Block& b) {
+        for (size_t i = 0; i < b.rows; ++i) {
+            if (b.rideId[i] == rideId) {
+                out = rowAt(b, i);
+                return true;
+            }
+        }
+        return false;
+    };
+    vector<shared_ptr<const Block>> candidates;
+    {
+        lock_guard<mutex> guard(lock);
+        if (scan(*open)) return true;
+        for (size_t i = sealed.size(); i-- > 0;) {
+            if (rideId >= sealed[i].lowestId && rideId <= sealed[i].highestId) {
+                candidates.push_back(sealed[i].block);
+            }
+        }
+    }
+    for (const auto& b : candidates) {
+        if (scan(*b)) return true;
+    }
+    return false;
+}
+
+// Caller holds lock. Only moves pointers; the spill thread does the I/O.
+void RideArchive::seal() {
+    RideId lowest = *min_element(open->rideId, open->rideId + open->rows);
+    RideId highest = *max_element(open->rideId, open->rideId + open->rows);
+    sealed.push_back(Segment{shared_ptr<const Block>(open.release()), false, lowest, highest});
+    if (spiller.joinable() && !spillDirectory.empty()) {
+        spillQueue.push_back(sealed.size() - 1);
+        spillChanged.notify_all();
+    }
+    open.reset(new Block);
+    open->rows = 0;
+}
+
+void RideArchive::spillLoop() {
+    unique_lock<mutex> guard(lock);
+    while (true) {
+        spillChanged.wait(guard, [this] { return stopping || !spillQueue.empty(); });
+        if (stopping) return;
+        size_t index = spillQueue.front();
+        spillQueue.pop_front();
+        shared_ptr<const Block> block = sealed[index].block;
+        string path = spillDirectory + "/rides-" + to_string(index) + ".blk";
+        spilling = true;
+        guard.unlock();
+
+        shared_ptr<const Block> mapped;
+#ifdef DISPATCH_HAVE_MMAP
+        if (const Block* map = spill(*block, path)) {
+            mapped.reset(map, [](const Block* b) { munmap(const_cast<Block*>(b), sizeof(Block)); });
+        }
+#endif
+
+        guard.lock();
+        if (mapped) {
+            sealed[index].block = mapped;
+            sealed[index].mapped = true;
+        }
+        spilling = false;
+        spillChanged.notify_all();
+    }
+}
+
+const RideArchive::Block* RideArchive::spill(const Block& block, const string& path) {
+#ifdef DISPATCH_HAVE_MMAP
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        EventLog::getInstance().message(LOG_WARN, "Cannot create archive file " + path +
+                                                      "; keeping block in memory.");
+        return nullptr;
+    }
+    void* map = writeFully(fd, &block, sizeof(Block))
+                    ? mmap(nullptr, sizeof(Block), PROT_READ, MAP_SHARED, fd, 0)
+                    : MAP_FAILED;
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        EventLog::getInstance().message(LOG_WARN, "Cannot map archive file " + path +
+                                                      "; keeping block in memory.");
+        return nullptr;
+    }
+    return static_cast<const Block*>(map);
+#else
+    (void)block;
+    (void)path;
+    return nullptr;
+#endif
+}
+
+// TimerWheel
+template <class Payload>
+TimerWheel<Payload>::TimerWheel(int64_t startTick)
+    : freeHead(NIL), currentTick(startTick), live(0) {
+    for (auto& level : heads) fill(begin(level), end(level), NIL);
+}
+
+template <class Payload> void TimerWheel<Payload>::link(uint32_t index) {
+    Entry& e = entries[index];
+    // Lowest level whose span still holds both now and the fire tick.
+    int level = 0;
+    while (level < LEVELS - 1 &&
+           (e.fireTick >> (SLOT_BITS * (level + 1))) != (currentTick >> (SLOT_BITS * (level + 1)))) {
+        ++level;
+    }
+    e.level = level;
+    e.slot = (int)((e.fireTick >> (SLOT_BITS * level)) & (SLOTS - 1));
+    e.prev = NIL;
+    e.next = heads[level][e.slot];
+    if (e.next != NIL) entries[e.next].prev = index;
+    heads[level][e.slot] = index;
+}
+
+template <class Payload> void TimerWheel<Payload>::unlink(uint32_t index) {
+    Entry& e = entries[index];
+    if (e.prev != NIL) entries[e.prev].next = e.next;
+    else heads[e.level][e.slot] = e.next;
+    if (e.next != NIL) entries[e.next].prev = e.prev;
+    e.prev = e.next = NIL;
+}
+
+template <class Payload> void TimerWheel<Payload>::cascade(int level, int slot) {
+    uint32_t index = heads[level][slot];
+    heads[level][slot] = NIL;
+    while (index != NIL) {
+        uint32_t next = entries[index].next;
+        link(index);
+        index = next;
+    }
+}
+
+template <class Payload>
+typename TimerWheel<Payload>::ScheduleId TimerWheel<Payload>::schedule(const Payload& payload,
+                                                                        int64_t fireTick) {
+    // Beyond the top level's span (2^32 ticks) bookings are clamped.
+    const int64_t horizon = ((int64_t)1 << (SLOT_BITS * LEVELS)) - 1;
+    fireTick = min(max(fireTick, currentTick + 1), currentTick + horizon);
+
+    uint32_t index;
+    if (freeHead != NIL) {
+        index = freeHead;
+        freeHead = entries[index].next;
+        entries[index].payload = payload;
+    } else {
+        index = (uint32_t)entries.size();
+        entries.emplace_back(payload);
+    }
+    entries[index].fireTick = fireTick;
+    link(index);
+    ++live;
+    return ((ScheduleId)entries[index].generation << 32) | index;
+}
+
+template <class Payload> bool TimerWheel<Payload>::cancel(ScheduleId id) {
+    uint32_t index = (uint32_t)id;
+    if (index >= entries.size()) return false;
+    Entry& e = entries[index];
+    if (e.level < 0 || e.generation != (uint32_t)(id >> 32)) return false;
+    unlink(index);
+    e.level = -1;
+    ++e.generation;
+    e.next = freeHead;
+    freeHead = index;
+    --live;
+    return true;
+}
+
+template <class Payload> void TimerWheel<Payload>::advance(int64_t nowTick, vector<Payload>& due) {
+    while (currentTick < nowTick) {
+        ++currentTick;
+        // Refill lower levels top down when their span rolls over.
+        for (int level = LEVELS - 1; level > 0; --level) {
+            int64_t mask = ((int64_t)1 << (SLOT_BITS * level)) - 1;
+            if ((currentTick & mask) == 0) {
+                cascade(level, (int)((currentTick >> (SLOT_BITS * level)) & (SLOTS - 1)));
+            }
+        }
+        int slot = (int)(currentTick & (SLOTS - 1));
+        uint32_t index = heads[0][slot];
+        heads[0][slot] = NIL;
+        while (index != NIL) {
+            Entry& e = entries[index];
+            uint32_t next = e.next;
+            due.push_back(e.payload);
+            e.level = -1;
+            ++e.generation;
+            e.next = freeHead;
+            freeHead = index;
+            --live;
+            index = next;
+        }
+    }
+}
+
+// SharedTrip
+SharedTrip::Insertion SharedTrip::bestInsertion(const Location& pickup, const Location& drop,
+                                                int seats) const {
+    Insertion best = {0, 0, 0.0, false};
+    long n = (long)stops.size();
+
+    // reach[k]: route distance from origin to stop k. load[k]: seats taken
+    // on the leg that ends at stop k; leg n is the open end of the route.
+    vector<double> reach(n + 1, 0.0);
+    vector<int> load(n + 1, onboard);
+    for (long k = 0; k < n; ++k) {
+        reach[k + 1] = reach[k] + stopAt(k - 1).distanceTo(stops[k].location);
+        load[k + 1] = load[k] + (stops[k].pickup ? stops[k].seats : -stops[k].seats);
+    }
+    auto reachOf = [&](long k) { return k < 0 ? 0.0 : reach[k + 1]; };
+    auto legLength = [&](long k) { return k < n ? reachOf(k) - reachOf(k - 1) : 0.0; };
+
+    // Leg span (first, last] and slack of every rider already on the trip.
+    struct Span { long first, last; double slack; };
+    vector<Span> spans;
+    for (const auto& p : passengers) {
+        Span span = {-1, -1, 0.0};
+        for (long k = 0; k < n; ++k) {
+            if (stops[k].rideId != p.rideId) continue;
+            if (stops[k].pickup) span.first = k;
+            else span.last = k;
+        }
+        span.slack = p.allowed - p.rodeSoFar - (reachOf(span.last) - reachOf(span.first));
+        spans.push_back(span);
+    }
+    double allowed = pickup.distanceTo(drop) * (1.0 + maxDetourRatio);
+
+    for (long i = 0; i <= n; ++i) {
+        if (load[i] + seats > capacity) continue;
+        Location before = stopAt(i - 1);
+        double toPickup = before.distanceTo(pickup);
+        int maxLoad = load[i];
+        for (long j = i; j <= n; ++j) {
+            maxLoad = max(maxLoad, load[j]);
+            if (maxLoad + seats > capacity) break;
+
+            double extraP, extraD, ride;
+            if (i == j) {
+                double direct = pickup.distanceTo(drop);
+                extraP = toPickup + direct +
+                         (i < n ? drop.distanceTo(stops[i].location) : 0.0) - legLength(i);
+                extraD = 0.0;
+                ride = direct;
+            } else {
+                Location afterPickup = stops[i].location;
+                Location beforeDrop = stopAt(j - 1);
+                extraP = toPickup + pickup.distanceTo(afterPickup) - legLength(i);
+                extraD = beforeDrop.distanceTo(drop) +
+                         (j < n ? drop.distanceTo(stops[j].location) : 0.0) - legLength(j);
+                ride = pickup.distanceTo(afterPickup) + (reachOf(j - 1) - reachOf(i)) +
+                       beforeDrop.distanceTo(drop);
+            }
+            double added = extraP + extraD;
+            if (ride > allowed || (best.feasible && added >= best.addedDistance)) continue;
+
+            bool fits = true;
+            for (const auto& span : spans) {
+                double extra = 0.0;
+                if (span.first < i && i <= span.last) extra += extraP;
+                if (i != j && span.first < j && j <= span.last) extra += extraD;
+                if (extra > span.slack) { fits = false; break; }
+            }
+            if (fits) best = {(size_t)i, (size_t)j, added, true};
+        }
+    }
+    return best;
+}
+
+void SharedTrip::insert(RideId rideId, const Location& pickup, const Location& drop, int seats,
+                        const Insertion& at) {
+    stops.insert(stops.begin() + at.dropAt, TripStop{drop, rideId, seats, false});
+    stops.insert(stops.begin() + at.pickupAt, TripStop{pickup, rideId, seats, true});
+    passengers.push_back(Passenger{rideId, seats, 0.0,
+                                   pickup.distanceTo(drop) * (1.0 + maxDetourRatio), false});
+}
+
+TripStop SharedTrip::advance() {
+    TripStop stop = stops.front();
+    stops.erase(stops.begin());
+    double leg = origin.distanceTo(stop.location);
+    origin = stop.location;
+    for (size_t i = 0; i < passengers.size(); ++i) {
+        Passenger& p = passengers[i];
+        if (p.aboard) p.rodeSoFar += leg;
+        if (p.rideId != stop.rideId) continue;
+        if (stop.pickup) {
+            p.aboard = true;
+            onboard += stop.seats;
+        } else {
+            onboard -= stop.seats;
+            passengers.erase(passengers.begin() + i--);
+        }
+    }
+    return stop;
+}
+
+void SharedTrip::removeRide(RideId rideId) {
+    for (size_t i = 0; i < passengers.size(); ++i) {
+        if (passengers[i].rideId != rideId) continue;
+        if (passengers[i].aboard) onboard -= passengers[i].seats;
+        passengers.erase(passengers.begin() + i);
+        break;
+    }
+    stops.erase(remove_if(stops.begin(), stops.end(),
+                          [&](const TripStop& stop) { return stop.rideId == rideId; }),
+                stops.end());
+}
+
+// MappedFile
+MappedFile::MappedFile(const string& path) : bytes(nullptr), length(0) {
+#ifdef DISPATCH_HAVE_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (end > 0) {
+        void* map = mmap(nullptr, (size_t)end, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            bytes = static_cast<const char*>(map);
+            length = (size_t)end;
+        }
+    }
+    ::close(fd);
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifdef DISPATCH_HAVE_MMAP
+    if (bytes) munmap(const_cast<char*>(bytes), length);
+#endif
+}
+
+// RecordJournal
+template <class Record>
+bool RecordJournal<Record>::open(const string& path, bool truncate,
+                                 chrono::milliseconds syncEvery) {
+    close();
+#ifdef DISPATCH_HAVE_MMAP
+    lock_guard<mutex> guard(lock);
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0), 0644);
+    buffer.reserve(BUFFER_RECORDS);
+    syncInterval = syncEvery;
+    stopping = false;
+    if (fd >= 0 && syncEvery.count() > 0) syncer = thread([this] { syncLoop(); });
+#else
+    (void)path;
+    (void)truncate;
+    (void)syncEvery;
+#endif
+    return fd >= 0;
+}
+
+template <class Record>
+void RecordJournal<Record>::close() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (syncer.joinable()) syncer.join();
+    writeBuffered(syncInterval.count() >= 0);
+    lock_guard<mutex> guard(lock);
+#ifdef DISPATCH_HAVE_MMAP
+    if (fd >= 0) ::close(fd);
+#endif
+    fd = -1;
+}
+
+template <class Record>
+void RecordJournal<Record>::append(const Record& record) {
+    bool writeNow;
+    {
+        lock_guard<mutex> guard(lock);
+        if (fd < 0) return;
+        buffer.push_back(record);
+        if (syncInterval.count() > 0) {
+            if (buffer.size() == BUFFER_RECORDS) wake.notify_one();
+            return;
+        }
+        writeNow = syncInterval.count() == 0 || buffer.size() >= BUFFER_RECORDS;
+    }
+    if (writeNow) writeBuffered(syncInterval.count() == 0);
+}
+
+template <class Record>
+void RecordJournal<Record>::writeBuffered(bool durable) {
+    lock_guard<mutex> io(writeLock);
+    int target;
+    {
+        lock_guard<mutex> guard(lock);
+        writing.swap(buffer);
+        target = fd;
+    }
+    // Someone else's write already took the records, and synced them.
+    if (writing.empty()) return;
+#ifdef DISPATCH_HAVE_MMAP
+    if (target >= 0 && !writeFully(target, writing.data(), writing.size() * sizeof(Record))) {
+        EventLog::getInstance().message(LOG_WARN,
+                                        string("Journal write failed; ") +
+                                        to_string(writing.size()) + " records lost.");
+    } else if (target >= 0 && durable && ::fsync(target) != 0) {
+        EventLog::getInstance().message(LOG_WARN, "Journal sync failed.");
+    }
+#else
+    (void)target;
+    (void)durable;
+#endif
+    writing.clear();
+}
+
+template <class Record>
+void RecordJournal<Record>::syncLoop() {
+    unique_lock<mutex> guard(lock);
+    while (!stopping) {
+        wake.wait_for(guard, syncInterval,
+                      [this] { return stopping || buffer.size() >= BUFFER_RECORDS; });
+        guard.unlock();
+        writeBuffered(true);
+        guard.lock();
+    }
+}
+
+// Ride methods
+void Ride::reset(RideId rideId, Rider* r,
+                 const Location& pickup, const Location& drop, VehicleType type) {
+    id = rideId;
+    rider = r;
+    driver = nullptr;
+    pickupLocation = pickup;
+    dropLocation = drop;
+    requestedType = type;
+    status = REQUESTED;
+    distanceKm = pickup.distanceTo(drop);
+    fare = 0.0;
+    paid.store(false, memory_order_relaxed);
+    requestedAt = wallClockMs();
+    finishedAt = 0;
+    observers.clear();
+}
+
+void Ride::assignDriver(Driver* d) {
+    driver = d;
+    updateStatus(DRIVER_ASSIGNED);
+}
+
+void Ride::attachObserver(RideObserver* obs) {
     observers.push_back(obs);
 }
 
-void Ride::removeObserver(RideObserver* obs) {
-    observers.erase(
-        remove(observers.begin(), observers.end(), obs),
-        observers.end());
+void Ride::removeObserver(RideObserver* obs) {
+    observers.erase(
+        remove(observers.begin(), observers.end(), obs),
+        observers.end());
+}
+
+void Ride::notifyObservers(RideStatus newStatus) {
+    ScopedStageTimer timer(STAGE_NOTIFY);
+    if (NotificationDispatcher::tryPublish(this, newStatus)) return;
+    deliverNotifications(newStatus);
+}
+
+void Ride::deliverNotifications(RideStatus newStatus) {
+    for (auto obs : observers) {
+        obs->onRideStatusChanged(this, newStatus);
+    }
+}
+
+// Event log
+// The user's name, or its id once it has gone.
+static string userName(int id) {
+    string name;
+    if (!UserRegistry::getInstance().nameOf(id, name)) name = to_string(id);
+    return name;
+}
+
+void TextEventSink::write(const EventRecord* records, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        const EventRecord& r = records[i];
+        if (timestamps) out << "[" << r.timestampNs << "] ";
+        switch ((EventType)r.type) {
+            case EV_DRIVER_REGISTERED:
+                // Same layout as operator<<(ostream&, const Driver&).
+                out << "Driver registered: Driver{name='" << userName(r.driverId)
+                    << "', vehicle=" << vehicleTypeName((VehicleType)r.arg) << ", loc=("
+                    << r.latitude << ", " << r.longitude << "), rating=" << r.value << "}";
+                break;
+            case EV_DRIVER_DEREGISTERED:
+                out << "Driver " << userName(r.driverId) << " deregistered";
+                break;
+            case EV_RIDE_REQUESTED:
+                out << "\n=== Rider " << userName(r.riderId) << " requests a "
+                    << vehicleTypeName((VehicleType)r.arg) << " ride ===";
+                break;
+            case EV_BATCH_MATCHED:
+                out << "\n=== Matching a batch of " << (size_t)r.value
+                    << " ride requests ===";
+                break;
+            case EV_NO_DRIVER:
+                out << "No available drivers for Ride " << r.rideId << ". Cancelling ride.";
+                break;
+            case EV_RIDE_NOT_FOUND:
+                out << "Ride " << r.rideId << " not found or already completed.";
+                break;
+            case EV_PAYMENT_PROCESSING:
+                out << "Processing payment of ₹" << r.value << " for Ride " << r.rideId;
+                break;
+            case EV_PAYMENT_SUCCEEDED:
+                out << "[Notification to Rider " << userName(r.riderId) << "]: Payment of ₹"
+                    << r.value << " successful.";
+                break;
+            case EV_PAYMENT_FAILED:
+                out << "Payment failed for Ride " << r.rideId;
+                break;
+            case EV_PAYMENT_RETRIED:
+                out << "Retrying payment for Ride " << r.rideId << " (attempt "
+                    << (int)r.value << ")";
+                break;
+            case EV_DRIVER_AVAILABLE:
+                out << "Driver " << userName(r.driverId) << " is now AVAILABLE.";
+                break;
+            case EV_LOCATIONS_APPLIED:
+                out << "Applied " << (size_t)r.value << " driver locations ("
+                    << r.driverId << " stale or unknown pings dropped)";
+                break;
+            case EV_RIDE_ARCHIVED:
+                out << "Ride " << r.rideId << " completed and archived.\n";
+                break;
+            case EV_RIDER_NOTIFIED:
+                out << "[Notification to Rider " << userName(r.riderId) << "]: Ride "
+                    << r.rideId << " is now " << rideStatusName((RideStatus)r.arg);
+                break;
+            case EV_DRIVER_NOTIFIED:
+                out << "[Notification to Driver " << userName(r.driverId) << "]: Ride "
+                    << r.rideId << " is now " << rideStatusName((RideStatus)r.arg);
+                break;
+            case EV_OFFER_DECLINED:
+                out << "Driver " << userName(r.driverId) << " declined Ride " << r.rideId;
+                break;
+            case EV_OFFER_TIMED_OUT:
+                out << "Offer of Ride " << r.rideId << " to Driver " << userName(r.driverId)
+                    << " timed out";
+                break;
+            case EV_RIDE_POOLED:
+                out << "Ride " << r.rideId << " joins Driver " << userName(r.driverId)
+                    << "'s shared trip (+" << r.value << " detour)";
+                break;
+            case EV_RIDE_CANCELLED:
+                out << "Ride " << r.rideId << " " << cancelReasonName((CancelReason)r.arg) << ".";
+                break;
+            case EV_INVALID_TRANSITION:
+                out << "Ride " << r.rideId << " cannot go from "
+                    << rideStatusName((RideStatus)(int)r.value) << " to "
+                    << rideStatusName((RideStatus)r.arg) << ".";
+                break;
+            case EV_MESSAGE:
+                out << EventLog::getInstance().messageText(r.rideId);
+                break;
+        }
+        out << '\n';
+    }
+}
+
+EventLog::~EventLog() {
+    stopDrainThread();
+    flush();
+}
+
+// Logging never blocks dispatch: a full ring drops the record, and a
+// batch boundary skips its write when another thread holds the sink.
+bool EventLog::push(const EventRecord& rec) {
+    if (!ring.tryPush(rec)) {
+        dropped.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+    static thread_local size_t sinceDrain = 0;
+    if (++sinceDrain >= DRAIN_BATCH && !draining.load(memory_order_acquire)) {
+        sinceDrain = 0;
+        unique_lock<mutex> guard(drainLock, try_to_lock);
+        if (guard.owns_lock()) drainOnce();
+    }
+    return true;
+}
+
+size_t EventLog::drainOnce() {
+    EventRecord batch[DRAIN_BATCH];
+    size_t n = 0;
+    while (n < DRAIN_BATCH && ring.tryPop(batch[n])) ++n;
+    if (n == 0) return 0;
+    sink->write(batch, n);
+    for (size_t i = 0; i < n; ++i) {
+        if (batch[i].type != EV_MESSAGE) continue;
+        lock_guard<mutex> guard(messageLock);
+        messages.erase(batch[i].rideId);
+    }
+    return n;
+}
+
+void EventLog::message(LogLevel lvl, const string& text) {
+    if (!enabled(lvl)) return;
+    EventRecord rec = makeRecord(lvl, EV_MESSAGE, 0);
+    {
+        lock_guard<mutex> guard(messageLock);
+        rec.rideId = ++nextMessage;
+        messages[rec.rideId] = text;
+    }
+    if (!push(rec)) {
+        lock_guard<mutex> guard(messageLock);
+        messages.erase(rec.rideId);
+        return;
+    }
+    if (!draining.load(memory_order_acquire)) flush();
+}
+
+string EventLog::messageText(uint64_t index) const {
+    lock_guard<mutex> guard(messageLock);
+    auto it = messages.find(index);
+    return it == messages.end() ? string() : it->second;
+}
+
+void EventLog::flush() {
+    lock_guard<mutex> guard(drainLock);
+    while (drainOnce() > 0) {}
+    sink->flush();
+}
+
+void EventLog::setSink(EventSink* newSink) {
+    flush();
+    lock_guard<mutex> guard(drainLock);
+    sink.reset(newSink);
+}
+
+void EventLog::startDrainThread() {
+    if (draining.exchange(true)) return;
+    drainer = thread([this] {
+        while (draining.load(memory_order_acquire)) {
+            size_t n;
+            {
+                lock_guard<mutex> guard(drainLock);
+                n = drainOnce();
+                if (n == 0) sink->flush();
+            }
+            if (n == 0) this_thread::sleep_for(chrono::microseconds(200));
+        }
+    });
+}
+
+void EventLog::stopDrainThread() {
+    if (!draining.exchange(false)) return;
+    drainer.join();
+    flush();
+}
+
+// PaymentWorkerPool
+PaymentWorkerPool::PaymentWorkerPool(size_t workerCount, size_t queueCapacity,
+                                     SettleCallback callback, chrono::milliseconds backoff)
+    : onSettled(callback), retryBackoff(backoff), running(true), submitted(0), settled(0) {
+    workerCount = max<size_t>(1, workerCount);
+    for (size_t i = 0; i < workerCount; ++i) {
+        workers.emplace_back(new Worker(queueCapacity));
+    }
+    for (auto& worker : workers) {
+        Worker* w = worker.get();
+        w->runner = thread([this, w] { run(*w); });
+    }
+}
+
+PaymentWorkerPool::~PaymentWorkerPool() {
+    drain();
+    running = false;
+    for (auto& worker : workers) worker->runner.join();
+}
+
+bool PaymentWorkerPool::submit(Ride* ride, PaymentProcessor* gateway, double amount) {
+    if (ride->isPaid()) return false;
+    {
+        lock_guard<mutex> guard(inFlightLock);
+        if (!inFlight.insert(ride->getId()).second) return false;
+    }
+    ride->pin();
+    submitted.fetch_add(1, memory_order_relaxed);
+    Worker& worker = *workers[ride->getId() % workers.size()];
+    PaymentJob job{ride, gateway, amount, 0, chrono::steady_clock::now()};
+    while (!worker.queue.tryPush(job)) {
+        this_thread::yield();
+    }
+    return true;
+}
+
+void PaymentWorkerPool::drain() {
+    while (settled.load(memory_order_acquire) < submitted.load(memory_order_acquire)) {
+        this_thread::yield();
+    }
+}
+
+void PaymentWorkerPool::finish(const PaymentJob& job, bool paid) {
+    onSettled(job.ride, job.amount, paid);
+    {
+        lock_guard<mutex> guard(inFlightLock);
+        inFlight.erase(job.ride->getId());
+    }
+    job.ride->unpin();
+    settled.fetch_add(1, memory_order_release);
+}
+
+void PaymentWorkerPool::run(Worker& worker) {
+    vector<PaymentJob> batch;
+    vector<PaymentCharge> charges;
+    batch.reserve(BATCH_SIZE);
+    charges.reserve(BATCH_SIZE);
+    PaymentJob job;
+    while (true) {
+        batch.clear();
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        for (size_t i = 0; i < worker.retries.size() && batch.size() < BATCH_SIZE;) {
+            if (worker.retries[i].due > now) {
+                ++i;
+                continue;
+            }
+            batch.push_back(worker.retries[i]);
+            worker.retries[i] = worker.retries.back();
+            worker.retries.pop_back();
+        }
+        while (batch.size() < BATCH_SIZE && worker.queue.tryPop(job)) {
+            batch.push_back(job);
+        }
+        if (batch.empty()) {
+            if (!running.load(memory_order_acquire) && worker.retries.empty()) return;
+            this_thread::sleep_for(chrono::microseconds(200));
+            continue;
+        }
+
+        // One processPayments call per gateway in this batch.
+        stable_sort(batch.begin(), batch.end(),
+                    [](const PaymentJob& a, const PaymentJob& b) { return a.gateway < b.gateway; });
+        for (size_t begin = 0; begin < batch.size();) {
+            size_t end = begin;
+            charges.clear();
+            while (end < batch.size() && batch[end].gateway == batch[begin].gateway) {
+                charges.push_back(PaymentCharge{batch[end].ride, batch[end].amount, false});
+                ++end;
+            }
+            batch[begin].gateway->processPayments(charges.data(), charges.size());
+
+            for (size_t i = begin; i < end; ++i) {
+                PaymentJob& j = batch[i];
+                if (charges[i - begin].settled || ++j.attempts >= MAX_ATTEMPTS) {
+                    finish(j, charges[i - begin].settled);
+                    continue;
+                }
+                EventLog::getInstance().record(LOG_DEBUG, EV_PAYMENT_RETRIED, j.ride->getId(), 0,
+                                               j.ride->getRider()->getId(), j.attempts + 1);
+                j.due = chrono::steady_clock::now() + retryBackoff * (1 << (j.attempts - 1));
+                worker.retries.push_back(j);
+            }
+            begin = end;
+        }
+    }
+}
+
+// LocationIngestor
+bool LocationIngestor::add(const LocationPing* pings, size_t count) {
+    lock_guard<mutex> guard(bufferLock);
+    if (active.empty()) windowOpenedAt = chrono::steady_clock::now();
+    active.insert(active.end(), pings, pings + count);
+    return active.size() >= maxBuffered ||
+           chrono::steady_clock::now() - windowOpenedAt >= window;
+}
+
+unique_lock<mutex> LocationIngestor::flush(vector<LocationPing>& coalesced) {
+    unique_lock<mutex> serial(flushLock);
+    {
+        lock_guard<mutex> guard(bufferLock);
+        retired.swap(active);
+    }
+
+    coalesced.clear();
+    newestIndex.clear();
+    for (const auto& ping : retired) {
+        auto found = newestIndex.emplace(ping.driverId, coalesced.size());
+        if (found.second) {
+            coalesced.push_back(ping);
+        } else if (ping.timestamp > coalesced[found.first->second].timestamp) {
+            coalesced[found.first->second] = ping;
+        }
+    }
+    // The retired buffer keeps its capacity for the next swap.
+    retired.clear();
+    return serial;
+}
+
+// NotificationDispatcher
+NotificationDispatcher::NotificationDispatcher(size_t workerCount, size_t queueCapacity)
+    : running(true), published(0), delivered(0) {
+    workerCount = max<size_t>(1, workerCount);
+    for (size_t i = 0; i < workerCount; ++i) {
+        workers.emplace_back(new Worker(queueCapacity));
+    }
+    for (auto& worker : workers) {
+        Worker* w = worker.get();
+        w->runner = thread([this, w] { run(*w); });
+    }
+}
+
+NotificationDispatcher::~NotificationDispatcher() {
+    uninstall();
+    drain();
+    running = false;
+    for (auto& worker : workers) worker->runner.join();
+}
+
+// Both sides are sequentially consistent: a publisher counted after
+// uninstall's store reads nullptr, and uninstall waits for the rest.
+void NotificationDispatcher::uninstall() {
+    NotificationDispatcher* self = this;
+    activeInstance.compare_exchange_strong(self, nullptr);
+    while (publishers.load() > 0) this_thread::yield();
+}
+
+bool NotificationDispatcher::tryPublish(Ride* ride, RideStatus status) {
+    publishers.fetch_add(1);
+    NotificationDispatcher* async = activeInstance.load();
+    if (async) async->publish(ride, status);
+    publishers.fetch_sub(1, memory_order_release);
+    return async != nullptr;
+}
+
+void NotificationDispatcher::publish(Ride* ride, RideStatus status) {
+    ride->pin();
+    published.fetch_add(1, memory_order_relaxed);
+    Worker& worker = *workers[ride->getId() % workers.size()];
+    while (!worker.queue.tryPush(StatusEvent{ride, status})) {
+        this_thread::yield();
+    }
+}
+
+void NotificationDispatcher::drain() {
+    while (delivered.load(memory_order_acquire) < published.load(memory_order_acquire)) {
+        this_thread::yield();
+    }
+}
+
+void NotificationDispatcher::run(Worker& worker) {
+    StatusEvent event;
+    while (true) {
+        size_t batch = 0;
+        while (batch < BATCH_SIZE && worker.queue.tryPop(event)) {
+            event.ride->deliverNotifications(event.status);
+            event.ride->unpin();
+            ++batch;
+        }
+        if (batch > 0) {
+            delivered.fetch_add(batch, memory_order_release);
+            continue;
+        }
+        if (!running.load(memory_order_acquire)) return;
+        this_thread::sleep_for(chrono::microseconds(100));
+    }
+}
+
+void Ride::updateStatus(RideStatus newStatus) {
+    status = newStatus;
+    notifyObservers(newStatus);
+}
+
+// LatencyHistogram
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+    for (int i = 0; i < BUCKETS; ++i) counts[i] += other.counts[i];
+    total += other.total;
+    sum += other.sum;
+    maxValue = max(maxValue, other.maxValue);
+}
+
+uint64_t LatencyHistogram::percentile(double q) const {
+    if (total == 0) return 0;
+    uint64_t rank = (uint64_t)std::ceil(q * (double)total);
+    rank = max<uint64_t>(rank, 1);
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+        seen += counts[i];
+        if (seen >= rank) return min(highestIn(i), maxValue);
+    }
+    return maxValue;
+}
+
+// SharedLatencyHistogram
+void SharedLatencyHistogram::addTo(LatencyHistogram& out) const {
+    for (int i = 0; i < LatencyHistogram::BUCKETS; ++i) {
+        out.counts[i] += counts[i].load(memory_order_relaxed);
+    }
+    out.total += total.load(memory_order_relaxed);
+    out.sum += sum.load(memory_order_relaxed);
+    out.maxValue = max(out.maxValue, maxValue.load(memory_order_relaxed));
+}
+
+void SharedLatencyHistogram::reset() {
+    for (auto& count : counts) count.store(0, memory_order_relaxed);
+    total.store(0, memory_order_relaxed);
+    sum.store(0, memory_order_relaxed);
+    maxValue.store(0, memory_order_relaxed);
+}
+
+// DispatchMetrics
+void DispatchMetrics::ThreadBlock::reset() {
+    for (auto& stage : stages) stage.reset();
+    candidates.reset();
+    for (auto& counter : counters) counter.store(0, memory_order_relaxed);
+}
+
+DispatchMetrics::ThreadSlot::~ThreadSlot() {
+    if (!block) return;
+    DispatchMetrics& metrics = DispatchMetrics::getInstance();
+    lock_guard<mutex> guard(metrics.registryLock);
+    metrics.freeBlocks.push_back(block);
+}
+
+DispatchMetrics::ThreadBlock& DispatchMetrics::local() {
+    static thread_local ThreadSlot slot;
+    if (!slot.block) {
+        lock_guard<mutex> guard(registryLock);
+        if (!freeBlocks.empty()) {
+            slot.block = freeBlocks.back();
+            freeBlocks.pop_back();
+        } else {
+            blocks.emplace_back(new ThreadBlock());
+            slot.block = blocks.back().get();
+        }
+    }
+    return *slot.block;
+}
+
+void DispatchMetrics::recordCandidateCount() {
+    if (!isEnabled()) return;
+    local().candidates.record((uint64_t)scanned());
+}
+
+DispatchMetrics::Snapshot DispatchMetrics::snapshot() const {
+    Snapshot merged;
+    lock_guard<mutex> guard(registryLock);
+    for (const auto& block : blocks) {
+        for (int s = 0; s < STAGE_COUNT; ++s) block->stages[s].addTo(merged.stages[s]);
+        block->candidates.addTo(merged.candidates);
+        for (int c = 0; c < COUNTER_COUNT; ++c) {
+            merged.counters[c] += block->counters[c].load(memory_order_relaxed);
+        }
+    }
+    return merged;
+}
+
+// Samples recorded while this runs may survive it.
+void DispatchMetrics::reset() {
+    lock_guard<mutex> guard(registryLock);
+    for (const auto& block : blocks) block->reset();
+}
+
+const char* DispatchMetrics::stageName(MetricStage stage) {
+    switch (stage) {
+        case STAGE_REQUEST: return "request";
+        case STAGE_CREATE_RIDE: return "create_ride";
+        case STAGE_MATCH: return "match";
+        case STAGE_BATCH_MATCH: return "batch_match";
+        case STAGE_POOL_REMOVE: return "pool_remove";
+        case STAGE_ASSIGN: return "assign";
+        case STAGE_NOTIFY: return "notify";
+        case STAGE_STATUS_UPDATE: return "status_update";
+        case STAGE_COMPLETE: return "complete";
+        case STAGE_CANCEL: return "cancel";
+        case STAGE_POOL_ADD: return "pool_add";
+        case STAGE_FARE: return "fare";
+        case STAGE_PAYMENT: return "payment";
+        case STAGE_ARCHIVE: return "archive";
+        default: return "unknown";
+    }
+}
+
+const char* DispatchMetrics::counterName(MetricCounter counter) {
+    switch (counter) {
+        case COUNTER_RIDES_CREATED: return "rides_created";
+        case COUNTER_MATCHED: return "matched";
+        case COUNTER_UNMATCHED: return "unmatched";
+        case COUNTER_CLAIMS_LOST: return "claims_lost";
+        case COUNTER_LOCKED_MATCHES: return "locked_matches";
+        case COUNTER_SNAPSHOT_COPIES: return "snapshot_copies";
+        case COUNTER_COMPLETED: return "completed";
+        case COUNTER_CANCELLED: return "cancelled";
+        case COUNTER_PAYMENTS_FAILED: return "payments_failed";
+        default: return "unknown";
+    }
 }
 
-void Ride::notifyObservers(RideStatus newStatus) {
-    for (auto obs : observers) {
-        obs->onRideStatusChanged(this, newStatus);
+// DispatchService metrics
+void DispatchService::writeMetrics(ostream& out) {
+    static const char* TYPE_NAMES[VEHICLE_TYPE_COUNT] = {"BIKE", "SEDAN", "SUV", "AUTO"};
+    static const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+    DispatchMetrics::Snapshot snap = DispatchMetrics::getInstance().snapshot();
+    out << "# TYPE dispatch_stage_latency_ns summary\n";
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        const LatencyHistogram& h = snap.stages[s];
+        const char* name = DispatchMetrics::stageName((MetricStage)s);
+        for (double q : QUANTILES) {
+            out << "dispatch_stage_latency_ns{stage=\"" << name << "\",quantile=\"" << q
+                << "\"} " << h.percentile(q) << "\n";
+        }
+        out << "dispatch_stage_latency_ns_count{stage=\"" << name << "\"} " << h.count() << "\n";
+        out << "dispatch_stage_latency_ns_max{stage=\"" << name << "\"} " << h.maxRecorded()
+            << "\n";
+    }
+    out << "# TYPE dispatch_match_candidates summary\n";
+    for (double q : QUANTILES) {
+        out << "dispatch_match_candidates{quantile=\"" << q << "\"} "
+            << snap.candidates.percentile(q) << "\n";
+    }
+    out << "dispatch_match_candidates_count " << snap.candidates.count() << "\n";
+    out << "# TYPE dispatch_events_total counter\n";
+    for (int c = 0; c < COUNTER_COUNT; ++c) {
+        out << "dispatch_events_total{event=\"" << DispatchMetrics::counterName((MetricCounter)c)
+            << "\"} " << snap.counters[c] << "\n";
     }
+
+    MetricGauges g = metricGauges();
+    out << "# TYPE dispatch_available_drivers gauge\n";
+    for (int t = 0; t < VEHICLE_TYPE_COUNT; ++t) {
+        out << "dispatch_available_drivers{type=\"" << TYPE_NAMES[t] << "\"} "
+            << g.availableDrivers[t] << "\n";
+    }
+    out << "# TYPE dispatch_queue_depth gauge\n";
+    out << "dispatch_queue_depth{queue=\"ongoing_rides\"} " << g.ongoingRides << "\n";
+    out << "dispatch_queue_depth{queue=\"batch_requests\"} " << g.pendingBatchRequests << "\n";
+    out << "dispatch_queue_depth{queue=\"scheduled_rides\"} " << g.scheduledRides << "\n";
+    out << "dispatch_queue_depth{queue=\"no_show_deadlines\"} " << g.noShowDeadlines << "\n";
+    out << "dispatch_queue_depth{queue=\"location_pings\"} " << g.bufferedLocationPings << "\n";
+    out << "dispatch_queue_depth{queue=\"payments\"} " << g.pendingPayments << "\n";
+    out << "dispatch_queue_depth{queue=\"notifications\"} " << g.pendingNotifications << "\n";
+    out << "# TYPE dispatch_log_records_dropped_total counter\n";
+    out << "dispatch_log_records_dropped_total " << g.droppedLogRecords << "\n";
+    out.flush();
 }
 
-void Ride::updateStatus(RideStatus newStatus) {
-    status = newStatus;
-    notifyObservers(newStatus);
+// SyntheticCity
+SyntheticCity::SyntheticCity(const Location& cityCentre, double radiusDeg, int hotSpotCount,
+                             uint64_t seed)
+    : centre(cityCentre), radius(radiusDeg), rng(seed),
+      typePicker({15.0, 40.0, 15.0, 30.0}) {  // BIKE, SEDAN, SUV, AUTO
+    uniform_real_distribution<double> offset(-0.7 * radius, 0.7 * radius);
+    uniform_real_distribution<double> spread(0.05 * radius, 0.15 * radius);
+    vector<double> popularity;
+    for (int i = 0; i < max(1, hotSpotCount); ++i) {
+        hotSpots.push_back(HotSpot{Location(centre.latitude + offset(rng),
+                                            centre.longitude + offset(rng)),
+                                   spread(rng)});
+        popularity.push_back(1.0 / (i + 1));  // Zipf: a few spots dominate
+    }
+    spotPicker = discrete_distribution<int>(popularity.begin(), popularity.end());
+}
+
+Location SyntheticCity::samplePoint() {
+    uniform_real_distribution<double> unit(0.0, 1.0);
+    if (unit(rng) < HOT_SPOT_SHARE) {
+        const HotSpot& spot = hotSpots[spotPicker(rng)];
+        normal_distribution<double> jitter(0.0, spot.spread);
+        double lat = spot.centre.latitude + jitter(rng);
+        double lon = spot.centre.longitude + jitter(rng);
+        lat = min(max(lat, centre.latitude - radius), centre.latitude + radius);
+        lon = min(max(lon, centre.longitude - radius), centre.longitude + radius);
+        return Location(lat, lon);
+    }
+    uniform_real_distribution<double> anywhere(-radius, radius);
+    return Location(centre.latitude + anywhere(rng), centre.longitude + anywhere(rng));
+}
+
+Vehicle* SyntheticCity::makeVehicle(VehicleType type, int serial) {
+    static const int capacity[VEHICLE_TYPE_COUNT] = {1, 4, 6, 3};
+    static const double farePerKm[VEHICLE_TYPE_COUNT] = {6.0, 15.0, 20.0, 10.0};
+    return new Vehicle("SIM-" + to_string(serial), type, capacity[type], farePerKm[type]);
+}
+
+// DispatchBenchmark
+bool BenchmarkOptions::parse(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        string flag = argv[i];
+        if (flag == "--bench") continue;
+        if (i + 1 >= argc) {
+            cout << "Missing value for " << flag << endl;
+            return false;
+        }
+        const char* value = argv[++i];
+        if (flag == "--drivers") drivers = atoi(value);
+        else if (flag == "--rps") requestsPerSecond = atoi(value);
+        else if (flag == "--seconds") seconds = atof(value);
+        else if (flag == "--threads") threads = atoi(value);
+        else if (flag == "--shards") shards = atoi(value);
+        else if (flag == "--seed") seed = strtoull(value, nullptr, 10);
+        else if (flag == "--strategy") strategy = value;
+        else if (flag == "--trace") tracePath = value;
+        else {
+            cout << "Unknown option " << flag << endl;
+            return false;
+        }
+    }
+    if (drivers < 1 || threads < 1 || shards < 1 || seconds <= 0.0 || requestsPerSecond < 0) {
+        cout << "Benchmark options must be positive." << endl;
+        return false;
+    }
+    unique_ptr<MatchingStrategy> probe(strategyNamed(strategy));
+    if (!probe) {
+        cout << "Unknown strategy " << strategy << endl;
+        return false;
+    }
+    return true;
+}
+
+MatchingStrategy* strategyNamed(const string& name) {
+    if (name == "nearest") return new NearestDriverStrategy();
+    if (name == "haversine") return new NearestDriverStrategy(0.1, HAVERSINE);
+    if (name == "bestrated") return new BestRatedDriverStrategy();
+    if (name == "scored") return new ScoredDriverStrategy(1.0, 0.5, 0.05);
+    if (name == "batch") return new BatchAssignmentStrategy();
+    return nullptr;
+}
+
+void DispatchBenchmark::run(ostream& out) {
+    EventLog::getInstance().setLevel(LOG_OFF);
+    runEndToEnd();
+    runStrategies();
+    runFares();
+    runPersistence();
+    report(out);
+}
+
+void DispatchBenchmark::runEndToEnd() {
+    DispatchService& dispatch = DispatchService::getInstance();
+    dispatch.enableSharding(options.shards);
+    dispatch.setMatchingStrategy(strategyNamed(options.strategy));
+    if (!options.tracePath.empty()) dispatch.startTrace(options.tracePath);
+
+    SyntheticCity city(Location(12.97, 77.59), 0.15, 12, options.seed);
+    for (int i = 0; i < options.drivers; ++i) {
+        VehicleType type = city.sampleType();
+        dispatch.registerDriver(new Driver("sim-driver", "0", SyntheticCity::makeVehicle(type, i),
+                                           city.samplePoint(), 4.0 + (i % 11) * 0.1));
+    }
+
+    // Each thread keeps its share of half the fleet on trips and finishes
+    // its oldest ride whenever it goes over.
+    DispatchMetrics::getInstance().reset();
+    const size_t inFlightLimit = max<size_t>(1, options.drivers / 2 / options.threads);
+    const double perThreadRate = (double)options.requestsPerSecond / options.threads;
+    const auto start = chrono::steady_clock::now();
+    const auto deadline = start + chrono::duration_cast<chrono::steady_clock::duration>(
+                                      chrono::duration<double>(options.seconds));
+
+    struct ThreadStats {
+        LatencyHistogram request, status, complete;
+        uint64_t unmatched = 0;
+    };
+    vector<ThreadStats> stats(options.threads);
+    vector<thread> workers;
+    for (int t = 0; t < options.threads; ++t) {
+        workers.emplace_back([&, t] {
+            ThreadStats& mine = stats[t];
+            SyntheticCity trips(Location(12.97, 77.59), 0.15, 12, options.seed);
+            // Reseed the trips only: the hot spots are shared by all threads.
+            SyntheticCity jitter(Location(12.97, 77.59), 0.15, 12, options.seed + 1 + t);
+            vector<unique_ptr<Rider>> riders;
+            for (int r = 0; r < 64; ++r) {
+                riders.emplace_back(new Rider("sim-rider", "0", Location(12.97, 77.59)));
+            }
+            deque<RideId> inFlight;
+            auto finish = [&] {
+                RideId id = inFlight.front();
+                inFlight.pop_front();
+                auto t0 = chrono::steady_clock::now();
+                dispatch.updateRideStatus(id, EN_ROUTE_TO_PICKUP);
+                auto t1 = chrono::steady_clock::now();
+                dispatch.updateRideStatus(id, IN_PROGRESS);
+                auto t2 = chrono::steady_clock::now();
+                dispatch.completeRide(id);
+                auto t3 = chrono::steady_clock::now();
+                mine.status.record(t1 - t0);
+                mine.status.record(t2 - t1);
+                mine.complete.record(t3 - t2);
+            };
+
+            auto sendAt = chrono::steady_clock::now();
+            for (uint64_t n = 0;; ++n) {
+                if (perThreadRate > 0.0) {
+                    sendAt = start + chrono::duration_cast<chrono::steady_clock::duration>(
+                                         chrono::duration<double>(n / perThreadRate));
+                    if (sendAt >= deadline) break;
+                    this_thread::sleep_until(sendAt);
+                } else {
+                    sendAt = chrono::steady_clock::now();
+                    if (sendAt >= deadline) break;
+                }
+                SyntheticCity& source = (n & 1) ? jitter : trips;
+                Location pickup = source.samplePoint();
+                Location drop = source.samplePoint();
+                VehicleType type = source.sampleType();
+                Rider* rider = riders[n % riders.size()].get();
+
+                PinnedRide ride = dispatch.requestRide(rider, pickup, drop, type);
+                mine.request.record(chrono::steady_clock::now() - sendAt);
+                if (ride->getStatus() == CANCELLED) {
+                    ++mine.unmatched;
+                } else {
+                    inFlight.push_back(ride->getId());
+                }
+                if (inFlight.size() > inFlightLimit) finish();
+            }
+            while (!inFlight.empty()) finish();
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    dispatch.stopTrace();
+
+    Result request{"requestRide", LatencyHistogram(), elapsed};
+    Result status{"updateRideStatus", LatencyHistogram(), elapsed};
+    Result complete{"completeRide", LatencyHistogram(), elapsed};
+    for (const ThreadStats& s : stats) {
+        request.latency.merge(s.request);
+        status.latency.merge(s.status);
+        complete.latency.merge(s.complete);
+        unmatched += s.unmatched;
+    }
+    results.push_back(request);
+    results.push_back(status);
+    results.push_back(complete);
+
+    // Where the end-to-end time went, from DispatchMetrics.
+    DispatchMetrics::Snapshot metrics = DispatchMetrics::getInstance().snapshot();
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        if (metrics.stages[s].count() == 0) continue;
+        results.push_back(Result{string("  stage ") + DispatchMetrics::stageName((MetricStage)s),
+                                 metrics.stages[s], elapsed});
+    }
+    candidates = metrics.candidates;
+}
+
+template <class Fn> void DispatchBenchmark::timeMicro(const string& name, Fn fn) {
+    Result result{name, LatencyHistogram(), 0.0, MICRO_CALLS};
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < MICRO_CALLS; ++i) fn(i);
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    results.push_back(result);
+}
+
+void DispatchBenchmark::runStrategies() {
+    // A private pool, so the strategies see the whole fleet available.
+    SyntheticCity city(Location(12.97, 77.59), 0.15, 12, options.seed);
+    vector<unique_ptr<Driver>> drivers;
+    vector<unique_ptr<Vehicle>> vehicles;
+    DriverPool pool;
+    for (int i = 0; i < options.drivers; ++i) {
+        VehicleType type = city.sampleType();
+        vehicles.emplace_back(SyntheticCity::makeVehicle(type, i));
+        drivers.emplace_back(new Driver("sim-driver", "0", vehicles.back().get(),
+                                        city.samplePoint(), 4.0 + (i % 11) * 0.1));
+        pool.add(drivers.back().get());
+    }
+    Rider rider("sim-rider", "0", Location(12.97, 77.59));
+    vector<RideRequest> requests;
+    for (int i = 0; i < 4096; ++i) {
+        requests.emplace_back(&rider, city.samplePoint(), city.samplePoint(), city.sampleType());
+    }
+
+    struct Entry {
+        string name;
+        MatchingStrategy* strategy;
+    };
+    vector<Entry> strategies = {
+        {"NearestDriverStrategy", new NearestDriverStrategy()},
+        {"NearestDriverStrategy/haversine", new NearestDriverStrategy(0.1, HAVERSINE)},
+        {"BestRatedDriverStrategy", new BestRatedDriverStrategy()},
+        {"ScoredDriverStrategy", new ScoredDriverStrategy(1.0, 0.5, 0.05)},
+    };
+    volatile int sink = 0;
+    for (Entry& entry : strategies) {
+        const ScoreWeights* weights = entry.strategy->scoreWeights();
+        pool.setScoreWeights(weights ? *weights : ScoreWeights());
+        Result result{entry.name, LatencyHistogram(), 0.0};
+        auto start = chrono::steady_clock::now();
+        for (int s = 0; s < MICRO_SAMPLES; ++s) {
+            const RideRequest& request = requests[s % requests.size()];
+            auto t0 = chrono::steady_clock::now();
+            sink = sink + entry.strategy->chooseSlot(request, pool);
+            result.latency.record(chrono::steady_clock::now() - t0);
+        }
+        result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        results.push_back(result);
+        delete entry.strategy;
+    }
+
+    // Windows of 16 requests, one sample per window.
+    const size_t WINDOW = 16;
+    BatchAssignmentStrategy batch;
+    pool.setScoreWeights(ScoreWeights());
+    Result result{"BatchAssignmentStrategy/16 window", LatencyHistogram(), 0.0};
+    auto start = chrono::steady_clock::now();
+    for (int s = 0; s < MICRO_SAMPLES / (int)WINDOW; ++s) {
+        vector<RideRequest> window;
+        for (size_t i = 0; i < WINDOW; ++i) {
+            window.push_back(requests[(s * WINDOW + i) % requests.size()]);
+        }
+        auto t0 = chrono::steady_clock::now();
+        sink = sink + (int)batch.chooseDrivers(window, pool).size();
+        result.latency.record(chrono::steady_clock::now() - t0);
+    }
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    results.push_back(result);
+}
+
+void DispatchBenchmark::runFares() {
+    SyntheticCity city(Location(12.97, 77.59), 0.15, 12, options.seed);
+    Rider rider("sim-rider", "0", Location(12.97, 77.59));
+    rider.setDiscountAmount(20.0);
+    unique_ptr<Vehicle> vehicle(SyntheticCity::makeVehicle(SEDAN, 0));
+    Driver driver("sim-driver", "0", vehicle.get(), city.samplePoint(), 4.5);
+    vector<unique_ptr<Ride>> rides;
+    for (int i = 0; i < 256; ++i) {
+        rides.emplace_back(new Ride(0, &rider, city.samplePoint(), city.samplePoint(), SEDAN));
+        rides.back()->assignDriver(&driver);
+    }
+
+    BaseFareCalculator base;
+    SurgePricingDecorator surge(new BaseFareCalculator(), 1.5);
+    DiscountDecorator surgeDiscount(new SurgePricingDecorator(new BaseFareCalculator(), 1.5), 20.0);
+    FareEngine engine(true, 1.5);
+
+    volatile double sink = 0.0;
+    timeMicro("BaseFareCalculator", [&](int i) { sink = sink + base.calculate(rides[i & 255].get()); });
+    timeMicro("SurgePricingDecorator", [&](int i) { sink = sink + surge.calculate(rides[i & 255].get()); });
+    timeMicro("Surge+DiscountDecorator",
+              [&](int i) { sink = sink + surgeDiscount.calculate(rides[i & 255].get()); });
+    timeMicro("FareEngine", [&](int i) { sink = sink + engine.calculate(rides[i & 255].get()); });
+
+    DispatchService& dispatch = DispatchService::getInstance();
+    vector<pair<Location, Location>> trips;
+    for (int i = 0; i < 4096; ++i) trips.push_back({city.samplePoint(), city.samplePoint()});
+    auto quote = [&](int i) {
+        const auto& trip = trips[i & 4095];
+        sink = sink + dispatch.quoteFares(&rider, trip.first, trip.second)[SEDAN];
+    };
+    timeMicro("quoteFares", quote);
+    dispatch.enableQuoteCache();
+    timeMicro("quoteFares/cached", quote);
+}
+
+// One saveSnapshot of the end-to-end fleet, and one restoreState of it into
+// a fresh service, in a scratch directory.
+void DispatchBenchmark::runPersistence() {
+#ifdef DISPATCH_HAVE_MMAP
+    char dir[] = "/tmp/dispatch-bench-XXXXXX";
+    if (!mkdtemp(dir)) return;
+    auto timeOnce = [&](const string& name, function<void()> fn) {
+        Result result{name, LatencyHistogram(), 0.0};
+        auto start = chrono::steady_clock::now();
+        fn();
+        auto elapsed = chrono::steady_clock::now() - start;
+        result.latency.record(elapsed);
+        result.seconds = chrono::duration<double>(elapsed).count();
+        results.push_back(result);
+    };
+    DispatchService& dispatch = DispatchService::getInstance();
+    dispatch.enablePersistence(dir);
+    timeOnce("saveSnapshot", [&] { dispatch.saveSnapshot(); });
+    dispatch.disablePersistence();
+    {
+        unique_ptr<DispatchService> restored(new DispatchService());
+        timeOnce("restoreState", [&] { restored->restoreState(dir); });
+        restored->disablePersistence();
+    }
+    unlink((string(dir) + "/state.img").c_str());
+    unlink((string(dir) + "/journal.bin").c_str());
+    rmdir(dir);
+#endif
+}
+
+void DispatchBenchmark::report(ostream& out) const {
+    out << "--- Dispatch benchmark ---" << endl;
+    out << options.drivers << " drivers, " << options.strategy << ", " << options.threads
+        << " threads, " << options.shards << " shards, ";
+    if (options.requestsPerSecond > 0) out << options.requestsPerSecond << " requests/s, ";
+    else out << "unpaced, ";
+    out << options.seconds << " s, " << unmatched << " requests unmatched" << endl;
+    out << left << setw(34) << "operation" << right << setw(10) << "ops" << setw(12) << "ops/s"
+        << setw(12) << "mean us" << setw(12) << "p50 us" << setw(12) << "p99 us" << setw(12)
+        << "p999 us" << setw(12) << "max us" << endl;
+    out << fixed;
+    auto row = [&](const Result& r) {
+        const LatencyHistogram& h = r.latency;
+        uint64_t ops = r.calls ? r.calls : h.count();
+        double mean = r.calls ? r.seconds * 1e9 / r.calls : h.mean();
+        out << left << setw(34) << r.name << right << setw(10) << ops << setw(12)
+            << setprecision(0) << (r.seconds > 0.0 ? ops / r.seconds : 0.0)
+            << setprecision(3) << setw(12) << mean / 1000.0;
+        if (r.calls) {
+            out << setw(12) << "-" << setw(12) << "-" << setw(12) << "-" << setw(12) << "-" << endl;
+            return;
+        }
+        out << setw(12) << h.percentile(0.50) / 1000.0 << setw(12) << h.percentile(0.99) / 1000.0
+            << setw(12) << h.percentile(0.999) / 1000.0 << setw(12) << h.maxRecorded() / 1000.0
+            << endl;
+    };
+    for (const Result& r : results) row(r);
+    out << "candidates scanned per match: p50 " << candidates.percentile(0.5) << ", p99 "
+        << candidates.percentile(0.99) << ", max " << candidates.maxRecorded() << endl;
+    out.unsetf(ios::floatfield);
+    out << left;
+}
+
+// TraceReplayer
+bool TraceReplayer::replay(const string& path, double speed, Report& report) {
+    MappedFile file(path);
+    size_t count = file.size() / sizeof(TraceRecord);
+    const TraceRecord* records = (const TraceRecord*)file.data();
+    if (count == 0 || records[0].op != TRACE_BEGIN || records[0].driverId != TRACE_MAGIC ||
+        records[0].capacity != TRACE_VERSION) {
+        cout << "Not a dispatch trace: " << path << "." << endl;
+        return false;
+    }
+
+    // Pings wait for the traced flushes, so the window never fires.
+    service.configureLocationIngestion(chrono::hours(24 * 365), numeric_limits<size_t>::max());
+    service.pinPoolClock(0.0);
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 1; i < count; ++i) {
+        const TraceRecord& record = records[i];
+        if (speed > 0.0) {
+            this_thread::sleep_until(start + chrono::nanoseconds((int64_t)(record.atNs / speed)));
+        }
+        service.pinPoolClock(record.atNs / 60e9);
+        if (record.op != TRACE_LOCATION_PING && !pings.empty()) {
+            service.ingestLocations(pings);
+            pings.clear();
+        }
+        apply(record, report);
+        ++report.records;
+    }
+    if (!pings.empty()) {
+        service.ingestLocations(pings);
+        pings.clear();
+    }
+    report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return true;
+}
+
+Driver* TraceReplayer::driverFor(int tracedId, Report& report) {
+    auto it = drivers.find(tracedId);
+    if (it != drivers.end()) return it->second;
+    ++report.skipped;
+    return nullptr;
+}
+
+void TraceReplayer::apply(const TraceRecord& record, Report& report) {
+    switch ((TraceOp)record.op) {
+        case TRACE_REGISTER_DRIVER: {
+            vehicles.emplace_back(new Vehicle("TRACE-" + to_string(record.driverId),
+                                              (VehicleType)record.type, record.capacity,
+                                              record.farePerKm));
+            ownedDrivers.emplace_back(new Driver("trace-driver", "0", vehicles.back().get(),
+                                                 Location(record.latitude, record.longitude),
+                                                 record.value));
+            drivers[record.driverId] = ownedDrivers.back().get();
+            service.registerDriver(ownedDrivers.back().get());
+            break;
+        }
+        case TRACE_DEREGISTER_DRIVER:
+            if (Driver* d = driverFor(record.driverId, report)) service.deregisterDriver(d);
+            break;
+        case TRACE_RATE_DRIVER:
+            if (Driver* d = driverFor(record.driverId, report)) service.rateDriver(d, record.value);
+            break;
+        case TRACE_MOVE_DRIVER:
+            if (Driver* d = driverFor(record.driverId, report)) {
+                service.moveDriver(d, Location(record.latitude, record.longitude));
+            }
+            break;
+        case TRACE_LOCATION_PING:
+            if (Driver* d = driverFor(record.driverId, report)) {
+                pings.push_back(LocationPing{d->getId(), record.latitude, record.longitude,
+                                             record.stamp});
+            }
+            break;
+        case TRACE_FLUSH_LOCATIONS:
+            service.flushLocationUpdates();
+            break;
+        case TRACE_REQUEST_RIDE: {
+            unique_ptr<Rider>& rider = riders[record.riderId];
+            if (!rider) rider.reset(new Rider("trace-rider", "0", Location(record.latitude, record.longitude)));
+            Location pickup(record.latitude, record.longitude);
+            auto t0 = chrono::steady_clock::now();
+            PinnedRide ride = service.requestRide(rider.get(), pickup,
+                                                  Location(record.dropLatitude, record.dropLongitude),
+                                                  (VehicleType)record.type);
+            report.request.record(chrono::steady_clock::now() - t0);
+            if (ride->getStatus() == CANCELLED) {
+                ++report.unmatched;
+                break;
+            }
+            ++report.matched;
+            Location at = ride->getDriver()->getCurrentLocation();
+            report.pickupKm += at.haversineKm(pickup);
+            rides[(RideId)record.stamp] = ride;
+            break;
+        }
+        case TRACE_RIDE_STATUS: {
+            auto it = rides.find((RideId)record.stamp);
+            if (it == rides.end()) {
+                ++report.skipped;
+                break;
+            }
+            auto t0 = chrono::steady_clock::now();
+            service.updateRideStatus(it->second->getId(), (RideStatus)record.status);
+            report.status.record(chrono::steady_clock::now() - t0);
+            break;
+        }
+        case TRACE_COMPLETE_RIDE: {
+            auto it = rides.find((RideId)record.stamp);
+            if (it == rides.end()) {
+                ++report.skipped;
+                break;
+            }
+            auto t0 = chrono::steady_clock::now();
+            service.completeRide(it->second->getId());
+            report.complete.record(chrono::steady_clock::now() - t0);
+            // Payments run inline here unless the caller made them async.
+            ++report.completed;
+            report.fares += it->second->getFare();
+            rides.erase(it);
+            break;
+        }
+        case TRACE_CANCEL_RIDE: {
+            auto it = rides.find((RideId)record.stamp);
+            if (it == rides.end()) {
+                ++report.skipped;
+                break;
+            }
+            if (service.cancelRide(it->second->getId(), (CancelReason)record.status)) {
+                ++report.cancelled;
+            }
+            rides.erase(it);
+            break;
+        }
+        case TRACE_SURGE_ON:
+            service.activateSurge(record.value);
+            break;
+        case TRACE_SURGE_OFF:
+            service.deactivateSurge();
+            break;
+        default:
+            ++report.skipped;
+            break;
+    }
+}
+
+bool ReplayOptions::parse(int argc, char** argv) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string flag = argv[i];
+        const char* value = argv[i + 1];
+        if (flag == "--replay") path = value;
+        else if (flag == "--strategy") strategy = value;
+        else if (flag == "--speed") speed = atof(value);
+        else if (flag == "--shards") shards = atoi(value);
+        else {
+            cout << "Unknown option " << flag << endl;
+            return false;
+        }
+    }
+    if (argc % 2 == 0) {
+        cout << "Missing value for " << argv[argc - 1] << endl;
+        return false;
+    }
+    if (path.empty() || speed < 0.0 || shards < 1) {
+        cout << "Replay needs a trace path, a speed >= 0 and at least one shard." << endl;
+        return false;
+    }
+    unique_ptr<MatchingStrategy> probe(strategyNamed(strategy));
+    if (!probe) {
+        cout << "Unknown strategy " << strategy << endl;
+        return false;
+    }
+    return true;
+}
+
+void TraceReplayer::Report::print(ostream& out) const {
+    out << "--- Trace replay ---" << endl;
+    out << records << " records in " << seconds << " s, " << skipped << " skipped" << endl;
+    out << matched << " matched, " << unmatched << " unmatched, " << completed << " completed, "
+        << cancelled << " cancelled" << endl;
+    out << fixed << setprecision(3);
+    out << "mean pickup distance " << (matched ? pickupKm / matched : 0.0) << " km, mean fare "
+        << (completed ? fares / completed : 0.0) << endl;
+    const pair<const char*, const LatencyHistogram*> rows[] = {
+        {"requestRide", &request}, {"updateRideStatus", &status}, {"completeRide", &complete}};
+    for (const auto& row : rows) {
+        const LatencyHistogram& h = *row.second;
+        out << left << setw(20) << row.first << right << setw(10) << h.count() << "  p50 "
+            << h.percentile(0.50) / 1000.0 << " us  p99 " << h.percentile(0.99) / 1000.0
+            << " us  p999 " << h.percentile(0.999) / 1000.0 << " us" << endl;
+    }
+    out.unsetf(ios::floatfield);
+    out << left;
+}
+
+// ZoneRing
+void ZoneRing::addNode(int node) {
+    for (int v = 0; v < VIRTUAL_POINTS; ++v) {
+        points.emplace_back(mix(((uint64_t)(uint32_t)node << 32) | (uint32_t)v), node);
+    }
+    sort(points.begin(), points.end());
+}
+
+void ZoneRing::removeNode(int node) {
+    points.erase(remove_if(points.begin(), points.end(),
+                           [node](const pair<uint64_t, int>& p) { return p.second == node; }),
+                 points.end());
+}
+
+int ZoneRing::ownerAfter(int cellX, int cellY, int skip) const {
+    if (points.empty()) return -1;
+    uint64_t h = mix(((uint64_t)(uint32_t)cellX << 32) | (uint32_t)cellY);
+    size_t start = lower_bound(points.begin(), points.end(), make_pair(h, numeric_limits<int>::min())) - points.begin();
+    for (size_t i = 0; i < points.size(); ++i) {
+        int node = points[(start + i) % points.size()].second;
+        if (node != skip) return node;
+    }
+    return -1;
+}
+
+// Cluster wire protocol
+vector<uint8_t> WireWriter::frame() const {
+    vector<uint8_t> out;
+    out.reserve(payload.size() + 6);
+    out.push_back((uint8_t)type);
+    uint64_t n = payload.size();
+    while (n >= 0x80) {
+        out.push_back((uint8_t)(n | 0x80));
+        n >>= 7;
+    }
+    out.push_back((uint8_t)n);
+    out.insert(out.end(), payload.begin(), payload.end());
+    return out;
+}
+
+WireReader::WireReader(const vector<uint8_t>& frame)
+    : pos(frame.data()), end(frame.data() + frame.size()), type(WIRE_ERROR), valid(!frame.empty()) {
+    if (!valid) return;
+    type = (WireType)*pos++;
+    uint64_t length = varint();
+    if (valid && length != (uint64_t)(end - pos)) valid = false;
+}
+
+uint64_t WireReader::varint() {
+    uint64_t v = 0;
+    for (int shift = 0; valid && shift < 64; shift += 7) {
+        if (pos == end) break;
+        uint8_t byte = *pos++;
+        v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return v;
+    }
+    valid = false;
+    return 0;
+}
+
+double WireReader::real() {
+    double v = 0.0;
+    if (!valid || end - pos < (ptrdiff_t)sizeof(v)) {
+        valid = false;
+        return 0.0;
+    }
+    memcpy(&v, pos, sizeof(v));
+    pos += sizeof(v);
+    return v;
+}
+
+string WireReader::text() {
+    uint64_t n = varint();
+    if (!valid || n > (uint64_t)(end - pos)) {
+        valid = false;
+        return string();
+    }
+    string s((const char*)pos, (size_t)n);
+    pos += n;
+    return s;
+}
+
+void writeDriverState(WireWriter& out, const Driver* driver, const Location& loc) {
+    const Vehicle* v = driver->getVehicle();
+    out.varint((uint64_t)driver->getId())
+        .varint((uint64_t)v->getType())
+        .varint((uint64_t)v->getCapacity())
+        .real(v->getFarePerKm())
+        .real(driver->getRating())
+        .location(loc)
+        .text(driver->getName())
+        .text(driver->getPhone())
+        .text(v->getPlateNumber());
+}
+
+bool readDriverState(WireReader& in, WireDriverState& state) {
+    state.id = (int)in.varint();
+    uint64_t type = in.varint();
+    state.type = type < (uint64_t)VEHICLE_TYPE_COUNT ? (VehicleType)type : SEDAN;
+    state.capacity = (int)in.varint();
+    state.farePerKm = in.real();
+    state.rating = in.real();
+    state.location = in.location();
+    state.name = in.text();
+    state.phone = in.text();
+    state.plate = in.text();
+    return in.ok() && type < (uint64_t)VEHICLE_TYPE_COUNT;
+}
+
+// ClusterTransport
+vector<uint8_t> LocalTransport::call(int node, const vector<uint8_t>& frame) {
+    shared_lock<shared_mutex> guard(lock);
+    auto it = nodes.find(node);
+    if (it == nodes.end()) return vector<uint8_t>();
+    vector<uint8_t> reply = it->second->handle(frame);
+    frames.fetch_add(2, memory_order_relaxed);
+    bytes.fetch_add(frame.size() + reply.size(), memory_order_relaxed);
+    return reply;
+}
+
+// ClusterNode
+Driver* ClusterNode::hostedDriver(int driverId) {
+    auto it = drivers.find(driverId);
+    return it != drivers.end() && it->second.hosted ? it->second.driver.get() : nullptr;
+}
+
+void ClusterNode::host(const WireDriverState& state) {
+    HostedDriver& entry = drivers[state.id];
+    if (entry.hosted) {
+        service.moveDriver(entry.driver.get(), state.location);
+        service.rateDriver(entry.driver.get(), state.rating);
+        return;
+    }
+    if (!entry.driver) {
+        entry.vehicle.reset(new Vehicle(state.plate, state.type, state.capacity, state.farePerKm));
+        entry.driver.reset(new Driver(state.id, state.name, state.phone, entry.vehicle.get(),
+                                      state.location, state.rating));
+        service.registerDriver(entry.driver.get());
+    } else {
+        // Registered where it last was, then moved, so a sharded service
+        // rehomes it properly.
+        service.registerDriver(entry.driver.get());
+        service.moveDriver(entry.driver.get(), state.location);
+        service.rateDriver(entry.driver.get(), state.rating);
+    }
+    entry.hosted = true;
+}
+
+size_t ClusterNode::hostedDriverCount() {
+    lock_guard<mutex> guard(lock);
+    size_t n = 0;
+    for (const auto& entry : drivers) n += entry.second.hosted;
+    return n;
+}
+
+vector<uint8_t> ClusterNode::handle(const vector<uint8_t>& frame) {
+    WireReader in(frame);
+    if (!in.ok()) return error();
+    switch (in.messageType()) {
+        case WIRE_DRIVER_STATE: {
+            WireDriverState state;
+            if (!readDriverState(in, state)) return error();
+            lock_guard<mutex> guard(lock);
+            host(state);
+            return ack();
+        }
+        case WIRE_DRIVER_REPLICA: {
+            WireDriverState state;
+            if (!readDriverState(in, state)) return error();
+            lock_guard<mutex> guard(lock);
+            replicas[state.id] = frame;
+            return ack();
+        }
+        case WIRE_DROP_REPLICA: {
+            int driverId = (int)in.varint();
+            lock_guard<mutex> guard(lock);
+            replicas.erase(driverId);
+            return ack();
+        }
+        case WIRE_PROMOTE_REPLICA: {
+            int driverId = (int)in.varint();
+            Location loc = in.location();
+            if (!in.ok()) return error();
+            lock_guard<mutex> guard(lock);
+            auto it = replicas.find(driverId);
+            if (it == replicas.end()) return error();
+            WireReader copy(it->second);
+            WireDriverState state;
+            if (!readDriverState(copy, state)) return error();
+            state.location = loc;
+            replicas.erase(it);
+            host(state);
+            return ack();
+        }
+        case WIRE_DRIVER_EXPORT:
+            return exportDriver(in);
+        case WIRE_DRIVER_SNAPSHOT: {
+            int driverId = (int)in.varint();
+            lock_guard<mutex> guard(lock);
+            Driver* driver = hostedDriver(driverId);
+            if (!driver) return error();
+            WireWriter out(WIRE_DRIVER_STATE);
+            writeDriverState(out, driver, driver->getCurrentLocation());
+            return out.frame();
+        }
+        case WIRE_DRIVER_MOVE: {
+            int driverId = (int)in.varint();
+            Location loc = in.location();
+            if (!in.ok()) return error();
+            lock_guard<mutex> guard(lock);
+            Driver* driver = hostedDriver(driverId);
+            if (!driver) return error();
+            service.moveDriver(driver, loc);
+            return ack();
+        }
+        case WIRE_DRIVER_RATE: {
+            int driverId = (int)in.varint();
+            double rating = in.real();
+            if (!in.ok()) return error();
+            lock_guard<mutex> guard(lock);
+            Driver* driver = hostedDriver(driverId);
+            if (!driver) return error();
+            service.rateDriver(driver, rating);
+            return ack();
+        }
+        case WIRE_DRIVER_REMOVE: {
+            int driverId = (int)in.varint();
+            lock_guard<mutex> guard(lock);
+            Driver* driver = hostedDriver(driverId);
+            if (!driver) return error();
+            service.deregisterDriver(driver);
+            drivers[driverId].hosted = false;
+            return ack();
+        }
+        case WIRE_CANDIDATE_QUERY: {
+            uint64_t type = in.varint();
+            Location pickup = in.location();
+            Location drop = in.location();
+            if (!in.ok() || type >= (uint64_t)VEHICLE_TYPE_COUNT) return error();
+            double rank = 0.0;
+            Driver* best = service.bestCandidate(RideRequest(nullptr, pickup, drop, (VehicleType)type),
+                                                 &rank);
+            WireWriter out(WIRE_CANDIDATE_REPLY);
+            out.varint(best ? 1 : 0).varint(best ? (uint64_t)best->getId() : 0).real(rank);
+            return out.frame();
+        }
+        case WIRE_RIDE_REQUEST:
+            return requestRide(in);
+        case WIRE_RIDE_STATUS: {
+            RideId rideId = in.varint();
+            uint64_t status = in.varint();
+            if (!in.ok() || status >= (uint64_t)RIDE_STATUS_COUNT) return error();
+            service.updateRideStatus(rideId, (RideStatus)status);
+            return ack();
+        }
+        case WIRE_RIDE_COMPLETE:
+            return completeRide(in);
+        case WIRE_RIDE_CANCEL:
+            return cancelRide(in);
+        default:
+            return error();
+    }
+}
+
+// Hands the driver over unless it is on a trip, in which case it stays
+// here until the trip ends and only its location is updated. Claiming it
+// first keeps a concurrent match from taking it halfway through.
+vector<uint8_t> ClusterNode::exportDriver(WireReader& in) {
+    int driverId = (int)in.varint();
+    Location loc = in.location();
+    if (!in.ok()) return error();
+    lock_guard<mutex> guard(lock);
+    Driver* driver = hostedDriver(driverId);
+    if (!driver) return error();
+    if (!driver->tryClaim()) {
+        service.moveDriver(driver, loc);
+        return ack();
+    }
+    service.deregisterDriver(driver);
+    drivers[driverId].hosted = false;
+    replicas.erase(driverId);
+    WireWriter out(WIRE_DRIVER_STATE);
+    writeDriverState(out, driver, loc);
+    return out.frame();
+}
+
+vector<uint8_t> ClusterNode::requestRide(WireReader& in) {
+    int riderId = (int)in.varint();
+    string name = in.text();
+    string phone = in.text();
+    double discount = in.real();
+    uint64_t type = in.varint();
+    Location pickup = in.location();
+    Location drop = in.location();
+    if (!in.ok() || type >= (uint64_t)VEHICLE_TYPE_COUNT) return error();
+    Rider* rider;
+    {
+        lock_guard<mutex> guard(lock);
+        unique_ptr<Rider>& stub = riders[riderId];
+        if (!stub) stub.reset(new Rider(riderId, name, phone, pickup));
+        rider = stub.get();
+    }
+    rider->updateLocation(pickup);
+    rider->setDiscountAmount(discount);
+    PinnedRide ride = service.requestRide(rider, pickup, drop, (VehicleType)type);
+    RideId rideId = ride->getId();
+    RideStatus status = ride->getStatus();
+    int driverId = ride->getDriver() ? ride->getDriver()->getId() : 0;
+    if (driverId) {
+        lock_guard<mutex> guard(lock);
+        rideDrivers[rideId] = driverId;
+    }
+    WireWriter out(WIRE_RIDE_REPLY);
+    out.varint(rideId).varint((uint64_t)status).varint((uint64_t)driverId);
+    return out.frame();
+}
+
+vector<uint8_t> ClusterNode::completeRide(WireReader& in) {
+    RideId rideId = in.varint();
+    if (!in.ok()) return error();
+    int driverId;
+    {
+        lock_guard<mutex> guard(lock);
+        auto it = rideDrivers.find(rideId);
+        if (it == rideDrivers.end()) return error();
+        driverId = it->second;
+        rideDrivers.erase(it);
+    }
+    service.completeRide(rideId);
+    WireWriter out(WIRE_ACK);
+    out.varint((uint64_t)driverId);
+    return out.frame();
+}
+
+vector<uint8_t> ClusterNode::cancelRide(WireReader& in) {
+    RideId rideId = in.varint();
+    uint64_t reason = in.varint();
+    if (!in.ok() || reason >= (uint64_t)CANCEL_REASON_COUNT) return error();
+    int driverId;
+    {
+        lock_guard<mutex> guard(lock);
+        auto it = rideDrivers.find(rideId);
+        if (it == rideDrivers.end()) return error();
+        driverId = it->second;
+    }
+    if (!service.cancelRide(rideId, (CancelReason)reason)) return error();
+    {
+        lock_guard<mutex> guard(lock);
+        rideDrivers.erase(rideId);
+    }
+    WireWriter out(WIRE_ACK);
+    out.varint((uint64_t)driverId);
+    return out.frame();
+}
+
+// DispatchCluster
+vector<int> DispatchCluster::nodesNear(const Location& loc) const {
+    vector<int> result;
+    int home = ownerOf(loc);
+    if (home < 0) return result;
+    result.push_back(home);
+
+    double gx = loc.latitude / zoneCellSize;
+    double gy = loc.longitude / zoneCellSize;
+    int cx = (int)std::floor(gx);
+    int cy = (int)std::floor(gy);
+    double margin = borderMargin / zoneCellSize;
+    for (int dx = -1; dx <= 1; ++dx) {
+        for (int dy = -1; dy <= 1; ++dy) {
+            if (dx == 0 && dy == 0) continue;
+            bool nearX = dx == 0 || (dx < 0 ? gx - cx < margin : cx + 1 - gx < margin);
+            bool nearY = dy == 0 || (dy < 0 ? gy - cy < margin : cy + 1 - gy < margin);
+            if (!nearX || !nearY) continue;
+            int n = ring.ownerOf(cx + dx, cy + dy);
+            if (find(result.begin(), result.end(), n) == result.end()) result.push_back(n);
+        }
+    }
+    return result;
+}
+
+void DispatchCluster::migrate(int driverId, DriverEntry& entry, int target) {
+    WireWriter request(WIRE_DRIVER_EXPORT);
+    request.varint((uint64_t)driverId).location(entry.location);
+    vector<uint8_t> state = transport.call(entry.node, request.frame());
+    WireReader reply(state);
+    // An ack means the driver is on a trip and stays until it ends.
+    if (!reply.ok() || reply.messageType() != WIRE_DRIVER_STATE) return;
+    vector<uint8_t> answer = transport.call(target, state);
+    if (frameType(answer) != WIRE_ACK) {
+        // The target is gone; give the driver back.
+        transport.call(entry.node, state);
+        return;
+    }
+    entry.node = target;
+    migrations.fetch_add(1, memory_order_relaxed);
+    replicate(driverId, entry);
+}
+
+// The copy lives on the node that would take the driver's cell over if
+// its host were lost.
+void DispatchCluster::replicate(int driverId, DriverEntry& entry) {
+    int replica = ring.ownerAfter(cellX(entry.location), cellY(entry.location), entry.node);
+    if (entry.replica >= 0 && entry.replica != replica) {
+        WireWriter drop(WIRE_DROP_REPLICA);
+        drop.varint((uint64_t)driverId);
+        transport.call(entry.replica, drop.frame());
+    }
+    entry.replica = -1;
+    if (replica < 0) return;
+    WireWriter snapshot(WIRE_DRIVER_SNAPSHOT);
+    snapshot.varint((uint64_t)driverId);
+    vector<uint8_t> state = transport.call(entry.node, snapshot.frame());
+    if (frameType(state) != WIRE_DRIVER_STATE) return;
+    // Same payload, other message type.
+    state[0] = WIRE_DRIVER_REPLICA;
+    if (frameType(transport.call(replica, state)) == WIRE_ACK) entry.replica = replica;
+}
+
+void DispatchCluster::rehome(int driverId) {
+    DriverEntry entry;
+    if (!lookup(driverId, entry)) return;
+    int owner = ownerOf(entry.location);
+    if (owner < 0 || owner == entry.node) return;
+    migrate(driverId, entry, owner);
+    store(driverId, entry);
+}
+
+void DispatchCluster::rebalance() {
+    vector<int> ids;
+    for (const auto& entry : drivers) ids.push_back(entry.first);
+    for (int id : ids) {
+        DriverEntry& entry = drivers[id];
+        int owner = ownerOf(entry.location);
+        if (owner >= 0 && owner != entry.node) migrate(id, entry, owner);
+        if (entry.replica != ring.ownerAfter(cellX(entry.location), cellY(entry.location), entry.node)) {
+            replicate(id, entry);
+        }
+    }
+}
+
+int DispatchCluster::addNode() {
+    unique_lock<shared_mutex> guard(topologyLock);
+    int id = (int)nodes.size();
+    nodes.emplace_back(new ClusterNode(id));
+    nodeUp.push_back(true);
+    transport.attach(id, nodes.back().get());
+    ring.addNode(id);
+    rebalance();
+    return id;
+}
+
+bool DispatchCluster::failNode(int nodeId) {
+    unique_lock<shared_mutex> guard(topologyLock);
+    if (nodeId < 0 || nodeId >= (int)nodes.size() || !nodeUp[nodeId]) return false;
+    nodeUp[nodeId] = false;
+    transport.detach(nodeId);
+    ring.removeNode(nodeId);
+
+    for (auto it = rides.begin(); it != rides.end();) {
+        if (it->second == nodeId) {
+            lostRides.fetch_add(1, memory_order_relaxed);
+            it = rides.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto it = drivers.begin(); it != drivers.end();) {
+        DriverEntry& entry = it->second;
+        if (entry.replica == nodeId) entry.replica = -1;
+        if (entry.node != nodeId) {
+            ++it;
+            continue;
+        }
+        WireWriter promote(WIRE_PROMOTE_REPLICA);
+        promote.varint((uint64_t)it->first).location(entry.location);
+        if (entry.replica >= 0 &&
+            frameType(transport.call(entry.replica, promote.frame())) == WIRE_ACK) {
+            entry.node = entry.replica;
+            entry.replica = -1;
+            promotedDrivers.fetch_add(1, memory_order_relaxed);
+            ++it;
+        } else {
+            lostDrivers.fetch_add(1, memory_order_relaxed);
+            it = drivers.erase(it);
+        }
+    }
+    rebalance();
+    return true;
+}
+
+bool DispatchCluster::registerDriver(const Driver* driver) {
+    shared_lock<shared_mutex> topology(topologyLock);
+    int driverId = driver->getId();
+    lock_guard<mutex> stripe(driverStripes[(size_t)driverId % DRIVER_STRIPES]);
+    DriverEntry entry{ownerOf(driver->getCurrentLocation()), -1, driver->getCurrentLocation()};
+    if (entry.node < 0) {
+        EventLog::getInstance().message(LOG_WARN,
+                                        string("Cluster has no nodes; driver ") +
+                                        to_string(driverId) + " not registered.");
+        return false;
+    }
+    WireWriter state(WIRE_DRIVER_STATE);
+    writeDriverState(state, driver, entry.location);
+    if (frameType(transport.call(entry.node, state.frame())) != WIRE_ACK) return false;
+    replicate(driverId, entry);
+    store(driverId, entry);
+    return true;
+}
+
+void DispatchCluster::deregisterDriver(int driverId) {
+    shared_lock<shared_mutex> topology(topologyLock);
+    lock_guard<mutex> stripe(driverStripes[(size_t)driverId % DRIVER_STRIPES]);
+    DriverEntry entry;
+    if (!lookup(driverId, entry)) return;
+    WireWriter remove(WIRE_DRIVER_REMOVE);
+    remove.varint((uint64_t)driverId);
+    transport.call(entry.node, remove.frame());
+    if (entry.replica >= 0) {
+        WireWriter drop(WIRE_DROP_REPLICA);
+        drop.varint((uint64_t)driverId);
+        transport.call(entry.replica, drop.frame());
+    }
+    lock_guard<mutex> guard(directoryLock);
+    drivers.erase(driverId);
+}
+
+void DispatchCluster::moveDriver(int driverId, const Location& loc) {
+    shared_lock<shared_mutex> topology(topologyLock);
+    lock_guard<mutex> stripe(driverStripes[(size_t)driverId % DRIVER_STRIPES]);
+    DriverEntry entry;
+    if (!lookup(driverId, entry)) return;
+    entry.location = loc;
+    int owner = ownerOf(loc);
+    if (owner >= 0 && owner != entry.node) {
+        migrate(driverId, entry, owner);
+    } else {
+        WireWriter move(WIRE_DRIVER_MOVE);
+        move.varint((uint64_t)driverId).location(loc);
+        transport.call(entry.node, move.frame());
+    }
+    store(driverId, entry);
+}
+
+void DispatchCluster::rateDriver(int driverId, double rating) {
+    shared_lock<shared_mutex> topology(topologyLock);
+    lock_guard<mutex> stripe(driverStripes[(size_t)driverId % DRIVER_STRIPES]);
+    DriverEntry entry;
+    if (!lookup(driverId, entry)) return;
+    WireWriter rate(WIRE_DRIVER_RATE);
+    rate.varint((uint64_t)driverId).real(rating);
+    transport.call(entry.node, rate.frame());
+    replicate(driverId, entry);
+    store(driverId, entry);
+}
+
+DispatchCluster::RideHandle DispatchCluster::requestRide(const Rider* rider, const Location& pickup,
+                                                         const Location& drop, VehicleType type) {
+    RideHandle handle{0, CANCELLED, 0, -1};
+    shared_lock<shared_mutex> topology(topologyLock);
+    vector<int> near = nodesNear(pickup);
+    if (near.empty()) return handle;
+
+    int target = near[0];
+    if (near.size() > 1) {
+        crossNodeQueries.fetch_add(1, memory_order_relaxed);
+        WireWriter query(WIRE_CANDIDATE_QUERY);
+        query.varint((uint64_t)type).location(pickup).location(drop);
+        vector<uint8_t> frame = query.frame();
+        double bestRank = numeric_limits<double>::infinity();
+        for (int n : near) {
+            vector<uint8_t> answer = transport.call(n, frame);
+            WireReader reply(answer);
+            if (reply.messageType() != WIRE_CANDIDATE_REPLY) continue;
+            bool found = reply.varint() != 0;
+            reply.varint();
+            double rank = reply.real();
+            if (reply.ok() && found && rank < bestRank) {
+                bestRank = rank;
+                target = n;
+            }
+        }
+    }
+
+    WireWriter request(WIRE_RIDE_REQUEST);
+    request.varint((uint64_t)rider->getId())
+        .text(rider->getName())
+        .text(rider->getPhone())
+        .real(rider->getDiscountAmount())
+        .varint((uint64_t)type)
+        .location(pickup)
+        .location(drop);
+    vector<uint8_t> answer = transport.call(target, request.frame());
+    WireReader reply(answer);
+    if (reply.messageType() != WIRE_RIDE_REPLY) return handle;
+    RideId local = reply.varint();
+    uint64_t status = reply.varint();
+    int driverId = (int)reply.varint();
+    if (!reply.ok() || status >= (uint64_t)RIDE_STATUS_COUNT) return handle;
+    if (local > LOCAL_RIDE_MASK) {
+        EventLog::getInstance().message(LOG_WARN,
+                                        string("Node ") + to_string(target) +
+                                        " ride id " + to_string(local) + " out of range.");
+        return handle;
+    }
+    RideId rideId = clusterRideId(target, local);
+    handle = RideHandle{rideId, (RideStatus)status, driverId, target};
+    if (driverId) {
+        lock_guard<mutex> guard(directoryLock);
+        rides[rideId] = target;
+    }
+    return handle;
+}
+
+void DispatchCluster::updateRideStatus(RideId rideId, RideStatus status) {
+    if (status == COMPLETED) {
+        completeRide(rideId);
+        return;
+    }
+    if (status == CANCELLED) {
+        cancelRide(rideId, CANCEL_BY_RIDER);
+        return;
+    }
+    shared_lock<shared_mutex> topology(topologyLock);
+    int node;
+    {
+        lock_guard<mutex> guard(directoryLock);
+        auto it = rides.find(rideId);
+        if (it == rides.end()) return;
+        node = it->second;
+    }
+    WireWriter update(WIRE_RIDE_STATUS);
+    update.varint(localRideId(rideId)).varint((uint64_t)status);
+    transport.call(node, update.frame());
+}
+
+// The driver may have crossed into another node's zone during the trip;
+// it moves there as soon as it is free.
+void DispatchCluster::completeRide(RideId rideId) {
+    shared_lock<shared_mutex> topology(topologyLock);
+    int node;
+    {
+        lock_guard<mutex> guard(directoryLock);
+        auto it = rides.find(rideId);
+        if (it == rides.end()) return;
+        node = it->second;
+        rides.erase(it);
+    }
+    WireWriter complete(WIRE_RIDE_COMPLETE);
+    complete.varint(localRideId(rideId));
+    vector<uint8_t> answer = transport.call(node, complete.frame());
+    WireReader reply(answer);
+    if (reply.messageType() != WIRE_ACK) return;
+    int driverId = (int)reply.varint();
+    if (!reply.ok()) return;
+    lock_guard<mutex> stripe(driverStripes[(size_t)driverId % DRIVER_STRIPES]);
+    rehome(driverId);
+}
+
+bool DispatchCluster::cancelRide(RideId rideId, CancelReason reason) {
+    shared_lock<shared_mutex> topology(topologyLock);
+    int node;
+    {
+        lock_guard<mutex> guard(directoryLock);
+        auto it = rides.find(rideId);
+        if (it == rides.end()) return false;
+        node = it->second;
+    }
+    WireWriter cancel(WIRE_RIDE_CANCEL);
+    cancel.varint(localRideId(rideId)).varint((uint64_t)reason);
+    vector<uint8_t> answer = transport.call(node, cancel.frame());
+    WireReader reply(answer);
+    if (reply.messageType() != WIRE_ACK) return false;
+    int driverId = (int)reply.varint();
+    {
+        lock_guard<mutex> guard(directoryLock);
+        rides.erase(rideId);
+    }
+    if (!reply.ok()) return true;
+    lock_guard<mutex> stripe(driverStripes[(size_t)driverId % DRIVER_STRIPES]);
+    rehome(driverId);
+    return true;
+}
+
+DispatchCluster::Stats DispatchCluster::stats() {
+    shared_lock<shared_mutex> topology(topologyLock);
+    Stats s;
+    s.nodes = (size_t)count(nodeUp.begin(), nodeUp.end(), true);
+    {
+        lock_guard<mutex> guard(directoryLock);
+        s.drivers = drivers.size();
+        s.ongoingRides = rides.size();
+    }
+    s.migrations = migrations.load(memory_order_relaxed);
+    s.crossNodeQueries = crossNodeQueries.load(memory_order_relaxed);
+    s.promotedDrivers = promotedDrivers.load(memory_order_relaxed);
+    s.lostDrivers = lostDrivers.load(memory_order_relaxed);
+    s.lostRides = lostRides.load(memory_order_relaxed);
+    s.frames = transport.framesSent();
+    s.bytes = transport.bytesSent();
+    return s;
 }
 
 // Main Function
-int main() {
+// `main --bench [options]` runs DispatchBenchmark and `main --replay trace
+// [options]` a TraceReplayer instead of the demo. tests/dispatch_test.cpp
+// includes this file with DISPATCH_NO_MAIN defined and brings its own.
+#ifndef DISPATCH_NO_MAIN
+int main(int argc, char** argv) {
+    if (argc > 1 && string(argv[1]) == "--bench") {
+        BenchmarkOptions options;
+        if (!options.parse(argc, argv)) return 1;
+        DispatchBenchmark(options).run(cout);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--replay") {
+        ReplayOptions options;
+        if (!options.parse(argc, argv)) return 1;
+        DispatchService& dispatch = DispatchService::getInstance();
+        EventLog::getInstance().setLevel(LOG_OFF);
+        dispatch.enableSharding(options.shards);
+        dispatch.setMatchingStrategy(strategyNamed(options.strategy));
+        // Leaked on purpose: the service keeps using its drivers until exit.
+        TraceReplayer* replayer = new TraceReplayer(dispatch);
+        TraceReplayer::Report report;
+        if (!replayer->replay(options.path, options.speed, report)) return 1;
+        cout << options.strategy << ", " << options.shards << " shards" << endl;
+        report.print(cout);
+        return 0;
+    }
+
     DispatchService& dispatch = DispatchService::getInstance();
 
     // Create some vehicles and drivers, then register them
@@ -625,7 +9295,7 @@ int main() {
     Rider* rider1 = new Rider("Eve", "8888880001", Location(12.9725, 77.5930));
 
     // Rider requests a Sedan ride
-    Ride* ride1 = rider1->requestRide(
+    PinnedRide ride1 = rider1->requestRide(
         Location(12.9725, 77.5930),  // pickup
         Location(12.9850, 77.5950),  // drop
         SEDAN);
@@ -636,6 +9306,7 @@ int main() {
 
     // Activate surge pricing
     dispatch.activateSurge(1.5);
+    EventLog::getInstance().flush();
     cout << "\n--- Surge pricing activated (1.5x) ---\n" << endl;
 
     // Complete the ride
@@ -644,12 +9315,13 @@ int main() {
     dispatch.printAvailableDrivers();
 
     // Switch matching strategy at runtime
+    EventLog::getInstance().flush();
     cout << "\n--- Switching to BestRatedDriverStrategy ---\n" << endl;
     dispatch.setMatchingStrategy(new BestRatedDriverStrategy());
 
     // Create another rider & request SUV ride
     Rider* rider2 = new Rider("Frank", "8888880002", Location(12.9740, 77.5960));
-    Ride* ride2 = rider2->requestRide(
+    PinnedRide ride2 = rider2->requestRide(
         Location(12.9740, 77.5960),
         Location(12.9800, 77.6000),
         SUV);
@@ -660,8 +9332,29 @@ int main() {
 
     dispatch.printAvailableDrivers();
 
+    // Collect a burst of requests and match them as one batch
+    EventLog::getInstance().flush();
+    cout << "\n--- Switching to BatchAssignmentStrategy ---\n" << endl;
+    dispatch.setMatchingStrategy(new BatchAssignmentStrategy());
+
+    Rider* rider3 = new Rider("Grace", "8888880003", Location(12.9730, 77.5920));
+    Rider* rider4 = new Rider("Heidi", "8888880004", Location(12.9745, 77.5905));
+    dispatch.submitRideRequest(rider3, Location(12.9730, 77.5920),
+                               Location(12.9900, 77.6000), SEDAN);
+    dispatch.submitRideRequest(rider4, Location(12.9745, 77.5905),
+                               Location(12.9600, 77.5800), SEDAN);
+    vector<PinnedRide> batch = dispatch.flushPendingRequests();
+    for (const auto& ride : batch) {
+        dispatch.completeRide(ride->getId());
+    }
+
+    dispatch.printAvailableDrivers();
+
     delete rider1;
     delete rider2;
+    delete rider3;
+    delete rider4;
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
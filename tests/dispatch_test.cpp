@@ -0,0 +1,2159 @@
+// Behavioural tests for the dispatch service.
+// Build and run from the repository root:
+//   g++ -std=c++17 -Wall -pthread -O2 -o dispatch_test tests/dispatch_test.cpp && ./dispatch_test
+// An argument runs only the tests whose name contains it.
+#define DISPATCH_NO_MAIN 1
+#include "../main.cpp"
+
+#include <fstream>
+#include <random>
+
+// Test harness
+struct TestCase {
+    const char* name;
+    void (*fn)();
+};
+
+static vector<TestCase>& testCases() {
+    static vector<TestCase> cases;
+    return cases;
+}
+
+struct TestRegistrar {
+    TestRegistrar(const char* name, void (*fn)()) { testCases().push_back({name, fn}); }
+};
+
+static int checkFailures = 0;
+
+#define TEST(name)                                          \
+    static void test_##name();                              \
+    static TestRegistrar registrar_##name(#name, test_##name); \
+    static void test_##name()
+
+#define CHECK(cond)                                                               \
+    do {                                                                          \
+        if (!(cond)) {                                                            \
+            ++checkFailures;                                                      \
+            cout << "  " << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << endl; \
+        }                                                                         \
+    } while (0)
+
+// Owns the drivers and vehicles a test creates.
+struct Fleet {
+    vector<unique_ptr<Vehicle>> vehicles;
+    vector<unique_ptr<Driver>> drivers;
+
+    Driver* add(const Location& loc, double rating = 4.5, VehicleType type = SEDAN) {
+        vehicles.emplace_back(new Vehicle("KA-00", type, 4, 10.0));
+        drivers.emplace_back(new Driver("driver", "000", vehicles.back().get(), loc, rating));
+        return drivers.back().get();
+    }
+};
+
+// A private DispatchService per test, so tests do not share drivers or
+// configuration through the singleton.
+struct DispatchTestAccess {
+    static unique_ptr<DispatchService> create() {
+        return unique_ptr<DispatchService>(new DispatchService());
+    }
+    static vector<int> shardsNear(const DispatchService& service, const Location& loc,
+                                  double radius) {
+        return service.shardsNear(loc, radius);
+    }
+    static int shardFor(const DispatchService& service, const Location& loc) {
+        return service.shardFor(loc);
+    }
+    static size_t restoredDriverCount(const DispatchService& service) {
+        return service.restoredDrivers.size();
+    }
+    static vector<double> pendingQuotes(DispatchService& service) {
+        lock_guard<mutex> guard(service.batchLock);
+        vector<double> quotes;
+        for (const auto& request : service.pendingRequests) quotes.push_back(request.getQuotedFare());
+        return quotes;
+    }
+};
+
+// Spatial index
+TEST(pool_nearest_matches_brute_force) {
+    mt19937 rng(7);
+    uniform_real_distribution<double> lat(12.90, 13.10), lon(77.50, 77.70);
+    Fleet fleet;
+    DriverPool pool;
+    // Enough drivers to leave the linear-scan path and walk the grid.
+    for (int i = 0; i < 500; ++i) pool.add(fleet.add(Location(lat(rng), lon(rng))));
+
+    for (int q = 0; q < 50; ++q) {
+        Location pickup(lat(rng), lon(rng));
+        double radius = 0.03;
+        vector<pair<double, Driver*>> expected;
+        for (auto& d : fleet.drivers) {
+            double dist = pickup.distanceTo(d->getCurrentLocation());
+            if (dist <= radius) expected.push_back(make_pair(dist, d.get()));
+        }
+        sort(expected.begin(), expected.end());
+        if (expected.size() > 5) expected.resize(5);
+
+        vector<Driver*> got = pool.nearest(SEDAN, pickup, radius, 5);
+        CHECK(got.size() == expected.size());
+        for (size_t i = 0; i < got.size() && i < expected.size(); ++i) {
+            CHECK(pickup.distanceTo(got[i]->getCurrentLocation()) == expected[i].first);
+        }
+    }
+}
+
+TEST(pool_nearest_walks_rings_across_a_wide_extent) {
+    // A dense cluster plus outliers hundreds of cells away, queried with
+    // no radius from inside, beside and far outside the occupied cells.
+    mt19937 rng(9);
+    uniform_real_distribution<double> lat(12.90, 12.95), lon(77.50, 77.55), wide(-3.0, 3.0);
+    Fleet fleet;
+    DriverPool pool;
+    for (int i = 0; i < 300; ++i) pool.add(fleet.add(Location(lat(rng), lon(rng))));
+    for (int i = 0; i < 20; ++i) pool.add(fleet.add(Location(13 + wide(rng), 77.6 + wide(rng))));
+    double inf = numeric_limits<double>::infinity();
+    for (int q = 0; q < 60; ++q) {
+        Location pickup = q % 3 == 0   ? Location(lat(rng), lon(rng))
+                          : q % 3 == 1 ? Location(13 + wide(rng), 77.6 + wide(rng))
+                                       : Location(20 + wide(rng), 70 + wide(rng));
+        vector<double> expected;
+        for (auto& d : fleet.drivers) expected.push_back(pickup.distanceTo(d->getCurrentLocation()));
+        sort(expected.begin(), expected.end());
+        vector<Driver*> got = pool.nearest(SEDAN, pickup, inf, 4);
+        CHECK(got.size() == 4);
+        for (size_t i = 0; i < got.size(); ++i) {
+            CHECK(pickup.distanceTo(got[i]->getCurrentLocation()) == expected[i]);
+        }
+    }
+}
+
+TEST(haversine_strategy_finds_great_circle_nearest) {
+    // At 60 degrees north a degree of longitude is half a degree of
+    // latitude, so the grid's Euclidean order is often wrong.
+    mt19937 rng(13);
+    uniform_real_distribution<double> lat(59.9, 60.1), lon(9.8, 10.2);
+    Fleet fleet;
+    DriverPool pool;
+    for (int i = 0; i < 400; ++i) pool.add(fleet.add(Location(lat(rng), lon(rng))));
+    NearestDriverStrategy strategy(0.1, HAVERSINE);
+    Rider rider("rider", "000", Location());
+    for (int q = 0; q < 100; ++q) {
+        RideRequest request(&rider, Location(lat(rng), lon(rng)), Location(60, 10), SEDAN);
+        vector<double> expected;
+        for (auto& d : fleet.drivers) {
+            if (request.getPickup().distanceTo(d->getCurrentLocation()) <= 0.1) {
+                expected.push_back(d->getCurrentLocation().haversineKm(request.getPickup()));
+            }
+        }
+        sort(expected.begin(), expected.end());
+        vector<int> got = strategy.chooseSlots(request, pool, 3);
+        CHECK(got.size() == min<size_t>(3, expected.size()));
+        for (size_t i = 0; i < got.size(); ++i) {
+            CHECK(pool.ofType(SEDAN).locationOf(got[i]).haversineKm(request.getPickup()) ==
+                  expected[i]);
+        }
+        int best = strategy.chooseSlot(request, pool);
+        CHECK(best == (got.empty() ? -1 : got[0]));
+    }
+}
+
+TEST(pool_remove_and_relocate_keep_index_consistent) {
+    Fleet fleet;
+    DriverPool pool;
+    for (int i = 0; i < 100; ++i) pool.add(fleet.add(Location(12.9 + i * 0.001, 77.6)));
+    // Swap-and-pop removal renumbers the last slot.
+    for (int i = 0; i < 100; i += 2) pool.remove(fleet.drivers[i].get());
+    CHECK(pool.ofType(SEDAN).size() == 50);
+    CHECK(!pool.contains(fleet.drivers[0].get()));
+    CHECK(pool.contains(fleet.drivers[1].get()));
+
+    Driver* moved = fleet.drivers[1].get();
+    moved->setCurrentLocation(Location(13.5, 78.0));
+    pool.relocate(moved);
+    vector<Driver*> got = pool.nearest(SEDAN, Location(13.5, 78.0), 0.01, 3);
+    CHECK(got.size() == 1 && got[0] == moved);
+    CHECK(pool.nearest(SEDAN, Location(12.903, 77.6), 0.0015, 5).size() == 1);
+}
+
+// Driver pool
+TEST(pool_keeps_one_dense_bucket_per_type) {
+    Fleet fleet;
+    DriverPool pool;
+    vector<Driver*> sedans, bikes;
+    for (int i = 0; i < 6; ++i) sedans.push_back(fleet.add(Location(12.9 + i * 0.001, 77.6)));
+    for (int i = 0; i < 4; ++i) {
+        bikes.push_back(fleet.add(Location(12.9, 77.6 + i * 0.001), 4.5, BIKE));
+    }
+    for (auto& d : fleet.drivers) pool.add(d.get());
+    CHECK(pool.size() == 10);
+    CHECK(pool.ofType(SEDAN).size() == 6 && pool.ofType(BIKE).size() == 4);
+    CHECK(pool.ofType(SUV).size() == 0);
+
+    // Only the requested type is searched.
+    vector<Driver*> got = pool.nearest(BIKE, Location(12.9, 77.6), 0.1, 10);
+    CHECK(got.size() == 4);
+    for (Driver* d : got) CHECK(d->getVehicle()->getType() == BIKE);
+    CHECK(pool.nearest(SUV, Location(12.9, 77.6), 0.1, 10).empty());
+
+    // Removing from the middle moves the last row into the hole and
+    // leaves the other type alone.
+    int hole = pool.slotOf(sedans[1]);
+    Driver* last = pool.ofType(SEDAN).drivers.back();
+    pool.remove(sedans[1]);
+    CHECK(!pool.contains(sedans[1]) && pool.slotOf(sedans[1]) == -1);
+    CHECK(pool.slotOf(last) == hole);
+    CHECK(pool.ofType(SEDAN).size() == 5 && pool.ofType(BIKE).size() == 4);
+    for (auto& d : fleet.drivers) {
+        if (!pool.contains(d.get())) continue;
+        const DriverStateStore& store = pool.ofType(d->getVehicle()->getType());
+        int slot = pool.slotOf(d.get());
+        CHECK(store.drivers[slot] == d.get());
+        CHECK(store.latitude[slot] == d->getCurrentLocation().latitude);
+        CHECK(store.longitude[slot] == d->getCurrentLocation().longitude);
+    }
+    // Removing twice is harmless.
+    pool.remove(sedans[1]);
+    CHECK(pool.size() == 9);
+
+    for (Driver* d : sedans) pool.remove(d);
+    for (Driver* d : bikes) pool.remove(d);
+    CHECK(pool.size() == 0 && pool.ofType(SEDAN).size() == 0 && pool.ofType(BIKE).size() == 0);
+    CHECK(pool.nearest(SEDAN, Location(12.9, 77.6), 0.1, 10).empty());
+}
+
+TEST(state_store_rows_follow_their_driver) {
+    atomic<double> minutes(100.0);
+    Fleet fleet;
+    DriverPool pool;
+    pool.setClock(&minutes);
+    pool.setScoreWeights(ScoreWeights(2.0, 0.5));
+    Driver* a = fleet.add(Location(12.90, 77.60), 4.0);
+    pool.add(a);
+    minutes = 110.0;
+    Driver* b = fleet.add(Location(12.95, 77.65), 3.0);
+    pool.add(b);
+
+    const DriverStateStore& store = pool.ofType(SEDAN);
+    int sa = pool.slotOf(a), sb = pool.slotOf(b);
+    CHECK(store.availableSince[sa] == 100.0 && store.availableSince[sb] == 110.0);
+    CHECK(store.staticScore[sa] == 4.0 * 2.0 - 100.0 * 0.5);
+    CHECK(store.staticScore[sb] == 3.0 * 2.0 - 110.0 * 0.5);
+    CHECK(store.farePerKm[sa] == 10.0 && store.status[sa] == AVAILABLE);
+
+    // A rating change is re-read into its column and the score.
+    a->setCurrentRating(5.0);
+    pool.refresh(a);
+    CHECK(store.rating[sa] == 5.0);
+    CHECK(store.staticScore[sa] == 5.0 * 2.0 - 100.0 * 0.5);
+    CHECK(store.availableSince[sa] == 100.0);
+
+    b->setCurrentLocation(Location(13.20, 77.90));
+    pool.relocate(b);
+    CHECK(store.latitude[sb] == 13.20 && store.longitude[sb] == 77.90);
+    vector<Driver*> got = pool.nearest(SEDAN, Location(13.20, 77.90), 0.01, 2);
+    CHECK(got.size() == 1 && got[0] == b);
+
+    pool.setScoreWeights(ScoreWeights(1.0, 0.0));
+    CHECK(store.staticScore[sa] == 5.0 && store.staticScore[sb] == 3.0);
+
+    // Removal moves the whole row of the last slot.
+    pool.remove(a);
+    CHECK(pool.slotOf(b) == 0 && store.drivers[0] == b);
+    CHECK(store.rating[0] == 3.0 && store.availableSince[0] == 110.0);
+    CHECK(store.latitude[0] == 13.20 && store.staticScore[0] == 3.0);
+}
+
+// Scored matching
+TEST(scored_strategy_matches_brute_force) {
+    mt19937 rng(17);
+    uniform_real_distribution<double> lat(12.90, 13.10), lon(77.50, 77.70), rating(3.0, 5.0),
+        idle(0.0, 30.0);
+    atomic<double> minutes(0.0);
+    Fleet fleet;
+    DriverPool pool;
+    pool.setClock(&minutes);
+    // Per km, per rating point, per idle minute; radius in degrees.
+    ScoredDriverStrategy strategy(1.0, 2.0, 0.2, 0.05);
+    pool.setScoreWeights(*strategy.scoreWeights());
+    // Enough drivers to leave the linear-scan path and walk the grid.
+    for (int i = 0; i < 600; ++i) {
+        minutes = idle(rng);
+        pool.add(fleet.add(Location(lat(rng), lon(rng)), rating(rng)));
+    }
+    minutes = 30.0;
+
+    const DriverStateStore& store = pool.ofType(SEDAN);
+    auto score = [&](const Location& pickup, int slot) {
+        const Driver* d = store.drivers[slot];
+        double idleMinutes = minutes - store.availableSince[slot];
+        double km = pickup.distanceTo(d->getCurrentLocation()) * 111.2;
+        return d->getRating() * 2.0 + idleMinutes * 0.2 - km;
+    };
+    for (int q = 0; q < 100; ++q) {
+        RideRequest request(nullptr, Location(lat(rng), lon(rng)), Location(13, 77.7), SEDAN);
+        vector<double> expected;
+        for (size_t slot = 0; slot < store.size(); ++slot) {
+            if (store.distanceTo((int)slot, request.getPickup()) <= 0.05) {
+                expected.push_back(score(request.getPickup(), (int)slot));
+            }
+        }
+        sort(expected.rbegin(), expected.rend());
+        vector<int> got = strategy.chooseSlots(request, pool, 5);
+        CHECK(got.size() == min<size_t>(5, expected.size()));
+        for (size_t i = 0; i < got.size(); ++i) {
+            CHECK(fabs(score(request.getPickup(), got[i]) - expected[i]) < 1e-9);
+        }
+        CHECK(strategy.chooseSlot(request, pool) == (got.empty() ? -1 : got[0]));
+    }
+
+    // A rating change is folded into the precomputed score.
+    RideRequest request(nullptr, Location(13.0, 77.6), Location(13, 77.7), SEDAN);
+    int first = strategy.chooseSlot(request, pool);
+    CHECK(first >= 0);
+    Driver* best = store.drivers[first];
+    best->setCurrentRating(-100.0);
+    pool.refresh(best);
+    int second = strategy.chooseSlot(request, pool);
+    CHECK(second >= 0 && store.drivers[second] != best);
+}
+
+// Ride table
+TEST(ride_table_matches_a_map_under_churn) {
+    mt19937 rng(11);
+    // Few distinct ids, so probe runs collide and erases shift them back.
+    uniform_int_distribution<RideId> ids(1, 3000);
+    RideTable table;
+    unordered_map<RideId, Ride*> model;
+    for (int step = 0; step < 200000; ++step) {
+        RideId id = ids(rng);
+        Ride* ride = (Ride*)(uintptr_t)(id * 16 + step % 7);
+        if (rng() % 3 != 0) {
+            table.insert(id, ride);
+            model[id] = ride;
+        } else {
+            auto it = model.find(id);
+            Ride* expected = it == model.end() ? nullptr : it->second;
+            CHECK(table.erase(id) == expected);
+            if (it != model.end()) model.erase(it);
+        }
+        if (step % 1000 == 0) {
+            for (RideId probe = 1; probe <= 3000; ++probe) {
+                auto it = model.find(probe);
+                CHECK(table.find(probe) == (it == model.end() ? nullptr : it->second));
+            }
+        }
+    }
+    CHECK(table.size() == model.size());
+    size_t visited = 0;
+    table.forEach([&](Ride*) { ++visited; });
+    CHECK(visited == model.size());
+    for (auto& entry : model) CHECK(table.erase(entry.first) == entry.second);
+    CHECK(table.size() == 0 && table.find(1) == nullptr);
+}
+
+// Vector kernels
+TEST(fare_batch_matches_scalar_pipeline) {
+    mt19937 rng(5);
+    uniform_real_distribution<double> km(0.1, 60.0), rate(5.0, 25.0), surge(1.0, 3.0),
+        disc(0.0, 80.0);
+    FareQuoteBatch batch;
+    for (int i = 0; i < 1027; ++i) batch.add(km(rng), rate(rng), surge(rng), disc(rng));
+    vector<double> out(batch.size());
+    FareEngine::calculateBatch(batch, out.data());
+    for (size_t i = 0; i < batch.size(); ++i) {
+        FareInputs in{batch.distanceKm[i], batch.farePerKm[i], batch.surgeMultiplier[i],
+                      batch.discount[i]};
+        CHECK(out[i] == SurgeDiscountFarePipeline::calculate(in));
+    }
+}
+
+TEST(squared_distances_match_scalar) {
+    mt19937 rng(9);
+    uniform_real_distribution<double> lat(12.0, 14.0), lon(77.0, 78.0);
+    vector<double> lats(301), lons(301), out(301);
+    for (size_t i = 0; i < lats.size(); ++i) {
+        lats[i] = lat(rng);
+        lons[i] = lon(rng);
+    }
+    Location q(13.0, 77.5);
+    CandidateKernel::squaredDistances(lats.data(), lons.data(), lats.size(), q, out.data());
+    for (size_t i = 0; i < lats.size(); ++i) {
+        double dx = lats[i] - q.latitude, dy = lons[i] - q.longitude;
+        CHECK(out[i] == dx * dx + dy * dy);
+    }
+}
+
+// Fares
+static double decoratedFare(Ride* ride, bool surge, double multiplier) {
+    FareCalculator* calc = new BaseFareCalculator();
+    if (surge) calc = new SurgePricingDecorator(calc, multiplier);
+    const Rider* rider = ride->getRider();
+    if (rider->hasDiscount()) calc = new DiscountDecorator(calc, rider->getDiscountAmount());
+    double fare = calc->calculate(ride);
+    delete calc;
+    return fare;
+}
+
+TEST(fare_engine_matches_decorator_chain) {
+    mt19937 rng(3);
+    uniform_real_distribution<double> km(0.1, 40.0), disc(0.0, 600.0);
+    Fleet fleet;
+    Driver* driver = fleet.add(Location(12.9, 77.6));
+    Rider rider("rider", "000", Location());
+    for (int surge = 0; surge < 2; ++surge) {
+        FareEngine engine(surge != 0, 1.7);
+        for (int i = 0; i < 200; ++i) {
+            Ride ride(1, &rider, Location(12.9, 77.6), Location(13, 77.7), SEDAN);
+            ride.assignDriver(driver);
+            ride.setDistanceKm(km(rng));
+            // Large discounts clamp the fare at zero.
+            rider.setDiscountAmount(i % 2 ? disc(rng) : 0.0);
+            CHECK(engine.calculate(&ride) == decoratedFare(&ride, surge != 0, 1.7));
+        }
+    }
+
+    // A completed ride is priced by the engine for the surge in force.
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    service->registerDriver(driver);
+    service->flushLocationUpdates();
+    service->activateSurge(1.5);
+    rider.setDiscountAmount(20.0);
+    PinnedRide ride = service->requestRide(&rider, Location(12.9, 77.6), Location(13, 77.7), SEDAN);
+    CHECK(ride->getDriver() == driver);
+    service->completeRide(ride->getId());
+    CHECK(ride->getStatus() == COMPLETED);
+    CHECK(ride->getFare() == decoratedFare(ride.get(), true, 1.5));
+    service->deregisterDriver(driver);
+}
+
+// Road distances
+TEST(unreachable_sources_get_infinite_uncached_etas) {
+    // Two road islands: the pickup's, and a closer one with no road across.
+    RoadNetwork roads;
+    int p0 = roads.addNode(Location(12.900, 77.600));
+    int p1 = roads.addNode(Location(12.900, 77.620));
+    int p2 = roads.addNode(Location(12.900, 77.640));
+    roads.addRoad(p0, p1, 120.0, 2.0);
+    roads.addRoad(p1, p2, 120.0, 2.0);
+    int i0 = roads.addNode(Location(12.910, 77.600));
+    int i1 = roads.addNode(Location(12.912, 77.600));
+    roads.addRoad(i0, i1, 30.0, 0.2);
+    roads.prepare();
+    RoadDistanceProvider distances(roads);
+
+    Location pickup(12.900, 77.600);
+    Location island(12.911, 77.600), onRoad(12.900, 77.640);
+    Location from[2] = {island, onRoad};
+    double etas[2];
+    distances.etasTo(from, 2, pickup, etas);
+    CHECK(etas[0] == numeric_limits<double>::infinity());
+    CHECK(etas[1] > 200.0 && etas[1] < 300.0);
+    uint64_t hits = distances.getCache().hitCount();
+    distances.etasTo(from, 2, pickup, etas);
+    // Only the reachable source was cached.
+    CHECK(distances.getCache().hitCount() == hits + 1);
+    CHECK(etas[0] == numeric_limits<double>::infinity());
+    CHECK(distances.etaSeconds(island, pickup) == numeric_limits<double>::infinity());
+    CHECK(distances.distanceKm(island, pickup) > 1.0);
+
+    // The strategy passes over the closer, unreachable driver.
+    Fleet fleet;
+    DriverPool pool;
+    pool.add(fleet.add(island));
+    Driver* reachable = fleet.add(onRoad);
+    pool.add(reachable);
+    EtaDriverStrategy strategy(&distances, 10, 0.1);
+    RideRequest request(nullptr, pickup, Location(13, 77.7), SEDAN);
+    vector<int> slots = strategy.chooseSlots(request, pool, 2);
+    CHECK(slots.size() == 1);
+    CHECK(!slots.empty() && pool.ofType(SEDAN).drivers[slots[0]] == reachable);
+}
+
+// Sharding
+TEST(shards_near_cover_search_radius) {
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    CHECK(service->enableSharding(8, 0.05));
+    mt19937 rng(11);
+    uniform_real_distribution<double> lat(12.80, 13.20), lon(77.40, 77.80), off(-0.1, 0.1);
+    for (int q = 0; q < 200; ++q) {
+        Location pickup(lat(rng), lon(rng));
+        vector<int> near = DispatchTestAccess::shardsNear(*service, pickup, 0.1);
+        CHECK(near.front() == DispatchTestAccess::shardFor(*service, pickup));
+        for (int i = 0; i < 20; ++i) {
+            Location other(pickup.latitude + off(rng), pickup.longitude + off(rng));
+            if (pickup.distanceTo(other) > 0.1) continue;
+            int s = DispatchTestAccess::shardFor(*service, other);
+            CHECK(find(near.begin(), near.end(), s) != near.end());
+        }
+    }
+    // An unbounded strategy searches everything.
+    CHECK(DispatchTestAccess::shardsNear(*service, Location(13, 77.6),
+                                         numeric_limits<double>::infinity()).size() == 8);
+}
+
+TEST(sharded_matching_equals_unsharded) {
+    unique_ptr<DispatchService> plain = DispatchTestAccess::create();
+    unique_ptr<DispatchService> sharded = DispatchTestAccess::create();
+    CHECK(sharded->enableSharding(8, 0.05));
+    mt19937 rng(3);
+    uniform_real_distribution<double> lat(12.90, 13.10), lon(77.50, 77.70);
+    Fleet plainFleet, shardedFleet;
+    for (int i = 0; i < 300; ++i) {
+        Location loc(lat(rng), lon(rng));
+        plain->registerDriver(plainFleet.add(loc));
+        sharded->registerDriver(shardedFleet.add(loc));
+    }
+    Rider rider("rider", "000", Location());
+    int matched = 0;
+    for (int q = 0; q < 200; ++q) {
+        Location pickup(lat(rng), lon(rng)), drop(lat(rng), lon(rng));
+        PinnedRide a = plain->requestRide(&rider, pickup, drop, SEDAN);
+        PinnedRide b = sharded->requestRide(&rider, pickup, drop, SEDAN);
+        CHECK(!a->getDriver() == !b->getDriver());
+        if (!a->getDriver() || !b->getDriver()) continue;
+        ++matched;
+        // Same fleet layout, so the same pick has the same location.
+        CHECK(a->getDriver()->getCurrentLocation().distanceTo(
+                  b->getDriver()->getCurrentLocation()) == 0.0);
+    }
+    CHECK(matched > 100);
+}
+
+// Checks that two pools hold the same drivers with the same rows.
+static bool samePools(const DriverPool& a, const DriverPool& b, const Fleet& fleet) {
+    if (a.size() != b.size()) return false;
+    for (const auto& d : fleet.drivers) {
+        if (a.contains(d.get()) != b.contains(d.get())) return false;
+        if (!a.contains(d.get())) continue;
+        const DriverStateStore& sa = a.ofType(SEDAN);
+        const DriverStateStore& sb = b.ofType(SEDAN);
+        int x = a.slotOf(d.get()), y = b.slotOf(d.get());
+        if (sa.latitude[x] != sb.latitude[y] || sa.longitude[x] != sb.longitude[y] ||
+            sa.rating[x] != sb.rating[y] || sa.staticScore[x] != sb.staticScore[y] ||
+            sa.cell[x] != sb.cell[y]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+TEST(shard_snapshots_patch_to_match_live_pool) {
+    mt19937 rng(16);
+    uniform_real_distribution<double> lat(12.8, 13.1), lon(77.5, 77.8);
+    uniform_int_distribution<int> pick(0, 299);
+    Fleet fleet;
+    for (int i = 0; i < 300; ++i) fleet.add(Location(lat(rng), lon(rng)));
+    DispatchMetrics& metrics = DispatchMetrics::getInstance();
+    metrics.setEnabled(true);
+    uint64_t copiesBefore = metrics.snapshot().counters[COUNTER_SNAPSHOT_COPIES];
+
+    DispatchShard shard;
+    DriverPool& live = shard.availableDrivers;
+    for (auto& d : fleet.drivers) live.add(d.get());
+    bool matched = true;
+    for (int round = 0; round < 40; ++round) {
+        for (int op = 0; op < 25; ++op) {
+            Driver* d = fleet.drivers[pick(rng)].get();
+            switch (op % 3) {
+            case 0: live.remove(d); break;
+            case 1: live.add(d); break;
+            default:
+                d->setCurrentLocation(Location(lat(rng), lon(rng)));
+                live.relocate(d);
+            }
+        }
+        lock_guard<mutex> guard(shard.lock);
+        shared_ptr<const DriverPool> snap = shard.publish(shard.version.load(), 0);
+        matched = matched && samePools(live, *snap, fleet);
+    }
+    CHECK(matched);
+    // Only the first publish finds no copy to patch.
+    CHECK(metrics.snapshot().counters[COUNTER_SNAPSHOT_COPIES] - copiesBefore == 1);
+
+    // A held copy keeps its own membership while the live pool moves on.
+    shared_ptr<const DriverPool> held = atomic_load(&shard.snapshot);
+    Driver* leaver = nullptr;
+    for (auto& d : fleet.drivers) {
+        if (live.contains(d.get())) leaver = d.get();
+    }
+    live.remove(leaver);
+    CHECK(held->contains(leaver));
+    CHECK(!live.contains(leaver));
+    metrics.setEnabled(false);
+}
+
+TEST(deregistered_drivers_leave_stale_snapshots) {
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    CHECK(service->enableSharding(8, 0.05));
+    Location pickup(12.9, 77.6), drop(13, 77.7), away(13.3, 77.9);
+    CHECK(DispatchTestAccess::shardFor(*service, pickup) !=
+          DispatchTestAccess::shardFor(*service, away));
+    unique_ptr<Vehicle> car(new Vehicle("KA-00", SEDAN, 4, 10.0));
+    unique_ptr<Driver> gone(new Driver("gone", "000", car.get(), pickup, 4.5));
+    Fleet fleet;
+    Driver* stays = fleet.add(Location(12.93, 77.6));
+    service->registerDriver(gone.get());
+    service->registerDriver(stays);
+    RideRequest request(nullptr, pickup, drop, SEDAN);
+    CHECK(service->bestCandidate(request, nullptr) == gone.get());
+    // The copies just published would otherwise stay for an hour.
+    service->setSnapshotRefreshInterval(chrono::hours(1));
+
+    // Moving into another shard leaves the pickup shard's copy listing the
+    // driver at the pickup.
+    service->moveDriver(gone.get(), away);
+    CHECK(service->bestCandidate(request, nullptr) == gone.get());
+    service->deregisterDriver(gone.get());
+    CHECK(service->bestCandidate(request, nullptr) == stays);
+
+    // Nothing running still holds the driver, so it may go.
+    int goneId = gone->getId();
+    gone.reset();
+    Rider rider("rider", "000", Location());
+    PinnedRide ride = service->requestRide(&rider, pickup, drop, SEDAN);
+    CHECK(ride->getDriver() == stays);
+    CHECK(!service->findDriver(goneId));
+}
+
+// Location ingestion
+TEST(location_pings_coalesce_to_the_newest_per_driver) {
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    CHECK(service->enableSharding(4, 0.05));
+    service->configureLocationIngestion(chrono::hours(1), 1000);
+    Fleet fleet;
+    Driver* a = fleet.add(Location(12.90, 77.60));
+    Driver* b = fleet.add(Location(12.91, 77.60));
+    service->registerDriver(a);
+    service->registerDriver(b);
+    int homeOfB = b->getHomeShard();
+
+    // Out of order per driver; an unknown driver is dropped.
+    vector<LocationPing> pings = {
+        {a->getId(), 12.93, 77.60, 3},
+        {b->getId(), 12.92, 77.60, 5},
+        {a->getId(), 12.95, 77.60, 1},
+        {-1, 12.90, 77.60, 1},
+        {a->getId(), 12.94, 77.60, 2},
+    };
+    service->ingestLocations(pings);
+    CHECK(a->getCurrentLocation().latitude == 12.90);  // still buffered
+    CHECK(service->flushLocationUpdates() == 2);
+    CHECK(a->getCurrentLocation().latitude == 12.93);
+    CHECK(b->getCurrentLocation().latitude == 12.92);
+    CHECK(service->flushLocationUpdates() == 0);
+
+    // Older than the last applied ping: dropped. The newer one moves b
+    // into another shard, where matching finds it.
+    pings = {{b->getId(), 13.30, 77.60, 4}, {b->getId(), 13.50, 78.00, 6}};
+    service->ingestLocations(pings);
+    CHECK(service->flushLocationUpdates() == 1);
+    CHECK(b->getCurrentLocation().latitude == 13.50);
+    CHECK(b->getHomeShard() != homeOfB);
+    CHECK(b->getHomeShard() == DispatchTestAccess::shardFor(*service, Location(13.50, 78.00)));
+    Rider rider("rider", "000", Location());
+    PinnedRide ride = service->requestRide(&rider, Location(13.50, 78.00), Location(13.6, 78.1), SEDAN);
+    CHECK(ride->getDriver() == b);
+
+    // A full buffer flushes without being asked.
+    service->configureLocationIngestion(chrono::hours(1), 2);
+    pings = {{a->getId(), 12.96, 77.60, 7}, {a->getId(), 12.97, 77.60, 8}};
+    service->ingestLocations(pings);
+    CHECK(a->getCurrentLocation().latitude == 12.97);
+}
+
+// Quotes
+TEST(quote_cache_can_be_replaced_while_quoting) {
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    Rider rider("rider", "000", Location());
+    Location pickup(12.95, 77.6), drop(13.0, 77.7);
+    array<double, VEHICLE_TYPE_COUNT> cached, direct = service->quoteFares(&rider, pickup, drop);
+    service->enableQuoteCache(1 << 10, 0.002);
+    cached = service->quoteFares(&rider, pickup, drop);
+    atomic<bool> done(false);
+    thread swapper([&] {
+        while (!done.load()) {
+            service->enableQuoteCache(1 << 10, 0.002);
+            this_thread::yield();
+        }
+    });
+    bool same = true;
+    for (int i = 0; i < 20000; ++i) {
+        array<double, VEHICLE_TYPE_COUNT> fares = service->quoteFares(&rider, pickup, drop);
+        same = same && fares == cached;
+    }
+    done = true;
+    swapper.join();
+    CHECK(same);
+    // Cell centres move the quote by well under a percent.
+    CHECK(fabs(cached[SEDAN] - direct[SEDAN]) < direct[SEDAN] * 0.01);
+    CHECK(service->fareQuoteCache()->hitCount() + service->fareQuoteCache()->missCount() > 0);
+}
+
+TEST(surge_requotes_price_on_the_quote_distance) {
+    // The road doubles back, so it is far longer than the straight line.
+    RoadNetwork roads;
+    int a = roads.addNode(Location(12.900, 77.600));
+    int b = roads.addNode(Location(12.900, 77.640));
+    roads.addRoad(a, b, 900.0, 9.0);
+    roads.prepare();
+    RoadDistanceProvider distances(roads);
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    service->setDistanceProvider(&distances);
+    service->configureBatching(100, chrono::hours(1));
+    Rider rider("rider", "000", Location());
+    Location pickup(12.900, 77.600), drop(12.900, 77.640);
+    service->submitRideRequest(&rider, pickup, drop, SEDAN);
+
+    service->activateSurge(2.0);
+    vector<double> quotes = DispatchTestAccess::pendingQuotes(*service);
+    CHECK(quotes.size() == 1);
+    CHECK(!quotes.empty() && quotes[0] == service->quoteFares(&rider, pickup, drop)[SEDAN]);
+
+    service->enableQuoteCache();
+    service->deactivateSurge();
+    quotes = DispatchTestAccess::pendingQuotes(*service);
+    CHECK(!quotes.empty() && quotes[0] == service->quoteFares(&rider, pickup, drop)[SEDAN]);
+    service->flushPendingRequests();
+}
+
+// Zone surge
+TEST(zone_surge_follows_demand_and_supply) {
+    // 20 ms buckets: a 240 ms demand window.
+    SurgeZoneTracker zones(0.02, chrono::milliseconds(20));
+    Location here(12.905, 77.605), elsewhere(12.945, 77.605);
+    zones.driverAvailable(SEDAN, here);
+    zones.driverAvailable(SEDAN, here);
+    for (int i = 0; i < 3; ++i) zones.rideRequested(SEDAN, here);
+    // 3 requests over 2 drivers: 1 + 0.5 * 0.5, floored to 0.1 steps.
+    CHECK(zones.multiplierFor(SEDAN, here) == 1.2);
+    CHECK(zones.multiplierFor(BIKE, here) == 1.0);
+    CHECK(zones.multiplierFor(SEDAN, elsewhere) == 1.0);
+
+    zones.driverMoved(SEDAN, here, elsewhere);
+    CHECK(zones.multiplierFor(SEDAN, here) == 2.0);
+    zones.driverUnavailable(SEDAN, here);
+    for (int i = 0; i < 10; ++i) zones.rideRequested(SEDAN, here);
+    CHECK(zones.multiplierFor(SEDAN, here) == 3.0);  // capped
+    double all[VEHICLE_TYPE_COUNT];
+    zones.multipliersFor(here, all);
+    for (int t = 0; t < VEHICLE_TYPE_COUNT; ++t) {
+        CHECK(all[t] == zones.multiplierFor((VehicleType)t, here));
+    }
+
+    // Demand slides out of the window; supply stays.
+    this_thread::sleep_for(chrono::milliseconds(300));
+    CHECK(zones.multiplierFor(SEDAN, here) == 1.0);
+    zones.rideRequested(SEDAN, elsewhere);
+    zones.rideRequested(SEDAN, elsewhere);
+    CHECK(zones.multiplierFor(SEDAN, elsewhere) == 1.5);
+}
+
+TEST(zone_surge_prices_quotes_from_the_pool) {
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    Fleet fleet;
+    Location pickup(12.905, 77.605), drop(13.0, 77.7);
+    service->registerDriver(fleet.add(pickup));
+    service->flushLocationUpdates();
+    service->configureBatching(100, chrono::hours(1));
+    Rider rider("rider", "000", Location());
+    double flat = service->quoteFares(&rider, pickup, drop)[SEDAN];
+    service->enableZoneSurge();
+    for (int i = 0; i < 3; ++i) service->submitRideRequest(&rider, pickup, drop, SEDAN);
+    CHECK(service->zoneMultiplier(SEDAN, pickup) == 2.0);
+    CHECK(service->quoteFares(&rider, pickup, drop)[SEDAN] == flat * 2.0);
+    // A second driver in the zone halves the excess.
+    service->registerDriver(fleet.add(pickup));
+    service->flushLocationUpdates();
+    CHECK(service->zoneMultiplier(SEDAN, pickup) == 1.2);
+    service->disableZoneSurge();
+    CHECK(service->quoteFares(&rider, pickup, drop)[SEDAN] == flat);
+    service->flushPendingRequests();
+}
+
+// Notifications
+struct CountingObserver : RideObserver {
+    atomic<int> seen{0};
+    void onRideStatusChanged(Ride*, RideStatus) override { seen.fetch_add(1); }
+};
+
+TEST(async_notifications_survive_reconfiguration) {
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    Fleet fleet;
+    for (int i = 0; i < 64; ++i) service->registerDriver(fleet.add(Location(12.9 + i * 0.001, 77.6)));
+    Rider rider("rider", "000", Location());
+    CountingObserver counter;
+    vector<PinnedRide> rides;
+    for (int i = 0; i < 64; ++i) {
+        rides.push_back(service->requestRide(&rider, Location(12.9 + i * 0.001, 77.6),
+                                             Location(13, 77.7), SEDAN));
+        rides.back()->attachObserver(&counter);
+    }
+    atomic<bool> done(false);
+    thread toggler([&] {
+        while (!done.load()) {
+            service->enableAsyncNotifications(2, 64);
+            this_thread::yield();
+            service->disableAsyncNotifications();
+        }
+    });
+    for (auto& ride : rides) {
+        service->updateRideStatus(ride->getId(), EN_ROUTE_TO_PICKUP);
+        service->updateRideStatus(ride->getId(), IN_PROGRESS);
+        service->completeRide(ride->getId());
+    }
+    done = true;
+    toggler.join();
+    service->disableAsyncNotifications();
+    // Every change delivered exactly once, whichever path it took.
+    CHECK(counter.seen.load() == 64 * 3);
+}
+
+// Payments
+// Declines the first failFirst charges of every ride.
+struct FlakyGateway : PaymentProcessor {
+    mutex lock;
+    unordered_map<RideId, int> attempts;
+    int failFirst;
+    size_t largestBatch = 0;
+
+    explicit FlakyGateway(int fails) : failFirst(fails) {}
+    bool processPayment(Ride* ride, double) override {
+        lock_guard<mutex> guard(lock);
+        return ++attempts[ride->getId()] > failFirst;
+    }
+    void processPayments(PaymentCharge* charges, size_t count) override {
+        {
+            lock_guard<mutex> guard(lock);
+            largestBatch = max(largestBatch, count);
+        }
+        PaymentProcessor::processPayments(charges, count);
+    }
+};
+
+TEST(payments_retry_until_settled_once) {
+    Rider rider("rider", "000", Location());
+    vector<unique_ptr<Ride>> rides;
+    for (RideId id = 1; id <= 100; ++id) {
+        rides.emplace_back(new Ride(id, &rider, Location(12.9, 77.6), Location(13, 77.7), SEDAN));
+    }
+    mutex settledLock;
+    unordered_map<RideId, int> settledCount;
+    unordered_map<RideId, bool> outcome;
+    FlakyGateway flaky(2), broken(1000);
+    {
+        // A queue smaller than the burst, so submit has to wait for room.
+        PaymentWorkerPool payments(2, 16,
+                                   [&](Ride* ride, double, bool paid) {
+                                       if (paid) ride->setPaid(true);
+                                       lock_guard<mutex> guard(settledLock);
+                                       ++settledCount[ride->getId()];
+                                       outcome[ride->getId()] = paid;
+                                   },
+                                   chrono::milliseconds(10));
+        for (size_t i = 0; i < rides.size(); ++i) {
+            PaymentProcessor* gateway = i % 10 == 0 ? (PaymentProcessor*)&broken : &flaky;
+            CHECK(payments.submit(rides[i].get(), gateway, 10.0 + i));
+            // Retries are at least 10 ms apart, so the charge is still in
+            // flight and the repeat is refused.
+            if (i == 1) CHECK(!payments.submit(rides[i].get(), gateway, 10.0 + i));
+        }
+        payments.drain();
+        CHECK(payments.pending() == 0);
+        // Settled and paid: nothing to submit again.
+        CHECK(!payments.submit(rides[1].get(), &flaky, 11.0));
+    }
+
+    CHECK(settledCount.size() == rides.size());
+    for (size_t i = 0; i < rides.size(); ++i) {
+        RideId id = rides[i]->getId();
+        CHECK(settledCount[id] == 1);
+        CHECK(!rides[i]->isPinned());
+        if (i % 10 == 0) {
+            CHECK(!outcome[id] && !rides[i]->isPaid());
+            CHECK(broken.attempts[id] == PaymentWorkerPool::MAX_ATTEMPTS);
+        } else {
+            CHECK(outcome[id] && rides[i]->isPaid());
+            CHECK(flaky.attempts[id] == 3);
+        }
+    }
+    CHECK(flaky.largestBatch <= PaymentWorkerPool::BATCH_SIZE);
+}
+
+// Shared rides
+static vector<RideId> stopRides(const vector<TripStop>& stops) {
+    vector<RideId> ids;
+    for (const auto& stop : stops) ids.push_back(stop.rideId);
+    return ids;
+}
+
+TEST(shared_trip_inserts_at_least_detour) {
+    Fleet fleet;
+    Driver* driver = fleet.add(Location(12.90, 77.60));  // 4 seats
+    Location aPickup(12.90, 77.61), aDrop(12.90, 77.70);
+    SharedTrip trip(driver, Location(12.90, 77.60), 0.5);
+    SharedTrip::Insertion at = trip.bestInsertion(aPickup, aDrop, 1);
+    CHECK(at.feasible && at.pickupAt == 0 && at.dropAt == 0);
+    trip.insert(1, aPickup, aDrop, 1, at);
+
+    // Off the route: cheapest inside A's leg (0.035 added, against 0.063
+    // before A and 0.105 after), which A's budget of 0.045 allows.
+    at = trip.bestInsertion(Location(12.93, 77.61), Location(12.93, 77.62), 1);
+    CHECK(at.feasible && at.pickupAt == 1 && at.dropAt == 1);
+    CHECK(fabs(at.addedDistance - 0.0354) < 1e-3);
+
+    // On the way: picked up and dropped inside A's leg at no extra cost.
+    at = trip.bestInsertion(Location(12.90, 77.63), Location(12.90, 77.66), 1);
+    CHECK(at.feasible && at.pickupAt == 1 && at.dropAt == 1);
+    CHECK(fabs(at.addedDistance) < 1e-12);
+    trip.insert(2, Location(12.90, 77.63), Location(12.90, 77.66), 1, at);
+    CHECK(stopRides(trip.getStops()) == (vector<RideId>{1, 2, 2, 1}));
+}
+
+TEST(shared_trip_rejects_overfull_or_over_detour_insertions) {
+    Fleet fleet;
+    Driver* driver = fleet.add(Location(12.90, 77.60));  // 4 seats
+    Location aPickup(12.90, 77.61), aDrop(12.90, 77.70);
+    Location bPickup(12.93, 77.61), bDrop(12.93, 77.62);
+
+    // A 20% budget leaves A too little slack for the cheapest detour, so
+    // B is picked up and dropped before A instead.
+    SharedTrip tight(driver, Location(12.90, 77.60), 0.2);
+    tight.insert(1, aPickup, aDrop, 1, tight.bestInsertion(aPickup, aDrop, 1));
+    SharedTrip::Insertion at = tight.bestInsertion(bPickup, bDrop, 1);
+    CHECK(at.feasible && at.pickupAt == 0 && at.dropAt == 0);
+
+    // Three seats taken: a party of two never rides along with A.
+    SharedTrip full(driver, Location(12.90, 77.60), 0.5);
+    full.insert(1, aPickup, aDrop, 3, full.bestInsertion(aPickup, aDrop, 3));
+    at = full.bestInsertion(Location(12.90, 77.63), Location(12.90, 77.66), 2);
+    CHECK(at.feasible && at.pickupAt == at.dropAt && at.pickupAt != 1);
+    at = full.bestInsertion(Location(12.90, 77.63), Location(12.90, 77.66), 1);
+    CHECK(at.feasible && at.pickupAt == 1);
+    CHECK(!full.bestInsertion(Location(12.90, 77.63), Location(12.90, 77.66), 5).feasible);
+
+    // With A aboard, B still fits into what is left of A's leg.
+    SharedTrip riding(driver, Location(12.90, 77.60), 0.5);
+    riding.insert(1, aPickup, aDrop, 1, riding.bestInsertion(aPickup, aDrop, 1));
+    TripStop stop = riding.advance();
+    CHECK(stop.rideId == 1 && stop.pickup);
+    at = riding.bestInsertion(bPickup, bDrop, 1);
+    CHECK(at.feasible && at.pickupAt == 0 && at.dropAt == 0);
+    // A full vehicle takes nobody until the drop.
+    SharedTrip busy(driver, Location(12.90, 77.60), 0.5);
+    busy.insert(1, aPickup, aDrop, 4, busy.bestInsertion(aPickup, aDrop, 4));
+    busy.advance();
+    at = busy.bestInsertion(bPickup, bDrop, 1);
+    CHECK(at.feasible && at.pickupAt == 1);
+    busy.removeRide(1);
+    CHECK(busy.empty());
+    at = busy.bestInsertion(bPickup, bDrop, 4);
+    CHECK(at.feasible && at.pickupAt == 0);
+}
+
+TEST(shared_trip_releases_its_driver_after_the_last_rider) {
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    Fleet fleet;
+    Driver* driver = fleet.add(Location(12.90, 77.60));
+    service->registerDriver(driver);
+    Rider a("a", "000", Location()), b("b", "000", Location()), c("c", "000", Location());
+    PinnedRide rideA = service->requestSharedRide(&a, Location(12.90, 77.61), Location(12.90, 77.70), SEDAN);
+    PinnedRide rideB = service->requestSharedRide(&b, Location(12.90, 77.63), Location(12.90, 77.66), SEDAN);
+    CHECK(rideA->getDriver() == driver && rideB->getDriver() == driver);
+    CHECK(service->sharedTripStops(driver->getId()).size() == 4);
+
+    // Stops A pickup, B pickup, B drop: A is still aboard.
+    for (int i = 0; i < 3; ++i) CHECK(service->advanceSharedTrip(driver->getId()));
+    CHECK(rideA->getStatus() == IN_PROGRESS && rideB->getStatus() == COMPLETED);
+    CHECK(driver->getStatus() == ON_TRIP);
+    CHECK(service->advanceSharedTrip(driver->getId()));
+    CHECK(rideA->getStatus() == COMPLETED);
+    CHECK(driver->getStatus() == AVAILABLE);
+    CHECK(!service->advanceSharedTrip(driver->getId()));
+
+    // Cancelling the last rider also frees the driver.
+    PinnedRide rideC = service->requestSharedRide(&c, Location(12.90, 77.61), Location(12.90, 77.70), SEDAN);
+    CHECK(rideC->getDriver() == driver && driver->getStatus() == ON_TRIP);
+    CHECK(service->cancelRide(rideC->getId(), CANCEL_BY_RIDER));
+    CHECK(driver->getStatus() == AVAILABLE);
+    CHECK(service->sharedTripStops(driver->getId()).empty());
+    PinnedRide again = service->requestRide(&c, Location(12.90, 77.61), Location(12.90, 77.70), SEDAN);
+    CHECK(again->getDriver() == driver);
+}
+
+TEST(shared_ride_skips_vehicles_too_small_for_the_party) {
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    Fleet fleet;
+    Vehicle small("KA-01", SEDAN, 2, 10.0);
+    Driver near("near", "000", &small, Location(12.900, 77.600), 4.5);
+    Driver* far = fleet.add(Location(12.910, 77.600));  // 4 seats
+    service->registerDriver(&near);
+    service->registerDriver(far);
+    Rider rider("rider", "000", Location());
+    PinnedRide ride = service->requestSharedRide(&rider, Location(12.900, 77.600),
+                                                 Location(12.95, 77.65), SEDAN, 3);
+    CHECK(ride->getDriver() == far);
+    CHECK(near.getStatus() == AVAILABLE);
+    PinnedRide other = service->requestRide(&rider, Location(12.900, 77.600),
+                                            Location(12.95, 77.65), SEDAN);
+    CHECK(other->getDriver() == &near);
+    // Nobody fits a party of five.
+    service->completeRide(other->getId());
+    PinnedRide none = service->requestSharedRide(&rider, Location(12.900, 77.600),
+                                                 Location(12.95, 77.65), SEDAN, 5);
+    CHECK(!none->getDriver() && none->getStatus() == CANCELLED);
+    CHECK(near.getStatus() == AVAILABLE);
+    service->deregisterDriver(&near);
+}
+
+// Driver offers
+TEST(offers_wake_on_answer_and_share_one_deadline) {
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    DriverAppOfferChannel channel;
+    Fleet fleet;
+    Driver* near = fleet.add(Location(12.900, 77.600));
+    Driver* far = fleet.add(Location(12.905, 77.600));
+    service->registerDriver(near);
+    service->registerDriver(far);
+    Rider rider("rider", "000", Location());
+
+    // The nearest driver declines and the next accepts, long before either
+    // offer would time out.
+    service->setOfferChannel(&channel, 2, chrono::milliseconds(5000),
+                             chrono::milliseconds(10000));
+    atomic<bool> done(false);
+    thread app([&] {
+        bool declined = false;
+        while (!done.load()) {
+            if (RideId id = channel.pendingOfferFor(near->getId())) {
+                declined = channel.respond(near->getId(), id, false) || declined;
+            }
+            if (RideId id = channel.pendingOfferFor(far->getId())) {
+                if (declined) channel.respond(far->getId(), id, true);
+            }
+            this_thread::yield();
+        }
+    });
+    auto start = chrono::steady_clock::now();
+    PinnedRide ride = service->requestRide(&rider, Location(12.9, 77.6), Location(13, 77.7), SEDAN);
+    auto took = chrono::steady_clock::now() - start;
+    done = true;
+    app.join();
+    CHECK(ride->getDriver() == far);
+    CHECK(took < chrono::milliseconds(1000));
+    service->updateRideStatus(ride->getId(), EN_ROUTE_TO_PICKUP);
+    service->updateRideStatus(ride->getId(), IN_PROGRESS);
+    service->completeRide(ride->getId());
+
+    // Nobody answers: two 200 ms offers are cut to 300 ms in total.
+    service->setOfferChannel(&channel, 2, chrono::milliseconds(200),
+                             chrono::milliseconds(300));
+    start = chrono::steady_clock::now();
+    ride = service->requestRide(&rider, Location(12.9, 77.6), Location(13, 77.7), SEDAN);
+    took = chrono::steady_clock::now() - start;
+    CHECK(!ride->getDriver());
+    CHECK(took >= chrono::milliseconds(290));
+    CHECK(took < chrono::milliseconds(390));
+    service->setOfferChannel(nullptr);
+}
+
+TEST(drivers_deregistered_mid_offer_or_trip_stay_out_of_the_pool) {
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    DriverAppOfferChannel channel;
+    Fleet fleet;
+    Driver* driver = fleet.add(Location(12.9, 77.6));
+    service->registerDriver(driver);
+    Rider rider("rider", "000", Location());
+    Location pickup(12.9, 77.6), drop(13, 77.7);
+
+    // The driver goes offline while the offer is open, then declines.
+    service->setOfferChannel(&channel, 1, chrono::milliseconds(5000),
+                             chrono::milliseconds(5000));
+    thread app([&] {
+        RideId id;
+        while (!(id = channel.pendingOfferFor(driver->getId()))) this_thread::yield();
+        service->deregisterDriver(driver);
+        channel.respond(driver->getId(), id, false);
+    });
+    PinnedRide ride = service->requestRide(&rider, pickup, drop, SEDAN);
+    app.join();
+    service->setOfferChannel(nullptr);
+    CHECK(!ride->getDriver() && ride->getStatus() == CANCELLED);
+    CHECK(driver->getStatus() == OFFLINE);
+    CHECK(service->requestRide(&rider, pickup, drop, SEDAN)->getStatus() == CANCELLED);
+
+    // The same after going offline during a trip.
+    service->registerDriver(driver);
+    ride = service->requestRide(&rider, pickup, drop, SEDAN);
+    CHECK(ride->getDriver() == driver);
+    service->deregisterDriver(driver);
+    service->completeRide(ride->getId());
+    CHECK(ride->getStatus() == COMPLETED && driver->getStatus() == OFFLINE);
+    CHECK(service->requestRide(&rider, pickup, drop, SEDAN)->getStatus() == CANCELLED);
+}
+
+// Ride lifetime
+TEST(pinned_ride_survives_retention) {
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    Rider rider("rider", "000", Location());
+    // No drivers: every request is cancelled and retired at once.
+    PinnedRide first = service->requestRide(&rider, Location(12.9, 77.6), Location(13, 77.7), SEDAN);
+    RideId firstId = first->getId();
+    CHECK(first->getStatus() == CANCELLED);
+    for (int i = 0; i < 5000; ++i) {
+        service->requestRide(&rider, Location(12.9, 77.6), Location(13, 77.7), SEDAN);
+    }
+    // Aged out of the retention ring, but not recycled while pinned.
+    CHECK(first->getId() == firstId);
+    CHECK(first->getStatus() == CANCELLED);
+    PinnedRide copy = first;
+    first = PinnedRide();
+    CHECK(copy->getId() == firstId);
+}
+
+// Cancellation and no-shows
+TEST(illegal_transitions_are_rejected) {
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    Fleet fleet;
+    Driver* driver = fleet.add(Location(12.9, 77.6));
+    service->registerDriver(driver);
+    Rider rider("rider", "000", Location());
+    PinnedRide ride = service->requestRide(&rider, Location(12.9, 77.6), Location(13, 77.7), SEDAN);
+    CHECK(ride->getStatus() == DRIVER_ASSIGNED);
+    service->updateRideStatus(ride->getId(), REQUESTED);
+    CHECK(ride->getStatus() == DRIVER_ASSIGNED);
+    service->updateRideStatus(ride->getId(), IN_PROGRESS);
+    service->updateRideStatus(ride->getId(), EN_ROUTE_TO_PICKUP);
+    CHECK(ride->getStatus() == IN_PROGRESS);
+    // No-show reasons no longer apply once the rider is on board.
+    CHECK(!service->cancelRide(ride->getId(), CANCEL_RIDER_NO_SHOW));
+    CHECK(!service->cancelRide(ride->getId(), CANCEL_DRIVER_NO_SHOW));
+    CHECK(ride->getStatus() == IN_PROGRESS && driver->getStatus() == ON_TRIP);
+
+    service->completeRide(ride->getId());
+    CHECK(ride->getStatus() == COMPLETED);
+    service->updateRideStatus(ride->getId(), IN_PROGRESS);
+    CHECK(!service->cancelRide(ride->getId(), CANCEL_BY_RIDER));
+    CHECK(ride->getStatus() == COMPLETED && driver->getStatus() == AVAILABLE);
+}
+
+TEST(cancel_before_and_after_assignment_frees_the_driver) {
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    Rider rider("rider", "000", Location());
+    Location pickup(12.9, 77.6), drop(13, 77.7);
+    // Nobody to assign: the request ends unmatched and there is nothing
+    // left to cancel.
+    PinnedRide unmatched = service->requestRide(&rider, pickup, drop, SEDAN);
+    CHECK(unmatched->getStatus() == CANCELLED);
+    CHECK(!service->cancelRide(unmatched->getId(), CANCEL_BY_RIDER));
+    CHECK(!service->cancelRide(unmatched->getId() + 1000, CANCEL_BY_RIDER));
+
+    Fleet fleet;
+    Driver* driver = fleet.add(pickup);
+    service->registerDriver(driver);
+    // A booking cancelled before it is released never takes the driver.
+    ScheduleWheel::ScheduleId booking =
+        service->scheduleRide(&rider, pickup, drop, SEDAN, Ride::wallClockMs() + 3600 * 1000);
+    CHECK(service->cancelScheduledRide(booking));
+    CHECK(service->releaseScheduledRides(Ride::wallClockMs() + 7200 * 1000).empty());
+    CHECK(driver->getStatus() == AVAILABLE);
+
+    PinnedRide ride = service->requestRide(&rider, pickup, drop, SEDAN);
+    CHECK(ride->getStatus() == DRIVER_ASSIGNED && driver->getStatus() == ON_TRIP);
+    service->updateRideStatus(ride->getId(), EN_ROUTE_TO_PICKUP);
+    CHECK(service->cancelRide(ride->getId(), CANCEL_BY_DRIVER));
+    CHECK(ride->getStatus() == CANCELLED && driver->getStatus() == AVAILABLE);
+    CHECK(!service->cancelRide(ride->getId(), CANCEL_BY_RIDER));
+    service->completeRide(ride->getId());
+    CHECK(ride->getStatus() == CANCELLED);
+
+    PinnedRide next = service->requestRide(&rider, pickup, drop, SEDAN);
+    CHECK(next->getStatus() == DRIVER_ASSIGNED && next->getDriver() == driver);
+    service->completeRide(next->getId());
+
+    vector<RideStatus> archived;
+    service->forEachArchivedRide(&rider, [&](const RideArchive::Row& row) {
+        archived.push_back(row.status);
+    });
+    CHECK(archived.size() == 3);
+    CHECK(count(archived.begin(), archived.end(), CANCELLED) == 2);
+    CHECK(count(archived.begin(), archived.end(), COMPLETED) == 1);
+}
+
+TEST(no_show_timeouts_cancel_with_their_reason) {
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    ostringstream out;
+    EventLog& log = EventLog::getInstance();
+    log.setSink(new TextEventSink(out));
+    log.setLevel(LOG_INFO);
+    Fleet fleet;
+    Driver* driver = fleet.add(Location(12.9, 77.6));
+    service->registerDriver(driver);
+    Rider rider("rider", "000", Location());
+    Location pickup(12.9, 77.6), drop(13, 77.7);
+    CHECK(service->configureNoShowTimeouts(chrono::milliseconds(1000), chrono::milliseconds(5000),
+                                           chrono::milliseconds(10)));
+
+    // The driver never shows up.
+    int64_t now = Ride::wallClockMs();
+    PinnedRide ride = service->requestRide(&rider, pickup, drop, SEDAN);
+    CHECK(service->pendingTimeoutCount() == 1);
+    CHECK(!service->configureNoShowTimeouts(chrono::milliseconds(0), chrono::milliseconds(0)));
+    CHECK(service->expireRideTimeouts(now + 500) == 0);
+    CHECK(service->expireRideTimeouts(now + 3000) == 1);
+    CHECK(ride->getStatus() == CANCELLED && driver->getStatus() == AVAILABLE);
+    CHECK(service->pendingTimeoutCount() == 0);
+
+    // The driver arrives in time, which replaces the driver's deadline
+    // with the rider's; the rider never boards.
+    now = Ride::wallClockMs();
+    ride = service->requestRide(&rider, pickup, drop, SEDAN);
+    service->driverArrived(ride->getId(), now);
+    CHECK(service->pendingTimeoutCount() == 1);
+    CHECK(service->expireRideTimeouts(now + 3000) == 0);
+    CHECK(ride->getStatus() == DRIVER_ASSIGNED);
+    CHECK(service->expireRideTimeouts(now + 6000) == 1);
+    CHECK(ride->getStatus() == CANCELLED && driver->getStatus() == AVAILABLE);
+
+    // Boarding clears the rider's deadline too.
+    now = Ride::wallClockMs();
+    ride = service->requestRide(&rider, pickup, drop, SEDAN);
+    service->driverArrived(ride->getId(), now);
+    service->updateRideStatus(ride->getId(), IN_PROGRESS);
+    CHECK(service->pendingTimeoutCount() == 0);
+    CHECK(service->expireRideTimeouts(now + 60000) == 0);
+    CHECK(ride->getStatus() == IN_PROGRESS);
+    service->completeRide(ride->getId());
+
+    log.flush();
+    string text = out.str();
+    size_t driverNoShow = text.find(cancelReasonName(CANCEL_DRIVER_NO_SHOW));
+    size_t riderNoShow = text.find(cancelReasonName(CANCEL_RIDER_NO_SHOW));
+    CHECK(driverNoShow != string::npos && riderNoShow != string::npos);
+    CHECK(driverNoShow < riderNoShow);
+    CHECK(text.find("No-show timeouts must be configured while none are pending.") !=
+          string::npos);
+    log.setLevel(LOG_OFF);
+    log.setSink(new TextEventSink(cout));
+}
+
+// Timer wheel
+TEST(timer_wheel_fires_each_entry_on_its_tick) {
+    mt19937 rng(22);
+    // Spread over the first three levels, from a start that is not aligned
+    // to any level's span.
+    const int64_t start = 3 * 65536 + 777;
+    uniform_int_distribution<int64_t> delay(1, 1 << 20);
+    uniform_int_distribution<int64_t> step(1, 5000);
+    TimerWheel<int> wheel(start);
+    vector<int64_t> fireAt;
+    for (int i = 0; i < 5000; ++i) {
+        fireAt.push_back(start + delay(rng));
+        wheel.schedule(i, fireAt.back());
+    }
+    CHECK(wheel.size() == 5000);
+
+    vector<int64_t> firedAt(fireAt.size(), -1);
+    int64_t now = start;
+    bool onTime = true;
+    vector<int> due;
+    while (now < start + (1 << 20)) {
+        int64_t before = now;
+        now += step(rng);
+        due.clear();
+        wheel.advance(now, due);
+        for (int id : due) {
+            if (firedAt[id] >= 0 || fireAt[id] <= before || fireAt[id] > now) onTime = false;
+            firedAt[id] = now;
+        }
+    }
+    CHECK(onTime);
+    CHECK(count(firedAt.begin(), firedAt.end(), -1) == 0);
+    CHECK(wheel.size() == 0);
+}
+
+TEST(timer_wheel_cancel_and_reuse) {
+    TimerWheel<int> wheel(0);
+    TimerWheel<int>::ScheduleId a = wheel.schedule(1, 10);
+    TimerWheel<int>::ScheduleId b = wheel.schedule(2, 300);
+    TimerWheel<int>::ScheduleId c = wheel.schedule(3, 70000);
+    CHECK(wheel.cancel(b));
+    CHECK(!wheel.cancel(b));
+    CHECK(wheel.size() == 2);
+
+    // b's entry is reused; its old id must not cancel the new booking.
+    TimerWheel<int>::ScheduleId d = wheel.schedule(4, 300);
+    CHECK(d != b);
+    CHECK(!wheel.cancel(b));
+
+    vector<int> due;
+    wheel.advance(9, due);
+    CHECK(due.empty());
+    wheel.advance(10, due);
+    CHECK(due == vector<int>{1});
+    CHECK(!wheel.cancel(a));  // already fired
+    CHECK(wheel.cancel(c));
+    due.clear();
+    wheel.advance(100000, due);
+    CHECK(due == vector<int>{4});
+    CHECK(wheel.size() == 0);
+
+    // A booking in the past fires on the next tick.
+    wheel.schedule(5, 5);
+    due.clear();
+    wheel.advance(100001, due);
+    CHECK(due == vector<int>{5});
+}
+
+// Metrics
+TEST(metrics_blocks_are_recycled_and_keep_their_counts) {
+    DispatchMetrics& metrics = DispatchMetrics::getInstance();
+    metrics.setEnabled(true);
+    metrics.increment(COUNTER_CANCELLED);  // this thread's block
+    uint64_t before = metrics.snapshot().counters[COUNTER_CANCELLED];
+    uint64_t stagesBefore = metrics.snapshot().stages[STAGE_CANCEL].count();
+    size_t blocks = metrics.blockCount();
+    atomic<bool> done(false);
+    thread reader([&] {
+        while (!done.load()) metrics.snapshot();
+    });
+    for (int t = 0; t < 32; ++t) {
+        thread worker([&] {
+            for (int i = 0; i < 100; ++i) {
+                metrics.increment(COUNTER_CANCELLED);
+                metrics.recordStage(STAGE_CANCEL, chrono::microseconds(i));
+            }
+        });
+        worker.join();
+    }
+    done = true;
+    reader.join();
+    DispatchMetrics::Snapshot after = metrics.snapshot();
+    // The reader and one worker at a time: at most two new blocks.
+    CHECK(metrics.blockCount() <= blocks + 2);
+    CHECK(after.counters[COUNTER_CANCELLED] == before + 3200);
+    CHECK(after.stages[STAGE_CANCEL].count() == stagesBefore + 3200);
+    CHECK(after.stages[STAGE_CANCEL].maxRecorded() >= 99000);
+    metrics.setEnabled(false);
+}
+
+// User registry
+TEST(registry_interns_names_and_maps_ids_to_users) {
+    UserRegistry& registry = UserRegistry::getInstance();
+    RideId ids[Rider::RECENT_RIDES];
+    int goneId;
+    {
+        Rider first("Asha Ramanathan", "+91-98450-00001", Location());
+        Rider second(string("Asha ") + "Ramanathan", "+91-98450-00002", Location());
+        // One copy of the name, separate phones.
+        CHECK(first.getName().data() == second.getName().data());
+        CHECK(first.getPhone() == "+91-98450-00001" && second.getPhone() == "+91-98450-00002");
+        CHECK(second.getId() == first.getId() + 1);
+        CHECK(registry.find(first.getId()) == &first);
+        string name;
+        CHECK(registry.nameOf(second.getId(), name) && name == "Asha Ramanathan");
+        CHECK(first.recentRideIds(ids) == 0);
+        goneId = first.getId();
+    }
+    string name;
+    CHECK(registry.find(goneId) == nullptr);
+    CHECK(!registry.nameOf(goneId, name));
+    CHECK(registry.find(-1) == nullptr);
+
+    // Re-created users keep their id; later ids go above it.
+    int restoredId = User::lastIssuedId() + 100;
+    Rider restored(restoredId, "restored", "000", Location());
+    CHECK(registry.find(restoredId) == &restored);
+    Rider next("next", "000", Location());
+    CHECK(next.getId() == restoredId + 1);
+}
+
+TEST(recent_rides_ring_resolves_against_the_archive) {
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    Fleet fleet;
+    service->registerDriver(fleet.add(Location(12.9, 77.6)));
+    Rider rider("rider", "000", Location());
+    vector<RideId> requested;
+    for (int i = 0; i < 10; ++i) {
+        PinnedRide ride = service->requestRide(&rider, Location(12.9, 77.6), Location(13, 77.7), SEDAN);
+        requested.push_back(ride->getId());
+        service->completeRide(ride->getId());
+    }
+    CHECK(rider.getRideCount() == 10);
+    RideId ids[Rider::RECENT_RIDES];
+    CHECK(rider.recentRideIds(ids) == Rider::RECENT_RIDES);
+    for (size_t i = 0; i < Rider::RECENT_RIDES; ++i) CHECK(ids[i] == requested[9 - i]);
+
+    vector<RideId> recent, archived;
+    service->forEachRecentRide(&rider, [&](const RideArchive::Row& row) {
+        recent.push_back(row.rideId);
+        CHECK(row.riderId == rider.getId() && row.status == COMPLETED);
+    });
+    CHECK(recent == vector<RideId>(ids, ids + Rider::RECENT_RIDES));
+    service->forEachArchivedRide(&rider, [&](const RideArchive::Row& row) {
+        archived.push_back(row.rideId);
+    });
+    CHECK(archived == requested);
+}
+
+// Event log
+TEST(event_log_names_users_and_drains_in_batches) {
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    ostringstream out;
+    EventLog& log = EventLog::getInstance();
+    log.setSink(new TextEventSink(out));
+    log.setLevel(LOG_INFO);
+    Vehicle car("KA-00", SEDAN, 4, 10.0);
+    Driver zed("Zed", "000", &car, Location(12.9, 77.6), 4.5);
+    Driver* driver = &zed;
+    Rider rider("Yan", "000", Location());
+    service->registerDriver(driver);
+    PinnedRide ride = service->requestRide(&rider, Location(12.9, 77.6), Location(13, 77.7), SEDAN);
+    // Nothing reaches the sink until a batch boundary or an explicit flush.
+    CHECK(out.str().empty());
+    log.message(LOG_WARN, "free text kept verbatim");
+    log.flush();
+    string text = out.str();
+    CHECK(text.find("Driver registered: Driver{name='Zed', vehicle=SEDAN") != string::npos);
+    CHECK(text.find("=== Rider Yan requests a SEDAN ride ===") != string::npos);
+    CHECK(text.find("[Notification to Driver Zed]: Ride") != string::npos);
+    CHECK(text.find("free text kept verbatim") != string::npos);
+    service->deregisterDriver(driver);
+    log.setLevel(LOG_OFF);
+    log.setSink(new TextEventSink(cout));
+}
+
+// Ride archive
+TEST(archive_spills_sealed_blocks_in_background) {
+    char dir[] = "/tmp/dispatch_archive_XXXXXX";
+    CHECK(mkdtemp(dir) != nullptr);
+    Rider rider("rider", "000", Location());
+    Rider other("other", "000", Location());
+    const size_t total = RideArchive::BLOCK_ROWS * 3 + 10;
+    {
+        RideArchive archive;
+        archive.setSpillDirectory(dir);
+        for (size_t i = 0; i < total; ++i) {
+            Ride ride((RideId)i + 1, i % 2 ? &rider : &other, Location(12.9, 77.6),
+                      Location(13, 77.7), SEDAN);
+            archive.append(&ride);
+        }
+        archive.flushSpills();
+        CHECK(archive.spilledBlocks() == 3);
+        CHECK(archive.size() == total);
+        size_t seen = 0, ofRider = 0;
+        archive.forEach([&](const RideArchive::Row&) { ++seen; });
+        archive.forEachOfRider(rider.getId(), [&](const RideArchive::Row& row) {
+            if (row.riderId == rider.getId()) ++ofRider;
+        });
+        CHECK(seen == total);
+        CHECK(ofRider == total / 2);
+        RideArchive::Row row;
+        CHECK(archive.findRide(5, row) && row.riderId == other.getId());
+        CHECK(archive.findRide((RideId)total, row));
+    }
+    for (int i = 0; i < 3; ++i) unlink((string(dir) + "/rides-" + to_string(i) + ".blk").c_str());
+    rmdir(dir);
+}
+
+// Trace replay
+static TraceRecord traceRecordOf(TraceOp op, double minutes) {
+    TraceRecord record;
+    memset(&record, 0, sizeof(record));
+    record.op = op;
+    record.atNs = (int64_t)(minutes * 60e9);
+    return record;
+}
+
+static TraceRecord tracedRide(TraceOp op, double minutes, RideId ride,
+                              RideStatus status = REQUESTED) {
+    TraceRecord record = traceRecordOf(op, minutes);
+    record.stamp = (int64_t)ride;
+    record.status = (uint8_t)status;
+    return record;
+}
+
+static TraceRecord tracedDriver(int id, double minutes, const Location& at) {
+    TraceRecord record = traceRecordOf(TRACE_REGISTER_DRIVER, minutes);
+    record.driverId = id;
+    record.type = SEDAN;
+    record.capacity = 4;
+    record.farePerKm = 10.0;
+    record.value = 4.5;
+    record.latitude = at.latitude;
+    record.longitude = at.longitude;
+    return record;
+}
+
+static TraceRecord tracedRequest(double minutes, RideId ride, const Location& pickup) {
+    TraceRecord record = tracedRide(TRACE_REQUEST_RIDE, minutes, ride);
+    record.riderId = 7;
+    record.type = SEDAN;
+    record.latitude = pickup.latitude;
+    record.longitude = pickup.longitude;
+    record.dropLatitude = 13.0;
+    record.dropLongitude = 77.7;
+    return record;
+}
+
+static TraceReplayer::Report replayScored(const string& path, double speed) {
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    service->setMatchingStrategy(new ScoredDriverStrategy(1.0, 0.0, 1.0));
+    TraceReplayer replayer(*service);
+    TraceReplayer::Report report;
+    CHECK(replayer.replay(path, speed, report));
+    return report;
+}
+
+TEST(replay_idles_drivers_by_traced_time) {
+    char dir[] = "/tmp/dispatch_trace_XXXXXX";
+    CHECK(mkdtemp(dir) != nullptr);
+    string path = string(dir) + "/trace.bin";
+    Location pickup(12.900, 77.600);
+    vector<TraceRecord> records;
+    TraceRecord begin = traceRecordOf(TRACE_BEGIN, 0.0);
+    begin.driverId = TRACE_MAGIC;
+    begin.capacity = TRACE_VERSION;
+    records.push_back(begin);
+    // About 1 km further away, but idle ten minutes longer: at one point
+    // per km and per idle minute the far driver wins.
+    records.push_back(tracedDriver(1, 0.0, Location(12.909, 77.600)));
+    records.push_back(tracedDriver(2, 10.0, pickup));
+    records.push_back(tracedRequest(10.01, 100, pickup));
+    records.push_back(tracedRide(TRACE_RIDE_STATUS, 10.02, 100, EN_ROUTE_TO_PICKUP));
+    records.push_back(tracedRide(TRACE_RIDE_STATUS, 10.03, 100, IN_PROGRESS));
+    records.push_back(tracedRide(TRACE_COMPLETE_RIDE, 10.04, 100));
+    records.push_back(tracedRequest(10.05, 101, pickup));
+    records.push_back(tracedRide(TRACE_CANCEL_RIDE, 10.06, 101, (RideStatus)CANCEL_BY_RIDER));
+    records.push_back(tracedRide(TRACE_RIDE_STATUS, 10.07, 101, EN_ROUTE_TO_PICKUP));
+    {
+        ofstream out(path, ios::binary);
+        out.write((const char*)records.data(), records.size() * sizeof(TraceRecord));
+    }
+
+    TraceReplayer::Report first = replayScored(path, 0.0);
+    CHECK(first.records == records.size() - 1);
+    CHECK(first.matched == 2);
+    CHECK(first.completed == 1);
+    CHECK(first.cancelled == 1);
+    CHECK(first.skipped == 1);  // the status change after the cancel
+    // The far driver took the first ride; the second went to the near one.
+    CHECK(first.pickupKm > 0.9 && first.pickupKm < 1.1);
+    TraceReplayer::Report second = replayScored(path, 0.0);
+    CHECK(second.pickupKm == first.pickupKm);
+    CHECK(second.fares == first.fares);
+
+    unlink(path.c_str());
+    rmdir(dir);
+}
+
+TEST(trace_stamps_requests_on_arrival) {
+    char dir[] = "/tmp/dispatch_trace_XXXXXX";
+    CHECK(mkdtemp(dir) != nullptr);
+    string path = string(dir) + "/trace.bin";
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    DriverAppOfferChannel channel;
+    Fleet fleet;
+    service->registerDriver(fleet.add(Location(12.9, 77.6)));
+    service->setOfferChannel(&channel, 1, chrono::milliseconds(100), chrono::milliseconds(100));
+    Rider rider("rider", "000", Location());
+    CHECK(service->startTrace(path));
+    service->flushLocationUpdates();
+    // Nobody answers, so the request takes the whole 100 ms offer.
+    service->requestRide(&rider, Location(12.9, 77.6), Location(13, 77.7), SEDAN);
+    service->flushLocationUpdates();
+    service->stopTrace();
+    service->setOfferChannel(nullptr);
+
+    MappedFile file(path);
+    const TraceRecord* records = (const TraceRecord*)file.data();
+    CHECK(file.size() == 4 * sizeof(TraceRecord));
+    if (file.size() == 4 * sizeof(TraceRecord)) {
+        CHECK(records[2].op == TRACE_REQUEST_RIDE);
+        CHECK(records[2].atNs - records[1].atNs < 50 * 1000000LL);
+        CHECK(records[3].atNs - records[2].atNs >= 90 * 1000000LL);
+    }
+    unlink(path.c_str());
+    rmdir(dir);
+}
+
+TEST(traced_cancel_replays) {
+    char dir[] = "/tmp/dispatch_trace_XXXXXX";
+    CHECK(mkdtemp(dir) != nullptr);
+    string path = string(dir) + "/trace.bin";
+    unique_ptr<DispatchService> service = DispatchTestAccess::create();
+    Fleet fleet;
+    Rider rider("rider", "000", Location());
+    Location pickup(12.9, 77.6), drop(13, 77.7);
+    CHECK(service->startTrace(path));
+    service->registerDriver(fleet.add(pickup));
+    PinnedRide cancelled = service->requestRide(&rider, pickup, drop, SEDAN);
+    CHECK(service->cancelRide(cancelled->getId(), CANCEL_BY_DRIVER));
+    PinnedRide completed = service->requestRide(&rider, pickup, drop, SEDAN);
+    service->completeRide(completed->getId());
+    service->stopTrace();
+
+    size_t cancels = 0;
+    {
+        MappedFile file(path);
+        const TraceRecord* records = (const TraceRecord*)file.data();
+        for (size_t i = 0; i < file.size() / sizeof(TraceRecord); ++i) {
+            if (records[i].op != TRACE_CANCEL_RIDE) continue;
+            ++cancels;
+            CHECK(records[i].stamp == (int64_t)cancelled->getId());
+            CHECK(records[i].status == CANCEL_BY_DRIVER);
+        }
+    }
+    CHECK(cancels == 1);
+
+    // The replayed cancel frees the driver for the second request.
+    unique_ptr<DispatchService> replayed = DispatchTestAccess::create();
+    TraceReplayer replayer(*replayed);
+    TraceReplayer::Report report;
+    CHECK(replayer.replay(path, 0.0, report));
+    CHECK(report.matched == 2 && report.unmatched == 0);
+    CHECK(report.cancelled == 1 && report.completed == 1 && report.skipped == 0);
+    CHECK(report.fares == completed->getFare());
+    unlink(path.c_str());
+    rmdir(dir);
+}
+
+// Cluster
+static vector<uint8_t> driverStateFrame(const Driver* driver) {
+    WireWriter out(WIRE_DRIVER_STATE);
+    writeDriverState(out, driver, driver->getCurrentLocation());
+    return out.frame();
+}
+
+static vector<uint8_t> rideRequestFrame(const Rider& rider, const Location& pickup,
+                                        const Location& drop) {
+    WireWriter out(WIRE_RIDE_REQUEST);
+    out.varint((uint64_t)rider.getId())
+        .text(rider.getName())
+        .text(rider.getPhone())
+        .real(rider.getDiscountAmount())
+        .varint(SEDAN)
+        .location(pickup)
+        .location(drop);
+    return out.frame();
+}
+
+TEST(wire_frames_round_trip) {
+    WireWriter out(WIRE_DRIVER_MOVE);
+    out.varint(0).varint(127).varint(128).varint(300).varint(numeric_limits<uint64_t>::max())
+        .signedVarint(0).signedVarint(-1).signedVarint(numeric_limits<int64_t>::min())
+        .signedVarint(numeric_limits<int64_t>::max())
+        .real(-3.25).text("").text("n\u00e9e").location(Location(12.9, -77.6));
+    vector<uint8_t> frame = out.frame();
+    WireReader in(frame);
+    CHECK(in.messageType() == WIRE_DRIVER_MOVE);
+    CHECK(in.varint() == 0 && in.varint() == 127 && in.varint() == 128 && in.varint() == 300);
+    CHECK(in.varint() == numeric_limits<uint64_t>::max());
+    CHECK(in.signedVarint() == 0 && in.signedVarint() == -1);
+    CHECK(in.signedVarint() == numeric_limits<int64_t>::min());
+    CHECK(in.signedVarint() == numeric_limits<int64_t>::max());
+    CHECK(in.real() == -3.25 && in.text() == "" && in.text() == "n\u00e9e");
+    Location loc = in.location();
+    CHECK(in.ok() && loc.latitude == 12.9 && loc.longitude == -77.6);
+    // Reading past the payload fails and yields zeros from then on.
+    CHECK(in.varint() == 0 && !in.ok());
+    CHECK(in.real() == 0.0 && in.text().empty() && !in.ok());
+
+    Fleet fleet;
+    Driver* driver = fleet.add(Location(12.9, 77.6), 4.25, SUV);
+    WireWriter state(WIRE_DRIVER_STATE);
+    writeDriverState(state, driver, Location(13, 77.7));
+    frame = state.frame();
+    WireReader stateIn(frame);
+    WireDriverState read;
+    CHECK(readDriverState(stateIn, read));
+    CHECK(read.id == driver->getId() && read.type == SUV && read.rating == 4.25);
+    CHECK(read.capacity == driver->getVehicle()->getCapacity());
+    CHECK(read.farePerKm == driver->getVehicle()->getFarePerKm());
+    CHECK(read.location.latitude == 13 && read.location.longitude == 77.7);
+    CHECK(read.name == driver->getName() && read.phone == driver->getPhone());
+    CHECK(read.plate == driver->getVehicle()->getPlateNumber());
+}
+
+TEST(wire_rejects_truncated_frames) {
+    CHECK(frameType(vector<uint8_t>()) == WIRE_ERROR);
+    WireWriter out(WIRE_RIDE_STATUS);
+    out.varint(300).varint(EN_ROUTE_TO_PICKUP);
+    vector<uint8_t> frame = out.frame();
+
+    // A frame whose length prefix disagrees with its size.
+    vector<uint8_t> cut(frame.begin(), frame.end() - 1);
+    WireReader shortFrame(cut);
+    CHECK(shortFrame.messageType() == WIRE_ERROR && !shortFrame.ok());
+    CHECK(shortFrame.varint() == 0);
+    vector<uint8_t> padded = frame;
+    padded.push_back(0);
+    CHECK(frameType(padded) == WIRE_ERROR);
+
+    // Well-formed frames whose payload ends too early.
+    WireWriter noStatus(WIRE_RIDE_STATUS);
+    noStatus.varint(300);
+    frame = noStatus.frame();
+    WireReader in(frame);
+    CHECK(in.ok() && in.varint() == 300);
+    CHECK(in.varint() == 0 && !in.ok());
+    // 300, then a varint whose continuation bit has no byte after it.
+    frame = {WIRE_RIDE_STATUS, 3, 0xac, 0x02, 0x80};
+    WireReader varintIn(frame);
+    CHECK(varintIn.ok() && varintIn.varint() == 300);
+    CHECK(varintIn.varint() == 0 && !varintIn.ok());
+    WireWriter longText(WIRE_RIDE_REQUEST);
+    longText.varint(1).varint(10).real(0.0);
+    frame = longText.frame();
+    WireReader textIn(frame);
+    CHECK(textIn.varint() == 1 && textIn.text().empty() && !textIn.ok());
+
+    Fleet fleet;
+    WireWriter state(WIRE_DRIVER_STATE);
+    writeDriverState(state, fleet.add(Location(12.9, 77.6)), Location(12.9, 77.6));
+    frame = state.frame();
+    WireWriter partial(WIRE_DRIVER_STATE);
+    partial.varint(7).varint(SEDAN).varint(4).real(10.0);
+    vector<uint8_t> partialFrame = partial.frame();
+    WireReader partialIn(partialFrame);
+    WireDriverState read;
+    CHECK(!readDriverState(partialIn, read));
+
+    // A node answers such frames with an error and hosts nothing.
+    ClusterNode node(0);
+    CHECK(frameType(node.handle(partialFrame)) == WIRE_ERROR);
+    CHECK(frameType(node.handle(noStatus.frame())) == WIRE_ERROR);
+    CHECK(frameType(node.handle(cut)) == WIRE_ERROR);
+    CHECK(node.hostedDriverCount() == 0);
+    CHECK(frameType(node.handle(frame)) == WIRE_ACK && node.hostedDriverCount() == 1);
+}
+
+TEST(zone_ring_moves_only_the_cells_it_must) {
+    ZoneRing ring;
+    CHECK(ring.ownerOf(0, 0) == -1);
+    for (int n = 0; n < 3; ++n) ring.addNode(n);
+    const int CELLS = 4000;
+    auto owners = [&]() {
+        vector<int> out;
+        for (int i = 0; i < CELLS; ++i) out.push_back(ring.ownerOf(i % 80 - 40, i / 80 - 25));
+        return out;
+    };
+    vector<int> before = owners();
+
+    ring.addNode(3);
+    vector<int> grown = owners();
+    int moved = 0;
+    for (int i = 0; i < CELLS; ++i) {
+        if (grown[i] == before[i]) continue;
+        CHECK(grown[i] == 3);
+        ++moved;
+    }
+    // About a quarter of the cells move to the new node.
+    CHECK(moved > CELLS / 8 && moved < CELLS / 2);
+    ring.removeNode(3);
+    CHECK(owners() == before);
+
+    vector<int> heirs;
+    for (int i = 0; i < CELLS; ++i) heirs.push_back(ring.ownerAfter(i % 80 - 40, i / 80 - 25, 1));
+    ring.removeNode(1);
+    vector<int> shrunk = owners();
+    for (int i = 0; i < CELLS; ++i) {
+        CHECK(shrunk[i] != 1);
+        CHECK(shrunk[i] == (before[i] == 1 ? heirs[i] : before[i]));
+    }
+}
+
+TEST(cluster_node_rejects_out_of_range_enums) {
+    ClusterNode node(0);
+    Fleet fleet;
+    Driver* driver = fleet.add(Location(12.9, 77.6));
+    CHECK(frameType(node.handle(driverStateFrame(driver))) == WIRE_ACK);
+    Rider rider("rider", "000", Location());
+    vector<uint8_t> answer = node.handle(rideRequestFrame(rider, Location(12.9, 77.6),
+                                                          Location(13, 77.7)));
+    WireReader reply(answer);
+    CHECK(reply.messageType() == WIRE_RIDE_REPLY);
+    RideId rideId = reply.varint();
+    CHECK(reply.varint() == DRIVER_ASSIGNED && (int)reply.varint() == driver->getId());
+
+    WireWriter badStatus(WIRE_RIDE_STATUS);
+    badStatus.varint(rideId).varint(RIDE_STATUS_COUNT);
+    CHECK(frameType(node.handle(badStatus.frame())) == WIRE_ERROR);
+    WireWriter hugeStatus(WIRE_RIDE_STATUS);
+    hugeStatus.varint(rideId).varint(numeric_limits<uint64_t>::max());
+    CHECK(frameType(node.handle(hugeStatus.frame())) == WIRE_ERROR);
+    WireWriter badReason(WIRE_RIDE_CANCEL);
+    badReason.varint(rideId).varint(CANCEL_REASON_COUNT);
+    CHECK(frameType(node.handle(badReason.frame())) == WIRE_ERROR);
+
+    // The ride is untouched and still takes valid frames.
+    WireWriter status(WIRE_RIDE_STATUS);
+    status.varint(rideId).varint(EN_ROUTE_TO_PICKUP);
+    CHECK(frameType(node.handle(status.frame())) == WIRE_ACK);
+    WireWriter cancel(WIRE_RIDE_CANCEL);
+    cancel.varint(rideId).varint(CANCEL_BY_DRIVER);
+    CHECK(frameType(node.handle(cancel.frame())) == WIRE_ACK);
+    Driver* hosted = node.dispatch().findDriver(driver->getId());
+    CHECK(hosted && hosted->getStatus() == AVAILABLE);
+}
+
+// A rider's rides archived on a node, oldest first.
+static vector<RideArchive::Row> nodeRows(ClusterNode* node, const Rider& rider) {
+    vector<RideArchive::Row> rows;
+    node->dispatch().forEachArchivedRide(&rider, [&](const RideArchive::Row& row) {
+        rows.push_back(row);
+    });
+    return rows;
+}
+
+TEST(cluster_rides_keep_the_rider_discount) {
+    Location pickup(12.9, 77.6), drop(13, 77.7);
+    Fleet fleet;
+    Rider rider("rider", "000", Location());
+    rider.setDiscountAmount(30.0);
+
+    unique_ptr<DispatchService> single = DispatchTestAccess::create();
+    single->registerDriver(fleet.add(pickup));
+    PinnedRide ride = single->requestRide(&rider, pickup, drop, SEDAN);
+    single->completeRide(ride->getId());
+
+    DispatchCluster cluster;
+    int n = cluster.addNode();
+    CHECK(cluster.registerDriver(fleet.add(pickup)));
+    DispatchCluster::RideHandle handle = cluster.requestRide(&rider, pickup, drop, SEDAN);
+    CHECK(handle.node == n && handle.driverId != 0);
+    cluster.completeRide(handle.rideId);
+    vector<RideArchive::Row> rows = nodeRows(cluster.node(n), rider);
+    CHECK(rows.size() == 1 && rows[0].fare == ride->getFare());
+
+    // The stub follows the rider's current discount.
+    rider.setDiscountAmount(0.0);
+    handle = cluster.requestRide(&rider, pickup, drop, SEDAN);
+    cluster.completeRide(handle.rideId);
+    rows = nodeRows(cluster.node(n), rider);
+    CHECK(rows.size() == 2 && rows[1].fare == ride->getFare() + 30.0);
+}
+
+// Registers drivers one zone cell apart until every node hosts one and
+// returns the first driver found on each node, by node id.
+static vector<Driver*> driverPerNode(DispatchCluster& cluster, Fleet& fleet, int nodes) {
+    vector<Driver*> found(nodes, nullptr);
+    int missing = nodes;
+    for (int i = 0; missing > 0 && i < 1000; ++i) {
+        Driver* driver = fleet.add(Location(12 + (i % 40) * 0.05, 77 + (i / 40) * 0.05));
+        if (!cluster.registerDriver(driver)) continue;
+        int n = cluster.nodeOfDriver(driver->getId());
+        if (!found[n]) {
+            found[n] = driver;
+            --missing;
+        }
+    }
+    return found;
+}
+
+TEST(cluster_ride_ids_carry_their_node) {
+    DispatchCluster cluster;
+    cluster.addNode();
+    cluster.addNode();
+    Fleet fleet;
+    vector<Driver*> drivers = driverPerNode(cluster, fleet, 2);
+    CHECK(drivers[0] && drivers[1]);
+    Rider rider("rider", "000", Location());
+    vector<DispatchCluster::RideHandle> handles;
+    for (Driver* driver : drivers) {
+        Location pickup = driver->getCurrentLocation();
+        Location drop(pickup.latitude + 0.001, pickup.longitude + 0.001);
+        handles.push_back(cluster.requestRide(&rider, pickup, drop, SEDAN));
+    }
+    for (const DispatchCluster::RideHandle& handle : handles) {
+        CHECK(handle.driverId != 0);
+        CHECK((int)(handle.rideId >> 48) == handle.node);
+    }
+    CHECK(handles[0].rideId != handles[1].rideId);
+    CHECK(cluster.stats().ongoingRides == 2);
+    cluster.completeRide(handles[1].rideId);
+    CHECK(cluster.cancelRide(handles[0].rideId, CANCEL_BY_RIDER));
+    CHECK(cluster.stats().ongoingRides == 0);
+
+    // Each node archived the ride under the low bits only.
+    for (const DispatchCluster::RideHandle& handle : handles) {
+        vector<RideArchive::Row> rows = nodeRows(cluster.node(handle.node), rider);
+        CHECK(rows.size() == 1 && rows[0].rideId == (handle.rideId & (((RideId)1 << 48) - 1)));
+    }
+}
+
+TEST(cluster_cross_node_ride_matches_a_single_service) {
+    // Two cells next to each other owned by different nodes, computed on
+    // a ring like the cluster's.
+    const double cell = 0.05;
+    ZoneRing ring;
+    ring.addNode(0);
+    ring.addNode(1);
+    int cx = 0, cy = 1600;
+    while (ring.ownerOf(cx, cy) != 0 || ring.ownerOf(cx + 1, cy) != 1) ++cx;
+    // The driver is just inside node 0's cell, the pickup just inside node 1's.
+    double border = (cx + 1) * cell;
+    Location at(border - 0.002, (cy + 0.5) * cell), pickup(border + 0.002, (cy + 0.5) * cell);
+    Location drop(border + 0.04, (cy + 0.8) * cell);
+    Fleet fleet;
+    Rider rider("rider", "000", Location());
+
+    unique_ptr<DispatchService> single = DispatchTestAccess::create();
+    single->registerDriver(fleet.add(at));
+    PinnedRide ride = single->requestRide(&rider, pickup, drop, SEDAN);
+    CHECK(ride->getStatus() == DRIVER_ASSIGNED);
+    single->updateRideStatus(ride->getId(), EN_ROUTE_TO_PICKUP);
+    single->updateRideStatus(ride->getId(), IN_PROGRESS);
+    single->completeRide(ride->getId());
+
+    DispatchCluster cluster(cell);
+    cluster.addNode();
+    cluster.addNode();
+    Driver* driver = fleet.add(at);
+    CHECK(cluster.registerDriver(driver) && cluster.nodeOfDriver(driver->getId()) == 0);
+    DispatchCluster::RideHandle handle = cluster.requestRide(&rider, pickup, drop, SEDAN);
+    CHECK(cluster.stats().crossNodeQueries == 1);
+    CHECK(handle.node == 0 && handle.driverId == driver->getId());
+    CHECK(handle.status == DRIVER_ASSIGNED);
+    cluster.updateRideStatus(handle.rideId, EN_ROUTE_TO_PICKUP);
+    cluster.updateRideStatus(handle.rideId, IN_PROGRESS);
+    cluster.updateRideStatus(handle.rideId, COMPLETED);
+    CHECK(cluster.stats().ongoingRides == 0);
+
+    vector<RideArchive::Row> rows = nodeRows(cluster.node(0), rider);
+    CHECK(rows.size() == 1 && rows[0].status == COMPLETED);
+    CHECK(rows[0].fare == ride->getFare() && rows[0].distanceKm == ride->getDistanceKm());
+    CHECK(nodeRows(cluster.node(1), rider).empty());
+}
+
+TEST(cluster_fail_node_promotes_copies_and_keeps_other_rides) {
+    DispatchCluster cluster;
+    for (int n = 0; n < 3; ++n) cluster.addNode();
+    Fleet fleet;
+    vector<Driver*> drivers = driverPerNode(cluster, fleet, 3);
+    CHECK(drivers[0] && drivers[1] && drivers[2]);
+    Rider rider("rider", "000", Location());
+    vector<DispatchCluster::RideHandle> handles;
+    for (Driver* driver : drivers) {
+        Location pickup = driver->getCurrentLocation();
+        Location drop(pickup.latitude + 0.001, pickup.longitude + 0.001);
+        handles.push_back(cluster.requestRide(&rider, pickup, drop, SEDAN));
+        CHECK(handles.back().driverId == driver->getId());
+    }
+    size_t registered = cluster.stats().drivers;
+    size_t hosted = cluster.node(2)->hostedDriverCount();
+    CHECK(hosted > 0);
+
+    CHECK(cluster.failNode(2));
+    CHECK(!cluster.failNode(2));
+    DispatchCluster::Stats stats = cluster.stats();
+    CHECK(stats.nodes == 2 && stats.lostDrivers == 0 && stats.promotedDrivers == hosted);
+    CHECK(stats.drivers == registered);
+    for (Driver* driver : drivers) CHECK(cluster.nodeOfDriver(driver->getId()) != 2);
+    CHECK(cluster.node(0)->hostedDriverCount() + cluster.node(1)->hostedDriverCount() ==
+          registered);
+
+    // Rides running on node 2 are gone; rides elsewhere go on as before.
+    int lost = 0;
+    for (const DispatchCluster::RideHandle& handle : handles) lost += handle.node == 2;
+    CHECK(stats.lostRides == (uint64_t)lost);
+    CHECK(stats.ongoingRides == handles.size() - lost);
+    for (const DispatchCluster::RideHandle& handle : handles) {
+        if (handle.node == 2) {
+            CHECK(!cluster.cancelRide(handle.rideId, CANCEL_BY_RIDER));
+            continue;
+        }
+        cluster.updateRideStatus(handle.rideId, EN_ROUTE_TO_PICKUP);
+        cluster.updateRideStatus(handle.rideId, IN_PROGRESS);
+        cluster.completeRide(handle.rideId);
+        vector<RideArchive::Row> rows = nodeRows(cluster.node(handle.node), rider);
+        CHECK(rows.size() == 1 && rows[0].status == COMPLETED);
+    }
+    CHECK(cluster.stats().ongoingRides == 0);
+
+    // The promoted copy of node 2's driver takes new rides.
+    Location pickup = drivers[2]->getCurrentLocation();
+    Location drop(pickup.latitude + 0.001, pickup.longitude + 0.001);
+    DispatchCluster::RideHandle again = cluster.requestRide(&rider, pickup, drop, SEDAN);
+    CHECK(again.driverId == drivers[2]->getId() && again.node != 2);
+}
+
+// Persistence
+static size_t fileSize(const string& path) {
+    MappedFile file(path);
+    return file.size();
+}
+
+TEST(journal_commits_in_groups_and_restores_long_names) {
+    char writeThrough[] = "/tmp/dispatch_journal_XXXXXX";
+    char grouped[] = "/tmp/dispatch_journal_XXXXXX";
+    CHECK(mkdtemp(writeThrough) != nullptr);
+    CHECK(mkdtemp(grouped) != nullptr);
+    const string name = "Driver With A Name Well Past Thirty-Two Bytes";
+    Vehicle car("KA-01-AB-1234-EXTRA", SEDAN, 4, 10.0);
+    Driver driver(name, "+91 98450 12345 x9", &car, Location(12.9, 77.6), 4.5);
+    {
+        unique_ptr<DispatchService> service = DispatchTestAccess::create();
+        service->enablePersistence(writeThrough, chrono::milliseconds(0));
+        service->registerDriver(&driver);
+        // Write-through: on disk before registerDriver returned.
+        CHECK(fileSize(string(writeThrough) + "/journal.bin") == sizeof(JournalRecord));
+        service->deregisterDriver(&driver);
+        service->disablePersistence();
+    }
+    {
+        unique_ptr<DispatchService> service = DispatchTestAccess::create();
+        service->enablePersistence(grouped, chrono::milliseconds(10));
+        service->registerDriver(&driver);
+        // The sync thread commits it within a few intervals.
+        size_t size = 0;
+        for (int i = 0; i < 200 && size == 0; ++i) {
+            this_thread::sleep_for(chrono::milliseconds(5));
+            size = fileSize(string(grouped) + "/journal.bin");
+        }
+        CHECK(size == sizeof(JournalRecord));
+        service->disablePersistence();
+    }
+    {
+        // The first journal holds the registration and the removal.
+        unique_ptr<DispatchService> restored = DispatchTestAccess::create();
+        CHECK(restored->restoreState(writeThrough) == 0);
+        restored->disablePersistence();
+    }
+    {
+        unique_ptr<DispatchService> restored = DispatchTestAccess::create();
+        CHECK(restored->restoreState(grouped) == 1);
+        Driver* back = restored->findDriver(driver.getId());
+        CHECK(back && back->getName() == name);
+        CHECK(back && back->getPhone() == driver.getPhone());
+        CHECK(back && back->getVehicle()->getPlateNumber() == car.getPlateNumber());
+        restored->disablePersistence();
+    }
+    for (const char* dir : {writeThrough, grouped}) {
+        unlink((string(dir) + "/journal.bin").c_str());
+        rmdir(dir);
+    }
+}
+
+TEST(restore_replays_the_journal_over_a_snapshot) {
+    char dir[] = "/tmp/dispatch_journal_XXXXXX";
+    CHECK(mkdtemp(dir) != nullptr);
+    Fleet fleet;
+    Location pickup(12.9, 77.6), drop(13, 77.7);
+    Driver* first = fleet.add(pickup);
+    Driver* second = fleet.add(Location(12.91, 77.6));
+    Driver* leaving = fleet.add(Location(12.95, 77.6));
+    Rider rider("rider", "000", Location());
+    RideId inSnapshot, inJournal;
+    {
+        unique_ptr<DispatchService> service = DispatchTestAccess::create();
+        service->enablePersistence(dir, chrono::milliseconds(0));
+        for (Driver* d : {first, second, leaving}) service->registerDriver(d);
+        PinnedRide ride = service->requestRide(&rider, pickup, drop, SEDAN);
+        CHECK(ride->getDriver() == first);
+        inSnapshot = ride->getId();
+        CHECK(service->saveSnapshot());
+        CHECK(fileSize(string(dir) + "/journal.bin") == 0);
+
+        // The tail: a second ride, a status change and a removal.
+        ride = service->requestRide(&rider, pickup, drop, SEDAN);
+        CHECK(ride->getDriver() == second);
+        inJournal = ride->getId();
+        service->updateRideStatus(inSnapshot, EN_ROUTE_TO_PICKUP);
+        service->updateRideStatus(inJournal, IN_PROGRESS);
+        service->deregisterDriver(leaving);
+        CHECK(fileSize(string(dir) + "/journal.bin") == 4 * sizeof(JournalRecord));
+        service->disablePersistence();
+    }
+
+    unique_ptr<DispatchService> restored = DispatchTestAccess::create();
+    CHECK(restored->restoreState(dir, [&](int id) { return id == rider.getId() ? &rider : nullptr; }) == 2);
+    restored->disablePersistence();
+    Driver* firstBack = restored->findDriver(first->getId());
+    Driver* secondBack = restored->findDriver(second->getId());
+    CHECK(firstBack && firstBack->getStatus() == ON_TRIP);
+    CHECK(secondBack && secondBack->getStatus() == ON_TRIP);
+    CHECK(!restored->findDriver(leaving->getId()));
+    // Both drivers are on their trips, so nobody is left to match.
+    CHECK(restored->requestRide(&rider, pickup, drop, SEDAN)->getStatus() == CANCELLED);
+
+    // The journaled ride resumes IN_PROGRESS, where no-shows are refused.
+    CHECK(!restored->cancelRide(inJournal, CANCEL_RIDER_NO_SHOW));
+    restored->updateRideStatus(inSnapshot, IN_PROGRESS);
+    restored->completeRide(inSnapshot);
+    restored->completeRide(inJournal);
+    CHECK(firstBack && firstBack->getStatus() == AVAILABLE);
+    CHECK(secondBack && secondBack->getStatus() == AVAILABLE);
+    vector<RideArchive::Row> rows;
+    restored->forEachArchivedRide(&rider, [&](const RideArchive::Row& row) {
+        if (row.rideId == inSnapshot || row.rideId == inJournal) rows.push_back(row);
+    });
+    CHECK(rows.size() == 2);
+    for (const RideArchive::Row& row : rows) {
+        CHECK(row.status == COMPLETED);
+        CHECK(row.driverId == (row.rideId == inSnapshot ? first : second)->getId());
+    }
+
+    for (const char* file : {"/journal.bin", "/state.img"}) unlink((string(dir) + file).c_str());
+    rmdir(dir);
+}
+
+TEST(restore_drops_removed_drivers) {
+    char dir[] = "/tmp/dispatch_journal_XXXXXX";
+    CHECK(mkdtemp(dir) != nullptr);
+    string path = string(dir) + "/journal.bin";
+    Fleet fleet;
+    Location pickup(12.9, 77.6), drop(13, 77.7);
+    Driver* busy = fleet.add(pickup);
+    Driver* kept = fleet.add(Location(12.95, 77.6));
+    Driver* removed = fleet.add(Location(12.96, 77.6));
+    Rider rider("rider", "000", Location());
+    RideId rideId;
+    {
+        unique_ptr<DispatchService> service = DispatchTestAccess::create();
+        service->enablePersistence(dir, chrono::milliseconds(0));
+        for (Driver* d : {busy, kept, removed}) service->registerDriver(d);
+        PinnedRide ride = service->requestRide(&rider, pickup, drop, SEDAN);
+        CHECK(ride->getDriver() == busy);
+        rideId = ride->getId();
+        // Removed mid-trip, so the ride still needs the driver.
+        service->deregisterDriver(busy);
+        service->deregisterDriver(removed);
+        service->disablePersistence();
+    }
+    // A removal of a driver the journal never described.
+    JournalRecord stray;
+    memset(&stray, 0, sizeof(stray));
+    stray.op = JOURNAL_DRIVER_REMOVED;
+    stray.driver.id = 999999;
+    {
+        ofstream out(path, ios::binary | ios::app);
+        out.write((const char*)&stray, sizeof(stray));
+    }
+
+    unique_ptr<DispatchService> restored = DispatchTestAccess::create();
+    CHECK(restored->restoreState(dir, [&](int id) { return id == rider.getId() ? &rider : nullptr; }) == 1);
+    restored->disablePersistence();
+    CHECK(restored->findDriver(kept->getId()));
+    CHECK(!restored->findDriver(removed->getId()) && !restored->findDriver(busy->getId()));
+    CHECK(DispatchTestAccess::restoredDriverCount(*restored) == 2);
+    CHECK(restored->cancelRide(rideId, CANCEL_BY_RIDER));
+    unlink(path.c_str());
+    rmdir(dir);
+}
+
+int main(int argc, char** argv) {
+    EventLog::getInstance().setLevel(LOG_OFF);
+    const char* filter = argc > 1 ? argv[1] : nullptr;
+    int run = 0, failed = 0;
+    for (const TestCase& tc : testCases()) {
+        if (filter && !strstr(tc.name, filter)) continue;
+        int before = checkFailures;
+        tc.fn();
+        ++run;
+        bool ok = checkFailures == before;
+        if (!ok) ++failed;
+        cout << (ok ? "[ OK ] " : "[FAIL] ") << tc.name << endl;
+    }
+    cout << run - failed << "/" << run << " tests passed" << endl;
+    return failed == 0 ? 0 : 1;
+}